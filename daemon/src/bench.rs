@@ -0,0 +1,226 @@
+//! Measurement helpers shared by the benchmark binaries: a fixed-size
+//! latency histogram and the serialisable result records they report, so
+//! runs from different releases can be diffed field by field.
+
+use serde::Serialize;
+use std::time::Duration;
+
+/// Sub-buckets per power of two: values are kept to within 1/32 (~3%).
+const SUB_BITS: u32 = 5;
+const SUB: usize = 1 << SUB_BITS;
+const BUCKETS: usize = (65 - SUB_BITS as usize) * SUB;
+
+/// Log-linear histogram of nanosecond latencies. Recording is a shift and an
+/// increment, and memory stays fixed however long the run.
+#[derive(Clone)]
+pub struct Histogram {
+    counts: Box<[u64; BUCKETS]>,
+    n: u64,
+    sum: u128,
+    min: u64,
+    max: u64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self { counts: Box::new([0; BUCKETS]), n: 0, sum: 0, min: u64::MAX, max: 0 }
+    }
+}
+
+impl Histogram {
+    fn index(v: u64) -> usize {
+        if v < SUB as u64 {
+            return v as usize;
+        }
+        let shift = 63 - v.leading_zeros() - SUB_BITS;
+        (shift as usize + 1) * SUB + ((v >> shift) as usize & (SUB - 1))
+    }
+
+    /// Largest value that lands in bucket `i`.
+    fn upper(i: usize) -> u64 {
+        if i < SUB {
+            return i as u64;
+        }
+        let shift = (i / SUB - 1) as u32;
+        (((SUB + i % SUB) as u64) << shift) + ((1u64 << shift) - 1)
+    }
+
+    pub fn record(&mut self, ns: u64) {
+        self.counts[Self::index(ns)] += 1;
+        self.n += 1;
+        self.sum += ns as u128;
+        self.min = self.min.min(ns);
+        self.max = self.max.max(ns);
+    }
+
+    pub fn record_duration(&mut self, d: Duration) {
+        self.record(d.as_nanos().min(u64::MAX as u128) as u64);
+    }
+
+    pub fn merge(&mut self, other: &Histogram) {
+        for (a, b) in self.counts.iter_mut().zip(other.counts.iter()) {
+            *a += b;
+        }
+        self.n += other.n;
+        self.sum += other.sum;
+        self.min = self.min.min(other.min);
+        self.max = self.max.max(other.max);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.n
+    }
+
+    /// Smallest recorded bound at or below which `p` percent of samples lie.
+    pub fn percentile(&self, p: f64) -> u64 {
+        if self.n == 0 {
+            return 0;
+        }
+        let rank = ((p / 100.0 * self.n as f64).ceil() as u64).clamp(1, self.n);
+        let mut seen = 0;
+        for (i, &c) in self.counts.iter().enumerate() {
+            seen += c;
+            if seen >= rank {
+                return Self::upper(i).clamp(self.min, self.max);
+            }
+        }
+        self.max
+    }
+
+    pub fn latency(&self) -> Latency {
+        let us = |ns: u64| ns as f64 / 1000.0;
+        if self.n == 0 {
+            return Latency::default();
+        }
+        Latency {
+            min_us: us(self.min),
+            mean_us: self.sum as f64 / self.n as f64 / 1000.0,
+            p50_us: us(self.percentile(50.0)),
+            p90_us: us(self.percentile(90.0)),
+            p99_us: us(self.percentile(99.0)),
+            p99_9_us: us(self.percentile(99.9)),
+            max_us: us(self.max),
+        }
+    }
+}
+
+/// Latency summary in microseconds.
+#[derive(Clone, Debug, Default, Serialize)]
+pub struct Latency {
+    pub min_us: f64,
+    pub mean_us: f64,
+    pub p50_us: f64,
+    pub p90_us: f64,
+    pub p99_us: f64,
+    pub p99_9_us: f64,
+    pub max_us: f64,
+}
+
+/// One direction of a workload run.
+#[derive(Clone, Debug, Serialize)]
+pub struct OpStats {
+    pub ops: u64,
+    pub bytes: u64,
+    pub errors: u64,
+    pub iops: f64,
+    pub mib_s: f64,
+    pub lat: Latency,
+}
+
+impl OpStats {
+    pub fn new(h: &Histogram, bytes: u64, errors: u64, elapsed: Duration) -> Self {
+        let secs = elapsed.as_secs_f64().max(f64::MIN_POSITIVE);
+        Self {
+            ops: h.count(),
+            bytes,
+            errors,
+            iops: h.count() as f64 / secs,
+            mib_s: bytes as f64 / secs / (1024.0 * 1024.0),
+            lat: h.latency(),
+        }
+    }
+}
+
+/// One microbenchmark: mean cost per iteration and the data rate it implies.
+#[derive(Clone, Debug, Serialize)]
+pub struct MicroStats {
+    pub name: String,
+    pub iters: u64,
+    pub ns_per_iter: f64,
+    /// Bytes moved per second, where the iteration moves data.
+    pub mib_s: Option<f64>,
+}
+
+/// Where a report came from, so diffs across machines are not mistaken for
+/// regressions.
+#[derive(Clone, Debug, Serialize)]
+pub struct HostInfo {
+    pub os: &'static str,
+    pub arch: &'static str,
+    pub cpus: usize,
+    pub version: &'static str,
+}
+
+impl HostInfo {
+    pub fn current() -> Self {
+        Self {
+            os: std::env::consts::OS,
+            arch: std::env::consts::ARCH,
+            cpus: std::thread::available_parallelism().map_or(1, |n| n.get()),
+            version: env!("CARGO_PKG_VERSION"),
+        }
+    }
+}
+
+/// Parse a size with an optional binary suffix: `4096`, `4k`, `1m`, `2g`.
+pub fn parse_size(s: &str) -> anyhow::Result<u64> {
+    let s = s.trim().to_ascii_lowercase();
+    let (num, shift) = match s.strip_suffix(['k', 'm', 'g']) {
+        Some(n) => (n, match s.as_bytes()[s.len() - 1] { b'k' => 10, b'm' => 20, _ => 30 }),
+        None => (s.as_str(), 0),
+    };
+    let v: u64 = num.parse().map_err(|_| anyhow::anyhow!("bad size {s:?}"))?;
+    v.checked_shl(shift).filter(|r| r >> shift == v).ok_or_else(|| anyhow::anyhow!("size {s:?} overflows"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buckets_bound_values_within_the_resolution() {
+        for v in [0u64, 1, 31, 32, 33, 63, 64, 1000, 4095, 123_456_789, u64::MAX / 3] {
+            let i = Histogram::index(v);
+            assert!(Histogram::upper(i) >= v, "{v}");
+            assert!(i == 0 || Histogram::upper(i - 1) < v, "{v}");
+            assert!((Histogram::upper(i) - v) as f64 <= v as f64 / SUB as f64 + 1.0, "{v}");
+        }
+        assert!(Histogram::index(u64::MAX) < BUCKETS);
+    }
+
+    #[test]
+    fn percentiles_of_a_uniform_run() {
+        let mut h = Histogram::default();
+        for v in 1..=10_000u64 {
+            h.record(v * 1000);
+        }
+        let near = |got: u64, want: u64| (got as f64 - want as f64).abs() <= want as f64 / SUB as f64;
+        assert!(near(h.percentile(50.0), 5_000_000));
+        assert!(near(h.percentile(99.0), 9_900_000));
+        assert_eq!(h.percentile(100.0), 10_000_000);
+        let mut other = Histogram::default();
+        other.record(20_000_000);
+        h.merge(&other);
+        assert_eq!((h.count(), h.latency().max_us), (10_001, 20_000.0));
+        assert_eq!(Histogram::default().latency().p99_us, 0.0);
+    }
+
+    #[test]
+    fn sizes_take_binary_suffixes() {
+        assert_eq!(parse_size("4k").unwrap(), 4096);
+        assert_eq!(parse_size("1M").unwrap(), 1 << 20);
+        assert_eq!(parse_size("2g").unwrap(), 2 << 30);
+        assert_eq!(parse_size("512").unwrap(), 512);
+        assert!(parse_size("k").is_err() && parse_size("99999999999g").is_err());
+    }
+}
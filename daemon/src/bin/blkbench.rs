@@ -0,0 +1,725 @@
+//! Block I/O benchmarks for the daemon's VBLK paths.
+//!
+//! `micro` times the hot primitives on their own: `ByteRing` transfers,
+//! request encoding for the legacy SUBMIT IOCTL and one `VblkRing::pump`
+//! over a full ring against a disk that completes instantly.
+//!
+//! `run` is a small fio-like workload generator. Each job keeps `--qd`
+//! requests in flight for `--time` seconds and records per-request latency.
+//! - `--path ring` (default): the job plays a guest submitting into its own
+//!   VBLK ring of an in-process mapping, serviced by `VblkQueues` as the
+//!   daemon services the driver's rings.
+//! - `--path ioctl`: the job drives a `Vblk` dispatcher issuing VBLK
+//!   READ/WRITE IOCTLs; on Linux these go to the in-process host backend.
+//!
+//! The target is a file (`--file`, laid out to `--size` first) or, for the
+//! ring path, a simulated disk (`--sim`). Results go to stdout as a table
+//! and, with `--json FILE` (`-` for stdout), as one JSON document for
+//! diffing between releases.
+//!
+//! usage: blkbench micro [--json FILE]
+//!        blkbench run [--path ring|ioctl] [--file PATH | --sim] [--size 1g]
+//!                     [--bs 4k] [--qd 16] [--jobs 1] [--rw randread]
+//!                     [--rwmix 50] [--time 10] [--seed N] [--engine E]
+//!                     [--json FILE]
+//!   --rw: read | write | randread | randwrite | rw | randrw
+//!   --rwmix: percent reads for rw / randrw
+//!   --engine: block engine of the Linux host backend (inline, pool[:N],
+//!             uring[:N]); default as COLX_IO_ENGINE
+
+use anyhow::{bail, Context, Result};
+use colinux_daemon::bench::{parse_size, Histogram, HostInfo, MicroStats, OpStats};
+use colinux_daemon::blockdev::BlockBackend;
+use colinux_daemon::device::{Device, MapInfo};
+use colinux_daemon::geom::{Geometry, MAX_RING_CAP, MAX_SLOT_STRIDE, RING_CAP_OFF};
+use colinux_daemon::ring::ByteRing;
+use colinux_daemon::vblk::{self, Op, Vblk, VblkReq};
+use colinux_daemon::vblk_ring::{VblkQueues, VblkRing};
+use serde::Serialize;
+use std::alloc::{self, Layout};
+use std::fs::File;
+use std::hint::black_box;
+use std::io;
+use std::sync::atomic::{AtomicU32, AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+const SECTOR: u64 = 512;
+const PAGE: usize = 4096;
+const OP_READ: u8 = 0;
+const OP_WRITE: u8 = 1;
+
+/// struct colx_vblk_slot
+#[repr(C)]
+struct Slot {
+    id: u64,
+    op: u8,
+    status: u8,
+    _rsvd: u16,
+    lba: u64,
+    len: u32,
+    data_off: u32,
+}
+
+/// Completes every request without touching data.
+struct NullDisk;
+
+impl BlockBackend for NullDisk {
+    fn read(&self, _lba: u64, _dst: &mut [u8]) -> Result<()> {
+        Ok(())
+    }
+    fn write(&self, _lba: u64, _src: &[u8]) -> Result<()> {
+        Ok(())
+    }
+}
+
+/// A plain image file, read and written in place.
+struct FileDisk(File);
+
+impl BlockBackend for FileDisk {
+    fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+        Ok(read_at(&self.0, dst, lba * SECTOR)?)
+    }
+    fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+        Ok(write_at(&self.0, src, lba * SECTOR)?)
+    }
+    fn flush(&self) -> Result<()> {
+        Ok(self.0.sync_data()?)
+    }
+}
+
+#[cfg(unix)]
+fn read_at(f: &File, buf: &mut [u8], off: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    f.read_exact_at(buf, off)
+}
+
+#[cfg(unix)]
+fn write_at(f: &File, buf: &[u8], off: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    f.write_all_at(buf, off)
+}
+
+#[cfg(windows)]
+fn read_at(f: &File, mut buf: &mut [u8], mut off: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        match f.seek_read(buf, off)? {
+            0 => return Err(io::ErrorKind::UnexpectedEof.into()),
+            n => {
+                buf = &mut buf[n..];
+                off += n as u64;
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(windows)]
+fn write_at(f: &File, mut buf: &[u8], mut off: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        let n = f.seek_write(buf, off)?;
+        buf = &buf[n..];
+        off += n as u64;
+    }
+    Ok(())
+}
+
+/// Spin briefly, then yield, so runs also complete on a single CPU.
+#[derive(Default)]
+struct Backoff(u32);
+
+impl Backoff {
+    fn snooze(&mut self) {
+        if self.0 < 64 {
+            self.0 += 1;
+            std::hint::spin_loop();
+        } else {
+            std::thread::yield_now();
+        }
+    }
+}
+
+/// A page-aligned in-process mapping laid out and initialised as mem.c does.
+struct SimMap {
+    mem: *mut u8,
+    layout: Layout,
+    map: MapInfo,
+    geom: Geometry,
+}
+
+unsafe impl Sync for SimMap {}
+
+impl SimMap {
+    fn new(geom: Geometry) -> Self {
+        let layout = Layout::from_size_align(geom.span(), PAGE).expect("sim map layout");
+        let mem = unsafe { alloc::alloc_zeroed(layout) };
+        if mem.is_null() {
+            alloc::handle_alloc_error(layout);
+        }
+        unsafe {
+            geom.write(std::slice::from_raw_parts_mut(mem, PAGE));
+            for q in 0..geom.vblk_queues {
+                *(mem.add(geom.ring_off(q) + RING_CAP_OFF) as *mut [u32; 2]) = [geom.vblk_ring_cap as u32, std::mem::size_of::<Slot>() as u32];
+            }
+            // Windows never read back as all-zero, or writes would turn into WRITE_ZEROES
+            std::ptr::write_bytes(mem.add(geom.vblk_data_off), 0xa5, geom.vblk_queues * geom.vblk_queue_stride);
+        }
+        let map = MapInfo { user_base: mem as usize, kernel_base: 0, size: geom.span() as u64, ver: 1, flags: 0 };
+        Self { mem, layout, map, geom }
+    }
+
+    fn index(&self, off: usize) -> &AtomicU32 {
+        unsafe { &*((self.map.user_base + off) as *const AtomicU32) }
+    }
+
+    fn slots(&self, q: usize) -> *mut Slot {
+        (self.map.user_base + self.geom.slots_off(q)) as *mut Slot
+    }
+}
+
+impl Drop for SimMap {
+    fn drop(&mut self) {
+        unsafe { alloc::dealloc(self.mem, self.layout) };
+    }
+}
+
+// ---------------------------------------------------------------- micro
+
+/// Run `f` `iters` times after a short warm-up; returns the mean cost.
+fn time_iters(iters: u64, mut f: impl FnMut()) -> Duration {
+    for _ in 0..iters / 10 {
+        f();
+    }
+    let t0 = Instant::now();
+    for _ in 0..iters {
+        f();
+    }
+    t0.elapsed()
+}
+
+fn micro_stat(name: &str, iters: u64, elapsed: Duration, bytes_per_iter: u64) -> MicroStats {
+    let secs = elapsed.as_secs_f64();
+    MicroStats {
+        name: name.to_string(),
+        iters,
+        ns_per_iter: secs * 1e9 / iters as f64,
+        mib_s: (bytes_per_iter != 0).then(|| (bytes_per_iter * iters) as f64 / secs / (1024.0 * 1024.0)),
+    }
+}
+
+fn micro() -> Result<Vec<MicroStats>> {
+    let mut out = Vec::new();
+
+    // ByteRing: a write and a read of the same chunk, wrapping around a 64 KiB
+    // ring, copying and in place
+    let (mut tx, mut rx) = ByteRing::with_capacity(64 * 1024).split();
+    for chunk in [64usize, 4096] {
+        let (src, mut dst) = (vec![0x5au8; chunk], vec![0u8; chunk]);
+        let iters = (1u64 << 30) / chunk as u64 / 4;
+        let t = time_iters(iters, || {
+            black_box(tx.write(black_box(&src)));
+            black_box(rx.read(black_box(&mut dst)));
+        });
+        out.push(micro_stat(&format!("byte_ring.write_read.{chunk}"), iters, t, chunk as u64));
+        let t = time_iters(iters, || {
+            let (a, b) = tx.reserve(chunk);
+            let n = a.len() + b.len();
+            a.fill(0x5a);
+            b.fill(0x5a);
+            tx.commit(n);
+            let (a, b) = rx.peek(chunk);
+            let n = black_box(a).len() + black_box(b).len();
+            rx.consume(n);
+        });
+        out.push(micro_stat(&format!("byte_ring.reserve_peek.{chunk}"), iters, t, chunk as u64));
+    }
+
+    // Legacy SUBMIT encoding: header only for reads, header plus payload for writes
+    for (op, len, payload) in [(Op::Read, 4096u32, 0usize), (Op::Write, 4096, 4096)] {
+        let req = VblkReq { op, lba: 0x100, len, buf: vec![0x5a; payload] };
+        let iters = 2_000_000;
+        let t = time_iters(iters, || {
+            black_box(vblk::encode_req(black_box(&req)));
+        });
+        let name = format!("vblk.encode_req.{}", if payload == 0 { "read" } else { "write_4k" });
+        out.push(micro_stat(&name, iters, t, payload as u64));
+    }
+
+    // VblkRing::pump retiring a full ring of 4 KiB requests; cost is per slot
+    for (op, name) in [(OP_READ, "vblk_ring.pump.read_4k"), (OP_WRITE, "vblk_ring.pump.write_4k")] {
+        let (slots, t) = pump_full_rings(op, 64, 20_000)?;
+        out.push(micro_stat(name, slots, t, 4096));
+    }
+    Ok(out)
+}
+
+/// Publish `rounds` full rings of `cap` slots and time only the pumps.
+fn pump_full_rings(op: u8, cap: usize, rounds: u32) -> Result<(u64, Duration)> {
+    let sim = SimMap::new(Geometry::layout(1, cap, PAGE));
+    let disk = NullDisk;
+    let ring = VblkRing::new(&disk, sim.map, &sim.geom, 0)?;
+    let (prod, slots, base) = (sim.index(sim.geom.ring_off(0)), sim.slots(0), sim.geom.data_base(0) as u32);
+    let mut busy = Duration::ZERO;
+    let mut p = 0u32;
+    for _ in 0..rounds {
+        for i in 0..cap as u32 {
+            unsafe {
+                *slots.add(i as usize) = Slot {
+                    id: p.wrapping_add(i) as u64,
+                    op,
+                    status: 0,
+                    _rsvd: 0,
+                    lba: (i as u64) * 8,
+                    len: PAGE as u32,
+                    data_off: base + i * PAGE as u32,
+                };
+            }
+        }
+        p = p.wrapping_add(cap as u32);
+        prod.store(p, Ordering::Release);
+        let t0 = Instant::now();
+        ring.pump()?;
+        busy += t0.elapsed();
+    }
+    Ok((rounds as u64 * cap as u64, busy))
+}
+
+// ---------------------------------------------------------------- workload
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Serialize)]
+#[serde(rename_all = "lowercase")]
+enum IoPath {
+    Ring,
+    Ioctl,
+}
+
+#[derive(Clone, Debug, Serialize)]
+struct Workload {
+    path: IoPath,
+    /// Image file, or "sim".
+    target: String,
+    size: u64,
+    bs: u32,
+    qd: u32,
+    jobs: u32,
+    rw: String,
+    random: bool,
+    read_pct: u32,
+    time_s: f64,
+    seed: u64,
+    engine: Option<String>,
+}
+
+impl Workload {
+    fn parse(mut args: impl Iterator<Item = String>) -> Result<(Self, Option<String>)> {
+        let mut w = Workload {
+            path: IoPath::Ring,
+            target: "sim".into(),
+            size: 1 << 30,
+            bs: 4096,
+            qd: 16,
+            jobs: 1,
+            rw: "randread".into(),
+            random: true,
+            read_pct: 100,
+            time_s: 10.0,
+            seed: 0x2545_f491_4f6c_dd1d,
+            engine: None,
+        };
+        let (mut json, mut rwmix) = (None, 50);
+        while let Some(a) = args.next() {
+            let mut val = || args.next().with_context(|| format!("{a} needs a value"));
+            match a.as_str() {
+                "--path" => {
+                    w.path = match val()?.as_str() {
+                        "ring" => IoPath::Ring,
+                        "ioctl" => IoPath::Ioctl,
+                        p => bail!("unknown --path {p} (ring, ioctl)"),
+                    }
+                }
+                "--file" => w.target = val()?,
+                "--sim" => w.target = "sim".into(),
+                "--size" => w.size = parse_size(&val()?)?,
+                "--bs" => w.bs = u32::try_from(parse_size(&val()?)?).context("--bs")?,
+                "--qd" => w.qd = val()?.parse().context("--qd")?,
+                "--jobs" => w.jobs = val()?.parse().context("--jobs")?,
+                "--rw" => w.rw = val()?,
+                "--rwmix" => rwmix = val()?.parse().context("--rwmix")?,
+                "--time" => w.time_s = val()?.parse().context("--time")?,
+                "--seed" => w.seed = val()?.parse().context("--seed")?,
+                "--engine" => w.engine = Some(val()?),
+                "--json" => json = Some(val()?),
+                _ => bail!("unknown option {a}"),
+            }
+        }
+        (w.random, w.read_pct) = match w.rw.as_str() {
+            "read" => (false, 100),
+            "write" => (false, 0),
+            "randread" => (true, 100),
+            "randwrite" => (true, 0),
+            "rw" => (false, rwmix),
+            "randrw" => (true, rwmix),
+            rw => bail!("unknown --rw {rw}"),
+        };
+        if w.bs == 0 || w.bs as u64 % SECTOR != 0 || w.bs as usize > MAX_SLOT_STRIDE {
+            bail!("--bs must be a multiple of 512 up to {} KiB", MAX_SLOT_STRIDE / 1024);
+        }
+        if w.qd == 0 || w.qd as usize > MAX_RING_CAP || w.jobs == 0 || w.read_pct > 100 || w.time_s <= 0.0 {
+            bail!("--qd 1..={MAX_RING_CAP}, --jobs >= 1, --rwmix 0..=100 and --time > 0");
+        }
+        if w.size < w.bs as u64 * w.jobs as u64 {
+            bail!("--size must hold at least one block per job");
+        }
+        if w.path == IoPath::Ioctl && w.target == "sim" {
+            bail!("--path ioctl needs --file: the device reads and writes a real image");
+        }
+        Ok((w, json))
+    }
+}
+
+/// Per-job request stream: offsets in the job's slice of the target (random
+/// or sequential) and the read/write choice.
+struct Gen {
+    rng: u64,
+    random: bool,
+    read_pct: u32,
+    first: u64,
+    blocks: u64,
+    next: u64,
+    bs: u64,
+}
+
+impl Gen {
+    fn new(w: &Workload, job: u32) -> Self {
+        let blocks = w.size / w.bs as u64 / w.jobs as u64;
+        let rng = (w.seed ^ (job as u64 + 1).wrapping_mul(0x9e37_79b9_7f4a_7c15)) | 1;
+        Self { rng, random: w.random, read_pct: w.read_pct, first: job as u64 * blocks, blocks, next: 0, bs: w.bs as u64 }
+    }
+
+    fn rand(&mut self) -> u64 {
+        // xorshift64*
+        self.rng ^= self.rng >> 12;
+        self.rng ^= self.rng << 25;
+        self.rng ^= self.rng >> 27;
+        self.rng.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    /// (is_read, lba) of the next request.
+    fn next(&mut self) -> (bool, u64) {
+        let read = match self.read_pct {
+            100 => true,
+            0 => false,
+            pct => self.rand() % 100 < pct as u64,
+        };
+        let block = if self.random {
+            self.rand() % self.blocks
+        } else {
+            let b = self.next;
+            self.next = (b + 1) % self.blocks;
+            b
+        };
+        (read, (self.first + block) * self.bs / SECTOR)
+    }
+}
+
+#[derive(Default)]
+struct JobStats {
+    read: Histogram,
+    write: Histogram,
+    read_errors: u64,
+    write_errors: u64,
+}
+
+impl JobStats {
+    fn record(&mut self, read: bool, started: Instant, ok: bool) {
+        let (h, errors) = if read { (&mut self.read, &mut self.read_errors) } else { (&mut self.write, &mut self.write_errors) };
+        h.record_duration(started.elapsed());
+        *errors += !ok as u64;
+    }
+
+    fn merge(&mut self, o: &JobStats) {
+        self.read.merge(&o.read);
+        self.write.merge(&o.write);
+        self.read_errors += o.read_errors;
+        self.write_errors += o.write_errors;
+    }
+}
+
+/// Guest side of one ring: keep `qd` slots in flight until the deadline,
+/// timing each from publication until the host's cons passes it.
+fn ring_guest(sim: &SimMap, q: usize, w: &Workload, deadline: Instant) -> JobStats {
+    let g = &sim.geom;
+    let (prod, cons, slots) = (sim.index(g.ring_off(q)), sim.index(g.cons_off(q)), sim.slots(q));
+    let cap = g.vblk_ring_cap as u32;
+    let mut gen = Gen::new(w, q as u32);
+    let mut started = vec![(Instant::now(), true); cap as usize];
+    let mut stats = JobStats::default();
+    let (mut p, mut c) = (0u32, 0u32);
+    let mut backoff = Backoff::default();
+    loop {
+        let now_c = cons.load(Ordering::Acquire);
+        while c != now_c {
+            let i = (c % cap) as usize;
+            let (t, read) = started[i];
+            let ok = unsafe { std::ptr::read_volatile(&(*slots.add(i)).status) } == 0;
+            stats.record(read, t, ok);
+            c = c.wrapping_add(1);
+        }
+        let submitting = Instant::now() < deadline;
+        if submitting && p.wrapping_sub(c) < w.qd {
+            let i = p % cap;
+            let (read, lba) = gen.next();
+            let data_off = g.data_base(q) + i as usize * g.vblk_slot_stride;
+            unsafe {
+                if !read {
+                    // Keep the payload non-zero (see SimMap::new) whatever a read left there
+                    *((sim.map.user_base + g.vblk_data_off + data_off) as *mut u64) = p as u64 | 1;
+                }
+                *slots.add(i as usize) = Slot {
+                    id: p as u64,
+                    op: if read { OP_READ } else { OP_WRITE },
+                    status: 0,
+                    _rsvd: 0,
+                    lba,
+                    len: w.bs,
+                    data_off: data_off as u32,
+                };
+            }
+            started[i as usize] = (Instant::now(), read);
+            p = p.wrapping_add(1);
+            prod.store(p, Ordering::Release);
+            backoff = Backoff::default();
+            continue;
+        }
+        if !submitting && p == c {
+            return stats;
+        }
+        backoff.snooze();
+    }
+}
+
+fn run_ring(w: &Workload, disk: &dyn BlockBackend) -> Result<(JobStats, Duration)> {
+    let cap = (w.qd as usize).next_power_of_two().clamp(8, MAX_RING_CAP);
+    let stride = (w.bs as usize).div_ceil(PAGE) * PAGE;
+    let sim = SimMap::new(Geometry::layout(w.jobs as usize, cap, stride));
+    let queues = VblkQueues::new(disk, sim.map)?;
+    if queues.queues() != w.jobs as usize {
+        bail!("ring path: {} of {} queues laid out", queues.queues(), w.jobs);
+    }
+    let running = AtomicUsize::new(w.jobs as usize);
+    let t0 = Instant::now();
+    let deadline = t0 + Duration::from_secs_f64(w.time_s);
+    let mut total = JobStats::default();
+    std::thread::scope(|s| -> Result<()> {
+        let guests: Vec<_> = (0..w.jobs as usize)
+            .map(|q| {
+                let (sim, running) = (&sim, &running);
+                s.spawn(move || {
+                    let st = ring_guest(sim, q, w, deadline);
+                    running.fetch_sub(1, Ordering::Release);
+                    st
+                })
+            })
+            .collect();
+        // Host side: pump as the daemon's main loop does, backing off while idle
+        let mut backoff = Backoff::default();
+        while running.load(Ordering::Acquire) != 0 {
+            queues.pump()?;
+            let idle = (0..w.jobs as usize).all(|q| sim.index(sim.geom.ring_off(q)).load(Ordering::Acquire) == sim.index(sim.geom.cons_off(q)).load(Ordering::Acquire));
+            if idle {
+                backoff.snooze();
+            } else {
+                backoff = Backoff::default();
+            }
+        }
+        for g in guests {
+            total.merge(&g.join().expect("guest thread panicked"));
+        }
+        Ok(())
+    })?;
+    Ok((total, t0.elapsed()))
+}
+
+#[cfg(target_os = "linux")]
+fn open_device(w: &Workload) -> Result<Device> {
+    use colinux_daemon::hostdev::IoEngine;
+    let workers = (w.jobs as usize).max(2);
+    match &w.engine {
+        Some(e) => Device::open_host(IoEngine::parse(e)?, workers),
+        None => Device::open_with_workers(workers),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn open_device(w: &Workload) -> Result<Device> {
+    if w.engine.is_some() {
+        bail!("--engine selects the Linux host backend");
+    }
+    Device::open_with_workers((w.jobs as usize).max(2))
+}
+
+/// One job on the IOCTL path: a `Vblk` dispatcher `qd` deep.
+fn ioctl_job(dev: &Device, w: &Workload, job: u32, deadline: Instant) -> JobStats {
+    let mut vblk = Vblk::new(dev, w.qd as usize);
+    let mut gen = Gen::new(w, job);
+    let mut started: Vec<(Instant, bool)> = Vec::new();
+    let mut free: Vec<Vec<u8>> = (0..w.qd).map(|_| vec![0xa5u8; w.bs as usize]).collect();
+    let mut stats = JobStats::default();
+    let mut backoff = Backoff::default();
+    loop {
+        let submitting = Instant::now() < deadline;
+        while submitting && vblk.inflight() + vblk.pending() < w.qd as usize {
+            let (read, lba) = gen.next();
+            let mut buf = free.pop().unwrap_or_default();
+            // Completed writes hand back an emptied buffer
+            buf.resize(w.bs as usize, 0xa5);
+            let op = if read { Op::Read } else { Op::Write };
+            let tag = vblk.submit(VblkReq { op, lba, len: w.bs, buf }) as usize;
+            if started.len() <= tag {
+                started.resize(tag + 1, (Instant::now(), true));
+            }
+            started[tag] = (Instant::now(), read);
+        }
+        let mut reaped = false;
+        vblk.drain_completions(|c| {
+            let (t, read) = started[c.tag as usize];
+            stats.record(read, t, c.result.is_ok());
+            if let Ok(buf) = c.result {
+                free.push(buf);
+            }
+            reaped = true;
+        });
+        if !submitting && vblk.inflight() + vblk.pending() == 0 {
+            return stats;
+        }
+        if reaped {
+            backoff = Backoff::default();
+        } else {
+            backoff.snooze();
+        }
+    }
+}
+
+fn run_ioctl(w: &Workload) -> Result<(JobStats, Duration)> {
+    let dev = open_device(w)?;
+    dev.vblk_set_backing_sync(&w.target, Duration::from_secs(2))?;
+    let t0 = Instant::now();
+    let deadline = t0 + Duration::from_secs_f64(w.time_s);
+    let mut total = JobStats::default();
+    std::thread::scope(|s| {
+        let jobs: Vec<_> = (0..w.jobs).map(|j| { let dev = &dev; s.spawn(move || ioctl_job(dev, w, j, deadline)) }).collect();
+        for j in jobs {
+            total.merge(&j.join().expect("job thread panicked"));
+        }
+    });
+    Ok((total, t0.elapsed()))
+}
+
+/// Open the image, laying it out to `size` bytes of non-zero data the way fio
+/// does, so reads hit allocated blocks rather than holes.
+fn prepare_file(path: &str, size: u64) -> Result<File> {
+    let f = std::fs::OpenOptions::new().read(true).write(true).create(true).truncate(false).open(path).with_context(|| format!("open {path}"))?;
+    let have = f.metadata()?.len();
+    if have < size {
+        eprintln!("laying out {path}: {} MiB", size >> 20);
+        let chunk = vec![0xa5u8; 1 << 20];
+        let mut off = have / SECTOR * SECTOR;
+        while off < size {
+            let n = (size - off).min(chunk.len() as u64) as usize;
+            write_at(&f, &chunk[..n], off)?;
+            off += n as u64;
+        }
+        f.sync_data()?;
+    }
+    Ok(f)
+}
+
+// ---------------------------------------------------------------- reports
+
+#[derive(Serialize)]
+struct MicroReport {
+    bench: &'static str,
+    host: HostInfo,
+    results: Vec<MicroStats>,
+}
+
+#[derive(Serialize)]
+struct RunReport<'a> {
+    bench: &'static str,
+    host: HostInfo,
+    workload: &'a Workload,
+    elapsed_s: f64,
+    read: OpStats,
+    write: OpStats,
+}
+
+/// JSON to `dest` (`-`: stdout, replacing the table).
+fn emit_json<T: Serialize>(report: &T, dest: &str) -> Result<()> {
+    let json = serde_json::to_string_pretty(report)?;
+    if dest == "-" {
+        println!("{json}");
+    } else {
+        std::fs::write(dest, json + "\n").with_context(|| format!("write {dest}"))?;
+    }
+    Ok(())
+}
+
+fn main() -> Result<()> {
+    let mut args = std::env::args().skip(1);
+    let mode = args.next().unwrap_or_default();
+    match mode.as_str() {
+        "micro" => {
+            let json = match (args.next().as_deref(), args.next()) {
+                (None, _) => None,
+                (Some("--json"), Some(dest)) => Some(dest),
+                _ => bail!("usage: blkbench micro [--json FILE]"),
+            };
+            let results = micro()?;
+            if json.as_deref() != Some("-") {
+                println!("{:<28} {:>12} {:>12} {:>10}", "benchmark", "iters", "ns/iter", "MiB/s");
+                for r in &results {
+                    let rate = r.mib_s.map_or("-".to_string(), |m| format!("{m:.0}"));
+                    println!("{:<28} {:>12} {:>12.1} {:>10}", r.name, r.iters, r.ns_per_iter, rate);
+                }
+            }
+            if let Some(dest) = json {
+                emit_json(&MicroReport { bench: "blkbench.micro", host: HostInfo::current(), results }, &dest)?;
+            }
+        }
+        "run" => {
+            let (w, json) = Workload::parse(args)?;
+            let (stats, elapsed) = match (w.path, w.target.as_str()) {
+                (IoPath::Ring, "sim") => run_ring(&w, &NullDisk)?,
+                (IoPath::Ring, path) => run_ring(&w, &FileDisk(prepare_file(path, w.size)?))?,
+                (IoPath::Ioctl, path) => {
+                    drop(prepare_file(path, w.size)?);
+                    run_ioctl(&w)?
+                }
+            };
+            let bs = w.bs as u64;
+            let read = OpStats::new(&stats.read, stats.read.count() * bs, stats.read_errors, elapsed);
+            let write = OpStats::new(&stats.write, stats.write.count() * bs, stats.write_errors, elapsed);
+            if json.as_deref() != Some("-") {
+                println!(
+                    "{:?} path, {}, {} B blocks, qd {} x {} jobs, {:.1} s on {}",
+                    w.path, w.rw, w.bs, w.qd, w.jobs, elapsed.as_secs_f64(), w.target
+                );
+                println!("{:<6} {:>10} {:>10} {:>9} {:>9} {:>9} {:>9} {:>9} {:>7}", "op", "IOPS", "MiB/s", "mean us", "p50", "p99", "p99.9", "max", "errors");
+                for (name, s) in [("read", &read), ("write", &write)].into_iter().filter(|(_, s)| s.ops != 0) {
+                    let l = &s.lat;
+                    println!(
+                        "{:<6} {:>10.0} {:>10.1} {:>9.1} {:>9.1} {:>9.1} {:>9.1} {:>9.1} {:>7}",
+                        name, s.iops, s.mib_s, l.mean_us, l.p50_us, l.p99_us, l.p99_9_us, l.max_us, s.errors
+                    );
+                }
+            }
+            if let Some(dest) = json {
+                let report = RunReport { bench: "blkbench.run", host: HostInfo::current(), workload: &w, elapsed_s: elapsed.as_secs_f64(), read, write };
+                emit_json(&report, &dest)?;
+            }
+        }
+        _ => bail!("usage: blkbench micro [--json FILE] | blkbench run [options] (see the source header)"),
+    }
+    Ok(())
+}
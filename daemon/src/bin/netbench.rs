@@ -0,0 +1,170 @@
+//! Stealth networking benchmark over an in-process simulated guest.
+//!
+//! The main thread plays the guest front-end: it keeps a window of ops
+//! posted on a para-net queue and reaps completions, while the engine serves
+//! them against loopback servers running in this process. Reported are bulk
+//! send throughput (to a discard server), bulk receive throughput (from a
+//! source server) and the rate of short connections (CONNECT + CLOSE).
+//!
+//! usage: netbench [MiB] [connections]
+
+use anyhow::{bail, Result};
+use colinux_daemon::net::queue::{NetDesc, NetQueue, QueueShape, SimRegion, OP_CLOSE, OP_RECV, OP_SEND, PROTO_TCP};
+use colinux_daemon::net::stealth::{StealthCfg, StealthHandle, StealthNet};
+use std::io::{Read, Write};
+use std::net::{SocketAddr, TcpListener};
+use std::time::Instant;
+
+const BUF: u32 = 64 * 1024;
+const BUFS: u32 = 64;
+/// Ops in flight per flow.
+const WINDOW: u32 = 16;
+const CONN_WINDOW: u32 = 64;
+
+struct Guest {
+    q: NetQueue,
+    net: StealthHandle,
+    _region: SimRegion,
+}
+
+impl Guest {
+    fn new() -> Result<Self> {
+        let shape = QueueShape { sq_cap: 512, cq_cap: 512, buf_count: BUFS, buf_size: BUF };
+        let (mut region, host) = SimRegion::new(shape);
+        let q = region.attach();
+        let net = StealthNet::new(StealthCfg::default()).start(host, || {})?;
+        Ok(Self { q, net, _region: region })
+    }
+
+    fn submit(&self, d: &[NetDesc]) {
+        let mut done = 0;
+        while done < d.len() {
+            done += self.q.submit(&d[done..]);
+        }
+        self.net.kick();
+    }
+
+    /// At least one completion, failing on an error status.
+    fn reap(&self, out: &mut Vec<NetDesc>) -> Result<()> {
+        out.clear();
+        while self.q.reap(out, 256) == 0 {
+            std::thread::yield_now();
+        }
+        if let Some(d) = out.iter().find(|d| d.status < 0) {
+            bail!("op {} on flow {} failed: {}", d.op, d.flow, d.status);
+        }
+        Ok(())
+    }
+
+    fn connect(&self, flow: u32, addr: SocketAddr) -> Result<()> {
+        self.submit(&[NetDesc::connect(flow, PROTO_TCP, addr)]);
+        let mut out = Vec::new();
+        self.reap(&mut out)
+    }
+}
+
+fn op(op: u16, flow: u32, buf: u32, len: u32) -> NetDesc {
+    NetDesc { op, flow, buf, len, ..NetDesc::default() }
+}
+
+/// Serve every connection on its own thread.
+fn server(serve: fn(std::net::TcpStream)) -> Result<SocketAddr> {
+    let l = TcpListener::bind("127.0.0.1:0")?;
+    let addr = l.local_addr()?;
+    std::thread::spawn(move || {
+        for s in l.incoming().flatten() {
+            std::thread::spawn(move || serve(s));
+        }
+    });
+    Ok(addr)
+}
+
+fn send(total: u64) -> Result<f64> {
+    let addr = server(|mut s| {
+        let mut b = vec![0u8; 1 << 20];
+        while let Ok(1..) = s.read(&mut b) {}
+    })?;
+    let g = Guest::new()?;
+    g.connect(1, addr)?;
+    let ops = total.div_ceil(BUF as u64) as u32;
+    let t = Instant::now();
+    let (mut posted, mut done) = (0, 0);
+    let mut out = Vec::new();
+    while done < ops {
+        let batch: Vec<_> = (posted..ops.min(done + WINDOW)).map(|i| op(OP_SEND, 1, i % BUFS, BUF)).collect();
+        posted += batch.len() as u32;
+        g.submit(&batch);
+        g.reap(&mut out)?;
+        done += out.len() as u32;
+    }
+    let secs = t.elapsed().as_secs_f64();
+    g.submit(&[op(OP_CLOSE, 1, 0, 0)]);
+    g.reap(&mut out)?;
+    Ok(ops as f64 * BUF as f64 / secs)
+}
+
+fn recv(total: u64) -> Result<f64> {
+    let addr = server(|mut s| {
+        let b = vec![0x5au8; 1 << 20];
+        while s.write_all(&b).is_ok() {}
+    })?;
+    let g = Guest::new()?;
+    g.connect(1, addr)?;
+    let t = Instant::now();
+    let (mut got, mut inflight, mut next) = (0u64, 0u32, 0u32);
+    let mut out = Vec::new();
+    while got < total {
+        let batch: Vec<_> = (inflight..WINDOW).map(|_| {
+            next += 1;
+            op(OP_RECV, 1, next % BUFS, BUF)
+        }).collect();
+        inflight += batch.len() as u32;
+        g.submit(&batch);
+        g.reap(&mut out)?;
+        inflight -= out.len() as u32;
+        got += out.iter().map(|d| d.len as u64).sum::<u64>();
+    }
+    let secs = t.elapsed().as_secs_f64();
+    // Posted receives come back cancelled ahead of the close
+    g.submit(&[op(OP_CLOSE, 1, 0, 0)]);
+    while !out.iter().any(|d| d.op == OP_CLOSE) {
+        out.clear();
+        g.q.reap(&mut out, 256);
+    }
+    Ok(got as f64 / secs)
+}
+
+fn connections(total: u32) -> Result<f64> {
+    let addr = server(|mut s| {
+        let mut b = [0u8; 64];
+        while let Ok(1..) = s.read(&mut b) {}
+    })?;
+    let g = Guest::new()?;
+    let t = Instant::now();
+    let (mut next, mut closed) = (0u32, 0u32);
+    let mut out = Vec::new();
+    while closed < total {
+        let mut batch = Vec::new();
+        while next < total && next - closed < CONN_WINDOW {
+            batch.push(NetDesc::connect(next, PROTO_TCP, addr));
+            batch.push(op(OP_CLOSE, next, 0, 0));
+            next += 1;
+        }
+        g.submit(&batch);
+        g.reap(&mut out)?;
+        closed += out.iter().filter(|d| d.op == OP_CLOSE).count() as u32;
+    }
+    Ok(total as f64 / t.elapsed().as_secs_f64())
+}
+
+fn main() -> Result<()> {
+    let mut args = std::env::args().skip(1);
+    let mib: u64 = args.next().map(|a| a.parse()).transpose()?.unwrap_or(1024);
+    let conns: u32 = args.next().map(|a| a.parse()).transpose()?.unwrap_or(10_000);
+    println!("{} MiB per direction, {} KiB ops, {} in flight; {} connections, {} in flight", mib, BUF / 1024, WINDOW, conns, CONN_WINDOW);
+    println!("{:<8} {:>12}", "test", "rate");
+    println!("{:<8} {:>8.0} MB/s", "send", send(mib << 20)? / 1e6);
+    println!("{:<8} {:>8.0} MB/s", "recv", recv(mib << 20)? / 1e6);
+    println!("{:<8} {:>8.0} conn/s", "connect", connections(conns)?);
+    Ok(())
+}
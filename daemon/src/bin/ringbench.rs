@@ -0,0 +1,435 @@
+//! Cross-thread VBLK ring microbenchmark over an in-process simulated mapping.
+//!
+//! A producer thread plays the guest (fills slots, publishes prod) while the
+//! main thread pumps the ring exactly as the daemon does, against a backend
+//! that completes instantly, so the ring protocol itself is what is measured.
+//! Both control-block layouts (legacy packed, split prod/cons cache lines)
+//! run with per-request and batched index publication. On Linux the hardware
+//! cache-miss counters of both threads are reported per request.
+//!
+//! A second table streams bytes through a 64 KiB `ByteRing` between two
+//! threads: the copying ring it replaced (kept below as `LegacyRing`) against
+//! the split handles copying, working in place and moving batches of chunks.
+//!
+//! usage: ringbench [requests] [MiB]
+
+use anyhow::Result;
+use colinux_daemon::blockdev::BlockBackend;
+use colinux_daemon::device::MapInfo;
+use colinux_daemon::geom::{Geometry, RING_CAP_OFF};
+use colinux_daemon::ring::{ByteRing, Consumer, Producer};
+use colinux_daemon::vblk_ring::VblkQueues;
+use std::cell::UnsafeCell;
+use std::hint::black_box;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::time::Instant;
+
+const CAP: usize = 64;
+const SLOT_STRIDE: usize = 4096;
+const SECTOR: u32 = 512;
+const OP_WRITE: u8 = 1;
+
+/// Completes every request without touching data.
+struct NullDisk;
+
+impl BlockBackend for NullDisk {
+    fn read(&self, _lba: u64, _dst: &mut [u8]) -> Result<()> {
+        Ok(())
+    }
+    fn write(&self, _lba: u64, _src: &[u8]) -> Result<()> {
+        Ok(())
+    }
+}
+
+/// Spin briefly, then yield, so the benchmark also completes on a single CPU.
+#[derive(Default)]
+struct Backoff(u32);
+
+impl Backoff {
+    fn snooze(&mut self) {
+        if self.0 < 64 {
+            self.0 += 1;
+            std::hint::spin_loop();
+        } else {
+            std::thread::yield_now();
+        }
+    }
+}
+
+/// struct colx_vblk_slot
+#[repr(C)]
+struct Slot {
+    id: u64,
+    op: u8,
+    status: u8,
+    _rsvd: u16,
+    lba: u64,
+    len: u32,
+    data_off: u32,
+}
+
+/// One simulated shared mapping with a single ring, initialised as mem.c does.
+struct SimMap {
+    _mem: Vec<u64>,
+    map: MapInfo,
+    geom: Geometry,
+}
+
+impl SimMap {
+    fn new(split: bool) -> Self {
+        let geom = if split {
+            Geometry::layout(1, CAP, SLOT_STRIDE)
+        } else {
+            // No descriptor in the header: the daemon falls back to the packed block
+            Geometry { vblk_queues: 1, ..Geometry::legacy(0) }
+        };
+        let mut mem = vec![0u64; geom.span() / 8];
+        let base = mem.as_mut_ptr() as *mut u8;
+        unsafe {
+            if split {
+                geom.write(std::slice::from_raw_parts_mut(base, 0x1000));
+            }
+            *(base.add(geom.ring_off(0) + RING_CAP_OFF) as *mut [u32; 2]) = [geom.vblk_ring_cap as u32, std::mem::size_of::<Slot>() as u32];
+        }
+        let map = MapInfo { user_base: base as usize, kernel_base: 0, size: geom.span() as u64, ver: 1, flags: 0 };
+        Self { _mem: mem, map, geom }
+    }
+
+    fn index(&self, off: usize) -> &AtomicU32 {
+        unsafe { &*((self.map.user_base + off) as *const AtomicU32) }
+    }
+}
+
+/// Guest side: fill `total` slots, publishing prod every `batch` slots (and
+/// whenever the ring is full, so the host can make progress).
+fn produce(sim: &SimMap, total: u32, batch: u32) {
+    let g = &sim.geom;
+    let (prod, cons) = (sim.index(g.ring_off(0)), sim.index(g.cons_off(0)));
+    let cap = g.vblk_ring_cap as u32;
+    let slots = (sim.map.user_base + g.slots_off(0)) as *mut Slot;
+    let (mut p, mut published) = (0u32, 0u32);
+    let mut backoff = Backoff::default();
+    while p < total {
+        if p.wrapping_sub(cons.load(Ordering::Acquire)) >= cap {
+            if published != p {
+                prod.store(p, Ordering::Release);
+                published = p;
+            }
+            backoff.snooze();
+            continue;
+        }
+        backoff = Backoff::default();
+        let idx = p % cap;
+        unsafe {
+            *slots.add(idx as usize) = Slot {
+                id: p as u64,
+                op: OP_WRITE,
+                status: 0,
+                _rsvd: 0,
+                lba: (p % 1024) as u64,
+                len: SECTOR,
+                data_off: idx * g.vblk_slot_stride as u32,
+            };
+        }
+        p += 1;
+        if p - published >= batch || p == total {
+            prod.store(p, Ordering::Release);
+            published = p;
+        }
+    }
+}
+
+struct Sample {
+    secs: f64,
+    cache_misses: Option<u64>,
+    l1d_misses: Option<u64>,
+}
+
+fn run(split: bool, batch: u32, total: u32) -> Result<Sample> {
+    let sim = SimMap::new(split);
+    let disk = NullDisk;
+    let queues = VblkQueues::new(&disk, sim.map)?;
+    let cons = sim.index(sim.geom.cons_off(0));
+
+    // Opened before the producer starts so it inherits the counters
+    let llc = perf::Counter::open(perf::HW_CACHE_MISSES);
+    let l1d = perf::Counter::open(perf::L1D_READ_MISSES);
+    let t0 = Instant::now();
+    std::thread::scope(|s| -> Result<()> {
+        s.spawn(|| produce(&sim, total, batch));
+        let mut backoff = Backoff::default();
+        let mut done = 0;
+        while done != total {
+            queues.pump()?;
+            let c = cons.load(Ordering::Acquire);
+            if c == done {
+                backoff.snooze();
+            } else {
+                (done, backoff) = (c, Backoff::default());
+            }
+        }
+        Ok(())
+    })?;
+    let secs = t0.elapsed().as_secs_f64();
+    Ok(Sample { secs, cache_misses: llc.map(|c| c.stop()), l1d_misses: l1d.map(|c| c.stop()) })
+}
+
+fn main() -> Result<()> {
+    let total: u32 = std::env::args().nth(1).map(|a| a.parse()).transpose()?.unwrap_or(2_000_000);
+    println!("{} requests, ring depth {}, one producer and one consumer thread", total, CAP);
+    println!("{:<8} {:>7} {:>10} {:>14} {:>14}", "layout", "publish", "Mreq/s", "misses/req", "L1D miss/req");
+    let per_req = |v: Option<u64>| v.map_or("n/a".to_string(), |v| format!("{:.2}", v as f64 / total as f64));
+    for (split, name) in [(false, "packed"), (true, "split")] {
+        for batch in [1, 16] {
+            let s = run(split, batch, total)?;
+            println!(
+                "{:<8} {:>7} {:>10.2} {:>14} {:>14}",
+                name, batch, total as f64 / s.secs / 1e6, per_req(s.cache_misses), per_req(s.l1d_misses)
+            );
+        }
+    }
+
+    let mib: usize = std::env::args().nth(2).map(|a| a.parse()).transpose()?.unwrap_or(256);
+    println!();
+    println!("{} MiB through a {} KiB byte ring, one producer and one consumer thread", mib, BYTE_RING_CAP / 1024);
+    println!("{:<10} {:>6} {:>10}", "ring", "chunk", "MiB/s");
+    for chunk in [64, 4096] {
+        for mode in [Stream::Legacy, Stream::Copy, Stream::InPlace, Stream::Batch] {
+            let secs = stream(mode, chunk, mib << 20);
+            println!("{:<10} {:>6} {:>10.0}", mode.name(), chunk, mib as f64 / secs);
+        }
+    }
+    Ok(())
+}
+
+const BYTE_RING_CAP: usize = 64 * 1024;
+const STREAM_BATCH: usize = 8;
+
+/// `ring::ByteRing` as it was before the split into handles: both ends copy
+/// through `&self` and reload both indices on every call.
+struct LegacyRing {
+    buf: Box<[UnsafeCell<u8>]>,
+    cap: u32,
+    head: AtomicU32,
+    tail: AtomicU32,
+}
+
+unsafe impl Sync for LegacyRing {}
+
+impl LegacyRing {
+    fn with_capacity(cap: usize) -> Self {
+        Self { buf: (0..cap).map(|_| UnsafeCell::new(0)).collect(), cap: cap as u32, head: AtomicU32::new(0), tail: AtomicU32::new(0) }
+    }
+
+    fn mask(&self) -> u32 {
+        self.cap - 1
+    }
+
+    fn at(&self, idx: usize) -> *mut u8 {
+        self.buf[idx].get()
+    }
+
+    fn write(&self, src: &[u8]) -> usize {
+        let head = self.head.load(Ordering::Acquire);
+        let tail = self.tail.load(Ordering::Acquire);
+        let used = head.wrapping_sub(tail) & self.mask();
+        let n = (self.cap - used - 1).min(src.len() as u32) as usize;
+        let idx = (head & self.mask()) as usize;
+        let first = n.min(self.buf.len() - idx);
+        unsafe {
+            std::ptr::copy_nonoverlapping(src.as_ptr(), self.at(idx), first);
+            std::ptr::copy_nonoverlapping(src[first..].as_ptr(), self.at(0), n - first);
+        }
+        self.head.store(head.wrapping_add(n as u32) & self.mask(), Ordering::Release);
+        n
+    }
+
+    fn read(&self, dst: &mut [u8]) -> usize {
+        let head = self.head.load(Ordering::Acquire);
+        let tail = self.tail.load(Ordering::Acquire);
+        let n = (head.wrapping_sub(tail) & self.mask()).min(dst.len() as u32) as usize;
+        let idx = (tail & self.mask()) as usize;
+        let first = n.min(self.buf.len() - idx);
+        unsafe {
+            std::ptr::copy_nonoverlapping(self.at(idx), dst.as_mut_ptr(), first);
+            std::ptr::copy_nonoverlapping(self.at(0), dst[first..].as_mut_ptr(), n - first);
+        }
+        self.tail.store(tail.wrapping_add(n as u32) & self.mask(), Ordering::Release);
+        n
+    }
+}
+
+/// How the byte stream moves. The copying modes stage each chunk in a
+/// buffer on both sides, as callers of a copying ring do; `InPlace` fills
+/// and scans the ring's own slices instead.
+#[derive(Clone, Copy)]
+enum Stream {
+    Legacy,
+    Copy,
+    InPlace,
+    Batch,
+}
+
+impl Stream {
+    fn name(self) -> &'static str {
+        match self {
+            Stream::Legacy => "legacy",
+            Stream::Copy => "copy",
+            Stream::InPlace => "in-place",
+            Stream::Batch => "batch8",
+        }
+    }
+}
+
+/// Move `total` bytes in `chunk`-sized pieces; returns the seconds taken.
+fn stream(mode: Stream, chunk: usize, total: usize) -> f64 {
+    let legacy = LegacyRing::with_capacity(BYTE_RING_CAP);
+    let (mut tx, mut rx) = ByteRing::with_capacity(BYTE_RING_CAP).split();
+    let t0 = Instant::now();
+    std::thread::scope(|s| {
+        let legacy = &legacy;
+        s.spawn(move || {
+            let mut src = vec![0u8; chunk * STREAM_BATCH];
+            let mut sent = 0;
+            let mut backoff = Backoff::default();
+            while sent < total {
+                let n = match mode {
+                    Stream::Legacy => {
+                        src[..chunk].fill(sent as u8);
+                        legacy.write(&src[..chunk])
+                    }
+                    Stream::Copy => {
+                        src[..chunk].fill(sent as u8);
+                        tx.write(&src[..chunk])
+                    }
+                    Stream::InPlace => in_place(&mut tx, chunk, sent as u8),
+                    Stream::Batch => {
+                        let k = tx.write_batch(src.chunks(chunk));
+                        src[..k * chunk].fill(sent as u8);
+                        k * chunk
+                    }
+                };
+                if n == 0 {
+                    backoff.snooze();
+                } else {
+                    (sent, backoff) = (sent + n, Backoff::default());
+                }
+            }
+        });
+        let mut dst = vec![0u8; chunk];
+        let mut staged = vec![0u8; chunk * STREAM_BATCH];
+        let mut bufs: Vec<&mut [u8]> = staged.chunks_mut(chunk).collect();
+        let mut seen = 0;
+        let mut backoff = Backoff::default();
+        while seen < total {
+            let n = match mode {
+                Stream::Legacy => black_box(legacy.read(&mut dst)),
+                Stream::Copy => black_box(rx.read(&mut dst)),
+                Stream::InPlace => scan(&mut rx, chunk),
+                Stream::Batch => chunk * black_box(rx.read_batch(&mut bufs)),
+            };
+            if n == 0 {
+                backoff.snooze();
+            } else {
+                (seen, backoff) = (seen + n, Backoff::default());
+            }
+        }
+    });
+    t0.elapsed().as_secs_f64()
+}
+
+fn in_place(tx: &mut Producer, chunk: usize, v: u8) -> usize {
+    let (a, b) = tx.reserve(chunk);
+    let n = a.len() + b.len();
+    a.fill(v);
+    b.fill(v);
+    tx.commit(n);
+    n
+}
+
+fn scan(rx: &mut Consumer, chunk: usize) -> usize {
+    let (a, b) = rx.peek(chunk);
+    let n = black_box(a).len() + black_box(b).len();
+    rx.consume(n);
+    n
+}
+
+#[cfg(target_os = "linux")]
+mod perf {
+    /// perf_event_attr up to PERF_ATTR_SIZE_VER0.
+    #[repr(C)]
+    #[derive(Default)]
+    struct Attr {
+        type_: u32,
+        size: u32,
+        config: u64,
+        sample_period: u64,
+        sample_type: u64,
+        read_format: u64,
+        flags: u64,
+        wakeup_events: u32,
+        bp_type: u32,
+        config1: u64,
+    }
+
+    const F_INHERIT: u64 = 1 << 1;
+    const F_EXCLUDE_KERNEL: u64 = 1 << 5;
+    const F_EXCLUDE_HV: u64 = 1 << 6;
+    const IOC_DISABLE: libc::c_ulong = 0x2401;
+
+    /// (type, config): PERF_TYPE_HARDWARE / PERF_COUNT_HW_CACHE_MISSES
+    pub const HW_CACHE_MISSES: (u32, u64) = (0, 3);
+    /// PERF_TYPE_HW_CACHE: L1D | OP_READ << 8 | RESULT_MISS << 16
+    pub const L1D_READ_MISSES: (u32, u64) = (3, 1 << 16);
+
+    /// A user-space counter for this process and every thread it spawns later.
+    pub struct Counter(libc::c_int);
+
+    impl Counter {
+        /// None where the PMU or perf_event_paranoid does not allow it.
+        pub fn open((type_, config): (u32, u64)) -> Option<Self> {
+            let attr = Attr {
+                type_,
+                size: std::mem::size_of::<Attr>() as u32,
+                config,
+                flags: F_INHERIT | F_EXCLUDE_KERNEL | F_EXCLUDE_HV,
+                ..Default::default()
+            };
+            let fd = unsafe { libc::syscall(libc::SYS_perf_event_open, &attr as *const Attr, 0, -1, -1, 0) };
+            (fd >= 0).then(|| Counter(fd as libc::c_int))
+        }
+
+        /// Stop counting and return the total, including exited child threads.
+        pub fn stop(self) -> u64 {
+            let mut v = 0u64;
+            unsafe {
+                libc::ioctl(self.0, IOC_DISABLE, 0);
+                libc::read(self.0, &mut v as *mut u64 as *mut libc::c_void, 8);
+            }
+            v
+        }
+    }
+
+    impl Drop for Counter {
+        fn drop(&mut self) {
+            unsafe { libc::close(self.0) };
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+mod perf {
+    pub const HW_CACHE_MISSES: (u32, u64) = (0, 3);
+    pub const L1D_READ_MISSES: (u32, u64) = (3, 1 << 16);
+
+    pub struct Counter;
+
+    impl Counter {
+        pub fn open(_event: (u32, u64)) -> Option<Self> {
+            None
+        }
+        pub fn stop(self) -> u64 {
+            0
+        }
+    }
+}
@@ -1,5 +1,5 @@
 use anyhow::Result;
-use colinux_daemon::device::Device; // if crate name differs, adjust use path
+use colinux_daemon::device::{Device, MapRequest}; // if crate name differs, adjust use path
 
 fn main() -> Result<()> {
     // Accept optional cfg path
@@ -18,7 +18,8 @@ fn runner(cfg_path: &str) -> Result<()> {
 
     // Map shared
     let pages = (cfg.memory_mb as usize * 1024 * 1024 / 4096) as u32;
-    let map = dev.map_shared_sync(pages, std::time::Duration::from_secs(2))?;
+    let req = MapRequest { pages, vblk_queues: 1, vblk_ring_cap: 0, vblk_slot_stride: 0, vtty_chan_kb: [0; 4], shfs_ring_cap: 0, shfs_slot_kb: 0, vnet_bufs: 0, vnet_buf_kb: 0, trace_kb: 0 };
+    let map = dev.map_shared_sync(&req, std::time::Duration::from_secs(2))?;
     println!("mapped user_base=0x{:x} size={} ver={} flags={}",
         map.user_base, map.size, map.ver, map.flags);
 
@@ -50,6 +51,10 @@ fn runner(cfg_path: &str) -> Result<()> {
     let out = dev.vblk_read_sync(lba, len, std::time::Duration::from_secs(2))?;
     if out == data { println!("vblk r/w ok"); } else { println!("vblk r/w mismatch: got {} bytes", out.len()); }
 
+    let st = dev.reactor_stats();
+    println!("reactor: {} ioctls, {} errors, mean {:?} max {:?}, {:.1} events/dequeue",
+        st.completed, st.errors, st.mean_latency, st.max_latency, st.events_per_dequeue());
+
     Ok(())
 }
 
@@ -0,0 +1,210 @@
+//! Block backends behind the VBLK shared ring. The ring hands each backend a
+//! batch of descriptors whose data windows live in the shared mapping; the
+//! backend reads into / writes from those windows in place.
+//!
+//! `DriverBackend` forwards to the kernel driver's backing file (batched
+//! IOCTL, one IRP per slot on drivers without it); `overlay::Overlay` serves a
+//! copy-on-write chain from the daemon.
+//!
+//! Besides READ/WRITE a batch may carry FLUSH, DISCARD and WRITE_ZEROES;
+//! backends on sparse files punch holes for the latter two.
+
+use anyhow::Result;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+use crate::device::Device;
+use crate::reactor::IoctlError;
+use crate::vblk_batch::{self, BatchDesc, BATCH_MAX, OP_DISCARD, OP_FLUSH, OP_READ, OP_WRITE, OP_WRITE_ZEROES};
+
+pub const SECTOR: u64 = 512;
+
+const IO_TIMEOUT: Duration = Duration::from_secs(2);
+/// Extra completion allowance per this many bytes moved by one IRP.
+const TIMEOUT_BYTES_PER_SEC: u64 = 4 << 20;
+
+/// Completion deadline for an IRP moving `bytes`: a full batch is up to
+/// `BATCH_MAX` x 1 MiB, far more than a fixed `IO_TIMEOUT` covers.
+fn xfer_timeout(bytes: u64) -> Duration {
+    IO_TIMEOUT + Duration::from_secs(bytes / TIMEOUT_BYTES_PER_SEC)
+}
+
+/// Source for backends that can only emulate WRITE_ZEROES by writing.
+static ZEROS: [u8; 64 * 1024] = [0; 64 * 1024];
+
+/// Shared with helper threads (e.g. cache readahead), hence `Sync`.
+pub trait BlockBackend: Sync {
+    /// Read `dst.len()` bytes starting at sector `lba`.
+    fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()>;
+    /// Write `src` starting at sector `lba`.
+    fn write(&self, lba: u64, src: &[u8]) -> Result<()>;
+    /// Make completed writes durable.
+    fn flush(&self) -> Result<()> {
+        Ok(())
+    }
+    /// The guest no longer needs `len` bytes at sector `lba`. Advisory: the
+    /// range may keep its data or read back as zeros afterwards.
+    fn discard(&self, _lba: u64, _len: u64) -> Result<()> {
+        Ok(())
+    }
+    /// Make `len` bytes at sector `lba` read as zeros. Default: write them.
+    fn write_zeroes(&self, lba: u64, len: u64) -> Result<()> {
+        zero_fill(self, lba, len)
+    }
+
+    /// Service `descs`, whose windows are `buf_off`-relative to `span`, and
+    /// report each descriptor's outcome in `ok`. `span` ends with a scratch
+    /// status table of `BATCH_MAX` entries. Default: one call per descriptor.
+    fn submit_batch(&self, descs: &[BatchDesc], span: &mut [u8], ok: &mut [bool]) {
+        for (d, ok) in descs.iter().zip(ok.iter_mut()) {
+            let res = submit_one(self, d, span);
+            if let Err(e) = &res {
+                tracing::error!("vblk {} at LBA {} failed: {e:?}", op_name(d.op), d.lba);
+            }
+            *ok = res.is_ok();
+        }
+    }
+}
+
+/// Dispatch one descriptor to the matching `BlockBackend` call.
+fn submit_one<B: BlockBackend + ?Sized>(b: &B, d: &BatchDesc, span: &mut [u8]) -> Result<()> {
+    match d.op {
+        OP_READ => b.read(d.lba, d.window(span).ok_or_else(bad_window)?),
+        OP_WRITE => b.write(d.lba, d.window(span).ok_or_else(bad_window)?),
+        OP_FLUSH => b.flush(),
+        OP_DISCARD => b.discard(d.lba, d.len as u64),
+        OP_WRITE_ZEROES => b.write_zeroes(d.lba, d.len as u64),
+        op => anyhow::bail!("unknown vblk op {op}"),
+    }
+}
+
+/// Byte offset of sector `lba`; EINVAL for a guest LBA past the u64 byte range.
+pub fn byte_offset(lba: u64) -> Result<u64> {
+    lba.checked_mul(SECTOR)
+        .ok_or_else(|| std::io::Error::new(std::io::ErrorKind::InvalidInput, format!("LBA {lba} out of range")).into())
+}
+
+/// EINVAL for a descriptor whose window lies outside the span it came with.
+pub fn bad_window() -> anyhow::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidInput, "vblk window outside the batch span").into()
+}
+
+/// WRITE_ZEROES for backends that cannot punch: plain writes of zeros.
+pub fn zero_fill<B: BlockBackend + ?Sized>(b: &B, lba: u64, len: u64) -> Result<()> {
+    let mut done = 0;
+    while done < len {
+        let n = (len - done).min(ZEROS.len() as u64);
+        b.write(lba + done / SECTOR, &ZEROS[..n as usize])?;
+        done += n;
+    }
+    Ok(())
+}
+
+fn op_name(op: u8) -> &'static str {
+    match op {
+        OP_READ => "read",
+        OP_WRITE => "write",
+        OP_FLUSH => "flush",
+        OP_DISCARD => "discard",
+        OP_WRITE_ZEROES => "write-zeroes",
+        _ => "op",
+    }
+}
+
+/// The driver's own backing file (IOCTL_COLINUX_VBLK_SET_BACKING).
+pub struct DriverBackend<'a> {
+    dev: &'a Device,
+    /// Cleared after the first failed batch IOCTL (e.g. older driver); then slots go one IRP each.
+    batch_ok: AtomicBool,
+}
+
+impl<'a> DriverBackend<'a> {
+    pub fn new(dev: &'a Device) -> Self {
+        Self { dev, batch_ok: AtomicBool::new(true) }
+    }
+
+    /// Issue a data-less op as a one-descriptor batch; None once batching is
+    /// known not to work (older drivers have no other way to express it).
+    fn dataless(&self, d: BatchDesc) -> Option<Result<()>> {
+        if !self.batch_ok.load(Ordering::Relaxed) {
+            return None;
+        }
+        let mut status = [0u8; 4];
+        let res = self.dev.vblk_submit_batch(&[d], &mut status, 0, IO_TIMEOUT).and_then(|_| {
+            match vblk_batch::statuses(&status, 0, 1)?.next() {
+                Some(st) if vblk_batch::nt_success(st) => Ok(()),
+                st => anyhow::bail!("vblk {} failed: status {:?}", op_name(d.op), st),
+            }
+        });
+        if res.as_ref().is_err_and(|e| self.batch_unsupported(e)) {
+            return None;
+        }
+        Some(res)
+    }
+
+    /// True (and batching is off from now on) when `e` says the driver has
+    /// no batch IOCTL. Any other failure may have left the IRP partly done,
+    /// so it must not be replayed through the per-slot path.
+    fn batch_unsupported(&self, e: &anyhow::Error) -> bool {
+        let unsupported = IoctlError::of(e).is_some_and(IoctlError::unsupported);
+        if unsupported {
+            tracing::warn!("vblk batch IOCTL not supported by the driver; using one IRP per slot");
+            self.batch_ok.store(false, Ordering::Relaxed);
+        }
+        unsupported
+    }
+}
+
+impl BlockBackend for DriverBackend<'_> {
+    fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+        // Backing I/O lands in the slot itself
+        self.dev.vblk_read_into(lba, dst, xfer_timeout(dst.len() as u64))
+    }
+
+    fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+        self.dev.vblk_write_from(lba, src, xfer_timeout(src.len() as u64))
+    }
+
+    fn flush(&self) -> Result<()> {
+        self.dataless(BatchDesc::flush()).unwrap_or(Ok(()))
+    }
+
+    fn discard(&self, lba: u64, len: u64) -> Result<()> {
+        self.dataless(BatchDesc::discard(lba, len as u32)).unwrap_or(Ok(()))
+    }
+
+    fn write_zeroes(&self, lba: u64, len: u64) -> Result<()> {
+        match self.dataless(BatchDesc::write_zeroes(lba, len as u32)) {
+            Some(res) => res,
+            None => zero_fill(self, lba, len),
+        }
+    }
+
+    /// One batched IRP over the whole span, so each window is serviced in place.
+    fn submit_batch(&self, descs: &[BatchDesc], span: &mut [u8], ok: &mut [bool]) {
+        if self.batch_ok.load(Ordering::Relaxed) {
+            let status_off = span.len() - vblk_batch::status_table_len(BATCH_MAX);
+            let bytes = descs.iter().filter(|d| d.has_data()).map(|d| d.len as u64).sum();
+            match self.dev.vblk_submit_batch(descs, span, status_off, xfer_timeout(bytes))
+                .and_then(|_| vblk_batch::statuses(span, status_off, descs.len()))
+            {
+                Ok(statuses) => {
+                    for (st, ok) in statuses.zip(ok.iter_mut()) {
+                        *ok = vblk_batch::nt_success(st);
+                    }
+                    return;
+                }
+                Err(e) if self.batch_unsupported(&e) => {}
+                Err(e) => {
+                    // Timed out (cancelled) or failed as a whole: the guest sees EIO
+                    tracing::error!("vblk batch of {} failed: {e:?}", descs.len());
+                    ok.fill(false);
+                    return;
+                }
+            }
+        }
+        for (d, ok) in descs.iter().zip(ok.iter_mut()) {
+            *ok = submit_one(self, d, span).is_ok();
+        }
+    }
+}
@@ -0,0 +1,148 @@
+//! Fixed slab of page-aligned I/O buffers, allocated once up front.
+//! `get` hands out a `PoolBuf` that returns itself to the free list on drop,
+//! so steady-state IOCTLs can stage parameters and payloads without touching
+//! the allocator. Page alignment keeps MDL probing to whole pages.
+
+use std::alloc::{self, Layout};
+use std::ops::{Deref, DerefMut};
+use std::ptr::NonNull;
+use std::sync::{Arc, Mutex};
+
+pub const PAGE: usize = 4096;
+
+struct PoolInner {
+    base: NonNull<u8>,
+    layout: Layout,
+    buf_size: usize,
+    free: Mutex<Vec<u32>>,
+}
+
+// The slab is only reached through PoolBuf, which owns its slice exclusively.
+unsafe impl Send for PoolInner {}
+unsafe impl Sync for PoolInner {}
+
+impl Drop for PoolInner {
+    fn drop(&mut self) {
+        unsafe { alloc::dealloc(self.base.as_ptr(), self.layout) };
+    }
+}
+
+#[derive(Clone)]
+pub struct BufPool {
+    inner: Arc<PoolInner>,
+}
+
+impl BufPool {
+    /// `count` buffers of at least `buf_size` bytes, each rounded up to whole pages.
+    pub fn new(buf_size: usize, count: usize) -> Self {
+        assert!(count > 0 && count <= u32::MAX as usize, "bufpool: bad count {count}");
+        let buf_size = buf_size.max(1).div_ceil(PAGE) * PAGE;
+        let layout = Layout::from_size_align(buf_size * count, PAGE).expect("bufpool: layout");
+        let base = NonNull::new(unsafe { alloc::alloc_zeroed(layout) })
+            .unwrap_or_else(|| alloc::handle_alloc_error(layout));
+        // Pop order hands out low indices first
+        let free = (0..count as u32).rev().collect();
+        Self { inner: Arc::new(PoolInner { base, layout, buf_size, free: Mutex::new(free) }) }
+    }
+
+    /// A free buffer with length set to its full capacity, or None if all are in use.
+    pub fn get(&self) -> Option<PoolBuf> {
+        let idx = self.inner.free.lock().unwrap().pop()?;
+        Some(PoolBuf { pool: self.inner.clone(), idx, len: self.inner.buf_size })
+    }
+
+    pub fn buf_size(&self) -> usize {
+        self.inner.buf_size
+    }
+
+    pub fn available(&self) -> usize {
+        self.inner.free.lock().unwrap().len()
+    }
+}
+
+/// One slab buffer. Contents are whatever the previous user left behind.
+pub struct PoolBuf {
+    pool: Arc<PoolInner>,
+    idx: u32,
+    len: usize,
+}
+
+impl PoolBuf {
+    pub fn capacity(&self) -> usize {
+        self.pool.buf_size
+    }
+
+    /// Shrink or grow the visible length within the buffer's capacity.
+    pub fn set_len(&mut self, len: usize) {
+        assert!(len <= self.capacity(), "bufpool: len {len} exceeds {}", self.capacity());
+        self.len = len;
+    }
+
+    pub fn as_mut_ptr(&mut self) -> *mut u8 {
+        unsafe { self.pool.base.as_ptr().add(self.idx as usize * self.pool.buf_size) }
+    }
+}
+
+impl Deref for PoolBuf {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        unsafe {
+            let p = self.pool.base.as_ptr().add(self.idx as usize * self.pool.buf_size);
+            std::slice::from_raw_parts(p, self.len)
+        }
+    }
+}
+
+impl DerefMut for PoolBuf {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        let len = self.len;
+        unsafe { std::slice::from_raw_parts_mut(self.as_mut_ptr(), len) }
+    }
+}
+
+impl Drop for PoolBuf {
+    fn drop(&mut self) {
+        // The free list was sized for every buffer, so this push never reallocates
+        self.pool.free.lock().unwrap().push(self.idx);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buffers_are_page_aligned_and_disjoint() {
+        let pool = BufPool::new(5000, 3);
+        assert_eq!(pool.buf_size(), 2 * PAGE);
+        let mut a = pool.get().unwrap();
+        let mut b = pool.get().unwrap();
+        assert_eq!(a.as_mut_ptr() as usize % PAGE, 0);
+        assert_eq!(b.as_mut_ptr() as usize - a.as_mut_ptr() as usize, 2 * PAGE);
+        a.fill(0xAA);
+        b.fill(0x55);
+        assert!(a.iter().all(|&x| x == 0xAA));
+    }
+
+    #[test]
+    fn exhaustion_and_reuse() {
+        let pool = BufPool::new(PAGE, 2);
+        let a = pool.get().unwrap();
+        let _b = pool.get().unwrap();
+        assert!(pool.get().is_none());
+        drop(a);
+        assert_eq!(pool.available(), 1);
+        let mut c = pool.get().unwrap();
+        c.set_len(16);
+        assert_eq!(c.len(), 16);
+    }
+
+    #[test]
+    fn buffers_outlive_pool_handle() {
+        let pool = BufPool::new(PAGE, 1);
+        let mut a = pool.get().unwrap();
+        drop(pool);
+        a[0] = 7;
+        assert_eq!(a[0], 7);
+    }
+}
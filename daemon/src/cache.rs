@@ -0,0 +1,669 @@
+//! Read cache in front of a block backend, with sequential readahead.
+//!
+//! The disk is cached in 64 KiB blocks under a fixed memory budget. Eviction
+//! is S3-FIFO: new blocks enter a small probationary FIFO and are promoted to
+//! the main FIFO only if touched again before they age out; blocks evicted
+//! from probation leave a ghost entry so a quick re-reference goes straight
+//! to main. A one-pass scan (`find /`, a large copy) therefore cycles through
+//! probation without flushing the working set.
+//!
+//! Reads are tracked as streams keyed by where the next sequential read would
+//! start. Once a stream proves sequential, blocks ahead of it are queued to a
+//! readahead thread; the window doubles while the stream keeps hitting.
+//! Writes go straight through and update any cached copy; DISCARD and
+//! WRITE_ZEROES zero it, since backends leave those ranges reading as zeros.
+
+use anyhow::Result;
+use crossbeam_channel::{Receiver, Sender, TrySendError};
+use std::collections::{HashMap, HashSet, VecDeque};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+
+use crate::blockdev::{byte_offset, BlockBackend, SECTOR};
+use crate::bufpool::BufPool;
+use crate::vblk_batch::{BatchDesc, BATCH_MAX, OP_DISCARD, OP_READ, OP_WRITE, OP_WRITE_ZEROES};
+
+pub const CACHE_BLOCK_SHIFT: u32 = 16;
+const CACHE_BLOCK: usize = 1 << CACHE_BLOCK_SHIFT;
+/// Share of capacity given to the probationary FIFO.
+const SMALL_PERCENT: usize = 10;
+/// Hits remembered per block for promotion and second chances.
+const FREQ_MAX: u8 = 3;
+const STREAMS: usize = 16;
+/// Sequential reads needed before readahead starts.
+const RA_TRIGGER: u32 = 2;
+const RA_MIN_BLOCKS: u64 = 2;
+const RA_MAX_BLOCKS: u64 = 32;
+const RA_QUEUE: usize = 64;
+/// Pooled demand-fill buffers; a miss beyond this many allocates its own.
+const FILL_BUFS: usize = 8;
+
+#[derive(Default)]
+pub struct CacheStats {
+    hits: AtomicU64,
+    misses: AtomicU64,
+    ra_issued: AtomicU64,
+    ra_hits: AtomicU64,
+    ra_wasted: AtomicU64,
+    evictions: AtomicU64,
+    bypass: AtomicU64,
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CacheSnapshot {
+    /// Block lookups served from memory / that went to the backend.
+    pub hits: u64,
+    pub misses: u64,
+    /// Blocks queued for readahead, later read by the guest, or evicted unread.
+    pub ra_issued: u64,
+    pub ra_hits: u64,
+    pub ra_wasted: u64,
+    pub evictions: u64,
+    /// Requests served uncached (e.g. a block straddling the end of the disk).
+    pub bypass: u64,
+    pub resident_blocks: u64,
+    pub capacity_blocks: u64,
+}
+
+impl CacheSnapshot {
+    pub fn hit_ratio(&self) -> f64 {
+        let total = self.hits + self.misses;
+        if total > 0 { self.hits as f64 / total as f64 } else { 0.0 }
+    }
+}
+
+struct Entry {
+    slot: u32,
+    freq: u8,
+    main: bool,
+    /// Brought in by readahead and not yet read by the guest.
+    prefetched: bool,
+}
+
+#[derive(Clone, Copy, Default)]
+struct Stream {
+    next_off: u64,
+    run: u32,
+    window: u64,
+    /// First block not yet queued for readahead.
+    ra_next: u64,
+    last_use: u64,
+}
+
+struct State {
+    map: HashMap<u64, Entry>,
+    slots: Vec<Box<[u8]>>,
+    free: Vec<u32>,
+    small: VecDeque<u64>,
+    main: VecDeque<u64>,
+    ghost: VecDeque<u64>,
+    ghost_set: HashSet<u64>,
+    capacity: usize,
+    small_cap: usize,
+    streams: [Stream; STREAMS],
+    clock: u64,
+    /// Blocks being read from the backend (queued readahead or a demand fill)
+    /// with their reader count; a write to one marks it stale until the last
+    /// reader is done, so data that may predate the write is not cached.
+    inflight: HashMap<u64, u32>,
+    stale: HashSet<u64>,
+}
+
+impl State {
+    fn new(capacity: usize) -> Self {
+        Self {
+            map: HashMap::with_capacity(capacity),
+            slots: Vec::new(),
+            free: Vec::new(),
+            small: VecDeque::new(),
+            main: VecDeque::new(),
+            ghost: VecDeque::new(),
+            ghost_set: HashSet::new(),
+            capacity,
+            small_cap: (capacity * SMALL_PERCENT / 100).max(1),
+            streams: [Stream::default(); STREAMS],
+            clock: 0,
+            inflight: HashMap::new(),
+            stale: HashSet::new(),
+        }
+    }
+
+    /// Copy the cached part of `blk` at `in_blk` into `dst`; false on a miss.
+    fn lookup(&mut self, blk: u64, in_blk: usize, dst: &mut [u8], stats: &CacheStats) -> bool {
+        let Some(e) = self.map.get_mut(&blk) else { return false };
+        e.freq = (e.freq + 1).min(FREQ_MAX);
+        if e.prefetched {
+            e.prefetched = false;
+            stats.ra_hits.fetch_add(1, Ordering::Relaxed);
+        }
+        dst.copy_from_slice(&self.slots[e.slot as usize][in_blk..in_blk + dst.len()]);
+        true
+    }
+
+    fn insert(&mut self, blk: u64, data: &[u8], prefetched: bool, stats: &CacheStats) {
+        if self.map.contains_key(&blk) {
+            return;
+        }
+        let slot = match self.free.pop() {
+            Some(s) => s,
+            None if self.slots.len() < self.capacity => {
+                self.slots.push(vec![0u8; CACHE_BLOCK].into_boxed_slice());
+                (self.slots.len() - 1) as u32
+            }
+            None => self.evict(stats),
+        };
+        self.slots[slot as usize].copy_from_slice(data);
+        // A recently evicted block coming back skips probation
+        let main = self.ghost_set.remove(&blk);
+        if main {
+            self.main.push_back(blk);
+        } else {
+            self.small.push_back(blk);
+        }
+        self.map.insert(blk, Entry { slot, freq: 0, main, prefetched });
+    }
+
+    /// Free one slot following S3-FIFO and return it.
+    fn evict(&mut self, stats: &CacheStats) -> u32 {
+        loop {
+            let from_small = self.small.len() >= self.small_cap || self.main.is_empty();
+            let blk = if from_small { self.small.pop_front() } else { self.main.pop_front() };
+            let Some(blk) = blk else { unreachable!("evict on empty cache") };
+            let e = self.map.get_mut(&blk).expect("queued block not in map");
+            if from_small && e.freq > 0 {
+                // Touched during probation: promote
+                e.freq = 0;
+                e.main = true;
+                self.main.push_back(blk);
+                continue;
+            }
+            if !from_small && e.freq > 0 {
+                e.freq -= 1;
+                self.main.push_back(blk);
+                continue;
+            }
+            let e = self.map.remove(&blk).unwrap();
+            if e.prefetched {
+                stats.ra_wasted.fetch_add(1, Ordering::Relaxed);
+            }
+            if from_small {
+                self.ghost.push_back(blk);
+                self.ghost_set.insert(blk);
+                if self.ghost.len() > self.capacity {
+                    let old = self.ghost.pop_front().unwrap();
+                    self.ghost_set.remove(&old);
+                }
+            }
+            stats.evictions.fetch_add(1, Ordering::Relaxed);
+            return e.slot;
+        }
+    }
+
+    /// A backend read of `blk` is starting; pair with `end_read`.
+    fn begin_read(&mut self, blk: u64) {
+        *self.inflight.entry(blk).or_default() += 1;
+    }
+
+    /// A backend read of `blk` finished; false if a write raced with it.
+    fn end_read(&mut self, blk: u64) -> bool {
+        let fresh = !self.stale.contains(&blk);
+        if let Some(n) = self.inflight.get_mut(&blk) {
+            *n -= 1;
+            if *n == 0 {
+                self.inflight.remove(&blk);
+                self.stale.remove(&blk);
+            }
+        }
+        fresh
+    }
+
+    fn mark_stale(&mut self, blk: u64) {
+        if self.inflight.contains_key(&blk) {
+            self.stale.insert(blk);
+        }
+    }
+
+    /// Apply a successful write at byte `off` to any cached blocks.
+    fn update(&mut self, mut off: u64, mut src: &[u8]) {
+        while !src.is_empty() {
+            let blk = off >> CACHE_BLOCK_SHIFT;
+            let in_blk = (off as usize) & (CACHE_BLOCK - 1);
+            let n = (CACHE_BLOCK - in_blk).min(src.len());
+            if let Some(e) = self.map.get(&blk) {
+                self.slots[e.slot as usize][in_blk..in_blk + n].copy_from_slice(&src[..n]);
+            }
+            self.mark_stale(blk);
+            off += n as u64;
+            src = &src[n..];
+        }
+    }
+
+    /// Apply a successful DISCARD / WRITE_ZEROES of [off, off + len).
+    fn zero(&mut self, mut off: u64, len: u64) {
+        let end = off + len;
+        while off < end {
+            let blk = off >> CACHE_BLOCK_SHIFT;
+            let in_blk = (off as usize) & (CACHE_BLOCK - 1);
+            let n = ((CACHE_BLOCK - in_blk) as u64).min(end - off) as usize;
+            if let Some(e) = self.map.get(&blk) {
+                self.slots[e.slot as usize][in_blk..in_blk + n].fill(0);
+            }
+            self.mark_stale(blk);
+            off += n as u64;
+        }
+    }
+
+    /// Record a read of [off, end) and return blocks to read ahead.
+    fn track(&mut self, off: u64, end: u64) -> std::ops::Range<u64> {
+        self.clock += 1;
+        let clock = self.clock;
+        let end_blk = end.div_ceil(CACHE_BLOCK as u64);
+        let s = match self.streams.iter_mut().find(|s| s.run > 0 && s.next_off == off) {
+            Some(s) => {
+                s.run += 1;
+                s
+            }
+            None => {
+                let lru = self.streams.iter_mut().min_by_key(|s| s.last_use).unwrap();
+                *lru = Stream { next_off: 0, run: 1, window: RA_MIN_BLOCKS, ra_next: end_blk, last_use: 0 };
+                lru
+            }
+        };
+        s.next_off = end;
+        s.last_use = clock;
+        if s.run < RA_TRIGGER {
+            return 0..0;
+        }
+        let start = s.ra_next.max(end_blk);
+        // Top up once the guest is within half a window of what was queued
+        if start - end_blk > s.window / 2 {
+            return 0..0;
+        }
+        let stop = end_blk + s.window;
+        s.ra_next = stop;
+        s.window = (s.window * 2).min(RA_MAX_BLOCKS).min((self.capacity / 4).max(1) as u64);
+        start..stop
+    }
+}
+
+pub struct BlockCache<'a> {
+    inner: &'a dyn BlockBackend,
+    state: Arc<Mutex<State>>,
+    stats: Arc<CacheStats>,
+    /// Staging buffers for demand fills, one per concurrent miss.
+    fill: BufPool,
+    ra_tx: Option<Sender<u64>>,
+    ra_worker: Option<JoinHandle<()>>,
+}
+
+impl<'a> BlockCache<'a> {
+    /// Cache `inner` in `budget_mb` MiB of memory.
+    pub fn new(inner: &'a dyn BlockBackend, budget_mb: u32) -> Self {
+        let capacity = ((budget_mb as usize) << 20 >> CACHE_BLOCK_SHIFT).max(4);
+        let state = Arc::new(Mutex::new(State::new(capacity)));
+        let stats = Arc::new(CacheStats::default());
+        let (tx, rx) = crossbeam_channel::bounded(RA_QUEUE);
+        // The worker never outlives `self` (joined in Drop), which cannot outlive `inner`.
+        let inner_static = unsafe { std::mem::transmute::<&dyn BlockBackend, &'static dyn BlockBackend>(inner) };
+        let (st, ss) = (state.clone(), stats.clone());
+        let ra_worker = thread::spawn(move || readahead_worker(inner_static, rx, st, ss));
+        Self { inner, state, stats, fill: BufPool::new(CACHE_BLOCK, FILL_BUFS), ra_tx: Some(tx), ra_worker: Some(ra_worker) }
+    }
+
+    pub fn stats(&self) -> CacheSnapshot {
+        let st = &self.stats;
+        let (resident, capacity) = {
+            let s = self.state.lock().unwrap();
+            (s.map.len() as u64, s.capacity as u64)
+        };
+        CacheSnapshot {
+            hits: st.hits.load(Ordering::Relaxed),
+            misses: st.misses.load(Ordering::Relaxed),
+            ra_issued: st.ra_issued.load(Ordering::Relaxed),
+            ra_hits: st.ra_hits.load(Ordering::Relaxed),
+            ra_wasted: st.ra_wasted.load(Ordering::Relaxed),
+            evictions: st.evictions.load(Ordering::Relaxed),
+            bypass: st.bypass.load(Ordering::Relaxed),
+            resident_blocks: resident,
+            capacity_blocks: capacity,
+        }
+    }
+
+    /// Demand-fill `blk` and copy its [in_blk, +dst.len()) part into `dst`.
+    /// Ring pumps fill concurrently, so the read is tracked in flight like a
+    /// readahead and its data is dropped if a write lands meanwhile.
+    fn fill_block(&self, blk: u64, in_blk: usize, dst: &mut [u8]) -> Result<()> {
+        let mut pooled = self.fill.get();
+        let mut spare = Vec::new();
+        let buf: &mut [u8] = match pooled.as_deref_mut() {
+            Some(b) => b,
+            None => {
+                spare.resize(CACHE_BLOCK, 0);
+                &mut spare
+            }
+        };
+        self.state.lock().unwrap().begin_read(blk);
+        let res = self.inner.read((blk << CACHE_BLOCK_SHIFT) / SECTOR, buf);
+        let mut st = self.state.lock().unwrap();
+        let fresh = st.end_read(blk);
+        res?;
+        // The guest's copy is the read it asked for, stale for the cache or not
+        dst.copy_from_slice(&buf[in_blk..in_blk + dst.len()]);
+        if fresh {
+            st.insert(blk, buf, false, &self.stats);
+        }
+        Ok(())
+    }
+
+    fn queue_readahead(&self, blocks: std::ops::Range<u64>) {
+        let Some(tx) = self.ra_tx.as_ref() else { return };
+        let mut st = self.state.lock().unwrap();
+        for blk in blocks {
+            if st.map.contains_key(&blk) || st.inflight.contains_key(&blk) {
+                continue;
+            }
+            st.begin_read(blk);
+            match tx.try_send(blk) {
+                Ok(()) => {
+                    self.stats.ra_issued.fetch_add(1, Ordering::Relaxed);
+                }
+                Err(TrySendError::Full(_)) | Err(TrySendError::Disconnected(_)) => {
+                    // Worker is behind; the stream will ask again on its next read
+                    st.end_read(blk);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+impl Drop for BlockCache<'_> {
+    fn drop(&mut self) {
+        self.ra_tx.take();
+        if let Some(w) = self.ra_worker.take() {
+            let _ = w.join();
+        }
+    }
+}
+
+fn readahead_worker(inner: &'static dyn BlockBackend, rx: Receiver<u64>, state: Arc<Mutex<State>>, stats: Arc<CacheStats>) {
+    let mut buf = vec![0u8; CACHE_BLOCK];
+    for blk in rx.iter() {
+        let res = inner.read((blk << CACHE_BLOCK_SHIFT) / SECTOR, &mut buf);
+        let mut st = state.lock().unwrap();
+        // A write raced with this read; the data may predate it
+        let fresh = st.end_read(blk);
+        if res.is_ok() && fresh {
+            st.insert(blk, &buf, true, &stats);
+        }
+    }
+}
+
+/// Byte offset of `len` bytes at sector `lba`, checked before any cache
+/// block is keyed by it: a wrapped offset would alias another block.
+fn byte_range(lba: u64, len: u64) -> Result<u64> {
+    let off = byte_offset(lba)?;
+    off.checked_add(len).ok_or_else(|| anyhow::anyhow!("I/O at LBA {lba} +{len} out of range"))?;
+    Ok(off)
+}
+
+impl BlockBackend for BlockCache<'_> {
+    fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+        let start = byte_range(lba, dst.len() as u64)?;
+        let mut off = start;
+        let mut rest = &mut dst[..];
+        while !rest.is_empty() {
+            let blk = off >> CACHE_BLOCK_SHIFT;
+            let in_blk = (off as usize) & (CACHE_BLOCK - 1);
+            let n = (CACHE_BLOCK - in_blk).min(rest.len());
+            let (chunk, tail) = rest.split_at_mut(n);
+            if self.state.lock().unwrap().lookup(blk, in_blk, chunk, &self.stats) {
+                self.stats.hits.fetch_add(1, Ordering::Relaxed);
+            } else {
+                self.stats.misses.fetch_add(1, Ordering::Relaxed);
+                if self.fill_block(blk, in_blk, chunk).is_err() {
+                    // Block not readable whole (e.g. straddles the end of the disk)
+                    self.stats.bypass.fetch_add(1, Ordering::Relaxed);
+                    return self.inner.read(lba, dst);
+                }
+            }
+            off += n as u64;
+            rest = tail;
+        }
+        let ra = self.state.lock().unwrap().track(start, off);
+        if !ra.is_empty() {
+            self.queue_readahead(ra);
+        }
+        Ok(())
+    }
+
+    fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+        let off = byte_range(lba, src.len() as u64)?;
+        self.inner.write(lba, src)?;
+        self.state.lock().unwrap().update(off, src);
+        Ok(())
+    }
+
+    fn flush(&self) -> Result<()> {
+        self.inner.flush()
+    }
+
+    fn discard(&self, lba: u64, len: u64) -> Result<()> {
+        let off = byte_range(lba, len)?;
+        self.inner.discard(lba, len)?;
+        self.state.lock().unwrap().zero(off, len);
+        Ok(())
+    }
+
+    fn write_zeroes(&self, lba: u64, len: u64) -> Result<()> {
+        let off = byte_range(lba, len)?;
+        self.inner.write_zeroes(lba, len)?;
+        self.state.lock().unwrap().zero(off, len);
+        Ok(())
+    }
+
+    /// Reads are served through the cache; everything else still goes to the
+    /// backend as one batch, keeping its zero-copy path.
+    fn submit_batch(&self, descs: &[BatchDesc], span: &mut [u8], ok: &mut [bool]) {
+        let mut writes = [BatchDesc::default(); BATCH_MAX];
+        let mut owners = [0usize; BATCH_MAX];
+        let mut nw = 0;
+        for (i, d) in descs.iter().enumerate() {
+            if d.op == OP_READ {
+                ok[i] = d.window(span).is_some_and(|data| self.read(d.lba, data).is_ok());
+            } else if byte_range(d.lba, d.len as u64).is_err() {
+                // Rejected before the backend or the cache sees a wrapped offset
+                ok[i] = false;
+            } else {
+                writes[nw] = *d;
+                owners[nw] = i;
+                nw += 1;
+            }
+        }
+        if nw == 0 {
+            return;
+        }
+        let mut wok = [false; BATCH_MAX];
+        self.inner.submit_batch(&writes[..nw], span, &mut wok[..nw]);
+        let mut st = self.state.lock().unwrap();
+        for k in 0..nw {
+            ok[owners[k]] = wok[k];
+            let d = &writes[k];
+            match d.op {
+                _ if !wok[k] => {}
+                OP_WRITE => {
+                    if let Some(data) = d.window(span) {
+                        st.update(d.lba * SECTOR, data);
+                    }
+                }
+                OP_DISCARD | OP_WRITE_ZEROES => st.zero(d.lba * SECTOR, d.len as u64),
+                _ => {}
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::time::{Duration, Instant};
+
+    struct MemDisk {
+        data: Mutex<Vec<u8>>,
+        reads: AtomicU64,
+    }
+
+    impl MemDisk {
+        fn new(len: usize) -> Self {
+            let data = (0..len).map(|i| (i / 512) as u8).collect();
+            Self { data: Mutex::new(data), reads: AtomicU64::new(0) }
+        }
+        fn reads(&self) -> u64 {
+            self.reads.load(Ordering::SeqCst)
+        }
+    }
+
+    impl BlockBackend for MemDisk {
+        fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+            self.reads.fetch_add(1, Ordering::SeqCst);
+            let d = self.data.lock().unwrap();
+            let off = (lba * SECTOR) as usize;
+            anyhow::ensure!(off + dst.len() <= d.len(), "read past end");
+            dst.copy_from_slice(&d[off..off + dst.len()]);
+            Ok(())
+        }
+        fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+            let mut d = self.data.lock().unwrap();
+            let off = (lba * SECTOR) as usize;
+            d[off..off + src.len()].copy_from_slice(src);
+            Ok(())
+        }
+    }
+
+    fn wait_for(mut f: impl FnMut() -> bool) {
+        let t = Instant::now();
+        while !f() {
+            assert!(t.elapsed() < Duration::from_secs(5), "condition not reached");
+            thread::sleep(Duration::from_millis(1));
+        }
+    }
+
+    #[test]
+    fn repeated_reads_hit() {
+        let disk = MemDisk::new(4 << 20);
+        let cache = BlockCache::new(&disk, 1);
+        let mut buf = vec![0u8; 4096];
+        cache.read(300, &mut buf).unwrap();
+        let reads = disk.reads();
+        cache.read(300, &mut buf).unwrap();
+        cache.read(256, &mut buf).unwrap(); // same 64 KiB block
+        assert_eq!(disk.reads(), reads);
+        assert_eq!(buf[0], 0);
+        let s = cache.stats();
+        assert_eq!((s.hits, s.misses), (2, 1));
+    }
+
+    #[test]
+    fn writes_keep_cache_coherent() {
+        let disk = MemDisk::new(4 << 20);
+        let cache = BlockCache::new(&disk, 1);
+        let mut buf = vec![0u8; 1024];
+        cache.read(0, &mut buf).unwrap();
+        cache.write(1, &[0xAB; 512]).unwrap();
+        cache.read(0, &mut buf).unwrap();
+        assert_eq!(buf[0], 0);
+        assert!(buf[512..].iter().all(|&b| b == 0xAB));
+
+        // Batched writes update the cache too
+        let mut span = vec![0u8; 4096 + BATCH_MAX * 4];
+        span[..512].fill(0xCD);
+        let mut ok = [false; 1];
+        cache.submit_batch(&[BatchDesc::write(0, 512, 0)], &mut span, &mut ok);
+        assert!(ok[0]);
+        cache.read(0, &mut buf).unwrap();
+        assert!(buf[..512].iter().all(|&b| b == 0xCD));
+
+        // So do data-less zeroing ops
+        cache.submit_batch(&[BatchDesc::write_zeroes(0, 1024)], &mut span, &mut ok);
+        assert!(ok[0]);
+        cache.read(0, &mut buf).unwrap();
+        assert!(buf.iter().all(|&b| b == 0));
+
+        // An LBA whose byte offset wraps to block 0 leaves it alone
+        let wrap = 1u64 << 55;
+        cache.read(2, &mut buf).unwrap();
+        assert!(cache.write(wrap + 2, &[0xEE; 512]).is_err());
+        assert!(cache.write_zeroes(wrap + 2, 512).is_err());
+        cache.submit_batch(&[BatchDesc::write_zeroes(wrap + 2, 512)], &mut span, &mut ok);
+        assert!(!ok[0]);
+        cache.read(2, &mut buf).unwrap();
+        assert_eq!((buf[0], buf[512]), (2, 3));
+    }
+
+    #[test]
+    fn scan_does_not_flush_working_set() {
+        let disk = MemDisk::new(64 << 20);
+        let cache = BlockCache::new(&disk, 1); // 16 blocks
+        let mut buf = vec![0u8; 512];
+        let hot = |i: u64| i * 128; // blocks 0..4, one sector each
+        for _ in 0..2 {
+            for i in 0..4 {
+                cache.read(hot(i), &mut buf).unwrap();
+            }
+        }
+        // Random-order scan of 200 distinct blocks (no sequential streams)
+        for k in 0..200u64 {
+            let blk = 16 + (k * 37) % 800;
+            cache.read(blk * 128 + 1, &mut buf).unwrap();
+        }
+        let reads = disk.reads();
+        for i in 0..4 {
+            cache.read(hot(i), &mut buf).unwrap();
+        }
+        assert_eq!(disk.reads(), reads, "hot blocks were evicted by the scan");
+    }
+
+    #[test]
+    fn sequential_stream_triggers_readahead() {
+        let disk = MemDisk::new(16 << 20);
+        let cache = BlockCache::new(&disk, 8);
+        let mut buf = vec![0u8; 128 * 1024];
+        cache.read(0, &mut buf).unwrap();
+        cache.read(256, &mut buf).unwrap();
+        assert!(cache.stats().ra_issued > 0);
+        wait_for(|| cache.state.lock().unwrap().inflight.is_empty());
+        // Misses, not backend reads: this read queues more readahead, which
+        // the worker may already have issued by the time we look
+        let misses = cache.stats().misses;
+        cache.read(512, &mut buf).unwrap();
+        assert_eq!(cache.stats().misses, misses, "next chunk should come from readahead");
+        assert_eq!(buf[0], 0); // (512 * 512 / 512) as u8
+        assert!(cache.stats().ra_hits >= 2);
+    }
+
+    #[test]
+    fn write_during_backend_read_marks_it_stale() {
+        let mut st = State::new(4);
+        // A demand fill and a readahead of the same block overlap a write
+        st.begin_read(3);
+        st.begin_read(3);
+        st.update((3 << CACHE_BLOCK_SHIFT) + 512, &[1; 512]);
+        assert!(!st.end_read(3));
+        assert!(!st.end_read(3));
+        // The next read starts after the write and may be cached
+        st.begin_read(3);
+        assert!(st.end_read(3));
+        assert!(st.inflight.is_empty() && st.stale.is_empty());
+    }
+
+    #[test]
+    fn tail_block_bypasses_cache() {
+        let disk = MemDisk::new(CACHE_BLOCK + 4096);
+        let cache = BlockCache::new(&disk, 1);
+        let mut buf = vec![0u8; 4096];
+        cache.read((CACHE_BLOCK / 512) as u64, &mut buf).unwrap();
+        assert_eq!(cache.stats().bypass, 1);
+        assert_eq!(buf[0], (CACHE_BLOCK / 512) as u8);
+    }
+}
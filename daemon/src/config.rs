@@ -6,6 +6,50 @@ use std::path::Path;
 pub struct SharedMount {
     pub host_path: String,
     pub guest_path: String,
+    #[serde(default = "default_shared_ring_depth")]
+    pub ring_depth: u32,   // requests in flight; 0 disables the shared folder
+    #[serde(default = "default_shared_max_io_kb")]
+    pub max_io_kb: u32,    // largest single read/write = per-slot window
+    #[serde(default)]
+    pub read_only: bool,
+}
+
+/// Event-driven main loop: sleep on the guest doorbell instead of tick polling.
+#[derive(Debug, Serialize, Deserialize, Clone)]
+#[serde(default)]
+pub struct DoorbellCfg {
+    pub enabled: bool,
+    pub coalesce_us: u32,     // first re-check interval after going to sleep
+    pub max_sleep_us: u32,    // idle back-off ceiling between re-checks
+    pub idle_timeout_ms: u32, // wake at least this often (keepalive tick)
+}
+
+impl Default for DoorbellCfg {
+    fn default() -> Self {
+        Self { enabled: true, coalesce_us: 250, max_sleep_us: 4000, idle_timeout_ms: 250 }
+    }
+}
+
+/// Live metrics: a Prometheus text endpoint and a periodic summary log line.
+#[derive(Debug, Serialize, Deserialize, Clone)]
+#[serde(default)]
+pub struct MetricsCfg {
+    pub listen: String,    // loopback address for GET /metrics, e.g. "127.0.0.1:9464"; empty disables
+    pub summary_secs: u32, // log a metrics line this often; 0 disables
+}
+
+impl Default for MetricsCfg {
+    fn default() -> Self {
+        Self { listen: String::new(), summary_secs: 60 }
+    }
+}
+
+/// Request tracer: a ring in the shared mapping both sides stamp requests into.
+#[derive(Debug, Serialize, Deserialize, Clone, Default)]
+#[serde(default)]
+pub struct TraceCfg {
+    pub ring_kb: u32,      // KiB of 32-byte records (power of two, ..32768); 0 disables
+    pub dump_path: String, // write the ring as Chrome trace JSON here on shutdown; empty: only GET /trace
 }
 
 #[derive(Debug, Serialize, Deserialize, Clone)]
@@ -13,13 +57,47 @@ pub struct Config {
     pub memory_mb: u32,
     pub ringbuf_mb: u32,
     pub vblk_backing: String,    // e.g. C:\\KaliSync\\kali-rootfs-amd64.img
-    pub vblk_queue_depth: u32,
+    #[serde(default)]
+    pub vblk_overlay: Option<String>, // CoW top layer over vblk_backing; created if missing
+    pub vblk_queue_depth: u32,   // slots per VBLK ring; the driver rounds down to a power of two (8..1024)
+    #[serde(default = "default_vblk_max_transfer_kb")]
+    pub vblk_max_transfer_kb: u32, // per-slot data window (4..1024, 4K multiple); larger guest I/Os chain slots
+    #[serde(default = "default_vblk_merge_kb")]
+    pub vblk_merge_kb: u32,      // largest backing I/O contiguous requests are merged into (0 = no merging, ..1024)
+    #[serde(default = "default_vblk_queues")]
+    pub vblk_queues: u32,        // VBLK rings / guest hardware queues (1..8)
+    #[serde(default = "default_vblk_cache_mb")]
+    pub vblk_cache_mb: u32,      // daemon block cache budget; 0 disables
+    #[serde(default = "default_vtty_channels_kb")]
+    pub vtty_channels_kb: Vec<u32>, // ring KiB per VTTY channel: [console, bulk, ..] (0 = absent)
     pub vnet_mode: String,       // "bridge" | "nat"
+    #[serde(default)]
+    pub vnet_bufs: u32,          // NIC packet buffers shared with the guest (0..4096); 0 = no NIC
+    #[serde(default = "default_vnet_buf_kb")]
+    pub vnet_buf_kb: u32,        // KiB per NIC buffer = largest packed burst or GSO frame (4..256, multiple of 4)
     pub console_mode: String,    // "winpty"
     pub shared: SharedMount,
     pub tick_budget: u32,        // scheduler quantum
+    #[serde(default)]
+    pub doorbell: DoorbellCfg,
+    #[serde(default = "default_reactor_workers")]
+    pub reactor_workers: u32,    // IOCP completion threads
+    #[serde(default)]
+    pub metrics: MetricsCfg,
+    #[serde(default)]
+    pub trace: TraceCfg,
 }
 
+fn default_reactor_workers() -> u32 { 1 }
+fn default_vblk_cache_mb() -> u32 { 128 }
+fn default_vblk_queues() -> u32 { 1 }
+fn default_vblk_max_transfer_kb() -> u32 { 128 }
+fn default_vblk_merge_kb() -> u32 { 1024 }
+fn default_vtty_channels_kb() -> Vec<u32> { vec![64, 4096] }
+fn default_vnet_buf_kb() -> u32 { 64 }
+fn default_shared_ring_depth() -> u32 { 32 }
+fn default_shared_max_io_kb() -> u32 { 128 }
+
 pub fn load(path: &str) -> Result<Config> {
     let raw = std::fs::read_to_string(path).with_context(|| format!("reading config: {}", path))?;
     let cfg: Config = serde_yaml::from_str(&raw).context("parsing YAML")?;
@@ -31,7 +109,43 @@ pub fn validate(cfg: &Config) -> Result<()> {
     if cfg.memory_mb < 256 || cfg.memory_mb > 65536 { bail!("memory_mb out of range (256..65536)"); }
     if cfg.ringbuf_mb < 4 || cfg.ringbuf_mb > 1024 { bail!("ringbuf_mb out of range (4..1024)"); }
     if cfg.vblk_queue_depth == 0 || cfg.vblk_queue_depth > 1024 { bail!("vblk_queue_depth out of range (1..1024)"); }
+    if cfg.vblk_queues == 0 || cfg.vblk_queues > 8 { bail!("vblk_queues out of range (1..8)"); }
+    if cfg.vblk_max_transfer_kb < 4 || cfg.vblk_max_transfer_kb > 1024 || cfg.vblk_max_transfer_kb % 4 != 0 {
+        bail!("vblk_max_transfer_kb out of range (4..1024, multiple of 4)");
+    }
+    if cfg.vblk_merge_kb > 1024 || cfg.vblk_merge_kb % 4 != 0 { bail!("vblk_merge_kb out of range (0..1024, multiple of 4)"); }
+    if cfg.vblk_cache_mb > 16384 { bail!("vblk_cache_mb out of range (0..16384)"); }
+    let ch = &cfg.vtty_channels_kb;
+    if ch.is_empty() || ch.len() > 4 || ch[0] == 0 {
+        bail!("vtty_channels_kb needs 1..4 entries, the console (first) nonzero");
+    }
+    if ch.iter().any(|&kb| kb != 0 && (!kb.is_power_of_two() || !(4..=16384).contains(&kb))) {
+        bail!("vtty_channels_kb entries must be 0 or a power of two in 4..16384");
+    }
+    if cfg.vnet_bufs > 4096 { bail!("vnet_bufs out of range (0..4096)"); }
+    if cfg.vnet_buf_kb < 4 || cfg.vnet_buf_kb > 256 || cfg.vnet_buf_kb % 4 != 0 {
+        bail!("vnet_buf_kb out of range (4..256, multiple of 4)");
+    }
+    let sh = &cfg.shared;
+    if sh.ring_depth != 0 && (!sh.ring_depth.is_power_of_two() || sh.ring_depth > 256) {
+        bail!("shared.ring_depth must be 0 or a power of two up to 256");
+    }
+    if sh.max_io_kb < 4 || sh.max_io_kb > 1024 || sh.max_io_kb % 4 != 0 {
+        bail!("shared.max_io_kb out of range (4..1024, multiple of 4)");
+    }
     if cfg.tick_budget == 0 || cfg.tick_budget > 100_000 { bail!("tick_budget out of range (1..100000)"); }
+    if cfg.reactor_workers == 0 || cfg.reactor_workers > 16 { bail!("reactor_workers out of range (1..16)"); }
+    let db = &cfg.doorbell;
+    if db.coalesce_us == 0 || db.coalesce_us > db.max_sleep_us { bail!("doorbell.coalesce_us out of range (1..max_sleep_us)"); }
+    if db.max_sleep_us > 100_000 { bail!("doorbell.max_sleep_us out of range (..100000)"); }
+    if db.idle_timeout_ms == 0 || db.idle_timeout_ms > 10_000 { bail!("doorbell.idle_timeout_ms out of range (1..10000)"); }
+    let m = &cfg.metrics;
+    if !m.listen.is_empty() && !m.listen.parse::<std::net::SocketAddr>().is_ok_and(|a| a.ip().is_loopback()) {
+        bail!("metrics.listen must be a loopback address:port (e.g. 127.0.0.1:9464)");
+    }
+    if m.summary_secs > 86_400 { bail!("metrics.summary_secs out of range (0..86400)"); }
+    let t = cfg.trace.ring_kb;
+    if t != 0 && (!t.is_power_of_two() || t > 32_768) { bail!("trace.ring_kb must be 0 or a power of two up to 32768"); }
     if !Path::new(&cfg.vblk_backing).exists() { bail!("vblk_backing not found: {}", cfg.vblk_backing); }
     Ok(())
 }
@@ -1,74 +1,243 @@
-use crate::device::Device;
-use anyhow::Result;
+//! Console bridge: stdin/stdout <-> VTTY channel 0.
+//!
+//! Both directions work on the shared rings directly (`ring::Producer` /
+//! `ring::Consumer` over the mapping) instead of a push/pull IOCTL per
+//! chunk, and sleep on a `Wake` the main loop kicks whenever the guest rings
+//! the doorbell. The guest rings it after filling its TX ring and after
+//! draining a ring the host had filled past half, so neither side polls; a
+//! slow safety-net wakeup covers guests that predate the latter.
+//!
+//! Output is written as it arrives while the console is quiet, but once the
+//! guest streams (a flush within `STREAM_GAP` of the last) bytes are held
+//! for up to `FLUSH_LATENCY` or until `FLUSH_BYTES` queue, so scrolling logs
+//! go out in large writes. Bytes leave the ring only after stdout took them,
+//! and stdin is read only into free ring space: a slow terminal stalls the
+//! guest's writers and a busy guest stalls stdin, nothing is dropped.
+
+use crate::device::{self, MapInfo};
+use crate::geom::Geometry;
+use crate::ring::{Consumer, Producer};
+use crate::trace;
+use anyhow::{Context, Result};
 use std::io::{Read, Write};
-use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
 use std::thread::{self, JoinHandle};
-use std::time::Duration;
+use std::time::{Duration, Instant};
+
+/// struct colx_ring_hdr: the guest_doorbell word and the flag that asks for it.
+const HDR_GUEST_DOORBELL: usize = 32;
+const HDR_F_VTTY_NOTIFY: u32 = 0x4;
+
+const FLUSH_LATENCY: Duration = Duration::from_millis(2);
+const FLUSH_BYTES: usize = 64 * 1024;
+const STREAM_GAP: Duration = Duration::from_millis(10);
+/// Re-check the rings this often even if no doorbell arrives.
+const IDLE_POLL: Duration = Duration::from_millis(100);
+
+/// Generation counter the main loop bumps on every guest doorbell.
+#[derive(Clone, Default)]
+pub struct Wake(Arc<(Mutex<u64>, Condvar)>);
+
+impl Wake {
+    pub fn kick(&self) {
+        *self.0 .0.lock().unwrap() += 1;
+        self.0 .1.notify_all();
+    }
+
+    fn current(&self) -> u64 {
+        *self.0 .0.lock().unwrap()
+    }
+
+    /// Sleep until a kick after generation `seen`, or `timeout`.
+    fn wait(&self, seen: u64, timeout: Duration) {
+        let g = self.0 .0.lock().unwrap();
+        let _ = self.0 .1.wait_timeout_while(g, timeout, |g| *g == seen);
+    }
+}
+
+/// Where to bump guest_doorbell after moving bytes, if the driver asked.
+#[derive(Clone, Copy)]
+struct GuestBell(Option<usize>);
 
-pub struct ConsoleBridge<'a> {
-    dev: &'a Device,
+impl GuestBell {
+    fn ring(self) {
+        if let Some(addr) = self.0 {
+            unsafe { &*(addr as *const AtomicU32) }.fetch_add(1, Ordering::AcqRel);
+        }
+    }
+}
+
+pub struct ConsoleBridge {
+    tx: Option<Producer>,
+    rx: Option<Consumer>,
+    bell: GuestBell,
+    wake: Wake,
     stop: Arc<AtomicBool>,
-    in_thr: Option<JoinHandle<()>>,
     out_thr: Option<JoinHandle<()>>,
 }
 
-impl<'a> ConsoleBridge<'a> {
-    pub fn new(dev: &'a Device) -> Self {
-        Self { dev, stop: Arc::new(AtomicBool::new(false)), in_thr: None, out_thr: None }
+impl ConsoleBridge {
+    /// Attach to channel 0 of `map`. The mapping must outlive the bridge and
+    /// nothing else may move bytes on the channel meanwhile.
+    pub fn new(map: MapInfo, geom: &Geometry) -> Result<Self> {
+        let ch = geom.vtty(0).context("driver laid out no VTTY console channel")?;
+        let base = map.user_base as *mut u8;
+        // The geometry was checked against the mapping when it was read
+        let (tx, rx) = unsafe { (Producer::from_raw(base.add(ch.tx_off), ch.cap), Consumer::from_raw(base.add(ch.rx_off), ch.cap)) };
+        let bell = GuestBell((geom.features & HDR_F_VTTY_NOTIFY != 0).then_some(map.user_base + HDR_GUEST_DOORBELL));
+        Ok(Self { tx: Some(tx), rx: Some(rx), bell, wake: Wake::default(), stop: Arc::new(AtomicBool::new(false)), out_thr: None })
+    }
+
+    /// The handle the main loop kicks on each guest doorbell.
+    pub fn waker(&self) -> Wake {
+        self.wake.clone()
     }
 
     pub fn start(&mut self) -> Result<()> {
-        let stop_in = self.stop.clone();
-        let dev_in = unsafe { std::mem::transmute::<&Device, &'static Device>(self.dev) };
-        let in_thr = thread::spawn(move || {
-            let mut stdin = std::io::stdin();
-            let mut buf = [0u8; 4096];
-            while !stop_in.load(Ordering::Relaxed) {
-                match stdin.read(&mut buf) {
-                    Ok(0) => thread::sleep(Duration::from_millis(5)),
-                    Ok(n) => {
-                        let mut off = 0;
-                        while off < n {
-                            match dev_in.vtty_push(&buf[off..n], Duration::from_millis(200)) {
-                                Ok(w) if w > 0 => off += w,
-                                Ok(_) => thread::sleep(Duration::from_millis(2)),
-                                Err(_) => thread::sleep(Duration::from_millis(10)),
-                            }
-                            if stop_in.load(Ordering::Relaxed) { break; }
-                        }
-                    }
-                    Err(_) => thread::sleep(Duration::from_millis(10)),
+        let (mut tx, mut rx) = (self.tx.take().context("console already started")?, self.rx.take().context("console already started")?);
+        let (bell, wake) = (self.bell, self.wake.clone());
+        // Never joined: a read on stdin cannot be interrupted
+        thread::Builder::new().name("console-in".into()).spawn(move || {
+            let _ = pump_in(&mut tx, &mut std::io::stdin(), bell, &wake);
+        })?;
+
+        let (wake, stop) = (self.wake.clone(), self.stop.clone());
+        self.out_thr = Some(thread::Builder::new().name("console-out".into()).spawn(move || {
+            let _ = pump_out(&mut rx, &mut std::io::stdout(), bell, &wake, &stop);
+        })?);
+        Ok(())
+    }
+
+    pub fn stop(mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        self.wake.kick();
+        if let Some(h) = self.out_thr.take() {
+            let _ = h.join();
+        }
+    }
+}
+
+/// stdin -> host->guest ring, reading only as much as the ring has room for.
+fn pump_in(tx: &mut Producer, input: &mut impl Read, bell: GuestBell, wake: &Wake) -> std::io::Result<()> {
+    loop {
+        let seen = wake.current();
+        let (room, _) = tx.reserve(usize::MAX);
+        if room.is_empty() {
+            wake.wait(seen, IDLE_POLL);
+            continue;
+        }
+        let n = match input.read(room) {
+            Ok(0) => return Ok(()),
+            Ok(n) => n,
+            Err(e) if e.kind() == std::io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+        tx.commit(n);
+        bell.ring();
+        device::vtty_moved(trace::EV_VTTY_HOST_TX, 0, n);
+    }
+}
+
+/// guest->host ring -> stdout, coalescing while the guest streams.
+fn pump_out(rx: &mut Consumer, out: &mut impl Write, bell: GuestBell, wake: &Wake, stop: &AtomicBool) -> std::io::Result<()> {
+    let mut last_flush: Option<Instant> = None;
+    while !stop.load(Ordering::Relaxed) {
+        let seen = wake.current();
+        if rx.available() == 0 {
+            wake.wait(seen, IDLE_POLL);
+            continue;
+        }
+        if last_flush.is_some_and(|t| t.elapsed() < STREAM_GAP) {
+            let until = Instant::now() + FLUSH_LATENCY;
+            loop {
+                let seen = wake.current();
+                let now = Instant::now();
+                if rx.available() >= FLUSH_BYTES || now >= until || stop.load(Ordering::Relaxed) {
+                    break;
                 }
+                wake.wait(seen, until - now);
             }
-        });
+        }
+        let (a, b) = rx.peek(usize::MAX);
+        let n = a.len() + b.len();
+        out.write_all(a)?;
+        out.write_all(b)?;
+        out.flush()?;
+        rx.consume(n);
+        bell.ring();
+        device::vtty_moved(trace::EV_VTTY_HOST_RX, 0, n);
+        last_flush = Some(Instant::now());
+    }
+    Ok(())
+}
 
-        let stop_out = self.stop.clone();
-        let dev_out = unsafe { std::mem::transmute::<&Device, &'static Device>(self.dev) };
-        let out_thr = thread::spawn(move || {
-            let mut stdout = std::io::stdout();
-            while !stop_out.load(Ordering::Relaxed) {
-                match dev_out.vtty_pull(4096, Duration::from_millis(50)) {
-                    Ok(data) if !data.is_empty() => {
-                        let _ = stdout.write_all(&data);
-                        let _ = stdout.flush();
-                    }
-                    _ => {
-                        // nothing available
-                    }
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ring::ByteRing;
+
+    /// Records each write call, so coalescing is visible.
+    #[derive(Default)]
+    struct Sink(Arc<Mutex<Vec<usize>>>);
+
+    impl Write for Sink {
+        fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+            if !buf.is_empty() {
+                self.0.lock().unwrap().push(buf.len());
+            }
+            Ok(buf.len())
+        }
+        fn flush(&mut self) -> std::io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn streamed_output_goes_out_in_large_writes() {
+        let (mut guest, mut rx) = ByteRing::with_capacity(256 * 1024).split();
+        let (wake, stop) = (Wake::default(), AtomicBool::new(false));
+        let writes = Arc::new(Mutex::new(Vec::new()));
+        let mut sink = Sink(writes.clone());
+        thread::scope(|s| {
+            let out = s.spawn(|| pump_out(&mut rx, &mut sink, GuestBell(None), &wake, &stop));
+            // A log scrolling at full speed: 80-byte lines, a doorbell each
+            for _ in 0..4000 {
+                while guest.write_batch([&[b'x'; 80][..]]) == 0 {
+                    thread::yield_now();
                 }
+                wake.kick();
+            }
+            while guest.free() != 256 * 1024 - 1 {
+                thread::sleep(Duration::from_millis(1));
             }
+            stop.store(true, Ordering::Relaxed);
+            wake.kick();
+            out.join().unwrap().unwrap();
         });
-
-        self.in_thr = Some(in_thr);
-        self.out_thr = Some(out_thr);
-        Ok(())
+        let writes = writes.lock().unwrap();
+        assert_eq!(writes.iter().sum::<usize>(), 4000 * 80);
+        assert!(writes.len() < 400, "{} writes for 4000 lines", writes.len());
     }
 
-    pub fn stop(mut self) {
-        self.stop.store(true, Ordering::Relaxed);
-        if let Some(h) = self.in_thr.take() { let _ = h.join(); }
-        if let Some(h) = self.out_thr.take() { let _ = h.join(); }
+    #[test]
+    fn input_waits_for_ring_space() {
+        let (mut tx, mut guest) = ByteRing::with_capacity(16).split();
+        let wake = Wake::default();
+        let input: Vec<u8> = (0..100u8).collect();
+        let mut got = Vec::new();
+        thread::scope(|s| {
+            let feeder = s.spawn(|| pump_in(&mut tx, &mut &input[..], GuestBell(None), &wake));
+            let mut buf = [0u8; 7];
+            while got.len() < input.len() {
+                let n = guest.read(&mut buf);
+                got.extend_from_slice(&buf[..n]);
+                if n != 0 {
+                    wake.kick();
+                }
+            }
+            feeder.join().unwrap().unwrap();
+        });
+        assert_eq!(got, input);
     }
 }
-
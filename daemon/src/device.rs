@@ -1,8 +1,18 @@
 use anyhow::{Result, Context};
 use crossbeam_channel::{bounded, Receiver};
-use std::time::Duration;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
-use crate::iocp::{IoctlRequest, Reactor};
+use crate::bufpool::BufPool;
+use crate::reactor::{CompletionSlot, InBuf, Inline, IoctlRequest, OutBuf, ReactorSnapshot, Reply, UserBuf};
+#[cfg(windows)]
+use crate::iocp::Reactor;
+#[cfg(target_os = "linux")]
+use crate::hostdev::{IoEngine, Reactor};
+use crate::config::DoorbellCfg;
+use crate::metrics::{self, Counter, Hist};
+use crate::trace;
+use crate::vblk_batch::{self, BatchDesc};
 
 // These constants must match the kernel driver's IOCTL codes (METHOD_BUFFERED)
 // CTL_CODE(FILE_DEVICE_UNKNOWN(0x22), 0x801.., METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -15,33 +25,136 @@ const IOCTL_COLINUX_VBLK_SET_BACKING: u32 = 0x00222010; // 0x22 <<16 | 0x804<<2
 // CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_IN_DIRECT,  FILE_ANY_ACCESS)
 const IOCTL_COLINUX_VBLK_READ: u32  = 0x00222016; // 0x22<<16 | 0x805<<2 | 2
 const IOCTL_COLINUX_VBLK_WRITE: u32 = 0x00222019; // 0x22<<16 | 0x806<<2 | 1
+// CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+const IOCTL_COLINUX_VBLK_SUBMIT_BATCH: u32 = 0x00222026; // 0x22<<16 | 0x809<<2 | 2
+const IOCTL_COLINUX_WAIT_DOORBELL: u32 = 0x00222028; // 0x22<<16 | 0x80A<<2 (METHOD_BUFFERED)
 const IOCTL_COLINUX_VTTY_PUSH: u32 = 0x0022201C; // 0x22<<16 | 0x807<<2 (METHOD_BUFFERED)
 const IOCTL_COLINUX_VTTY_PULL: u32 = 0x00222020; // 0x22<<16 | 0x808<<2 (METHOD_BUFFERED)
+const IOCTL_COLINUX_VTTY_PUSH_CHAN: u32 = 0x0022202C; // 0x22<<16 | 0x80B<<2 (METHOD_BUFFERED)
+const IOCTL_COLINUX_VTTY_PULL_CHAN: u32 = 0x00222030; // 0x22<<16 | 0x80C<<2 (METHOD_BUFFERED)
+
+/// Result of a doorbell wait: the doorbell value seen and VBLK slots left unconsumed.
+#[derive(Debug, Clone, Copy)]
+pub struct DoorbellState { pub doorbell: u32, pub pending: u32 }
+
+/// Page-sized parameter buffers for IOCTLs whose input outgrows `Inline`
+/// (batch descriptor tables). One per concurrently issuing thread is plenty.
+const PARAM_POOL_BUFS: usize = 32;
+
+thread_local! {
+    // Synchronous helpers park on this instead of allocating a channel per call
+    static SLOT: Arc<CompletionSlot> = CompletionSlot::new();
+}
 
 pub struct Device {
     reactor: Reactor,
+    params: BufPool,
 }
 
 impl Device {
     pub fn open() -> Result<Self> {
-        let reactor = Reactor::open_dev(r"\\.\coLinux")?;
-        Ok(Self { reactor })
+        Self::open_with_workers(1)
+    }
+
+    /// Open with `workers` IOCP completion threads.
+    #[cfg(windows)]
+    pub fn open_with_workers(workers: usize) -> Result<Self> {
+        Ok(Self::with_reactor(Reactor::open_dev_with_workers(r"\\.\coLinux", workers)?))
+    }
+
+    /// Open the in-process host backend with `workers` reactor threads. The
+    /// block engine comes from COLX_IO_ENGINE (see `IoEngine::parse`); unset,
+    /// io_uring where the kernel allows it, else the thread pool.
+    #[cfg(target_os = "linux")]
+    pub fn open_with_workers(workers: usize) -> Result<Self> {
+        match std::env::var("COLX_IO_ENGINE") {
+            Ok(s) => Self::open_host(IoEngine::parse(&s)?, workers),
+            Err(_) => Self::open_host(IoEngine::URING, workers).or_else(|e| {
+                tracing::warn!("io_uring unavailable, using the I/O thread pool: {e:#}");
+                Self::open_host(IoEngine::POOL, workers)
+            }),
+        }
+    }
+
+    /// As `open_with_workers`, with an explicit block engine.
+    #[cfg(target_os = "linux")]
+    pub fn open_host(engine: IoEngine, workers: usize) -> Result<Self> {
+        Ok(Self::with_reactor(Reactor::open_host(engine, workers)?))
+    }
+
+    fn with_reactor(reactor: Reactor) -> Self {
+        let params = BufPool::new(vblk_batch::BATCH_HDR_LEN + vblk_batch::BATCH_MAX * vblk_batch::BATCH_DESC_LEN, PARAM_POOL_BUFS);
+        Self { reactor, params }
+    }
+
+    /// Issue one IOCTL and wait for it on this thread's completion slot.
+    /// Returns bytes transferred and the out buffer (holding the reply).
+    fn call(&self, code: u32, inbuf: InBuf, out: OutBuf, timeout: Duration) -> Result<(usize, OutBuf)> {
+        SLOT.with(|slot| {
+            self.reactor.submit(IoctlRequest { code, inbuf, out, reply: slot.arm() })?;
+            slot.wait(timeout)
+        })
+    }
+
+    /// As `call`, for an out buffer in caller memory (a shared-mapping window,
+    /// a request's own Vec). A request still running at `timeout` is cancelled
+    /// and waited out, so the driver never touches `buf` after this returns.
+    fn call_in_place(&self, code: u32, inbuf: InBuf, buf: UserBuf, timeout: Duration) -> Result<usize> {
+        SLOT.with(|slot| {
+            self.reactor.submit(IoctlRequest { code, inbuf, out: OutBuf::User(buf), reply: slot.arm() })?;
+            slot.wait_in_place(timeout, |token| self.reactor.cancel(token)).map(|(n, _)| n)
+        })
+    }
+
+    /// Throughput/latency counters of the underlying reactor.
+    pub fn reactor_stats(&self) -> ReactorSnapshot {
+        self.reactor.stats()
     }
+}
 
 #[derive(Debug, Clone, Copy)]
 pub struct MapInfo { pub user_base: usize, pub kernel_base: u64, pub size: u64, pub ver: u32, pub flags: u32 }
 
-    /// Map N pages of shared memory (synchronous helper with timeout). Returns mapping descriptor.
-    pub fn map_shared_sync(&self, pages: u32, timeout: Duration) -> Result<MapInfo> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_MAP_SHARED,
-            inbuf: Some(pages.to_le_bytes().to_vec()),
-            out_capacity: 32, // MAP_INFO_OUT size
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = recv_with_timeout(rx, timeout)??;
+/// MAP_SHARED_IN: mapping size and the ring geometry to lay out in it.
+/// Zero ring fields take the driver defaults; the driver may shrink the
+/// request to fit and publishes what it granted in the header (see `geom`).
+#[derive(Debug, Clone, Copy)]
+pub struct MapRequest {
+    pub pages: u32,
+    pub vblk_queues: u32,
+    pub vblk_ring_cap: u32,    // slots per ring (rounded down to a power of two)
+    pub vblk_slot_stride: u32, // bytes per slot window = largest transfer per slot
+    pub vtty_chan_kb: [u32; 4], // KiB per ring of each VTTY channel (0: absent; console: 64)
+    pub shfs_ring_cap: u32,     // shared-folder requests in flight (0: no shared folder)
+    pub shfs_slot_kb: u32,      // KiB per shared-folder window = largest file READ / WRITE
+    pub vnet_bufs: u32,         // NIC pool buffers (0: no NIC)
+    pub vnet_buf_kb: u32,       // KiB per NIC buffer = largest burst or GSO frame
+    pub trace_kb: u32,          // KiB of request-trace records (0: no tracer)
+}
+
+impl MapRequest {
+    fn encode(&self) -> [u8; 52] {
+        let mut b = [0u8; 52];
+        let fields = [self.pages, self.vblk_queues, self.vblk_ring_cap, self.vblk_slot_stride];
+        let tail = [self.shfs_ring_cap, self.shfs_slot_kb, self.vnet_bufs, self.vnet_buf_kb, self.trace_kb];
+        for (i, v) in fields.into_iter().chain(self.vtty_chan_kb).chain(tail).enumerate() {
+            b[i * 4..i * 4 + 4].copy_from_slice(&v.to_le_bytes());
+        }
+        b
+    }
+}
+
+impl Device {
+    /// Map shared memory laid out as `req` asks (synchronous helper with
+    /// timeout). Returns mapping descriptor.
+    pub fn map_shared_sync(&self, req: &MapRequest, timeout: Duration) -> Result<MapInfo> {
+        let (n, out) = self.call(
+            IOCTL_COLINUX_MAP_SHARED,
+            InBuf::inline(&req.encode()),
+            OutBuf::Inline(Inline::zeroed(32)), // MAP_INFO_OUT size
+            timeout,
+        )?;
+        let out = out.filled(n);
         if out.len() < 32 { anyhow::bail!("map_shared: short reply {}", out.len()); }
         let user_base = usize::from_le_bytes(out[0..8].try_into().unwrap());
         let kernel_base = u64::from_le_bytes(out[8..16].try_into().unwrap());
@@ -53,26 +166,41 @@ pub struct MapInfo { pub user_base: usize, pub kernel_base: u64, pub size: u64,
 
     /// Run one scheduler tick with a budget (synchronous).
     pub fn run_tick_sync(&self, budget: u32, timeout: Duration) -> Result<()> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_RUN_TICK,
-            inbuf: Some(budget.to_le_bytes().to_vec()),
-            out_capacity: 0,
-            reply: tx,
-        })?;
-        let _ = recv_with_timeout(rx, timeout)??;
+        let t0 = Instant::now();
+        self.call(IOCTL_COLINUX_RUN_TICK, InBuf::inline(&budget.to_le_bytes()), OutBuf::None, timeout)?;
+        metrics::record_since(Hist::Tick, t0);
         Ok(())
     }
 
+    /// Sleep in the driver until the guest rings the doorbell past `last_seen`,
+    /// any VBLK ring has unconsumed slots, or `cfg.idle_timeout_ms` passes.
+    pub fn wait_doorbell(&self, last_seen: u32, cfg: &DoorbellCfg) -> Result<DoorbellState> {
+        let mut inb = [0u8; 16];
+        for (i, v) in [last_seen, cfg.idle_timeout_ms, cfg.coalesce_us, cfg.max_sleep_us].into_iter().enumerate() {
+            inb[i * 4..i * 4 + 4].copy_from_slice(&v.to_le_bytes());
+        }
+        // The driver enforces the deadline; allow slack for worker scheduling
+        let (n, out) = self.call(
+            IOCTL_COLINUX_WAIT_DOORBELL,
+            InBuf::inline(&inb),
+            OutBuf::Inline(Inline::zeroed(8)), // DOORBELL_WAIT_OUT size
+            Duration::from_millis(cfg.idle_timeout_ms as u64 + 1000),
+        )?;
+        let out = out.filled(n);
+        if out.len() < 8 { anyhow::bail!("wait_doorbell: short reply {}", out.len()); }
+        let doorbell = u32::from_le_bytes(out[0..4].try_into().unwrap());
+        let pending = u32::from_le_bytes(out[4..8].try_into().unwrap());
+        Ok(DoorbellState { doorbell, pending })
+    }
+
     /// Submit a virtual block I/O (async): returns a receiver you can await.
     pub fn vblk_submit_async(&self, req: &[u8], out_capacity: usize) -> Result<Receiver<Result<Vec<u8>>>> {
         let (tx, rx) = bounded(1);
         self.reactor.submit(IoctlRequest {
             code: IOCTL_COLINUX_VBLK_SUBMIT,
-            inbuf: Some(req.to_vec()),
-            out_capacity,
-            prefill_out: None,
-            reply: tx,
+            inbuf: InBuf::Owned(req.to_vec()),
+            out: OutBuf::Owned(vec![0u8; out_capacity]),
+            reply: Reply::Channel(tx),
         })?;
         Ok(rx)
     }
@@ -82,79 +210,159 @@ pub struct MapInfo { pub user_base: usize, pub kernel_base: u64, pub size: u64,
         // Encode as UTF-16 without explicit null terminator; driver will treat buffer length accordingly
         let wide: Vec<u16> = path.encode_utf16().collect();
         let bytes: Vec<u8> = wide.iter().flat_map(|w| w.to_le_bytes()).collect();
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VBLK_SET_BACKING,
-            inbuf: Some(bytes),
-            out_capacity: 0,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let _ = recv_with_timeout(rx, timeout)??;
+        self.call(IOCTL_COLINUX_VBLK_SET_BACKING, InBuf::Owned(bytes), OutBuf::None, timeout)?;
         Ok(())
     }
 
     pub fn vblk_read_sync(&self, lba_sectors: u64, len: u32, timeout: Duration) -> Result<Vec<u8>> {
-        let mut hdr = Vec::with_capacity(16);
-        hdr.extend_from_slice(&lba_sectors.to_le_bytes());
-        hdr.extend_from_slice(&len.to_le_bytes());
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VBLK_READ,
-            inbuf: Some(hdr),
-            out_capacity: len as usize,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = recv_with_timeout(rx, timeout)??;
-        Ok(out)
+        let (n, out) = self.call(
+            IOCTL_COLINUX_VBLK_READ,
+            InBuf::inline(&rw_hdr(lba_sectors, len)),
+            OutBuf::Owned(vec![0u8; len as usize]),
+            timeout,
+        )?;
+        Ok(out.into_vec(n))
     }
 
     pub fn vblk_write_sync(&self, lba_sectors: u64, payload: &[u8], timeout: Duration) -> Result<()> {
-        let len = payload.len() as u32;
-        let mut hdr = Vec::with_capacity(16);
-        hdr.extend_from_slice(&lba_sectors.to_le_bytes());
-        hdr.extend_from_slice(&len.to_le_bytes());
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VBLK_WRITE,
-            inbuf: Some(hdr),
-            out_capacity: payload.len(),
-            prefill_out: Some(payload.to_vec()),
-            reply: tx,
-        })?;
-        let _ = recv_with_timeout(rx, timeout)??;
+        self.vblk_write_from(lba_sectors, payload, timeout)
+    }
+
+    /// Read `buf.len()` bytes into `buf`, which the request owns until the IRP
+    /// completes. On timeout the buffer stays with the pending IRP (and is freed
+    /// with it), so the caller never reuses memory the driver may still write.
+    pub fn vblk_read_owned(&self, lba_sectors: u64, buf: Vec<u8>, timeout: Duration) -> Result<Vec<u8>> {
+        let len = buf.len();
+        let (_, out) = self.call(IOCTL_COLINUX_VBLK_READ, InBuf::inline(&rw_hdr(lba_sectors, len as u32)), OutBuf::Owned(buf), timeout)?;
+        Ok(out.into_vec(len))
+    }
+
+    /// Write `buf`, owned by the request until the IRP completes (see
+    /// `vblk_read_owned`); hands the buffer back for reuse.
+    pub fn vblk_write_owned(&self, lba_sectors: u64, buf: Vec<u8>, timeout: Duration) -> Result<Vec<u8>> {
+        let len = buf.len();
+        let (_, out) = self.call(IOCTL_COLINUX_VBLK_WRITE, InBuf::inline(&rw_hdr(lba_sectors, len as u32)), OutBuf::Owned(buf), timeout)?;
+        Ok(out.into_vec(len))
+    }
+
+    /// Read `dst.len()` bytes straight into caller memory (e.g. a data slot in the
+    /// shared mapping). The driver's MDL targets `dst`, so no intermediate buffer
+    /// or copy is involved; a timed-out read is cancelled before this returns.
+    pub fn vblk_read_into(&self, lba_sectors: u64, dst: &mut [u8], timeout: Duration) -> Result<()> {
+        self.call_in_place(
+            IOCTL_COLINUX_VBLK_READ,
+            InBuf::inline(&rw_hdr(lba_sectors, dst.len() as u32)),
+            UserBuf { ptr: dst.as_mut_ptr(), len: dst.len() },
+            timeout,
+        )?;
+        Ok(())
+    }
+
+    /// Write `src` sourced directly from caller memory (METHOD_IN_DIRECT: the
+    /// driver only reads through the MDL), cancelled before returning on timeout.
+    pub fn vblk_write_from(&self, lba_sectors: u64, src: &[u8], timeout: Duration) -> Result<()> {
+        self.call_in_place(
+            IOCTL_COLINUX_VBLK_WRITE,
+            InBuf::inline(&rw_hdr(lba_sectors, src.len() as u32)),
+            UserBuf { ptr: src.as_ptr() as *mut u8, len: src.len() },
+            timeout,
+        )?;
+        Ok(())
+    }
+
+    /// Submit several block I/Os in one IRP. `buf` holds every descriptor's data
+    /// window plus the status table at `status_off`, and is handed to the driver
+    /// zero-copy. On success the driver has written one NTSTATUS per descriptor
+    /// at `status_off` (see `vblk_batch::statuses`).
+    pub fn vblk_submit_batch(&self, descs: &[BatchDesc], buf: &mut [u8], status_off: usize, timeout: Duration) -> Result<()> {
+        vblk_batch::validate(descs, status_off, buf.len())?;
+        let mut params = self.params.get().context("vblk batch: parameter pool exhausted")?;
+        let n = vblk_batch::encode_into(descs, status_off as u32, &mut params);
+        params.set_len(n);
+        self.call_in_place(
+            IOCTL_COLINUX_VBLK_SUBMIT_BATCH,
+            InBuf::Pooled(params),
+            UserBuf { ptr: buf.as_mut_ptr(), len: buf.len() },
+            timeout,
+        )?;
         Ok(())
     }
 
     pub fn vtty_push(&self, data: &[u8], timeout: Duration) -> Result<usize> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VTTY_PUSH,
-            inbuf: Some(data.to_vec()),
-            out_capacity: 0,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = recv_with_timeout(rx, timeout)??;
-        Ok(out.len())
+        // Driver reports bytes accepted in IoStatus.Information
+        let inbuf = match self.params.get() {
+            Some(mut p) if data.len() <= p.capacity() => {
+                p[..data.len()].copy_from_slice(data);
+                p.set_len(data.len());
+                InBuf::Pooled(p)
+            }
+            _ => InBuf::Owned(data.to_vec()),
+        };
+        let (n, _) = self.call(IOCTL_COLINUX_VTTY_PUSH, inbuf, OutBuf::None, timeout)?;
+        vtty_moved(trace::EV_VTTY_HOST_TX, 0, n);
+        Ok(n)
     }
 
     pub fn vtty_pull(&self, capacity: usize, timeout: Duration) -> Result<Vec<u8>> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VTTY_PULL,
-            inbuf: None,
-            out_capacity: capacity,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = recv_with_timeout(rx, timeout)??;
-        Ok(out)
+        let (n, out) = self.call(IOCTL_COLINUX_VTTY_PULL, InBuf::None, OutBuf::Owned(vec![0u8; capacity]), timeout)?;
+        vtty_moved(trace::EV_VTTY_HOST_RX, 0, n);
+        Ok(out.into_vec(n))
     }
+
+    /// Queue bytes for the guest on VTTY channel `ch`; returns how many fit.
+    pub fn vtty_push_chan(&self, ch: u32, data: &[u8], timeout: Duration) -> Result<usize> {
+        // Channel header + bytes; console-sized pushes fit a pooled buffer
+        let hdr = vtty_chan_in(ch);
+        let len = hdr.len() + data.len();
+        let inbuf = match self.params.get() {
+            Some(mut p) if len <= p.capacity() => {
+                p[..hdr.len()].copy_from_slice(&hdr);
+                p[hdr.len()..len].copy_from_slice(data);
+                p.set_len(len);
+                InBuf::Pooled(p)
+            }
+            _ => InBuf::Owned([&hdr[..], data].concat()),
+        };
+        let (n, _) = self.call(IOCTL_COLINUX_VTTY_PUSH_CHAN, inbuf, OutBuf::None, timeout)?;
+        vtty_moved(trace::EV_VTTY_HOST_TX, ch, n);
+        Ok(n)
+    }
+
+    /// Take up to `buf.len()` bytes the guest wrote on VTTY channel `ch`,
+    /// straight into `buf`; returns how many (0 when the ring is empty).
+    pub fn vtty_pull_chan(&self, ch: u32, buf: &mut [u8], timeout: Duration) -> Result<usize> {
+        let n = self.call_in_place(
+            IOCTL_COLINUX_VTTY_PULL_CHAN,
+            InBuf::inline(&vtty_chan_in(ch)),
+            UserBuf { ptr: buf.as_mut_ptr(), len: buf.len() },
+            timeout,
+        )?;
+        let n = n.min(buf.len());
+        vtty_moved(trace::EV_VTTY_HOST_RX, ch, n);
+        Ok(n)
+    }
+}
+
+/// Count `n` VTTY bytes moved on channel `ch`; empty polls leave no trace record.
+pub(crate) fn vtty_moved(ev: u16, ch: u32, n: usize) {
+    let counter = if ev == trace::EV_VTTY_HOST_TX { Counter::VttyTxBytes } else { Counter::VttyRxBytes };
+    metrics::add(counter, n as u64);
+    if n != 0 {
+        trace::record(ev, ch as u8, 0, n as u32, 0);
+    }
+}
+
+/// VTTY_CHAN_IN: [channel:4][rsvd:4]
+fn vtty_chan_in(ch: u32) -> [u8; 8] {
+    let mut b = [0u8; 8];
+    b[0..4].copy_from_slice(&ch.to_le_bytes());
+    b
 }
 
-fn recv_with_timeout<T>(rx: Receiver<T>, timeout: Duration) -> Result<T> {
-    rx.recv_timeout(timeout)
-        .map_err(|_| anyhow::anyhow!("ioctl timeout"))
+/// VBLK_RW_HDR (driver_c/vblk.c): [lba:8][len:4][flags:4]
+fn rw_hdr(lba_sectors: u64, len: u32) -> [u8; 16] {
+    let mut hdr = [0u8; 16];
+    hdr[0..8].copy_from_slice(&lba_sectors.to_le_bytes());
+    hdr[8..12].copy_from_slice(&len.to_le_bytes());
+    hdr
 }
@@ -0,0 +1,662 @@
+//! Shared-mapping geometry descriptor (`struct colx_geom` in colinux_ring.h).
+//!
+//! The driver sizes the mapping at map time from the requested queue count,
+//! ring depth and slot stride, and publishes the layout at `GEOM_OFF` in the
+//! header page. Mappings without the descriptor use the legacy fixed layout,
+//! including its packed ring control block. VTTY traffic is split into
+//! independently sized channels; drivers without the channel table have one,
+//! the console. The shared-folder ring (`shfs`), the virtual NIC (`vnet`) and
+//! the request tracer come last in the descriptor and are absent on drivers
+//! that predate them.
+
+use crate::device::MapInfo;
+use anyhow::{bail, Result};
+
+pub const GEOM_OFF: usize = 0x100;
+pub const GEOM_MAGIC: u32 = 0x4d4f_4547; // "GEOM"
+pub const GEOM_VER: u16 = 1;
+pub const GEOM_LEN: usize = 256;
+/// Descriptor length of drivers without the VTTY channel table.
+const GEOM_LEN_V1: usize = 80;
+/// ... without the shared-folder ring.
+const GEOM_LEN_CHAN: usize = 184;
+/// ... without the NIC.
+const GEOM_LEN_SHFS: usize = 208;
+/// ... and without the request tracer.
+const GEOM_LEN_VNET: usize = 240;
+
+pub const MAX_QUEUES: usize = 8;
+pub const MAX_RING_CAP: usize = 1024;
+/// Largest slot window; must match COLINUX_VBLK_MAX_XFER.
+pub const MAX_SLOT_STRIDE: usize = 1024 * 1024;
+
+/// colx_ring_ctrl: prod on the first cache line, cons on the second.
+const RING_CTRL_LEN: usize = 128;
+const RING_CONS_OFF: usize = 64;
+/// colx_ring_ctrl_legacy: prod, cons, cap, slot_size in 16 bytes.
+const LEGACY_CTRL_LEN: usize = 16;
+const LEGACY_CONS_OFF: usize = 4;
+/// Offset of cap in either control block.
+pub const RING_CAP_OFF: usize = 8;
+const SLOT_LEN: usize = 32;
+const VTTY_RING_HDR: usize = 16;
+pub const MAX_VTTY_CHANNELS: usize = 4;
+pub const VTTY_MAX_CAP: usize = 16 << 20;
+/// colx_vtty_chan table: count at 80, entries of 24 bytes from 88.
+const VTTY_CHAN_OFF: usize = 88;
+const VTTY_CHAN_LEN: usize = 24;
+const PAGE: usize = 0x1000;
+/// struct colx_shfs_slot
+pub const SHFS_SLOT_LEN: usize = 64;
+pub const SHFS_MAX_RING_CAP: usize = 256;
+pub const SHFS_MAX_SLOT_STRIDE: usize = 1024 * 1024;
+/// struct colx_vnet_desc; the NIC has COLX_VNET_RINGS rings after its config page.
+pub const VNET_DESC_LEN: usize = 16;
+pub const VNET_RINGS: usize = 4;
+pub const VNET_MAX_RING_CAP: usize = 4096;
+pub const VNET_MIN_BUF_SIZE: usize = 4096;
+pub const VNET_MAX_BUF_SIZE: usize = 256 * 1024;
+/// struct colx_trace_hdr, then records of struct colx_trace_rec.
+pub const TRACE_HDR_LEN: usize = 128;
+pub const TRACE_REC_LEN: usize = 32;
+pub const TRACE_MAX_CAP: usize = 1 << 20;
+
+/// NIC pool requested from the driver; the ring cap is the pool size rounded
+/// up to a power of two.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct VnetShape {
+    pub bufs: usize,
+    pub buf_size: usize,
+}
+
+/// One VTTY channel: a host->guest and a guest->host byte ring of `cap` bytes.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct VttyChan {
+    pub tx_off: usize,
+    pub rx_off: usize,
+    pub cap: usize,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Geometry {
+    pub features: u32,
+    pub vblk_queues: usize,
+    pub vblk_ring_cap: usize,
+    pub vblk_slot_stride: usize,
+    pub vblk_ring_stride: usize,
+    pub vblk_ring_off: usize,
+    pub vblk_data_off: usize,
+    pub vblk_queue_stride: usize,
+    pub vtty_tx_off: usize,
+    pub vtty_rx_off: usize,
+    pub vtty_cap: usize,
+    /// Channel 0 repeats vtty_tx_off / vtty_rx_off / vtty_cap.
+    pub vtty_channels: usize,
+    pub vtty_chan: [VttyChan; MAX_VTTY_CHANNELS],
+    /// Shared-folder ring: control block, then slots; windows are page aligned.
+    pub shfs_ring_off: usize,
+    pub shfs_data_off: usize,
+    /// 0 if the driver laid out no shared folder.
+    pub shfs_ring_cap: usize,
+    pub shfs_slot_stride: usize,
+    /// NIC: config page, then TX, TXC, FILL and RX rings `vnet_ring_stride` apart.
+    pub vnet_off: usize,
+    pub vnet_pool_off: usize,
+    /// 0 if the driver laid out no NIC.
+    pub vnet_ring_cap: usize,
+    pub vnet_ring_stride: usize,
+    pub vnet_buf_count: usize,
+    pub vnet_buf_size: usize,
+    /// Request tracer: header, then `trace_cap` records; 0 if none.
+    pub trace_off: usize,
+    pub trace_cap: usize,
+    /// Control block layout (not on the wire: implied by the descriptor's presence).
+    pub ctrl_cons_off: usize,
+    pub ctrl_len: usize,
+}
+
+impl Geometry {
+    /// Layout of drivers that predate the descriptor (COLX_VBLK_* / COLX_VTTY_*
+    /// in colinux_ring.h). Rings are probed by their cap, up to MAX_QUEUES.
+    pub fn legacy(flags: u32) -> Self {
+        let cap = 64;
+        let stride = 128 * 1024;
+        Self {
+            features: flags,
+            vblk_queues: MAX_QUEUES,
+            vblk_ring_cap: cap,
+            vblk_slot_stride: stride,
+            vblk_ring_stride: 0x1000,
+            vblk_ring_off: 0x1000,
+            vblk_data_off: 0x10_0000,
+            vblk_queue_stride: cap * stride + PAGE,
+            vtty_tx_off: 0x4_0000,
+            vtty_rx_off: 0x5_0000,
+            vtty_cap: 64 * 1024,
+            vtty_channels: 1,
+            vtty_chan: console(0x4_0000, 0x5_0000, 64 * 1024),
+            shfs_ring_off: 0,
+            shfs_data_off: 0,
+            shfs_ring_cap: 0,
+            shfs_slot_stride: 0,
+            vnet_off: 0,
+            vnet_pool_off: 0,
+            vnet_ring_cap: 0,
+            vnet_ring_stride: 0,
+            vnet_buf_count: 0,
+            vnet_buf_size: 0,
+            trace_off: 0,
+            trace_cap: 0,
+            ctrl_cons_off: LEGACY_CONS_OFF,
+            ctrl_len: LEGACY_CTRL_LEN,
+        }
+    }
+
+    /// The layout mem.c's GeomLayout produces, for simulated mappings.
+    pub fn layout(queues: usize, cap: usize, stride: usize) -> Self {
+        Self::layout_with_channels(queues, cap, stride, &[64 * 1024])
+    }
+
+    /// As `layout`, with channel `c`'s rings sized `chans[c]` bytes (0: absent).
+    pub fn layout_with_channels(queues: usize, cap: usize, stride: usize, chans: &[usize]) -> Self {
+        Self::layout_with_shfs(queues, cap, stride, chans, 0, 0)
+    }
+
+    /// As `layout_with_channels`, plus a shared-folder ring of `shfs_cap`
+    /// slots with `shfs_stride`-byte windows (cap 0: none).
+    pub fn layout_with_shfs(queues: usize, cap: usize, stride: usize, chans: &[usize], shfs_cap: usize, shfs_stride: usize) -> Self {
+        Self::layout_with_vnet(queues, cap, stride, chans, shfs_cap, shfs_stride, VnetShape::default())
+    }
+
+    /// As `layout_with_shfs`, plus a NIC with `vnet.bufs` pool buffers (0: none).
+    pub fn layout_with_vnet(queues: usize, cap: usize, stride: usize, chans: &[usize], shfs_cap: usize, shfs_stride: usize, vnet: VnetShape) -> Self {
+        let round = |x: usize| (x + PAGE - 1) & !(PAGE - 1);
+        let vblk_ring_stride = round(RING_CTRL_LEN + cap * SLOT_LEN);
+        let mut vtty_chan = [VttyChan::default(); MAX_VTTY_CHANNELS];
+        let mut vtty_channels = 0;
+        let mut off = PAGE + queues * vblk_ring_stride;
+        for (c, &cap) in chans.iter().enumerate().filter(|(_, &cap)| cap != 0) {
+            let rx_off = off + round(VTTY_RING_HDR + cap);
+            vtty_chan[c] = VttyChan { tx_off: off, rx_off, cap };
+            vtty_channels = c + 1;
+            off = rx_off + round(VTTY_RING_HDR + cap);
+        }
+        let (mut shfs_ring_off, mut shfs_data_off) = (0, 0);
+        if shfs_cap != 0 {
+            shfs_ring_off = off;
+            shfs_data_off = off + round(RING_CTRL_LEN + shfs_cap * SHFS_SLOT_LEN);
+            off = shfs_data_off + shfs_cap * shfs_stride;
+        }
+        let (mut vnet_off, mut vnet_pool_off, mut vnet_ring_cap, mut vnet_ring_stride) = (0, 0, 0, 0);
+        if vnet.bufs != 0 {
+            vnet_ring_cap = vnet.bufs.next_power_of_two();
+            vnet_ring_stride = round(RING_CTRL_LEN + vnet_ring_cap * VNET_DESC_LEN);
+            vnet_off = off;
+            vnet_pool_off = off + PAGE + VNET_RINGS * vnet_ring_stride;
+            off = vnet_pool_off + vnet.bufs * vnet.buf_size;
+        }
+        Self {
+            features: 0x7, // DOORBELL | VBLK_TRIM | VTTY_NOTIFY
+            vblk_queues: queues,
+            vblk_ring_cap: cap,
+            vblk_slot_stride: stride,
+            vblk_ring_stride,
+            vblk_ring_off: PAGE,
+            vblk_data_off: off,
+            vblk_queue_stride: cap * stride + PAGE,
+            vtty_tx_off: vtty_chan[0].tx_off,
+            vtty_rx_off: vtty_chan[0].rx_off,
+            vtty_cap: vtty_chan[0].cap,
+            vtty_channels,
+            vtty_chan,
+            shfs_ring_off,
+            shfs_data_off,
+            shfs_ring_cap: shfs_cap,
+            shfs_slot_stride: if shfs_cap != 0 { shfs_stride } else { 0 },
+            vnet_off,
+            vnet_pool_off,
+            vnet_ring_cap,
+            vnet_ring_stride,
+            vnet_buf_count: vnet.bufs,
+            vnet_buf_size: if vnet.bufs != 0 { vnet.buf_size } else { 0 },
+            trace_off: 0,
+            trace_cap: 0,
+            ctrl_cons_off: RING_CONS_OFF,
+            ctrl_len: RING_CTRL_LEN,
+        }
+    }
+
+    /// This layout plus a request tracer of `cap` records (0: none), placed
+    /// after the NIC as mem.c does, pushing the VBLK windows up.
+    pub fn with_trace(self, cap: usize) -> Self {
+        if cap == 0 {
+            return self;
+        }
+        let round = |x: usize| (x + PAGE - 1) & !(PAGE - 1);
+        Self {
+            trace_off: self.vblk_data_off,
+            trace_cap: cap,
+            vblk_data_off: self.vblk_data_off + round(TRACE_HDR_LEN + cap * TRACE_REC_LEN),
+            ..self
+        }
+    }
+
+    /// Serialise into a header page the way the driver does.
+    pub fn write(&self, hdr: &mut [u8]) {
+        let b = &mut hdr[GEOM_OFF..GEOM_OFF + GEOM_LEN];
+        let mut put = |o: usize, v: &[u8]| b[o..o + v.len()].copy_from_slice(v);
+        put(0, &GEOM_MAGIC.to_le_bytes());
+        put(4, &GEOM_VER.to_le_bytes());
+        put(6, &(GEOM_LEN as u16).to_le_bytes());
+        put(8, &self.features.to_le_bytes());
+        for (o, v) in [(12, self.vblk_queues), (16, self.vblk_ring_cap), (20, SLOT_LEN), (24, self.vblk_slot_stride), (28, self.vblk_ring_stride), (72, self.vtty_cap)] {
+            put(o, &(v as u32).to_le_bytes());
+        }
+        for (o, v) in [(32, self.vblk_ring_off), (40, self.vblk_data_off), (48, self.vblk_queue_stride), (56, self.vtty_tx_off), (64, self.vtty_rx_off)] {
+            put(o, &(v as u64).to_le_bytes());
+        }
+        put(80, &(self.vtty_channels as u32).to_le_bytes());
+        for (c, ch) in self.vtty_chan.iter().enumerate() {
+            let o = VTTY_CHAN_OFF + c * VTTY_CHAN_LEN;
+            put(o, &(ch.tx_off as u64).to_le_bytes());
+            put(o + 8, &(ch.rx_off as u64).to_le_bytes());
+            put(o + 16, &(ch.cap as u32).to_le_bytes());
+        }
+        put(184, &(self.shfs_ring_off as u64).to_le_bytes());
+        put(192, &(self.shfs_data_off as u64).to_le_bytes());
+        put(200, &(self.shfs_ring_cap as u32).to_le_bytes());
+        put(204, &(self.shfs_slot_stride as u32).to_le_bytes());
+        put(208, &(self.vnet_off as u64).to_le_bytes());
+        put(216, &(self.vnet_pool_off as u64).to_le_bytes());
+        for (o, v) in [(224, self.vnet_ring_cap), (228, self.vnet_ring_stride), (232, self.vnet_buf_count), (236, self.vnet_buf_size)] {
+            put(o, &(v as u32).to_le_bytes());
+        }
+        put(240, &(self.trace_off as u64).to_le_bytes());
+        put(248, &(self.trace_cap as u32).to_le_bytes());
+    }
+
+    /// Bytes a mapping needs to hold every ring.
+    pub fn span(&self) -> usize {
+        self.vblk_data_off + self.vblk_queues * self.vblk_queue_stride
+    }
+
+    /// Parse the header page of a mapping of `map_size` bytes. The descriptor
+    /// lives in guest-writable memory, so every offset is checked against the
+    /// mapping before any consumer dereferences it.
+    pub fn parse(hdr: &[u8], map_size: usize) -> Result<Self> {
+        if hdr.len() < GEOM_OFF + GEOM_LEN {
+            bail!("geometry: header page too short ({} bytes)", hdr.len());
+        }
+        let u16_at = |o: usize| u16::from_le_bytes(hdr[GEOM_OFF + o..GEOM_OFF + o + 2].try_into().unwrap());
+        let u32_at = |o: usize| u32::from_le_bytes(hdr[GEOM_OFF + o..GEOM_OFF + o + 4].try_into().unwrap());
+        let u64_at = |o: usize| u64::from_le_bytes(hdr[GEOM_OFF + o..GEOM_OFF + o + 8].try_into().unwrap()) as usize;
+        if u32_at(0) != GEOM_MAGIC {
+            return Ok(Self::legacy(u32::from_le_bytes(hdr[4..8].try_into().unwrap())));
+        }
+        let (ver, size) = (u16_at(4), u16_at(6) as usize);
+        if ver != GEOM_VER || size < GEOM_LEN_V1 {
+            bail!("geometry: unsupported version {} (size {})", ver, size);
+        }
+        if u32_at(20) as usize != SLOT_LEN {
+            bail!("geometry: slot size {} (expected {})", u32_at(20), SLOT_LEN);
+        }
+        let (vtty_tx_off, vtty_rx_off, vtty_cap) = (u64_at(56), u64_at(64), u32_at(72) as usize);
+        let (vtty_channels, vtty_chan) = if size >= GEOM_LEN_CHAN {
+            let mut chans = [VttyChan::default(); MAX_VTTY_CHANNELS];
+            for (c, ch) in chans.iter_mut().enumerate() {
+                let o = VTTY_CHAN_OFF + c * VTTY_CHAN_LEN;
+                *ch = VttyChan { tx_off: u64_at(o), rx_off: u64_at(o + 8), cap: u32_at(o + 16) as usize };
+            }
+            (u32_at(80) as usize, chans)
+        } else {
+            // Older driver: the v1 ring pair is the only channel
+            ((vtty_cap != 0) as usize, console(vtty_tx_off, vtty_rx_off, vtty_cap))
+        };
+        // Regions past `size` were not written by the driver
+        let at = |min: usize, o: usize, wide: bool| match (size >= min, wide) {
+            (false, _) => 0,
+            (true, true) => u64_at(o),
+            (true, false) => u32_at(o) as usize,
+        };
+        let g = Self {
+            features: u32_at(8),
+            vblk_queues: u32_at(12) as usize,
+            vblk_ring_cap: u32_at(16) as usize,
+            vblk_slot_stride: u32_at(24) as usize,
+            vblk_ring_stride: u32_at(28) as usize,
+            vblk_ring_off: u64_at(32),
+            vblk_data_off: u64_at(40),
+            vblk_queue_stride: u64_at(48),
+            vtty_tx_off,
+            vtty_rx_off,
+            vtty_cap,
+            vtty_channels,
+            vtty_chan,
+            shfs_ring_off: at(GEOM_LEN_SHFS, 184, true),
+            shfs_data_off: at(GEOM_LEN_SHFS, 192, true),
+            shfs_ring_cap: at(GEOM_LEN_SHFS, 200, false),
+            shfs_slot_stride: at(GEOM_LEN_SHFS, 204, false),
+            vnet_off: at(GEOM_LEN_VNET, 208, true),
+            vnet_pool_off: at(GEOM_LEN_VNET, 216, true),
+            vnet_ring_cap: at(GEOM_LEN_VNET, 224, false),
+            vnet_ring_stride: at(GEOM_LEN_VNET, 228, false),
+            vnet_buf_count: at(GEOM_LEN_VNET, 232, false),
+            vnet_buf_size: at(GEOM_LEN_VNET, 236, false),
+            trace_off: at(GEOM_LEN, 240, true),
+            trace_cap: at(GEOM_LEN, 248, false),
+            ctrl_cons_off: RING_CONS_OFF,
+            ctrl_len: RING_CTRL_LEN,
+        };
+        g.check(map_size)?;
+        Ok(g)
+    }
+
+    /// Read the descriptor from a live mapping.
+    pub fn read(map: &MapInfo) -> Result<Self> {
+        let size = map.size as usize;
+        if map.user_base == 0 || size < PAGE {
+            bail!("geometry: mapping too small ({} bytes)", size);
+        }
+        let hdr = unsafe { std::slice::from_raw_parts(map.user_base as *const u8, PAGE) };
+        Self::parse(hdr, size)
+    }
+
+    fn check(&self, map_size: usize) -> Result<()> {
+        let q = self.vblk_queues;
+        if q > MAX_QUEUES {
+            bail!("geometry: {} queues (max {})", q, MAX_QUEUES);
+        }
+        if q > 0 {
+            let cap = self.vblk_ring_cap;
+            if !cap.is_power_of_two() || cap > MAX_RING_CAP {
+                bail!("geometry: ring cap {} not a power of two in 1..={}", cap, MAX_RING_CAP);
+            }
+            if self.vblk_slot_stride == 0 || self.vblk_slot_stride % 512 != 0 || self.vblk_slot_stride > MAX_SLOT_STRIDE {
+                bail!("geometry: slot stride {}", self.vblk_slot_stride);
+            }
+            if self.vblk_ring_stride < self.ctrl_len + cap * SLOT_LEN {
+                bail!("geometry: ring stride {} too small for {} slots", self.vblk_ring_stride, cap);
+            }
+            // Windows plus at least the batch status table in the scratch page
+            if self.vblk_queue_stride < cap * self.vblk_slot_stride + PAGE {
+                bail!("geometry: queue stride {} too small", self.vblk_queue_stride);
+            }
+            let rings_end = self.vblk_ring_off.checked_add(q * self.vblk_ring_stride);
+            // Slot data_off is 32-bit: every window must be reachable from vblk_data_off
+            let data_span = self.vblk_queue_stride.checked_mul(q).filter(|&s| s <= u32::MAX as usize);
+            let data_end = data_span.and_then(|s| self.vblk_data_off.checked_add(s));
+            if rings_end.map_or(true, |e| e > map_size) || data_end.map_or(true, |e| e > map_size) {
+                bail!("geometry: VBLK rings exceed the {} byte mapping", map_size);
+            }
+        }
+        let n = self.vtty_channels;
+        if n > MAX_VTTY_CHANNELS || (n == 0) != (self.vtty_cap == 0) {
+            bail!("geometry: {} VTTY channels with console cap {}", n, self.vtty_cap);
+        }
+        if n > 0 && self.vtty_chan[0] != (VttyChan { tx_off: self.vtty_tx_off, rx_off: self.vtty_rx_off, cap: self.vtty_cap }) {
+            bail!("geometry: VTTY channel 0 differs from the console rings");
+        }
+        for (c, ch) in self.vtty_chan[..n].iter().enumerate().filter(|(_, ch)| ch.cap != 0) {
+            if !ch.cap.is_power_of_two() || ch.cap > VTTY_MAX_CAP {
+                bail!("geometry: VTTY channel {} cap {} not a power of two up to {}", c, ch.cap, VTTY_MAX_CAP);
+            }
+            for off in [ch.tx_off, ch.rx_off] {
+                if off.checked_add(VTTY_RING_HDR + ch.cap).map_or(true, |e| e > map_size) {
+                    bail!("geometry: VTTY ring at 0x{:x} exceeds the mapping", off);
+                }
+            }
+        }
+        let cap = self.shfs_ring_cap;
+        if cap != 0 {
+            let stride = self.shfs_slot_stride;
+            if !cap.is_power_of_two() || cap > SHFS_MAX_RING_CAP {
+                bail!("geometry: shared-folder ring cap {} not a power of two in 1..={}", cap, SHFS_MAX_RING_CAP);
+            }
+            if stride < PAGE || stride % PAGE != 0 || stride > SHFS_MAX_SLOT_STRIDE || self.shfs_data_off % PAGE != 0 {
+                bail!("geometry: shared-folder windows of {} bytes at 0x{:x}", stride, self.shfs_data_off);
+            }
+            let ring_end = self.shfs_ring_off.checked_add(self.ctrl_len + cap * SHFS_SLOT_LEN);
+            let data_end = self.shfs_data_off.checked_add(cap * stride);
+            if ring_end.map_or(true, |e| e > map_size) || data_end.map_or(true, |e| e > map_size) {
+                bail!("geometry: shared-folder ring exceeds the {} byte mapping", map_size);
+            }
+        }
+        let cap = self.vnet_ring_cap;
+        if cap != 0 {
+            let (bufs, size) = (self.vnet_buf_count, self.vnet_buf_size);
+            if !cap.is_power_of_two() || cap > VNET_MAX_RING_CAP || bufs == 0 || bufs > cap {
+                bail!("geometry: NIC rings of {} slots for {} buffers", cap, bufs);
+            }
+            if !(VNET_MIN_BUF_SIZE..=VNET_MAX_BUF_SIZE).contains(&size) || size % PAGE != 0 || self.vnet_pool_off % PAGE != 0 {
+                bail!("geometry: NIC buffers of {} bytes at 0x{:x}", size, self.vnet_pool_off);
+            }
+            if self.vnet_ring_stride < self.ctrl_len + cap * VNET_DESC_LEN {
+                bail!("geometry: NIC ring stride {} too small for {} slots", self.vnet_ring_stride, cap);
+            }
+            let rings_end = self.vnet_off.checked_add(PAGE + VNET_RINGS * self.vnet_ring_stride);
+            let pool_end = self.vnet_pool_off.checked_add(bufs * size);
+            if rings_end.map_or(true, |e| e > map_size) || pool_end.map_or(true, |e| e > map_size) {
+                bail!("geometry: NIC exceeds the {} byte mapping", map_size);
+            }
+        }
+        let cap = self.trace_cap;
+        if cap != 0 {
+            if !cap.is_power_of_two() || cap > TRACE_MAX_CAP || self.trace_off % 64 != 0 {
+                bail!("geometry: trace ring of {} records at 0x{:x}", cap, self.trace_off);
+            }
+            if self.trace_off.checked_add(TRACE_HDR_LEN + cap * TRACE_REC_LEN).map_or(true, |e| e > map_size) {
+                bail!("geometry: trace ring exceeds the {} byte mapping", map_size);
+            }
+        }
+        Ok(())
+    }
+
+    /// Shared-folder ring's consumer index and first slot.
+    pub fn shfs_cons_off(&self) -> usize {
+        self.shfs_ring_off + self.ctrl_cons_off
+    }
+
+    pub fn shfs_slots_off(&self) -> usize {
+        self.shfs_ring_off + self.ctrl_len
+    }
+
+    /// NIC ring `r` (COLX_VNET_RING_*): control block, consumer index, first slot.
+    pub fn vnet_ring_off(&self, r: usize) -> usize {
+        self.vnet_off + PAGE + r * self.vnet_ring_stride
+    }
+
+    pub fn vnet_cons_off(&self, r: usize) -> usize {
+        self.vnet_ring_off(r) + self.ctrl_cons_off
+    }
+
+    pub fn vnet_slots_off(&self, r: usize) -> usize {
+        self.vnet_ring_off(r) + self.ctrl_len
+    }
+
+    /// VTTY channel `c`, if the driver laid it out.
+    pub fn vtty(&self, c: usize) -> Option<VttyChan> {
+        self.vtty_chan[..self.vtty_channels].get(c).copied().filter(|ch| ch.cap != 0)
+    }
+
+    /// Ring `q`'s control block (and its producer index).
+    pub fn ring_off(&self, q: usize) -> usize {
+        self.vblk_ring_off + q * self.vblk_ring_stride
+    }
+
+    /// Ring `q`'s consumer index.
+    pub fn cons_off(&self, q: usize) -> usize {
+        self.ring_off(q) + self.ctrl_cons_off
+    }
+
+    /// Ring `q`'s first slot.
+    pub fn slots_off(&self, q: usize) -> usize {
+        self.ring_off(q) + self.ctrl_len
+    }
+
+    /// Ring `q`'s windows relative to `vblk_data_off`, as slots express data_off.
+    pub fn data_base(&self, q: usize) -> usize {
+        q * self.vblk_queue_stride
+    }
+
+    /// Bytes of slot windows per ring; the host scratch page follows them.
+    pub fn window(&self) -> usize {
+        self.vblk_ring_cap * self.vblk_slot_stride
+    }
+}
+
+/// A channel table holding only the console rings.
+fn console(tx_off: usize, rx_off: usize, cap: usize) -> [VttyChan; MAX_VTTY_CHANNELS] {
+    let mut chans = [VttyChan::default(); MAX_VTTY_CHANNELS];
+    chans[0] = VttyChan { tx_off, rx_off, cap };
+    chans
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn descriptor_round_trips() {
+        let g = Geometry::layout(4, 256, 256 * 1024);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap(), g);
+        // 256 slots no longer fit one control page; VTTY follows the larger rings
+        assert_eq!(g.vblk_ring_stride, 0x3000);
+        assert_eq!(g.ring_off(2), 0x7000);
+        assert_eq!(g.cons_off(2) - g.ring_off(2), 64);
+        assert_eq!(g.slots_off(2) - g.ring_off(2), 128);
+        assert_eq!(g.vtty_rx_off - g.vtty_tx_off, 0x11000);
+    }
+
+    #[test]
+    fn channels_are_laid_out_after_the_rings() {
+        let g = Geometry::layout_with_channels(1, 64, 128 * 1024, &[64 * 1024, 4 << 20, 0, 16 * 1024]);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap(), g);
+        assert_eq!(g.vtty_channels, 4);
+        assert_eq!(g.vtty(0).unwrap().tx_off, g.vtty_tx_off);
+        let bulk = g.vtty(1).unwrap();
+        assert_eq!((bulk.tx_off, bulk.rx_off - bulk.tx_off), (g.vtty_rx_off + 0x11000, (4 << 20) + PAGE));
+        assert_eq!(g.vtty(2), None);
+        assert_eq!(g.vtty(3).unwrap().rx_off + 0x5000, g.vblk_data_off);
+        assert_eq!(g.vtty(4), None);
+
+        let mut huge = g;
+        huge.vtty_chan[1].cap = VTTY_MAX_CAP * 2;
+        huge.write(&mut hdr);
+        assert!(Geometry::parse(&hdr, g.span()).is_err());
+    }
+
+    #[test]
+    fn v1_descriptor_has_only_the_console_channel() {
+        let g = Geometry::layout(1, 64, 128 * 1024);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        hdr[GEOM_OFF + 6..GEOM_OFF + 8].copy_from_slice(&(GEOM_LEN_V1 as u16).to_le_bytes());
+        hdr[GEOM_OFF + GEOM_LEN_V1..GEOM_OFF + GEOM_LEN].fill(0xff);
+        let p = Geometry::parse(&hdr, g.span()).unwrap();
+        assert_eq!(p, g);
+        assert_eq!(p.vtty(1), None);
+    }
+
+    #[test]
+    fn shared_folder_windows_are_page_aligned() {
+        let g = Geometry::layout_with_shfs(1, 64, 128 * 1024, &[64 * 1024], 32, 64 * 1024);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap(), g);
+        assert_eq!(g.shfs_ring_off, g.vtty_rx_off + 0x11000);
+        assert!(g.shfs_slots_off() + 32 * SHFS_SLOT_LEN <= g.shfs_data_off);
+        assert_eq!(g.shfs_data_off, g.shfs_ring_off + PAGE);
+        assert_eq!(g.shfs_data_off + 32 * 64 * 1024, g.vblk_data_off);
+
+        // A driver without the shared folder writes the shorter descriptor
+        hdr[GEOM_OFF + 6..GEOM_OFF + 8].copy_from_slice(&(GEOM_LEN_CHAN as u16).to_le_bytes());
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap().shfs_ring_cap, 0);
+
+        for bad in [Geometry { shfs_slot_stride: 6000, ..g }, Geometry { shfs_ring_cap: 24, ..g }, Geometry { shfs_data_off: g.span(), ..g }] {
+            bad.write(&mut hdr);
+            assert!(Geometry::parse(&hdr, g.span()).is_err(), "{bad:?}");
+        }
+    }
+
+    #[test]
+    fn nic_follows_the_shared_folder() {
+        let vnet = VnetShape { bufs: 100, buf_size: 64 * 1024 };
+        let g = Geometry::layout_with_vnet(1, 64, 128 * 1024, &[64 * 1024], 32, 64 * 1024, vnet);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap(), g);
+        assert_eq!(g.vnet_off, g.shfs_data_off + 32 * 64 * 1024);
+        // 128 slots of 16 bytes share a page with the control block
+        assert_eq!((g.vnet_ring_cap, g.vnet_ring_stride), (128, PAGE));
+        assert_eq!(g.vnet_slots_off(3), g.vnet_off + 4 * PAGE + 128);
+        assert_eq!(g.vnet_pool_off, g.vnet_off + 5 * PAGE);
+        assert_eq!(g.vnet_pool_off + 100 * 64 * 1024, g.vblk_data_off);
+
+        // A driver without the NIC writes the shorter descriptor
+        hdr[GEOM_OFF + 6..GEOM_OFF + 8].copy_from_slice(&(GEOM_LEN_SHFS as u16).to_le_bytes());
+        let p = Geometry::parse(&hdr, g.span()).unwrap();
+        assert_eq!((p.vnet_ring_cap, p.shfs_ring_cap), (0, 32));
+
+        for bad in [Geometry { vnet_buf_count: 129, ..g }, Geometry { vnet_buf_size: 6000, ..g }, Geometry { vnet_ring_stride: 0x800, ..g }, Geometry { vnet_pool_off: g.span() - PAGE, ..g }] {
+            bad.write(&mut hdr);
+            assert!(Geometry::parse(&hdr, g.span()).is_err(), "{bad:?}");
+        }
+    }
+
+    #[test]
+    fn trace_ring_sits_before_the_windows() {
+        let vnet = VnetShape { bufs: 16, buf_size: 64 * 1024 };
+        let base = Geometry::layout_with_vnet(1, 64, 128 * 1024, &[64 * 1024], 0, 0, vnet);
+        let g = base.with_trace(4096);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert_eq!(Geometry::parse(&hdr, g.span()).unwrap(), g);
+        assert_eq!(g.trace_off, base.vblk_data_off);
+        assert_eq!(g.vblk_data_off, g.trace_off + 33 * PAGE);
+
+        // A driver without the tracer writes the shorter descriptor
+        hdr[GEOM_OFF + 6..GEOM_OFF + 8].copy_from_slice(&(GEOM_LEN_VNET as u16).to_le_bytes());
+        let p = Geometry::parse(&hdr, g.span()).unwrap();
+        assert_eq!((p.trace_cap, p.vnet_ring_cap), (0, 16));
+
+        for bad in [Geometry { trace_cap: 3000, ..g }, Geometry { trace_off: g.trace_off + 8, ..g }, Geometry { trace_off: g.span() - PAGE, ..g }] {
+            bad.write(&mut hdr);
+            assert!(Geometry::parse(&hdr, g.span()).is_err(), "{bad:?}");
+        }
+    }
+
+    #[test]
+    fn missing_magic_means_legacy_layout() {
+        let mut hdr = vec![0u8; PAGE];
+        hdr[4..8].copy_from_slice(&2u32.to_le_bytes());
+        let g = Geometry::parse(&hdr, 64 << 20).unwrap();
+        assert_eq!(g, Geometry::legacy(2));
+        assert_eq!(g.vblk_data_off, 0x10_0000);
+        assert_eq!(g.window(), 64 * 128 * 1024);
+        assert_eq!((g.cons_off(1), g.slots_off(1)), (0x2004, 0x2010));
+    }
+
+    #[test]
+    fn rejects_layouts_outside_the_mapping() {
+        let g = Geometry::layout(2, 64, 128 * 1024);
+        let mut hdr = vec![0u8; PAGE];
+        g.write(&mut hdr);
+        assert!(Geometry::parse(&hdr, g.span() - 1).is_err());
+
+        for bad in [
+            Geometry { vblk_ring_cap: 48, ..g },
+            Geometry { vblk_queues: 9, ..g },
+            Geometry { vblk_ring_stride: 0x100, ..g },
+            Geometry { vblk_queue_stride: g.window(), ..g },
+            Geometry { vtty_rx_off: usize::MAX - 8, ..g },
+            Geometry { vtty_channels: 5, ..g },
+        ] {
+            bad.write(&mut hdr);
+            assert!(Geometry::parse(&hdr, g.span()).is_err(), "{bad:?}");
+        }
+    }
+}
@@ -0,0 +1,1021 @@
+//! Linux host backend: the coLinux driver's IOCTLs served in-process, so the
+//! ring, VBLK and VTTY paths (and the daemon on top of them) run and profile
+//! on hosts without the Windows driver.
+//!
+//! MAP_SHARED creates a memfd and maps it twice, as the driver maps its
+//! section into the daemon and into system space; layout, header and ring
+//! initialisation follow mem.c. Control IOCTLs complete on the submitting
+//! worker, as the driver completes them inline, and doorbell waits pend on
+//! their own thread with the driver's back-off. Block I/O goes to the backing
+//! image through an `IoEngine`, so engines compare under one workload:
+//! - `Inline`: pread/pwrite on the submitting worker, completing synchronously.
+//! - `Pool(n)`: the same calls on n I/O threads, completing through the event
+//!   queue like the driver's work items.
+//! - `Uring(n)`: io_uring with n SQEs; every descriptor of a batch is in
+//!   flight at once.
+
+use anyhow::{anyhow, bail, Context, Result};
+use crossbeam_channel::{Receiver, Sender};
+use std::collections::VecDeque;
+use std::fs::File;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::os::unix::fs::FileExt;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+use crate::geom::{Geometry, VnetShape, MAX_QUEUES, MAX_RING_CAP, MAX_SLOT_STRIDE, MAX_VTTY_CHANNELS, SHFS_MAX_RING_CAP, SHFS_MAX_SLOT_STRIDE, SHFS_SLOT_LEN, TRACE_MAX_CAP, TRACE_REC_LEN, VNET_DESC_LEN, VNET_MAX_BUF_SIZE, VNET_MAX_RING_CAP, VNET_MIN_BUF_SIZE, VNET_RINGS, VTTY_MAX_CAP};
+use crate::reactor::{CompletionSource, Done, Event, IoctlError, IoctlRequest, OutBuf, ReactorCore, STATUS_INVALID_DEVICE_REQUEST, SUBMIT_QUEUE};
+use crate::ring;
+use crate::uring::{Cqe, Sqe, Uring};
+use crate::vblk_batch::{self, BatchDesc, BATCH_MAX_TRIM, BATCH_MAX_XFER, STATUS_INVALID_PARAMETER, STATUS_SUCCESS};
+
+pub type Reactor = ReactorCore<HostSource>;
+
+// IOCTL codes, as in device.rs
+const IOCTL_MAP_SHARED: u32 = 0x0022_2004;
+const IOCTL_RUN_TICK: u32 = 0x0022_2008;
+const IOCTL_VBLK_SUBMIT: u32 = 0x0022_200C;
+const IOCTL_VBLK_SET_BACKING: u32 = 0x0022_2010;
+const IOCTL_VBLK_READ: u32 = 0x0022_2016;
+const IOCTL_VBLK_WRITE: u32 = 0x0022_2019;
+const IOCTL_VTTY_PUSH: u32 = 0x0022_201C;
+const IOCTL_VTTY_PULL: u32 = 0x0022_2020;
+const IOCTL_VBLK_SUBMIT_BATCH: u32 = 0x0022_2026;
+const IOCTL_WAIT_DOORBELL: u32 = 0x0022_2028;
+const IOCTL_VTTY_PUSH_CHAN: u32 = 0x0022_202C;
+const IOCTL_VTTY_PULL_CHAN: u32 = 0x0022_2030;
+
+// struct colx_ring_header
+const HDR_VER: usize = 0;
+const HDR_FLAGS: usize = 4;
+const HDR_TICK: usize = 8;
+const HDR_PING_REQ: usize = 16;
+const HDR_PING_RESP: usize = 20;
+const HDR_DOORBELL: usize = 24;
+const HDR_HOST_WAITING: usize = 28;
+const HDR_GUEST_DOORBELL: usize = 32;
+const F_VTTY_NOTIFY: u32 = 0x4;
+/// mem.c's bounds on a doorbell wait's user-mode parameters.
+const DOORBELL_MAX_TIMEOUT_MS: u32 = 10_000;
+const DOORBELL_MAX_SLEEP_US: u32 = 100_000;
+
+// mem.c request defaults and bounds
+const PAGE: usize = 0x1000;
+const MIN_RING_CAP: usize = 8;
+const DEFAULT_RING_CAP: usize = 64;
+const DEFAULT_SLOT_STRIDE: usize = 128 * 1024;
+const VTTY_CAP: usize = 64 * 1024;
+const VTTY_MIN_CAP: usize = 4 * 1024;
+const SHFS_DEFAULT_SLOT_STRIDE: usize = 128 * 1024;
+const VNET_DEFAULT_BUF_SIZE: usize = 64 * 1024;
+const RING_CTRL_CAP: usize = 8;
+const RING_CTRL_SLOT_SIZE: usize = 12;
+const VBLK_SLOT_LEN: u32 = 32;
+const VTTY_RING_HDR: usize = 16;
+
+const SECTOR: u32 = 512;
+// NTSTATUS values for batch descriptors beyond vblk_batch's
+const STATUS_END_OF_FILE: i32 = 0xC000_0011u32 as i32;
+const STATUS_DISK_FULL: i32 = 0xC000_007Fu32 as i32;
+const STATUS_UNEXPECTED_IO_ERROR: i32 = 0xC000_00E9u32 as i32;
+
+/// How block I/O reaches the backing image.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum IoEngine {
+    Inline,
+    Pool(usize),
+    Uring(u32),
+}
+
+impl IoEngine {
+    pub const POOL: Self = Self::Pool(4);
+    pub const URING: Self = Self::Uring(128);
+
+    /// `inline`, `pool[:threads]` or `uring[:entries]`.
+    pub fn parse(s: &str) -> Result<Self> {
+        let (name, n) = match s.split_once(':') {
+            Some((name, n)) => (name, Some(n.parse::<u32>().with_context(|| format!("I/O engine {s}"))?)),
+            None => (s, None),
+        };
+        Ok(match name {
+            "inline" => Self::Inline,
+            "pool" => Self::Pool(n.unwrap_or(4).clamp(1, 64) as usize),
+            "uring" => Self::Uring(n.unwrap_or(128).clamp(8, 4096)),
+            _ => bail!("unknown I/O engine {s} (inline, pool[:threads], uring[:entries])"),
+        })
+    }
+}
+
+impl Reactor {
+    /// Serve the driver ABI in-process with `workers` reactor threads.
+    pub fn open_host(engine: IoEngine, workers: usize) -> Result<Self> {
+        Ok(ReactorCore::with_source(HostSource::new(engine)?, workers))
+    }
+}
+
+/// One MAP_SHARED: a memfd with a daemon view and a "kernel" view.
+struct Mapping {
+    _fd: OwnedFd,
+    user: *mut u8,
+    kernel: *mut u8,
+    len: usize,
+}
+
+impl Mapping {
+    fn new(len: usize) -> Result<Self> {
+        let fd = unsafe { libc::memfd_create(c"colinux-shared".as_ptr(), libc::MFD_CLOEXEC) };
+        if fd < 0 {
+            bail!("memfd_create: {}", std::io::Error::last_os_error());
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+        if unsafe { libc::ftruncate(fd.as_raw_fd(), len as libc::off_t) } != 0 {
+            bail!("memfd size {len}: {}", std::io::Error::last_os_error());
+        }
+        let view = || {
+            let p = unsafe { libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd.as_raw_fd(), 0) };
+            if p == libc::MAP_FAILED {
+                bail!("mmap {len} bytes: {}", std::io::Error::last_os_error());
+            }
+            Ok(p as *mut u8)
+        };
+        let user = view()?;
+        let kernel = view().inspect_err(|_: &anyhow::Error| unsafe {
+            libc::munmap(user as *mut _, len);
+        })?;
+        Ok(Self { _fd: fd, user, kernel, len })
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.user as *mut _, self.len);
+            libc::munmap(self.kernel as *mut _, self.len);
+        }
+    }
+}
+
+/// The driver's side of the current mapping: its view and private geometry.
+#[derive(Clone, Copy)]
+struct View {
+    base: *mut u8,
+    size: usize,
+    geom: Option<Geometry>,
+}
+
+unsafe impl Send for View {}
+
+impl View {
+    fn word(&self, off: usize) -> &AtomicU32 {
+        unsafe { &*(self.base.add(off) as *const AtomicU32) }
+    }
+
+    fn put(&self, off: usize, v: u32) {
+        self.word(off).store(v, Ordering::Relaxed);
+    }
+
+    /// RingPending in mem.c: unconsumed slots over every VBLK ring, the
+    /// shared folder ring and the NIC's TX ring.
+    fn pending(&self) -> u32 {
+        let Some(g) = &self.geom else { return 0 };
+        let ctrl = |off: usize| self.word(off).load(Ordering::Acquire).wrapping_sub(self.word(off + g.ctrl_cons_off).load(Ordering::Acquire));
+        let mut n = (0..g.vblk_queues).fold(0u32, |n, q| n.wrapping_add(ctrl(g.vblk_ring_off + q * g.vblk_ring_stride)));
+        if g.shfs_ring_cap != 0 {
+            n = n.wrapping_add(ctrl(g.shfs_ring_off));
+        }
+        if g.vnet_ring_cap != 0 {
+            n = n.wrapping_add(ctrl(g.vnet_ring_off(0)));
+        }
+        n
+    }
+
+    /// Channel `ch`'s (tx, rx, cap), checked against the mapping.
+    fn vtty(&self, ch: usize) -> Option<(usize, usize, usize)> {
+        let g = self.geom.as_ref()?;
+        let c = g.vtty_chan.get(ch).filter(|c| ch < g.vtty_channels && c.cap != 0)?;
+        let fits = |off: usize| off + VTTY_RING_HDR + c.cap <= self.size;
+        (fits(c.tx_off) && fits(c.rx_off)).then_some((c.tx_off, c.rx_off, c.cap))
+    }
+
+    fn vtty_notify(&self) {
+        if self.geom.is_some_and(|g| g.features & F_VTTY_NOTIFY != 0) {
+            self.word(HDR_GUEST_DOORBELL).fetch_add(1, Ordering::AcqRel);
+        }
+    }
+
+    fn vtty_write(&self, ring: usize, cap: usize, src: &[u8]) -> usize {
+        // vtty() checked the ring against the mapping; the guest only reads it
+        unsafe { ring::Producer::from_raw(self.base.add(ring), cap) }.write(src)
+    }
+
+    fn vtty_read(&self, ring: usize, cap: usize, dst: &mut [u8]) -> usize {
+        unsafe { ring::Consumer::from_raw(self.base.add(ring), cap) }.read(dst)
+    }
+}
+
+#[derive(Default)]
+struct State {
+    /// Every mapping made; earlier ones stay mapped until the device closes.
+    maps: Vec<Mapping>,
+    view: Option<View>,
+    backing: Option<Arc<File>>,
+}
+
+unsafe impl Send for State {}
+
+#[derive(Clone, Copy)]
+enum OpKind {
+    Read,
+    Write,
+    Flush,
+    Zero,
+}
+
+/// One backing-file operation against memory the request owns.
+#[derive(Clone, Copy)]
+struct Op {
+    kind: OpKind,
+    off: u64,
+    buf: *mut u8,
+    len: u32,
+    /// Batch descriptor the status goes to.
+    desc: usize,
+}
+
+enum JobKind {
+    /// READ / WRITE / SUBMIT: bytes transferred for reads, 0 for writes.
+    Single,
+    Batch { status_off: usize },
+}
+
+/// A block request in flight: the request (its buffers stay put while the
+/// job lives) and one result per op, bytes or -errno.
+struct Job {
+    req: IoctlRequest,
+    submitted: Instant,
+    file: Arc<File>,
+    kind: JobKind,
+    ops: Vec<Op>,
+    res: Vec<i64>,
+    left: usize,
+}
+
+unsafe impl Send for Job {}
+
+impl Job {
+    fn run(&mut self) {
+        for (op, res) in self.ops.iter().zip(&mut self.res) {
+            *res = run_op(&self.file, op);
+        }
+    }
+
+    fn done(self: Box<Self>) -> Done {
+        let job = *self;
+        let mut out = job.req.out;
+        let result = match job.kind {
+            JobKind::Single => match (job.ops[0].kind, job.res[0]) {
+                (_, e) if e < 0 => Err(anyhow!("vblk: {}", std::io::Error::from_raw_os_error(-e as i32))),
+                (OpKind::Read, n) => Ok(n as u32),
+                _ => Ok(0),
+            },
+            JobKind::Batch { status_off } => {
+                let (p, n) = out.ptr_len();
+                let buf = unsafe { std::slice::from_raw_parts_mut(p, n) };
+                for (op, &res) in job.ops.iter().zip(&job.res) {
+                    vblk_batch::store_status(buf, status_off, op.desc, nt_status(op, res));
+                }
+                Ok(0)
+            }
+        };
+        Done { code: job.req.code, reply: job.req.reply, result, out, submitted: job.submitted }
+    }
+}
+
+fn nt_status(op: &Op, res: i64) -> i32 {
+    match res {
+        r if r == -(libc::ENOSPC as i64) => STATUS_DISK_FULL,
+        r if r < 0 => STATUS_UNEXPECTED_IO_ERROR,
+        r if matches!(op.kind, OpKind::Read | OpKind::Write) && r != op.len as i64 => STATUS_END_OF_FILE,
+        _ => STATUS_SUCCESS,
+    }
+}
+
+/// Synchronous engines: the whole transfer, or up to end of file for reads.
+fn run_op(f: &File, op: &Op) -> i64 {
+    let buf = || unsafe { std::slice::from_raw_parts_mut(op.buf, op.len as usize) };
+    let r = match op.kind {
+        OpKind::Read => {
+            let (buf, mut n) = (buf(), 0);
+            loop {
+                match f.read_at(&mut buf[n..], op.off + n as u64) {
+                    Ok(0) => break Ok(n),
+                    Ok(m) => n += m,
+                    Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
+                    Err(e) => break Err(e),
+                }
+                if n == buf.len() {
+                    break Ok(n);
+                }
+            }
+        }
+        OpKind::Write => f.write_all_at(buf(), op.off).map(|_| op.len as usize),
+        OpKind::Flush => f.sync_data().map(|_| 0),
+        OpKind::Zero => crate::sparse::punch_hole(f, op.off, op.len as u64).map(|_| 0),
+    };
+    r.map_or_else(|e| -(e.raw_os_error().unwrap_or(libc::EIO) as i64), |n| n as i64)
+}
+
+fn op_sqe(fd: i32, op: &Op, user_data: u64) -> Sqe {
+    match op.kind {
+        OpKind::Read => Sqe::read(fd, op.buf, op.len, op.off, user_data),
+        OpKind::Write => Sqe::write(fd, op.buf, op.len, op.off, user_data),
+        OpKind::Flush => Sqe::fdatasync(fd, user_data),
+        OpKind::Zero => Sqe::fallocate(fd, libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE, op.off, op.len as u64, user_data),
+    }
+}
+
+/// Event queue shared by the workers, I/O threads, the reaper and the waiter.
+struct Events {
+    q: Mutex<VecDeque<Event>>,
+    cv: Condvar,
+}
+
+impl Events {
+    fn push(&self, ev: Event) {
+        self.q.lock().unwrap().push_back(ev);
+        self.cv.notify_one();
+    }
+}
+
+/// In-flight io_uring jobs; user_data is slot << 8 | op.
+struct UringJobs {
+    ring: Uring,
+    slots: Mutex<(Vec<Option<Box<Job>>>, Vec<usize>)>,
+}
+
+/// user_data of the NOP that stops the reaper.
+const REAP_STOP: u64 = u64::MAX;
+
+enum Io {
+    Inline,
+    Pool { tx: Option<Sender<Box<Job>>>, threads: Vec<JoinHandle<()>> },
+    Uring { jobs: Arc<UringJobs>, reaper: Option<JoinHandle<()>> },
+}
+
+struct Wait {
+    req: IoctlRequest,
+    submitted: Instant,
+    view: View,
+    last_seen: u32,
+    timeout_ms: u32,
+    coalesce_us: u32,
+    max_sleep_us: u32,
+}
+
+pub struct HostSource {
+    st: Mutex<State>,
+    events: Arc<Events>,
+    io: Io,
+    waits: Option<Sender<Wait>>,
+    waiter: Option<JoinHandle<()>>,
+    closing: Arc<AtomicBool>,
+    /// Block ops issued, for engine comparisons.
+    ops: AtomicU64,
+}
+
+impl HostSource {
+    pub fn new(engine: IoEngine) -> Result<Self> {
+        let events = Arc::new(Events { q: Mutex::new(VecDeque::with_capacity(SUBMIT_QUEUE)), cv: Condvar::new() });
+        let io = match engine {
+            IoEngine::Inline => Io::Inline,
+            IoEngine::Pool(n) => {
+                let (tx, rx) = crossbeam_channel::unbounded::<Box<Job>>();
+                let threads = (0..n)
+                    .map(|i| {
+                        let (rx, ev) = (rx.clone(), events.clone());
+                        std::thread::Builder::new().name(format!("hostdev-io{i}")).spawn(move || {
+                            while let Ok(mut job) = rx.recv() {
+                                job.run();
+                                ev.push(Event::Done(job.done()));
+                            }
+                        })
+                    })
+                    .collect::<std::io::Result<_>>()?;
+                Io::Pool { tx: Some(tx), threads }
+            }
+            IoEngine::Uring(entries) => {
+                let ring = Uring::new(entries).context("io_uring_setup")?;
+                let jobs = Arc::new(UringJobs { ring, slots: Mutex::new((Vec::new(), Vec::new())) });
+                let (j, ev) = (jobs.clone(), events.clone());
+                let reaper = std::thread::Builder::new().name("hostdev-uring".into()).spawn(move || reap(&j, &ev))?;
+                Io::Uring { jobs, reaper: Some(reaper) }
+            }
+        };
+        let closing = Arc::new(AtomicBool::new(false));
+        let (tx, rx) = crossbeam_channel::unbounded();
+        let (ev, stop) = (events.clone(), closing.clone());
+        let waiter = std::thread::Builder::new().name("hostdev-doorbell".into()).spawn(move || serve_waits(rx, &ev, &stop))?;
+        Ok(Self { st: Mutex::default(), events, io, waits: Some(tx), waiter: Some(waiter), closing, ops: AtomicU64::new(0) })
+    }
+
+    /// Block operations issued to the backing file so far.
+    pub fn block_ops(&self) -> u64 {
+        self.ops.load(Ordering::Relaxed)
+    }
+
+    fn view(&self) -> Result<View> {
+        self.st.lock().unwrap().view.ok_or_else(|| anyhow!("device not ready: nothing mapped"))
+    }
+
+    fn map_shared(&self, inb: &[u8], out: &mut OutBuf) -> Result<u32> {
+        let field = |i: usize| inb.get(i * 4..i * 4 + 4).map_or(0, |b| u32::from_le_bytes(b.try_into().unwrap()) as usize);
+        let (_, n) = out.ptr_len();
+        if inb.len() < 4 || n < 32 {
+            bail!("map_shared: buffer too small");
+        }
+        if field(0) == 0 {
+            bail!("map_shared: no pages requested");
+        }
+        let (geom, size) = fit_request(field(0) * PAGE, field(1), field(2), field(3), std::array::from_fn(|c| field(4 + c)), field(8), field(9), field(10), field(11), field(12));
+        let m = Mapping::new(size)?;
+        let view = View { base: m.kernel, size, geom };
+        view.put(HDR_VER, 1);
+        view.put(HDR_FLAGS, geom.map_or(0, |g| g.features));
+        if let Some(g) = &geom {
+            g.write(unsafe { std::slice::from_raw_parts_mut(m.kernel, PAGE) });
+            init_rings(&view, g);
+        }
+        let (p, _) = out.ptr_len();
+        let info = [m.user as u64, m.kernel as u64, size as u64, 1];
+        let reply = unsafe { std::slice::from_raw_parts_mut(p, 32) };
+        for (i, v) in info.into_iter().enumerate() {
+            reply[i * 8..i * 8 + 8].copy_from_slice(&v.to_le_bytes()); // ver 1, flags 0
+        }
+        let mut st = self.st.lock().unwrap();
+        st.maps.push(m);
+        st.view = Some(view);
+        Ok(32)
+    }
+
+    fn run_tick(&self) -> Result<u32> {
+        let v = self.view()?;
+        unsafe { &*(v.base.add(HDR_TICK) as *const AtomicU64) }.fetch_add(1, Ordering::Relaxed);
+        let req = v.word(HDR_PING_REQ).load(Ordering::Acquire);
+        if v.word(HDR_PING_RESP).load(Ordering::Relaxed) != req {
+            v.word(HDR_PING_RESP).store(req, Ordering::Release);
+        }
+        Ok(0)
+    }
+
+    fn set_backing(&self, inb: &[u8]) -> Result<u32> {
+        if inb.len() < 6 {
+            bail!("set_backing: path too short");
+        }
+        let wide: Vec<u16> = inb.chunks_exact(2).map(|c| u16::from_le_bytes([c[0], c[1]])).collect();
+        let path = String::from_utf16(&wide).context("set_backing: path is not UTF-16")?;
+        let f = std::fs::OpenOptions::new().read(true).write(true).open(&path).with_context(|| format!("open backing {path}"))?;
+        self.st.lock().unwrap().backing = Some(Arc::new(f));
+        Ok(0)
+    }
+
+    fn vtty(&self, code: u32, inb: &[u8], out: &mut OutBuf) -> Result<u32> {
+        let v = self.view()?;
+        let chan_in = matches!(code, IOCTL_VTTY_PUSH_CHAN | IOCTL_VTTY_PULL_CHAN);
+        let ch = if chan_in { inb.get(0..4).map(|b| u32::from_le_bytes(b.try_into().unwrap()) as usize) } else { Some(0) };
+        let hdr = if chan_in { 8 } else { 0 };
+        let (tx, rx, cap) = ch.and_then(|ch| v.vtty(ch)).ok_or_else(|| anyhow!("vtty: invalid channel"))?;
+        let n = if matches!(code, IOCTL_VTTY_PUSH | IOCTL_VTTY_PUSH_CHAN) {
+            if inb.len() <= hdr {
+                bail!("vtty: nothing to push");
+            }
+            v.vtty_write(tx, cap, &inb[hdr..])
+        } else {
+            let (p, len) = out.ptr_len();
+            if len == 0 {
+                bail!("vtty: no room to pull into");
+            }
+            v.vtty_read(rx, cap, unsafe { std::slice::from_raw_parts_mut(p, len) })
+        };
+        if n != 0 {
+            v.vtty_notify();
+        }
+        Ok(n as u32)
+    }
+
+    /// Queue a block IOCTL: box it, then turn it into ops against buffers
+    /// that no longer move.
+    fn block(&self, req: IoctlRequest, submitted: Instant) -> Option<Done> {
+        let Some(file) = self.st.lock().unwrap().backing.clone() else {
+            return Some(fail(req, submitted, anyhow!("device not ready: no backing file")));
+        };
+        let mut job = Box::new(Job { req, submitted, file, kind: JobKind::Single, ops: Vec::new(), res: Vec::new(), left: 0 });
+        if let Err(e) = plan(&mut job) {
+            return Some(fail(job.req, submitted, e));
+        }
+        self.ops.fetch_add(job.ops.len() as u64, Ordering::Relaxed);
+        (job.res, job.left) = (vec![0; job.ops.len()], job.ops.len());
+        self.start_block(job)
+    }
+
+    fn wait_doorbell(&self, req: IoctlRequest, submitted: Instant) -> Option<Done> {
+        let view = match self.view() {
+            Ok(v) if v.geom.is_some() => v,
+            Ok(_) => return Some(fail(req, submitted, anyhow!("device not ready: no geometry"))),
+            Err(e) => return Some(fail(req, submitted, e)),
+        };
+        let inb = req.inbuf.as_slice();
+        if inb.len() < 16 {
+            return Some(fail(req, submitted, anyhow!("wait_doorbell: buffer too small")));
+        }
+        let f = |i: usize| u32::from_le_bytes(inb[i * 4..i * 4 + 4].try_into().unwrap());
+        let (last_seen, timeout_ms, coalesce_us, max_sleep_us) = (f(0), f(1), f(2), f(3));
+        let w = Wait { req, submitted, view, last_seen, timeout_ms, coalesce_us, max_sleep_us };
+        self.waits.as_ref().expect("waiter running").send(w).ok().expect("waiter alive");
+        None
+    }
+
+    fn start_block(&self, job: Box<Job>) -> Option<Done> {
+        if job.ops.is_empty() {
+            return Some(job.done());
+        }
+        match &self.io {
+            Io::Inline => {
+                let mut job = job;
+                job.run();
+                Some(job.done())
+            }
+            Io::Pool { tx, .. } => {
+                tx.as_ref().expect("pool running").send(job).ok().expect("pool threads alive");
+                None
+            }
+            Io::Uring { jobs, .. } => {
+                let fd = job.file.as_raw_fd();
+                let mut slots = jobs.slots.lock().unwrap();
+                let slot = slots.1.pop().unwrap_or_else(|| {
+                    slots.0.push(None);
+                    slots.0.len() - 1
+                });
+                let sqes: Vec<Sqe> = job.ops.iter().enumerate().map(|(i, op)| op_sqe(fd, op, (slot as u64) << 8 | i as u64)).collect();
+                slots.0[slot] = Some(job);
+                drop(slots);
+                if let Err(e) = jobs.ring.submit(&sqes) {
+                    let job = jobs.slots.lock().unwrap().0[slot].take().expect("job just queued");
+                    let mut done = job.done();
+                    done.result = Err(anyhow!("io_uring submit: {e}"));
+                    return Some(done);
+                }
+                None
+            }
+        }
+    }
+}
+
+fn fail(req: IoctlRequest, submitted: Instant, e: anyhow::Error) -> Done {
+    Done { code: req.code, reply: req.reply, result: Err(e), out: req.out, submitted }
+}
+
+/// The ops a boxed block request performs, checked the way vblk.c checks
+/// them; batch descriptors that fail get STATUS_INVALID_PARAMETER and no op.
+fn plan(job: &mut Job) -> Result<()> {
+    let (out, out_len) = job.req.out.ptr_len();
+    let inb = job.req.inbuf.as_slice();
+    let xfer_ok = |len: u32| len != 0 && len <= BATCH_MAX_XFER && len % SECTOR == 0;
+    let u64_at = |o: usize| u64::from_le_bytes(inb[o..o + 8].try_into().unwrap());
+    let u32_at = |o: usize| u32::from_le_bytes(inb[o..o + 4].try_into().unwrap());
+    let op = |kind, lba: u64, buf, len| Op { kind, off: lba * SECTOR as u64, buf, len, desc: 0 };
+    match job.req.code {
+        IOCTL_VBLK_READ | IOCTL_VBLK_WRITE => {
+            // VBLK_RW_HDR; the data is the out buffer either way
+            if inb.len() < 16 || !xfer_ok(u32_at(8)) || u32_at(8) as usize > out_len {
+                bail!("vblk: invalid parameter");
+            }
+            let kind = if job.req.code == IOCTL_VBLK_READ { OpKind::Read } else { OpKind::Write };
+            job.ops.push(op(kind, u64_at(0), out, u32_at(8)));
+        }
+        IOCTL_VBLK_SUBMIT => {
+            // [op:1][resv:3][lba:8][len:4][data..]: reads return data, writes carry it
+            if inb.len() < 16 || !xfer_ok(u32_at(12)) {
+                bail!("vblk submit: invalid parameter");
+            }
+            let len = u32_at(12);
+            if inb[0] == 0 {
+                if len as usize > out_len {
+                    bail!("vblk submit: buffer too small");
+                }
+                job.ops.push(op(OpKind::Read, u64_at(4), out, len));
+            } else {
+                if inb.len() < 16 + len as usize {
+                    bail!("vblk submit: buffer too small");
+                }
+                job.ops.push(op(OpKind::Write, u64_at(4), inb[16..].as_ptr() as *mut u8, len));
+            }
+        }
+        _ => {
+            let (status_off, descs) = vblk_batch::decode(inb)?;
+            let status_off = status_off as usize;
+            let status_end = status_off + vblk_batch::status_table_len(descs.len());
+            if descs.is_empty() || status_off % 4 != 0 || status_end > out_len {
+                bail!("vblk batch: invalid parameter");
+            }
+            let buf = unsafe { std::slice::from_raw_parts_mut(out, out_len) };
+            for (i, d) in descs.iter().enumerate() {
+                match batch_op(d, status_off, status_end, out_len) {
+                    Some(kind) => {
+                        let at = if d.has_data() { unsafe { out.add(d.buf_off as usize) } } else { std::ptr::null_mut() };
+                        job.ops.push(Op { desc: i, ..op(kind, d.lba, at, d.len) });
+                    }
+                    None => vblk_batch::store_status(buf, status_off, i, STATUS_INVALID_PARAMETER),
+                }
+            }
+            job.kind = JobKind::Batch { status_off };
+        }
+    }
+    Ok(())
+}
+
+/// Validate one batch descriptor the way vblk.c does.
+fn batch_op(d: &BatchDesc, status_off: usize, status_end: usize, out_len: usize) -> Option<OpKind> {
+    let end = d.buf_off.checked_add(d.len as u64)?;
+    match d.op {
+        vblk_batch::OP_FLUSH => (d.len == 0).then_some(OpKind::Flush),
+        vblk_batch::OP_DISCARD | vblk_batch::OP_WRITE_ZEROES => (d.len != 0 && d.len <= BATCH_MAX_TRIM && d.len % SECTOR == 0).then_some(OpKind::Zero),
+        vblk_batch::OP_READ | vblk_batch::OP_WRITE => {
+            let ok = d.len != 0 && d.len <= BATCH_MAX_XFER && d.len % SECTOR == 0 && end <= out_len as u64
+                && !(d.buf_off < status_end as u64 && end > status_off as u64);
+            ok.then_some(if d.op == vblk_batch::OP_READ { OpKind::Read } else { OpKind::Write })
+        }
+        _ => None,
+    }
+}
+
+fn reap(jobs: &UringJobs, ev: &Events) {
+    let mut cqes: Vec<Cqe> = Vec::with_capacity(64);
+    loop {
+        cqes.clear();
+        if let Err(e) = jobs.ring.wait(&mut cqes) {
+            tracing::error!("io_uring wait failed: {e}");
+            return;
+        }
+        let mut slots = jobs.slots.lock().unwrap();
+        for c in &cqes {
+            if c.user_data == REAP_STOP {
+                return;
+            }
+            let (slot, op) = ((c.user_data >> 8) as usize, (c.user_data & 0xff) as usize);
+            let Some(job) = slots.0[slot].as_mut() else { continue };
+            job.res[op] = c.res as i64;
+            job.left -= 1;
+            if job.left == 0 {
+                let job = slots.0[slot].take().unwrap();
+                slots.1.push(slot);
+                ev.push(Event::Done(job.done()));
+            }
+        }
+    }
+}
+
+/// mem.c's doorbell watcher: sleep until the doorbell moves past `last_seen`,
+/// a ring has work, or the (clamped) deadline, backing off while idle.
+fn serve_waits(rx: Receiver<Wait>, ev: &Events, closing: &AtomicBool) {
+    while let Ok(w) = rx.recv() {
+        let v = w.view;
+        let deadline = Instant::now() + Duration::from_millis(w.timeout_ms.min(DOORBELL_MAX_TIMEOUT_MS) as u64);
+        let coalesce = w.coalesce_us.clamp(1, DOORBELL_MAX_SLEEP_US);
+        let (mut sleep, max_sleep) = (coalesce, w.max_sleep_us.min(DOORBELL_MAX_SLEEP_US).max(coalesce));
+        // Advertised before the checks below; the guest reads it after publishing
+        v.word(HDR_HOST_WAITING).swap(1, Ordering::SeqCst);
+        loop {
+            if v.word(HDR_DOORBELL).load(Ordering::Acquire) != w.last_seen || v.pending() != 0 || closing.load(Ordering::Relaxed) {
+                break;
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                break;
+            }
+            std::thread::sleep(Duration::from_micros(sleep as u64).min(deadline - now));
+            sleep = (sleep * 2).min(max_sleep);
+        }
+        v.put(HDR_HOST_WAITING, 0);
+        let mut out = w.req.out;
+        let (p, n) = out.ptr_len();
+        let result = if n >= 8 {
+            let reply = unsafe { std::slice::from_raw_parts_mut(p, 8) };
+            reply[..4].copy_from_slice(&v.word(HDR_DOORBELL).load(Ordering::Acquire).to_le_bytes());
+            reply[4..].copy_from_slice(&v.pending().to_le_bytes());
+            Ok(8)
+        } else {
+            Err(anyhow!("wait_doorbell: buffer too small"))
+        };
+        ev.push(Event::Done(Done { code: w.req.code, reply: w.req.reply, result, out, submitted: w.submitted }));
+    }
+}
+
+/// Clamp a MAP_SHARED_IN the way mem.c does and fit the layout into `size`
+/// bytes (GeomFit). None when not even the console channel fits.
+#[allow(clippy::too_many_arguments)]
+fn fit_request(size: usize, queues: usize, cap: usize, stride: usize, chan_kb: [usize; MAX_VTTY_CHANNELS], shfs_cap: usize, shfs_kb: usize, vnet_bufs: usize, vnet_kb: usize, trace_kb: usize) -> (Option<Geometry>, usize) {
+    let round = |x: usize| (x + PAGE - 1) & !(PAGE - 1);
+    let pow2_down = |x: usize| if x == 0 { 0 } else { 1 << x.ilog2() };
+    let mut queues = queues.clamp(1, MAX_QUEUES);
+    let mut cap = pow2_down(if cap == 0 { DEFAULT_RING_CAP } else { cap }.clamp(MIN_RING_CAP, MAX_RING_CAP));
+    let stride = round(if stride == 0 { DEFAULT_SLOT_STRIDE } else { stride.min(MAX_SLOT_STRIDE) });
+    let chans: [usize; MAX_VTTY_CHANNELS] = std::array::from_fn(|c| match chan_kb[c] {
+        0 if c == 0 => VTTY_CAP,
+        0 => 0,
+        kb => pow2_down((kb * 1024).clamp(VTTY_MIN_CAP, VTTY_MAX_CAP)),
+    });
+    let (shfs_cap, shfs_stride) = match shfs_cap {
+        0 => (0, 0),
+        n => (pow2_down(n.min(SHFS_MAX_RING_CAP)), round(if shfs_kb == 0 { SHFS_DEFAULT_SLOT_STRIDE } else { (shfs_kb * 1024).min(SHFS_MAX_SLOT_STRIDE) })),
+    };
+    let vnet = match vnet_bufs {
+        0 => VnetShape::default(),
+        n => VnetShape {
+            bufs: n.min(VNET_MAX_RING_CAP),
+            buf_size: round(if vnet_kb == 0 { VNET_DEFAULT_BUF_SIZE } else { (vnet_kb * 1024).clamp(VNET_MIN_BUF_SIZE, VNET_MAX_BUF_SIZE) }),
+        },
+    };
+    let trace_cap = pow2_down((trace_kb * 1024 / TRACE_REC_LEN).min(TRACE_MAX_CAP));
+    let fits = |g: &Geometry| g.vblk_queues * g.vblk_queue_stride <= u32::MAX as usize && g.span() <= size;
+    if shfs_cap != 0 || vnet.bufs != 0 || trace_cap != 0 {
+        let g = Geometry::layout_with_vnet(queues, cap, stride, &chans, shfs_cap, shfs_stride, vnet).with_trace(trace_cap);
+        if fits(&g) {
+            return (Some(g), size);
+        }
+    }
+    loop {
+        let g = Geometry::layout_with_channels(queues, cap, stride, &chans);
+        if fits(&g) {
+            return (Some(g), size);
+        }
+        if queues > 1 {
+            queues -= 1;
+        } else if cap > MIN_RING_CAP {
+            cap /= 2;
+        } else {
+            break;
+        }
+    }
+    let g = Geometry::layout_with_channels(0, cap, stride, &chans);
+    if g.vblk_data_off <= size {
+        return (Some(g), size);
+    }
+    let g = Geometry::layout_with_channels(0, cap, stride, &chans[..1]);
+    ((g.vblk_data_off <= size).then_some(g), size)
+}
+
+/// Empty every ring the geometry places, as mem.c and vnet.c do; the memfd
+/// starts zeroed, so only cap and slot size need writing.
+fn init_rings(v: &View, g: &Geometry) {
+    let ctrl = |off: usize, cap: usize, slot: usize| {
+        v.put(off + RING_CTRL_CAP, cap as u32);
+        v.put(off + RING_CTRL_SLOT_SIZE, slot as u32);
+    };
+    for q in 0..g.vblk_queues {
+        ctrl(g.vblk_ring_off + q * g.vblk_ring_stride, g.vblk_ring_cap, VBLK_SLOT_LEN as usize);
+    }
+    for c in g.vtty_chan.iter().filter(|c| c.cap != 0) {
+        v.put(c.tx_off + 8, c.cap as u32);
+        v.put(c.rx_off + 8, c.cap as u32);
+    }
+    if g.shfs_ring_cap != 0 {
+        ctrl(g.shfs_ring_off, g.shfs_ring_cap, SHFS_SLOT_LEN);
+    }
+    for r in (0..VNET_RINGS).filter(|_| g.vnet_ring_cap != 0) {
+        ctrl(g.vnet_ring_off(r), g.vnet_ring_cap, VNET_DESC_LEN);
+    }
+}
+
+impl CompletionSource for HostSource {
+    fn start(&self, req: IoctlRequest, submitted: Instant) -> Option<Done> {
+        let IoctlRequest { code, inbuf, mut out, reply } = match req.code {
+            IOCTL_VBLK_READ | IOCTL_VBLK_WRITE | IOCTL_VBLK_SUBMIT | IOCTL_VBLK_SUBMIT_BATCH => return self.block(req, submitted),
+            IOCTL_WAIT_DOORBELL => return self.wait_doorbell(req, submitted),
+            _ => req,
+        };
+        let inb = inbuf.as_slice();
+        let result = match code {
+            IOCTL_MAP_SHARED => self.map_shared(inb, &mut out),
+            IOCTL_RUN_TICK => self.run_tick(),
+            IOCTL_VBLK_SET_BACKING => self.set_backing(inb),
+            IOCTL_VTTY_PUSH | IOCTL_VTTY_PULL | IOCTL_VTTY_PUSH_CHAN | IOCTL_VTTY_PULL_CHAN => self.vtty(code, inb, &mut out),
+            _ => Err(IoctlError::Status(STATUS_INVALID_DEVICE_REQUEST).into()),
+        };
+        Some(Done { code, reply, result, out, submitted })
+    }
+
+    fn dequeue(&self, out: &mut Vec<Event>, max: usize, timeout: Option<Duration>) {
+        let mut q = self.events.q.lock().unwrap();
+        while q.is_empty() {
+            q = match timeout {
+                Some(t) => {
+                    let (g, res) = self.events.cv.wait_timeout(q, t).unwrap();
+                    if res.timed_out() {
+                        return;
+                    }
+                    g
+                }
+                None => self.events.cv.wait(q).unwrap(),
+            };
+        }
+        let n = q.len().min(max);
+        out.extend(q.drain(..n));
+    }
+
+    fn post_wake(&self) {
+        self.events.push(Event::Wake);
+    }
+}
+
+impl Drop for HostSource {
+    fn drop(&mut self) {
+        // Runs after the reactor joined its workers: stop the helpers, then unmap
+        self.closing.store(true, Ordering::Relaxed);
+        self.waits = None;
+        if let Some(t) = self.waiter.take() {
+            let _ = t.join();
+        }
+        match &mut self.io {
+            Io::Inline => {}
+            Io::Pool { tx, threads } => {
+                *tx = None;
+                threads.drain(..).for_each(|t| drop(t.join()));
+            }
+            Io::Uring { jobs, reaper } => {
+                if jobs.ring.submit(&[Sqe::nop(REAP_STOP)]).is_ok() {
+                    if let Some(t) = reaper.take() {
+                        let _ = t.join();
+                    }
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::config::DoorbellCfg;
+    use crate::device::{Device, MapInfo, MapRequest};
+
+    const T: Duration = Duration::from_secs(5);
+
+    fn request(pages: u32) -> MapRequest {
+        MapRequest {
+            pages,
+            vblk_queues: 2,
+            vblk_ring_cap: 16,
+            vblk_slot_stride: 64 * 1024,
+            vtty_chan_kb: [0, 16, 0, 0],
+            shfs_ring_cap: 0,
+            shfs_slot_kb: 0,
+            vnet_bufs: 0,
+            vnet_buf_kb: 0,
+            trace_kb: 0,
+        }
+    }
+
+    fn mapped(engine: IoEngine) -> Option<(Device, MapInfo, Geometry)> {
+        let dev = match Device::open_host(engine, 2) {
+            Ok(d) => d,
+            // Seccomp profiles in some CI sandboxes refuse io_uring
+            Err(e) => {
+                eprintln!("skipping {engine:?}: {e:#}");
+                return None;
+            }
+        };
+        let map = dev.map_shared_sync(&request(1024), T).unwrap();
+        let geom = Geometry::read(&map).unwrap();
+        Some((dev, map, geom))
+    }
+
+    fn word(map: &MapInfo, off: usize) -> &AtomicU32 {
+        unsafe { &*((map.user_base + off) as *const AtomicU32) }
+    }
+
+    fn backing(tag: &str, len: usize) -> (std::path::PathBuf, File) {
+        let path = std::env::temp_dir().join(format!("colx-hostdev-{tag}-{}", std::process::id()));
+        let f = std::fs::OpenOptions::new().read(true).write(true).create(true).truncate(true).open(&path).unwrap();
+        let data: Vec<u8> = (0..len).map(|i| (i / 512) as u8).collect();
+        f.write_all_at(&data, 0).unwrap();
+        (path, f)
+    }
+
+    #[test]
+    fn maps_the_driver_layout_and_ticks() {
+        let (dev, map, geom) = mapped(IoEngine::Inline).unwrap();
+        assert_eq!((map.ver, map.flags, map.size), (1, 0, 1024 * 4096));
+        assert_eq!((geom.vblk_queues, geom.vblk_ring_cap, geom.vblk_slot_stride), (2, 16, 64 * 1024));
+        assert_eq!((geom.vtty_channels, geom.vtty_chan[1].cap), (2, 16 * 1024));
+        // Rings start empty with their cap published
+        assert_eq!(word(&map, geom.ring_off(1) + RING_CTRL_CAP).load(Ordering::Relaxed), 16);
+        assert_eq!(word(&map, geom.vtty_chan[1].rx_off + 8).load(Ordering::Relaxed), 16 * 1024);
+
+        word(&map, HDR_PING_REQ).store(7, Ordering::Release);
+        dev.run_tick_sync(1, T).unwrap();
+        dev.run_tick_sync(1, T).unwrap();
+        assert_eq!(word(&map, HDR_PING_RESP).load(Ordering::Acquire), 7);
+        assert_eq!(unsafe { *((map.user_base + HDR_TICK) as *const u64) }, 2);
+
+        // Too small for two queues: the fit drops to one
+        let small = dev.map_shared_sync(&request(1024 * 1024 / 4096 + 64), T).unwrap();
+        assert_eq!(Geometry::read(&small).unwrap().vblk_queues, 1);
+    }
+
+    #[test]
+    fn block_engines_serve_the_same_image() {
+        for (i, engine) in [IoEngine::Inline, IoEngine::Pool(2), IoEngine::Uring(16)].into_iter().enumerate() {
+            let Some((dev, _, _)) = mapped(engine) else { continue };
+            let (path, _f) = backing(&i.to_string(), 64 * 1024);
+            assert!(dev.vblk_read_sync(0, 512, T).is_err(), "no backing yet");
+            dev.vblk_set_backing_sync(path.to_str().unwrap(), T).unwrap();
+
+            assert_eq!(dev.vblk_read_sync(3, 512, T).unwrap(), vec![3u8; 512]);
+            dev.vblk_write_from(4, &[0xa5; 1024], T).unwrap();
+            let mut buf = vec![0u8; 2048];
+            dev.vblk_read_into(3, &mut buf, T).unwrap();
+            assert!(buf[..512].iter().all(|&b| b == 3) && buf[512..1536].iter().all(|&b| b == 0xa5) && buf[1536..].iter().all(|&b| b == 6));
+            // A read past the end returns what exists
+            assert_eq!(dev.vblk_read_sync(127, 1024, T).unwrap().len(), 512);
+            assert!(dev.vblk_read_sync(0, 100, T).is_err(), "not a sector multiple");
+
+            // Batch: read, write, flush, a trim and a read running off the end
+            let descs = [
+                BatchDesc::read(0, 512, 0),
+                BatchDesc::write(10, 512, 512),
+                BatchDesc::flush(),
+                BatchDesc::discard(20, 1024),
+                BatchDesc::read(127, 1024, 2048),
+            ];
+            let mut buf = vec![0x11u8; 4096];
+            dev.vblk_submit_batch(&descs, &mut buf, 1536, T).unwrap();
+            let st = vblk_batch::decode_statuses(&buf, 1536, descs.len()).unwrap();
+            assert_eq!(st, [STATUS_SUCCESS, STATUS_SUCCESS, STATUS_SUCCESS, STATUS_SUCCESS, STATUS_END_OF_FILE]);
+            assert_eq!(buf[..512], [0u8; 512]);
+            assert_eq!(dev.vblk_read_sync(10, 512, T).unwrap(), vec![0x11u8; 512]);
+            assert_eq!(dev.vblk_read_sync(20, 1024, T).unwrap(), vec![0u8; 1024]);
+
+            // Legacy SUBMIT: write then read back
+            let mut req = vec![1u8, 0, 0, 0];
+            req.extend_from_slice(&30u64.to_le_bytes());
+            req.extend_from_slice(&512u32.to_le_bytes());
+            req.extend_from_slice(&[0x5a; 512]);
+            dev.vblk_submit_async(&req, 0).unwrap().recv().unwrap().unwrap();
+            req[0] = 0;
+            req.truncate(16);
+            assert_eq!(dev.vblk_submit_async(&req, 512).unwrap().recv().unwrap().unwrap(), vec![0x5a; 512]);
+            let _ = std::fs::remove_file(path);
+        }
+    }
+
+    #[test]
+    fn vtty_moves_bytes_through_the_channel_rings() {
+        let (dev, map, geom) = mapped(IoEngine::Inline).unwrap();
+        let ch = geom.vtty_chan[1];
+        assert_eq!(dev.vtty_push_chan(1, b"hello", T).unwrap(), 5);
+        let tx = map.user_base + ch.tx_off;
+        assert_eq!(word(&map, ch.tx_off).load(Ordering::Acquire), 5);
+        assert_eq!(unsafe { std::slice::from_raw_parts((tx + VTTY_RING_HDR) as *const u8, 5) }, b"hello");
+        assert_eq!(word(&map, HDR_GUEST_DOORBELL).load(Ordering::Acquire), 1);
+
+        // The guest writes its side wrapped around the end of the ring
+        let rx = map.user_base + ch.rx_off;
+        let at = ch.cap - 2;
+        word(&map, ch.rx_off + 4).store(at as u32, Ordering::Relaxed);
+        unsafe {
+            std::ptr::copy_nonoverlapping(b"wo".as_ptr(), (rx + VTTY_RING_HDR + at) as *mut u8, 2);
+            std::ptr::copy_nonoverlapping(b"rld".as_ptr(), (rx + VTTY_RING_HDR) as *mut u8, 3);
+        }
+        word(&map, ch.rx_off).store(3, Ordering::Release);
+        let mut buf = [0u8; 16];
+        assert_eq!(dev.vtty_pull_chan(1, &mut buf, T).unwrap(), 5);
+        assert_eq!(&buf[..5], b"world");
+        assert_eq!(dev.vtty_pull_chan(1, &mut buf, T).unwrap(), 0);
+        assert!(dev.vtty_push_chan(2, b"x", T).is_err(), "channel not laid out");
+    }
+
+    #[test]
+    fn doorbell_wait_wakes_on_ring_and_times_out() {
+        let (dev, map, _) = mapped(IoEngine::Inline).unwrap();
+        let cfg = DoorbellCfg { enabled: true, coalesce_us: 100, max_sleep_us: 1000, idle_timeout_ms: 30 };
+        let t0 = Instant::now();
+        let st = dev.wait_doorbell(0, &cfg).unwrap();
+        assert!(t0.elapsed() >= Duration::from_millis(30));
+        assert_eq!((st.doorbell, st.pending), (0, 0));
+
+        let cfg = DoorbellCfg { idle_timeout_ms: 5000, ..cfg };
+        let base = map.user_base;
+        let guest = std::thread::spawn(move || {
+            std::thread::sleep(Duration::from_millis(20));
+            unsafe { &*((base + HDR_DOORBELL) as *const AtomicU32) }.fetch_add(1, Ordering::AcqRel);
+        });
+        let t0 = Instant::now();
+        let st = dev.wait_doorbell(0, &cfg).unwrap();
+        guest.join().unwrap();
+        assert!(t0.elapsed() < Duration::from_secs(2));
+        assert_eq!(st.doorbell, 1);
+        assert_eq!(word(&map, HDR_HOST_WAITING).load(Ordering::Relaxed), 0);
+    }
+}
@@ -13,6 +13,13 @@ use windows::Win32::System::Hypervisor::*;
 use windows::Win32::System::Memory::*;
 use dialoguer::{theme::ColorfulTheme, Input, Select};
 use crate::profiles::{self, Profile};
+use crate::net::queue::{NetQueue, QueueShape};
+use crate::net::stealth::{StealthCfg, StealthNet};
+
+/// Para-net queue at the top of guest RAM; the guest writes any value to
+/// NETQ_DOORBELL_PORT after submitting.
+const NETQ_LEN: usize = 4 * 1024 * 1024;
+const NETQ_DOORBELL_PORT: u16 = 0x5f0;
 
 #[derive(Clone, Copy, Debug)]
 pub enum NetMode { Stealth, Passthrough }
@@ -85,17 +92,23 @@ pub fn boot_kernel(opts: &BootOptions) -> Result<()> {
         }
     }
 
-    // 5b) Networking backend selection (skeleton)
-    match opts.net {
+    // 5b) Networking backend selection
+    let stealth = match opts.net {
         NetMode::Stealth => {
-            // Placeholder: would initialize a slirp/host-socket proxy backend and expose a minimal virtio-net device to the guest.
-            tracing::info!("hypervisor.net", mode = "stealth", "Using host-socket proxy (slirp-like) [stub]");
+            let shape = QueueShape { sq_cap: 256, cq_cap: 256, buf_count: 512, buf_size: 4096 };
+            let gpa = mem_size - NETQ_LEN;
+            let queue = unsafe { NetQueue::format(mem.add(gpa), NETQ_LEN, shape)? };
+            // No interrupt injection yet: the guest polls its completion ring
+            let net = StealthNet::new(StealthCfg::default()).start(queue, || {})?;
+            tracing::info!("hypervisor.net", mode = "stealth", gpa, "Host-socket proxy on para-net queue");
+            Some(net)
         }
         NetMode::Passthrough => {
             // Placeholder: would attach a TAP/USB NIC and bridge or forward frames at L2.
             tracing::info!("hypervisor.net", mode = "passthrough", "Using NIC passthrough/bridge [stub]");
+            None
         }
-    }
+    };
 
     // 6) Create one vCPU
     unsafe { WHvCreateVirtualProcessor(part, 0, 0).ok()?; }
@@ -130,6 +143,8 @@ pub fn boot_kernel(opts: &BootOptions) -> Result<()> {
                         print!("{}", ch);
                         let _ = std::io::Write::flush(&mut std::io::stdout());
                         printed += 1;
+                    } else if is_write && port == NETQ_DOORBELL_PORT {
+                        if let Some(net) = &stealth { net.kick(); }
                     }
                 }
                 WHV_RUN_VP_EXIT_REASON_X64_HALT => {
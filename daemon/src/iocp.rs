@@ -1,44 +1,58 @@
 //! Minimal IOCP + overlapped DeviceIoControl reactor for coLinux 2.0.
 //! Safe(ish) wrapper: all unsafe is concentrated and documented.
-
-use anyhow::{anyhow, bail, Context, Result};
-use crossbeam_channel::{Receiver, RecvTimeoutError, Sender};
-use std::ptr::{addr_of_mut, null_mut};
-use std::thread;
-use std::time::Duration;
+//!
+//! This file is the Windows `CompletionSource`; scheduling, batching and
+//! statistics live in `reactor.rs`. Completions are drained with
+//! GetQueuedCompletionStatusEx and submissions wake a worker with a posted
+//! packet, so an idle reactor sleeps in the kernel instead of polling.
+
+use anyhow::{bail, Result};
+use std::mem::MaybeUninit;
+use std::ptr::addr_of_mut;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
 use windows::core::PCWSTR;
 use windows::Win32::Foundation::{CloseHandle, GetLastError, BOOL, HANDLE};
 use windows::Win32::Storage::FileSystem::{
-    CreateFileW, FILE_ATTRIBUTE_NORMAL, FILE_FLAG_OVERLAPPED, FILE_FLAGS_AND_ATTRIBUTES,
-    FILE_SHARE_READ, FILE_SHARE_WRITE, GENERIC_READ, GENERIC_WRITE, OPEN_EXISTING,
+    CreateFileW, SetFileCompletionNotificationModes, FILE_ATTRIBUTE_NORMAL, FILE_FLAG_OVERLAPPED,
+    FILE_FLAGS_AND_ATTRIBUTES, FILE_SHARE_READ, FILE_SHARE_WRITE, GENERIC_READ, GENERIC_WRITE,
+    OPEN_EXISTING,
 };
 use windows::Win32::System::IO::{
-    CreateIoCompletionPort, DeviceIoControl, GetQueuedCompletionStatus, OVERLAPPED,
+    CancelIoEx, CreateIoCompletionPort, DeviceIoControl, GetQueuedCompletionStatusEx,
+    PostQueuedCompletionStatus, OVERLAPPED, OVERLAPPED_ENTRY,
 };
 
+pub use crate::reactor::{CompletionSlot, InBuf, Inline, IoctlError, IoctlRequest, OutBuf, ReactorSnapshot, Reply, UserBuf};
+use crate::reactor::{CompletionSource, Done, Event, ReactorCore, DEQUEUE_BATCH};
+
 const COMPLETION_KEY_IOCTL: usize = 1;
+const COMPLETION_KEY_WAKE: usize = 2;
 
-pub struct IoctlRequest {
-    pub code: u32,
-    pub inbuf: Option<Vec<u8>>,      // parameters (METHOD_* params)
-    pub out_capacity: usize,         // size of out/other buffer (MDL target for direct I/O, or read buffer)
-    pub prefill_out: Option<Vec<u8>>,// if provided, initializes out buffer (e.g., write payload for METHOD_IN_DIRECT)
-    pub reply: Sender<Result<Vec<u8>>>,
-}
+// winbase.h
+const FILE_SKIP_COMPLETION_PORT_ON_SUCCESS: u8 = 0x1;
+const ERROR_IO_PENDING: u32 = 997;
+const INFINITE: u32 = u32::MAX;
 
-pub struct Reactor {
+pub type Reactor = ReactorCore<IocpSource>;
+
+pub struct IocpSource {
     iocp: HANDLE,
     dev: HANDLE,
-    tx_submit: Sender<IoctlRequest>,
-    worker: thread::JoinHandle<()>,
+    ctx_free: Mutex<Vec<Box<OverlappedCtx>>>,
 }
 
-unsafe impl Send for Reactor {}
-unsafe impl Sync for Reactor {}
+unsafe impl Send for IocpSource {}
+unsafe impl Sync for IocpSource {}
 
 impl Reactor {
     /// Open \\.\u{005c}coLinux with FILE_FLAG_OVERLAPPED and bind to a new IOCP.
     pub fn open_dev(path: &str) -> Result<Self> {
+        Self::open_dev_with_workers(path, 1)
+    }
+
+    /// As `open_dev`, with `workers` threads draining the same port.
+    pub fn open_dev_with_workers(path: &str, workers: usize) -> Result<Self> {
         let wide: Vec<u16> = path.encode_utf16().chain([0]).collect();
         let dev = unsafe {
             CreateFileW(
@@ -55,140 +69,182 @@ impl Reactor {
             bail!("CreateFileW({}) failed (last={:?})", path, unsafe { GetLastError() });
         }
 
-        let iocp = unsafe { CreateIoCompletionPort(dev, HANDLE(0), COMPLETION_KEY_IOCTL, 0) };
+        let iocp = unsafe { CreateIoCompletionPort(dev, HANDLE(0), COMPLETION_KEY_IOCTL, workers.max(1) as u32) };
         if iocp.0 == 0 {
             unsafe { CloseHandle(dev) };
             bail!("CreateIoCompletionPort failed (last={:?})", unsafe { GetLastError() });
         }
 
-        let (tx, rx) = crossbeam_channel::unbounded::<IoctlRequest>();
-        let worker = spawn_worker(dev, iocp, rx);
-
-        Ok(Self {
-            iocp,
-            dev,
-            tx_submit: tx,
-            worker,
-        })
-    }
+        // Synchronous successes then never queue a packet: the submitting worker
+        // completes them inline and owns the OVERLAPPED for its whole life.
+        let ok: BOOL = unsafe { SetFileCompletionNotificationModes(dev, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS) };
+        if !ok.as_bool() {
+            unsafe {
+                CloseHandle(iocp);
+                CloseHandle(dev);
+            }
+            bail!("SetFileCompletionNotificationModes failed (last={:?})", unsafe { GetLastError() });
+        }
 
-    pub fn submit(&self, req: IoctlRequest) -> Result<()> {
-        self.tx_submit
-            .send(req)
-            .map_err(|e| anyhow!("submit failed: {e}"))
+        Ok(ReactorCore::with_source(IocpSource { iocp, dev, ctx_free: Mutex::new(Vec::with_capacity(CTX_CACHE)) }, workers))
     }
 }
 
-impl Drop for Reactor {
+impl Drop for IocpSource {
     fn drop(&mut self) {
-        // Best-effort cleanup. IOCP closes when handle drops; worker exits on channel close.
+        // Runs after the reactor joined its workers. Contexts still owned by the
+        // driver leak rather than being freed under it.
         unsafe {
             let _ = CloseHandle(self.iocp);
             let _ = CloseHandle(self.dev);
         }
-        // Allow worker to exit when tx channel drops.
     }
 }
 
-struct OverlappedBox {
+/// Contexts kept for reuse; beyond this, finished contexts are freed.
+const CTX_CACHE: usize = 256;
+
+/// In-flight state for one IOCTL. Recycled through `IocpSource::ctx_free`, so
+/// after warm-up no request allocates its OVERLAPPED or bookkeeping.
+struct OverlappedCtx {
     /// Windows OVERLAPPED structure (must be first).
     ov: OVERLAPPED,
-    inbuf: Vec<u8>,
-    out: Vec<u8>,
-    reply: Sender<Result<Vec<u8>>>,
+    inbuf: InBuf,
+    out: OutBuf,
+    reply: Option<Reply>,
+    code: u32,
+    submitted: Instant,
 }
-impl OverlappedBox {
-    fn new(inbuf: Option<Vec<u8>>, out_capacity: usize, prefill_out: Option<Vec<u8>>, reply: Sender<Result<Vec<u8>>>) -> Box<Self> {
-        let mut out = vec![0u8; out_capacity];
-        if let Some(mut p) = prefill_out {
-            if p.len() != out_capacity { p.resize(out_capacity, 0); }
-            out.copy_from_slice(&p);
+
+impl IocpSource {
+    fn ctx_get(&self, req: IoctlRequest, submitted: Instant) -> Box<OverlappedCtx> {
+        let mut ctx = self.ctx_free.lock().unwrap().pop().unwrap_or_else(|| {
+            Box::new(OverlappedCtx { ov: OVERLAPPED::default(), inbuf: InBuf::None, out: OutBuf::None, reply: None, code: 0, submitted })
+        });
+        ctx.ov = OVERLAPPED::default();
+        ctx.inbuf = req.inbuf;
+        ctx.out = req.out;
+        ctx.reply = Some(req.reply);
+        ctx.code = req.code;
+        ctx.submitted = submitted;
+        ctx
+    }
+
+    /// Detach the request's buffers and reply, then recycle the context.
+    fn ctx_finish(&self, mut ctx: Box<OverlappedCtx>, result: Result<u32>) -> Done {
+        // The OVERLAPPED is about to be reused: it must no longer cancel this request
+        if let Some(Reply::Slot(slot, ticket)) = &ctx.reply {
+            slot.clear_cancel(*ticket);
+        }
+        let done = Done {
+            code: ctx.code,
+            reply: ctx.reply.take().expect("ctx without reply"),
+            result,
+            out: std::mem::replace(&mut ctx.out, OutBuf::None),
+            submitted: ctx.submitted,
+        };
+        ctx.inbuf = InBuf::None;
+        let mut free = self.ctx_free.lock().unwrap();
+        if free.len() < CTX_CACHE {
+            free.push(ctx);
         }
-        Box::new(Self { ov: OVERLAPPED::default(), inbuf: inbuf.unwrap_or_default(), out, reply })
+        done
     }
 }
 
-/// Worker thread: pumps two loops
-/// 1) posts new IOCTLs received over `rx`
-/// 2) collects completions from IOCP using GetQueuedCompletionStatus
-fn spawn_worker(dev: HANDLE, iocp: HANDLE, rx: Receiver<IoctlRequest>) -> thread::JoinHandle<()> {
-    thread::spawn(move || {
-        loop {
-            // 1) Post any queued IOCTLs (non-blocking check)
-            match rx.recv_timeout(Duration::from_millis(1)) {
-                Ok(req) => unsafe {
-                    // Box our overlapped + buffers + channel
-                    let mut obox = OverlappedBox::new(req.inbuf, req.out_capacity, req.prefill_out, req.reply);
-                    let p_ov: *mut OVERLAPPED = addr_of_mut!(obox.ov);
-
-                    // Prepare in/out pointers
-                    let (in_ptr, in_len) = if obox.inbuf.is_empty() {
-                        (None, 0u32)
-                    } else {
-                        (Some(obox.inbuf.as_ptr() as _), obox.inbuf.len() as u32)
-                    };
-
-                    let mut bytes_ret: u32 = 0;
-                    let ok: BOOL = DeviceIoControl(
-                        dev,
-                        req.code,
-                        in_ptr,
-                        in_len,
-                        if obox.out.is_empty() {
-                            None
-                        } else {
-                            Some(obox.out.as_mut_ptr() as _)
-                        },
-                        obox.out.len() as u32,
-                        &mut bytes_ret,
-                        Some(p_ov),
-                    );
-                    if ok.as_bool() {
-                        // Completed immediately; emulate completion via channel
-                        let mut out = obox.out;
-                        out.truncate(bytes_ret as usize);
-                        let _ = obox.reply.send(Ok(out));
-                        // Box drops here
-                    } else {
-                        // EXPECT: ERROR_IO_PENDING → completion will arrive via IOCP
-                        let err = GetLastError().0;
-                        const ERROR_IO_PENDING: u32 = 997;
-                        if err != ERROR_IO_PENDING {
-                            let _ = obox
-                                .reply
-                                .send(Err(anyhow!("DeviceIoControl failed: {err}")));
-                            // drop box; no completion will arrive
-                        } else {
-                            // leak Box until completion; IOCP will give back the pointer
-                            Box::into_raw(obox);
-                        }
-                    }
-                },
-                Err(RecvTimeoutError::Timeout) => { /* fall through to completions */ }
-                Err(RecvTimeoutError::Disconnected) => break,
+impl CompletionSource for IocpSource {
+    fn start(&self, req: IoctlRequest, submitted: Instant) -> Option<Done> {
+        unsafe {
+            // Context owns overlapped + buffers + reply until the IRP completes
+            let code = req.code;
+            let mut ctx = self.ctx_get(req, submitted);
+            let p_ov: *mut OVERLAPPED = addr_of_mut!(ctx.ov);
+            let (out_ptr, out_len) = match ctx.out.ptr_len() {
+                (p, 0) if p.is_null() => (None, 0u32),
+                (p, n) => (Some(p as *mut core::ffi::c_void), n as u32),
+            };
+
+            // Prepare in/out pointers
+            let inb = ctx.inbuf.as_slice();
+            let (in_ptr, in_len) = if inb.is_empty() {
+                (None, 0u32)
+            } else {
+                (Some(inb.as_ptr() as _), inb.len() as u32)
+            };
+
+            // Registered before issuing, so a timed-out caller can always reach the IRP
+            if let Some(Reply::Slot(slot, ticket)) = &ctx.reply {
+                slot.set_cancel(*ticket, p_ov as usize);
             }
 
-            // 2) Collect at most one completion per tick to stay responsive
-            unsafe {
-                let mut bytes: u32 = 0;
-                let mut key: usize = 0;
-                let mut lpov: *mut OVERLAPPED = null_mut();
-                let ok = GetQueuedCompletionStatus(iocp, &mut bytes, &mut key, &mut lpov, 1);
-
-                if !lpov.is_null() && key == COMPLETION_KEY_IOCTL {
-                    // Recover our OverlappedBox
-                    let obox_ptr = lpov as *mut OverlappedBox;
-                    let mut obox: Box<OverlappedBox> = Box::from_raw(obox_ptr);
-                    if ok.as_bool() {
-                        obox.out.truncate(bytes as usize);
-                        let _ = obox.reply.send(Ok(obox.out));
-                    } else {
-                        let err = GetLastError().0;
-                        let _ = obox.reply.send(Err(anyhow!("ioctl completion failed: {err}")));
+            let mut bytes_ret: u32 = 0;
+            let ok: BOOL = DeviceIoControl(
+                self.dev,
+                code,
+                in_ptr,
+                in_len,
+                out_ptr,
+                out_len,
+                &mut bytes_ret,
+                Some(p_ov),
+            );
+            if ok.as_bool() {
+                // Completed immediately; no packet is queued (skip-on-success)
+                return Some(self.ctx_finish(ctx, Ok(bytes_ret)));
+            }
+            let err = GetLastError().0;
+            if err != ERROR_IO_PENDING {
+                // No completion will arrive
+                return Some(self.ctx_finish(ctx, Err(IoctlError::Win32(err).into())));
+            }
+            // Leak Box until completion; IOCP will give back the pointer
+            let _ = Box::into_raw(ctx);
+            None
+        }
+    }
+
+    fn dequeue(&self, out: &mut Vec<Event>, max: usize, timeout: Option<Duration>) {
+        let mut entries: [MaybeUninit<OVERLAPPED_ENTRY>; DEQUEUE_BATCH] = unsafe { MaybeUninit::uninit().assume_init() };
+        let max = max.min(DEQUEUE_BATCH);
+        let ms = timeout.map_or(INFINITE, |t| t.as_millis().min(INFINITE as u128 - 1) as u32);
+        let mut n: u32 = 0;
+        unsafe {
+            let slice = std::slice::from_raw_parts_mut(entries.as_mut_ptr() as *mut OVERLAPPED_ENTRY, max);
+            let ok: BOOL = GetQueuedCompletionStatusEx(self.iocp, slice, &mut n, ms, BOOL(0));
+            if !ok.as_bool() {
+                // WAIT_TIMEOUT or port closed; the worker simply tries again
+                return;
+            }
+            for e in &slice[..n as usize] {
+                match e.lpCompletionKey {
+                    COMPLETION_KEY_WAKE => out.push(Event::Wake),
+                    COMPLETION_KEY_IOCTL if !e.lpOverlapped.is_null() => {
+                        // Recover our context; Internal carries the IRP's NTSTATUS
+                        let ctx: Box<OverlappedCtx> = Box::from_raw(e.lpOverlapped as *mut OverlappedCtx);
+                        let status = e.Internal as i32;
+                        let res = if status >= 0 {
+                            Ok(e.dwNumberOfBytesTransferred)
+                        } else {
+                            Err(IoctlError::Status(status as u32).into())
+                        };
+                        out.push(Event::Done(self.ctx_finish(ctx, res)));
                     }
-                    // Box drops here
+                    _ => {}
                 }
             }
         }
-    })
+    }
+
+    fn post_wake(&self) {
+        let ok: BOOL = unsafe { PostQueuedCompletionStatus(self.iocp, 0, COMPLETION_KEY_WAKE, None) };
+        if !ok.as_bool() {
+            tracing::error!("PostQueuedCompletionStatus failed (last={:?})", unsafe { GetLastError() });
+        }
+    }
+
+    /// `token` is the request's OVERLAPPED; the driver completes the IRP with
+    /// STATUS_CANCELLED (or it finishes first and this finds nothing).
+    fn cancel(&self, token: usize) {
+        let _ = unsafe { CancelIoEx(self.dev, Some(token as *const OVERLAPPED)) };
+    }
 }
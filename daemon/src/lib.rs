@@ -1,8 +1,30 @@
+pub mod bench;
+pub mod blockdev;
+pub mod bufpool;
+pub mod cache;
 pub mod config;
 pub mod device;
+pub mod geom;
+#[cfg(target_os = "linux")]
+pub mod hostdev;
+#[cfg(windows)]
 pub mod iocp;
 pub mod logging;
+pub mod metrics;
+pub mod net;
+pub mod overlay;
+pub mod reactor;
+#[cfg(windows)]
 pub mod service;
+pub mod shfs;
+pub mod shutdown;
+pub mod sparse;
+pub mod trace;
+#[cfg(target_os = "linux")]
+pub mod uring;
 pub mod vblk;
+pub mod vblk_batch;
+pub mod vblk_ring;
+pub mod vtty;
 pub mod ring;
 
@@ -1,56 +1,239 @@
+mod blockdev;  // VBLK block backends
+mod bufpool;   // page-aligned I/O buffer slab
+mod cache;     // VBLK block cache + readahead
 mod config;
 mod device;
+mod geom;      // shared-mapping geometry descriptor
+#[cfg(windows)]
 mod iocp;      // IOCP reactor
+#[cfg(target_os = "linux")]
+mod hostdev;   // in-process driver ABI (Linux hosts)
+#[cfg(target_os = "linux")]
+mod uring;     // io_uring binding for hostdev
+mod reactor;   // portable reactor core
+mod ring;      // SPSC byte rings (VTTY)
 mod logging;
+mod metrics;   // counters + latency histograms, /metrics endpoint
+mod overlay;   // copy-on-write overlay disks
+#[cfg(windows)]
 mod service;   // Windows Service wrapper
+mod sparse;    // hole punching + zero detection
+mod shfs;      // shared folder server
+mod shutdown;  // stop flag: service control, Ctrl-C / SIGTERM
+mod trace;     // cross-boundary request tracer, Chrome trace export
 mod vblk;      // VBLK ring/dispatcher
-mod vblk_ring; // VBLK shared ring service
+mod vblk_batch; // batched VBLK submit ABI
+mod vblk_ring; // VBLK shared rings (one per hw queue)
 mod console;   // VTTY console bridge
+mod vtty;      // VTTY channels as host streams
 #[cfg(windows)]
 mod hypervisor; // Experimental: WHP-based kernel runner
+mod net;       // guest networking backends (NIC rings, WHP runner)
 mod profiles;  // YAML profiles for operator defaults
 // vtty via device.rs helpers
 
 use anyhow::{Context, Result};
+use std::path::Path;
 use std::time::{Duration, Instant};
 use vblk::Vblk;
 
 fn console_main(cfg_path: &str) -> Result<()> {
     logging::init();
     let cfg = config::load(cfg_path)?;
-    let dev = device::Device::open()?;
+    let dev = device::Device::open_with_workers(cfg.reactor_workers as usize)?;
 
     // Set up vblk ring/dispatcher and shared-ring service
-    let mut vblk = Vblk::new(&dev, cfg.vblk_queue_depth as usize);
+    let mut vblk = Vblk::with_merge(&dev, cfg.vblk_queue_depth as usize, cfg.vblk_merge_kb * 1024);
 
-    // Configure vblk backing file (must exist)
-    dev.vblk_set_backing_sync(&cfg.vblk_backing, Duration::from_secs(2))?;
+    // Guest disk: a CoW overlay chain served by the daemon, or the raw backing
+    // file served by the driver (must exist)
+    let overlay = match &cfg.vblk_overlay {
+        Some(top) => {
+            let ovl = overlay::Overlay::open_or_create(Path::new(top), Path::new(&cfg.vblk_backing))?;
+            tracing::info!(top = top.as_str(), layers = ovl.depth(), "Using overlay disk");
+            Some(ovl)
+        }
+        None => {
+            dev.vblk_set_backing_sync(&cfg.vblk_backing, Duration::from_secs(2))?;
+            None
+        }
+    };
+    let driver_backend = blockdev::DriverBackend::new(&dev);
+    let backend: &dyn blockdev::BlockBackend = match &overlay {
+        Some(ovl) => ovl,
+        None => &driver_backend,
+    };
+    let cache = (cfg.vblk_cache_mb > 0).then(|| cache::BlockCache::new(backend, cfg.vblk_cache_mb));
+    let backend: &dyn blockdev::BlockBackend = match &cache {
+        Some(c) => c,
+        None => backend,
+    };
 
     // Map shared pages
     let pages = (cfg.memory_mb as usize * 1024 * 1024 / 4096) as u32;
-    let map = dev.map_shared_sync(pages, Duration::from_secs(2))?;
+    let req = device::MapRequest {
+        pages,
+        vblk_queues: cfg.vblk_queues,
+        vblk_ring_cap: cfg.vblk_queue_depth,
+        vblk_slot_stride: cfg.vblk_max_transfer_kb * 1024,
+        vtty_chan_kb: std::array::from_fn(|c| cfg.vtty_channels_kb.get(c).copied().unwrap_or(0)),
+        shfs_ring_cap: cfg.shared.ring_depth,
+        shfs_slot_kb: cfg.shared.max_io_kb,
+        vnet_bufs: cfg.vnet_bufs,
+        vnet_buf_kb: cfg.vnet_buf_kb,
+        trace_kb: cfg.trace.ring_kb,
+    };
+    let map = dev.map_shared_sync(&req, Duration::from_secs(2))?;
     tracing::info!(user_base = format!("0x{:x}", map.user_base).as_str(), size = map.size, "Mapped shared memory");
-    let vblk_ring = vblk_ring::VblkRing::new(&dev, map)?;
+    let vblk_ring = vblk_ring::VblkQueues::with_merge(backend, map, cfg.vblk_merge_kb * 1024)?;
+    let geom = vblk_ring.geometry();
+    tracing::info!(queues = vblk_ring.queues(), depth = geom.vblk_ring_cap, max_transfer = geom.vblk_slot_stride, "VBLK ring geometry");
+    if vblk_ring.queues() != cfg.vblk_queues as usize || geom.vblk_ring_cap != cfg.vblk_queue_depth as usize
+        || geom.vblk_slot_stride != req.vblk_slot_stride as usize
+    {
+        tracing::warn!(
+            queues = cfg.vblk_queues, depth = cfg.vblk_queue_depth, max_transfer = req.vblk_slot_stride,
+            "Driver granted a different VBLK geometry than requested"
+        );
+    }
+
+    for (c, &kb) in req.vtty_chan_kb.iter().enumerate().filter(|(_, &kb)| kb != 0) {
+        match geom.vtty(c) {
+            Some(ch) => {
+                tracing::info!(channel = c, ring_kb = ch.cap / 1024, "VTTY channel");
+                if ch.cap != kb as usize * 1024 {
+                    tracing::warn!(channel = c, requested_kb = kb, "Driver granted a different VTTY ring size");
+                }
+            }
+            None => tracing::warn!(channel = c, "Driver did not lay out VTTY channel (old driver or mapping too small)"),
+        }
+    }
+
+    if req.trace_kb != 0 {
+        match trace::TraceRing::attach(map, geom) {
+            Ok(t) => {
+                tracing::info!(records = t.capacity(), clock_khz = t.khz(), "Request tracer");
+                trace::install(t);
+            }
+            Err(e) => tracing::warn!("Request tracer disabled: {e:#}"),
+        }
+    }
 
-    // Start console bridge (stdin/stdout <-> vtty)
-    let mut bridge = console::ConsoleBridge::new(&dev);
-    bridge.start()?;
+    // Shared folder: needs both the driver's ring and the host directory
+    let shfs_server = match (req.shfs_ring_cap, geom.shfs_ring_cap) {
+        (0, _) => None,
+        (_, 0) => {
+            tracing::warn!("Driver did not lay out the shared-folder ring (old driver or mapping too small)");
+            None
+        }
+        _ => shfs::ShfsServer::new(Path::new(&cfg.shared.host_path), cfg.shared.read_only)
+            .map_err(|e| tracing::warn!("Shared folder disabled: {e:#}"))
+            .ok(),
+    };
+    let shfs_ring = match &shfs_server {
+        Some(s) => Some(shfs::ShfsRing::new(s, map, geom)?),
+        None => None,
+    };
+    if let Some(r) = &shfs_ring {
+        tracing::info!(
+            host_path = cfg.shared.host_path.as_str(), guest_path = cfg.shared.guest_path.as_str(),
+            depth = r.depth(), max_io = r.max_io(), read_only = cfg.shared.read_only, "Shared folder"
+        );
+    }
+
+    // Virtual NIC: served on its own thread, bridged to the host port
+    let _nic = match (req.vnet_bufs, geom.vnet_ring_cap) {
+        (0, _) => None,
+        (_, 0) => {
+            tracing::warn!("Driver did not lay out the NIC rings (old driver or mapping too small)");
+            None
+        }
+        _ => start_nic(&cfg.vnet_mode, map, geom).map_err(|e| tracing::warn!("NIC left unattached: {e:#}")).ok(),
+    };
 
-    // Main loop: ticks + (placeholder) vblk pump
+    if !cfg.metrics.listen.is_empty() {
+        match metrics::serve(&cfg.metrics.listen) {
+            Ok(addr) => tracing::info!(addr = %addr, "Metrics endpoint"),
+            Err(e) => tracing::warn!("Metrics endpoint disabled: {e:#}"),
+        }
+    }
+    let summary_every = Duration::from_secs(cfg.metrics.summary_secs as u64);
+    let mut last_summary = (Instant::now(), metrics::global().snapshot());
+
+    // Start console bridge (stdin/stdout <-> vtty), woken by the guest doorbell
+    let bridge = match console::ConsoleBridge::new(map, geom) {
+        Ok(mut b) => {
+            b.start()?;
+            Some(b)
+        }
+        Err(e) => {
+            tracing::warn!("Console bridge disabled: {e:#}");
+            None
+        }
+    };
+    let console_wake = bridge.as_ref().map(console::ConsoleBridge::waker);
+
+    // Main loop: sleep on the guest doorbell when the driver supports it,
+    // otherwise ticks + periodic vblk pump
+    let mut event_mode = cfg.doorbell.enabled;
+    let mut last_doorbell = 0u32;
     let mut last_pump = Instant::now();
+    let mut last_stats = Instant::now();
     loop {
-        // honor service stop if running as service
-        if service::STOP_FLAG.load(std::sync::atomic::Ordering::SeqCst) {
+        // Service stop, Ctrl-C or SIGTERM: leave through the flush/trace path below
+        if shutdown::requested() {
+            tracing::info!("Stop requested; shutting down");
             break;
         }
 
+        if let Some(c) = cache.as_ref().filter(|_| last_stats.elapsed() >= CACHE_STATS_EVERY) {
+            log_cache_stats(c);
+            last_stats = Instant::now();
+        }
+        if !summary_every.is_zero() && last_summary.0.elapsed() >= summary_every {
+            let now = metrics::global().snapshot();
+            metrics::log_summary(&now, &last_summary.1);
+            last_summary = (Instant::now(), now);
+        }
+
+        if event_mode {
+            match dev.wait_doorbell(last_doorbell, &cfg.doorbell) {
+                Ok(state) => {
+                    // Every wake (work or idle deadline) advances the shared clock
+                    dev.run_tick_sync(cfg.tick_budget, Duration::from_millis(250))?;
+                    if state.doorbell != last_doorbell || state.pending != 0 {
+                        if let Some(w) = console_wake.as_ref().filter(|_| state.doorbell != last_doorbell) {
+                            w.kick();
+                        }
+                        last_doorbell = state.doorbell;
+                        vblk_ring.pump()?;
+                        if let Some(r) = &shfs_ring {
+                            r.pump();
+                        }
+                    }
+                    vblk.drain_completions(|_| {});
+                    continue;
+                }
+                Err(e) => {
+                    tracing::warn!("doorbell wait unavailable ({e:?}); falling back to tick polling");
+                    event_mode = false;
+                }
+            }
+        }
+
         dev.run_tick_sync(cfg.tick_budget, Duration::from_millis(250))?;
 
         if last_pump.elapsed() >= Duration::from_millis(5) {
             // ring-backed vblk from guest
-            let _ = vblk_ring.pump();
+            vblk_ring.pump()?;
+            if let Some(r) = &shfs_ring {
+                r.pump();
+            }
             // ioctls-backed vblk submissions
-            vblk.drain_completions();
+            vblk.drain_completions(|_| {});
+            if let Some(w) = &console_wake {
+                w.kick();
+            }
             last_pump = Instant::now();
         }
 
@@ -58,10 +241,41 @@ fn console_main(cfg_path: &str) -> Result<()> {
         std::thread::yield_now();
     }
     // Stop console bridge before exiting
-    bridge.stop();
+    if let Some(b) = bridge {
+        b.stop();
+    }
+    if let Some(json) = trace::chrome_json().filter(|_| !cfg.trace.dump_path.is_empty()) {
+        match std::fs::write(&cfg.trace.dump_path, json) {
+            Ok(()) => tracing::info!(path = cfg.trace.dump_path.as_str(), "Wrote request trace"),
+            Err(e) => tracing::warn!("Writing request trace to {}: {e}", cfg.trace.dump_path),
+        }
+    }
+    backend.flush()?;
+    if let Some(c) = &cache {
+        log_cache_stats(c);
+    }
     Ok(())
 }
 
+fn start_nic(mode: &str, map: device::MapInfo, geom: &geom::Geometry) -> Result<net::passthrough::NicHandle> {
+    let rings = net::vnet::VnetRings::new(map, geom)?;
+    tracing::info!(mode, buffers = rings.buf_count(), buf_kb = rings.buf_size() / 1024, "Virtual NIC");
+    let port = net::passthrough::open_port(mode)?;
+    net::passthrough::PassThroughNet::new(rings, port, net::passthrough::DEFAULT_MAC)?.start()
+}
+
+const CACHE_STATS_EVERY: Duration = Duration::from_secs(60);
+
+fn log_cache_stats(c: &cache::BlockCache) {
+    let s = c.stats();
+    tracing::info!(
+        hits = s.hits, misses = s.misses, hit_ratio = format!("{:.3}", s.hit_ratio()).as_str(),
+        readahead = s.ra_issued, readahead_hits = s.ra_hits, readahead_wasted = s.ra_wasted,
+        evictions = s.evictions, resident = s.resident_blocks, capacity = s.capacity_blocks,
+        "vblk cache"
+    );
+}
+
 fn maybe_handle_cli() -> Option<anyhow::Result<()>> {
     // Experimental kernel boot via WHP (Windows only)
     #[cfg(windows)]
@@ -100,6 +314,13 @@ fn maybe_handle_cli() -> Option<anyhow::Result<()>> {
         }
     }
 
+    // Overlay maintenance: <config> --snapshot <name> | --rollback [<name>]
+    let args: Vec<String> = std::env::args().collect();
+    if let Some(i) = args.iter().position(|a| a == "--snapshot" || a == "--rollback") {
+        return Some(overlay_cli(&args, i));
+    }
+
+    #[cfg(windows)]
     if std::env::args().any(|a| a == "--install") {
         let bin = match std::env::current_exe().context("failed to get current executable path") {
             Ok(p) => p.to_string_lossy().to_string(),
@@ -109,6 +330,7 @@ fn maybe_handle_cli() -> Option<anyhow::Result<()>> {
             println!("Installed service coLinux2");
         }));
     }
+    #[cfg(windows)]
     if std::env::args().any(|a| a == "--uninstall") {
         return Some(service::uninstall_service().map(|_| {
             println!("Uninstalled service coLinux2");
@@ -117,6 +339,23 @@ fn maybe_handle_cli() -> Option<anyhow::Result<()>> {
     None
 }
 
+fn overlay_cli(args: &[String], i: usize) -> Result<()> {
+    let cfg_path = args.get(1).filter(|a| !a.starts_with("--")).context("usage: colinux-daemon <config> --snapshot <name> | --rollback [<name>]")?;
+    let cfg = config::load(cfg_path)?;
+    let top = cfg.vblk_overlay.as_deref().context("vblk_overlay not set in config")?;
+    let top = Path::new(top);
+    let name = args.get(i + 1).map(String::as_str);
+    if args[i] == "--snapshot" {
+        let name = name.context("--snapshot needs a name")?;
+        let frozen = overlay::snapshot(top, name)?;
+        println!("Snapshot {} -> {}", name, frozen.display());
+    } else {
+        overlay::rollback(top, name)?;
+        println!("Rolled back {} to {}", top.display(), name.unwrap_or("its last snapshot"));
+    }
+    Ok(())
+}
+
 fn run() -> Result<()> {
     if let Some(res) = maybe_handle_cli() {
         return res;
@@ -136,11 +375,15 @@ fn run() -> Result<()> {
     let cfg_path = cfg_path.ok_or_else(|| anyhow::anyhow!("missing configuration file path"))?;
 
     // service mode?
-    let cfg_owned = cfg_path.clone();
-    if service::maybe_run_as_service(move || console_main(&cfg_owned))? {
-        return Ok(());
+    #[cfg(windows)]
+    {
+        let cfg_owned = cfg_path.clone();
+        if service::maybe_run_as_service(move || console_main(&cfg_owned))? {
+            return Ok(());
+        }
     }
     // console mode (cooperative path)
+    shutdown::install_handlers()?;
     console_main(&cfg_path)
 }
 
@@ -0,0 +1,456 @@
+//! Process-wide counters, gauges and log2 histograms, cheap enough to leave on.
+//!
+//! Each recording thread is pinned to one of `SHARDS` cache-line-aligned
+//! blocks of relaxed atomics, so hot paths (ring pumps, reactor workers, the
+//! VBLK dispatcher) never write a line another thread is writing. A record is
+//! a thread-local read, a leading-zero count and two uncontended adds;
+//! snapshots sum the shards. Snapshots are served as Prometheus text over
+//! loopback HTTP (`serve`) and logged as a periodic delta (`log_summary`);
+//! the same endpoint serves the request tracer's ring at `/trace`.
+
+use anyhow::{bail, Context, Result};
+use std::fmt::Write as _;
+use std::io::{Read, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+/// Recording shards; threads beyond this share, which stays correct.
+const SHARDS: usize = 16;
+/// Bucket `b` holds values in [2^(b-1), 2^b); bucket 0 holds zero.
+const BUCKETS: usize = 65;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Counter {
+    /// Bytes moved for the guest by VBLK reads / writes (ring and IOCTL paths).
+    VblkReadBytes,
+    VblkWriteBytes,
+    /// VBLK requests that completed with an error.
+    VblkErrors,
+    /// Bytes the daemon pushed to / pulled from the guest on any VTTY channel.
+    VttyTxBytes,
+    VttyRxBytes,
+    /// IOCTLs the driver (or host backend) failed.
+    IoctlErrors,
+}
+
+const COUNTERS: [(Counter, &str, &str); 6] = [
+    (Counter::VblkReadBytes, "colx_vblk_read_bytes_total", "Bytes read for the guest"),
+    (Counter::VblkWriteBytes, "colx_vblk_write_bytes_total", "Bytes written for the guest"),
+    (Counter::VblkErrors, "colx_vblk_errors_total", "VBLK requests completed with an error"),
+    (Counter::VttyTxBytes, "colx_vtty_tx_bytes_total", "VTTY bytes queued for the guest"),
+    (Counter::VttyRxBytes, "colx_vtty_rx_bytes_total", "VTTY bytes taken from the guest"),
+    (Counter::IoctlErrors, "colx_ioctl_errors_total", "IOCTLs that failed"),
+];
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Hist {
+    /// IOCTL-path VBLK request, submit to completion (ns).
+    VblkIo,
+    /// One `VblkRing::pump` that found work, first slot to last status (ns).
+    RingPump,
+    /// Slots retired by that pump: the ring depth the guest actually reached.
+    RingBatch,
+    /// RUN_TICK round trip (ns).
+    Tick,
+    /// Any IOCTL, reactor submit to completion (ns).
+    Ioctl,
+    /// Bytes per READ/WRITE handed to the backing store, after merging.
+    BackingIo,
+}
+
+/// (hist, name, help, values are nanoseconds)
+const HISTS: [(Hist, &str, &str, bool); 6] = [
+    (Hist::VblkIo, "colx_vblk_io_seconds", "VBLK IOCTL request latency", true),
+    (Hist::RingPump, "colx_vblk_ring_pump_seconds", "VBLK ring pump duration", true),
+    (Hist::RingBatch, "colx_vblk_ring_batch_slots", "Slots retired per VBLK ring pump", false),
+    (Hist::Tick, "colx_tick_seconds", "RUN_TICK round trip", true),
+    (Hist::Ioctl, "colx_ioctl_seconds", "IOCTL latency through the reactor", true),
+    (Hist::BackingIo, "colx_vblk_backing_io_bytes", "Bytes per backing READ/WRITE after merging", false),
+];
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Gauge {
+    /// VBLK IOCTL-path requests queued or in flight in the dispatcher.
+    VblkQueued,
+}
+
+const GAUGES: [(Gauge, &str, &str); 1] = [(Gauge::VblkQueued, "colx_vblk_queued", "VBLK IOCTL requests queued or in flight")];
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: AtomicU64 = AtomicU64::new(0);
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_BUCKETS: [AtomicU64; BUCKETS] = [ZERO; BUCKETS];
+
+struct HistCells {
+    buckets: [AtomicU64; BUCKETS],
+    sum: AtomicU64,
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_HIST: HistCells = HistCells { buckets: ZERO_BUCKETS, sum: ZERO };
+
+#[repr(align(128))]
+struct Shard {
+    counters: [AtomicU64; COUNTERS.len()],
+    hists: [HistCells; HISTS.len()],
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_SHARD: Shard = Shard { counters: [ZERO; COUNTERS.len()], hists: [ZERO_HIST; HISTS.len()] };
+
+pub struct Registry {
+    shards: [Shard; SHARDS],
+    gauges: [AtomicU64; GAUGES.len()],
+    started: Instant,
+}
+
+static NEXT_SHARD: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    static SHARD: usize = NEXT_SHARD.fetch_add(1, Ordering::Relaxed) % SHARDS;
+}
+
+fn bucket(v: u64) -> usize {
+    (64 - v.leading_zeros()) as usize
+}
+
+/// Largest value bucket `b` holds.
+fn bucket_upper(b: usize) -> u64 {
+    match b {
+        0 => 0,
+        64 => u64::MAX,
+        _ => (1u64 << b) - 1,
+    }
+}
+
+impl Registry {
+    pub fn new() -> Self {
+        Self { shards: [ZERO_SHARD; SHARDS], gauges: [ZERO; GAUGES.len()], started: Instant::now() }
+    }
+
+    fn shard(&self) -> &Shard {
+        &self.shards[SHARD.with(|s| *s)]
+    }
+
+    pub fn add(&self, c: Counter, n: u64) {
+        self.shard().counters[c as usize].fetch_add(n, Ordering::Relaxed);
+    }
+
+    pub fn record(&self, h: Hist, v: u64) {
+        let cells = &self.shard().hists[h as usize];
+        cells.buckets[bucket(v)].fetch_add(1, Ordering::Relaxed);
+        cells.sum.fetch_add(v, Ordering::Relaxed);
+    }
+
+    pub fn set(&self, g: Gauge, v: u64) {
+        self.gauges[g as usize].store(v, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> Snapshot {
+        let mut s = Snapshot {
+            counters: [0; COUNTERS.len()],
+            hists: [HistSnap::default(); HISTS.len()],
+            gauges: [0; GAUGES.len()],
+            uptime: self.started.elapsed(),
+        };
+        for sh in &self.shards {
+            for (t, c) in s.counters.iter_mut().zip(&sh.counters) {
+                *t += c.load(Ordering::Relaxed);
+            }
+            for (t, c) in s.hists.iter_mut().zip(&sh.hists) {
+                for (tb, cb) in t.buckets.iter_mut().zip(&c.buckets) {
+                    *tb += cb.load(Ordering::Relaxed);
+                }
+                t.sum = t.sum.wrapping_add(c.sum.load(Ordering::Relaxed));
+            }
+        }
+        for (t, g) in s.gauges.iter_mut().zip(&self.gauges) {
+            *t = g.load(Ordering::Relaxed);
+        }
+        s
+    }
+}
+
+impl Default for Registry {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+static GLOBAL: std::sync::OnceLock<Registry> = std::sync::OnceLock::new();
+
+/// The daemon's registry.
+pub fn global() -> &'static Registry {
+    GLOBAL.get_or_init(Registry::new)
+}
+
+pub fn add(c: Counter, n: u64) {
+    global().add(c, n);
+}
+
+pub fn record(h: Hist, v: u64) {
+    global().record(h, v);
+}
+
+/// Record the time since `t0` in nanoseconds.
+pub fn record_since(h: Hist, t0: Instant) {
+    global().record(h, t0.elapsed().as_nanos().min(u64::MAX as u128) as u64);
+}
+
+pub fn set(g: Gauge, v: u64) {
+    global().set(g, v);
+}
+
+#[derive(Clone, Copy, Debug)]
+pub struct HistSnap {
+    pub buckets: [u64; BUCKETS],
+    pub sum: u64,
+}
+
+impl Default for HistSnap {
+    fn default() -> Self {
+        Self { buckets: [0; BUCKETS], sum: 0 }
+    }
+}
+
+impl HistSnap {
+    pub fn count(&self) -> u64 {
+        self.buckets.iter().sum()
+    }
+
+    /// Upper bound of the bucket holding the `p`th percentile: within a
+    /// factor of two, which is what tuning queue depth or tick budget needs.
+    pub fn percentile(&self, p: f64) -> u64 {
+        let n = self.count();
+        if n == 0 {
+            return 0;
+        }
+        let rank = ((p / 100.0 * n as f64).ceil() as u64).clamp(1, n);
+        let mut seen = 0;
+        for (b, &c) in self.buckets.iter().enumerate() {
+            seen += c;
+            if seen >= rank {
+                return bucket_upper(b);
+            }
+        }
+        u64::MAX
+    }
+
+    pub fn mean(&self) -> f64 {
+        match self.count() {
+            0 => 0.0,
+            n => self.sum as f64 / n as f64,
+        }
+    }
+
+    fn since(&self, prev: &HistSnap) -> HistSnap {
+        let mut d = *self;
+        for (b, p) in d.buckets.iter_mut().zip(&prev.buckets) {
+            *b -= p;
+        }
+        d.sum = d.sum.wrapping_sub(prev.sum);
+        d
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct Snapshot {
+    counters: [u64; COUNTERS.len()],
+    hists: [HistSnap; HISTS.len()],
+    gauges: [u64; GAUGES.len()],
+    pub uptime: Duration,
+}
+
+impl Snapshot {
+    pub fn counter(&self, c: Counter) -> u64 {
+        self.counters[c as usize]
+    }
+
+    pub fn hist(&self, h: Hist) -> &HistSnap {
+        &self.hists[h as usize]
+    }
+
+    pub fn gauge(&self, g: Gauge) -> u64 {
+        self.gauges[g as usize]
+    }
+
+    /// Activity between `prev` and this snapshot; gauges keep their current value.
+    pub fn since(&self, prev: &Snapshot) -> Snapshot {
+        let mut d = self.clone();
+        for (c, p) in d.counters.iter_mut().zip(&prev.counters) {
+            *c -= p;
+        }
+        for (h, p) in d.hists.iter_mut().zip(&prev.hists) {
+            *h = h.since(p);
+        }
+        d.uptime = self.uptime.saturating_sub(prev.uptime);
+        d
+    }
+
+    /// Prometheus text exposition (format 0.0.4).
+    pub fn render(&self, out: &mut String) {
+        for &(c, name, help) in &COUNTERS {
+            let _ = write!(out, "# HELP {name} {help}\n# TYPE {name} counter\n{name} {}\n", self.counter(c));
+        }
+        for &(g, name, help) in &GAUGES {
+            let _ = write!(out, "# HELP {name} {help}\n# TYPE {name} gauge\n{name} {}\n", self.gauge(g));
+        }
+        for &(h, name, help, ns) in &HISTS {
+            let hs = self.hist(h);
+            let scale = |v: u64| if ns { v as f64 / 1e9 } else { v as f64 };
+            let _ = write!(out, "# HELP {name} {help}\n# TYPE {name} histogram\n");
+            // Buckets past the highest populated one add nothing
+            let top = hs.buckets.iter().rposition(|&c| c != 0).unwrap_or(0);
+            let mut cum = 0;
+            for (b, &c) in hs.buckets[..=top].iter().enumerate() {
+                cum += c;
+                let _ = writeln!(out, "{name}_bucket{{le=\"{}\"}} {cum}", scale(bucket_upper(b)));
+            }
+            let _ = write!(out, "{name}_bucket{{le=\"+Inf\"}} {cum}\n{name}_sum {}\n{name}_count {cum}\n", scale(hs.sum));
+        }
+        let _ = write!(out, "# TYPE colx_uptime_seconds gauge\ncolx_uptime_seconds {}\n", self.uptime.as_secs_f64());
+    }
+}
+
+/// Log what happened since `prev` as one line: rates, p50/p99 and errors.
+pub fn log_summary(now: &Snapshot, prev: &Snapshot) {
+    let d = now.since(prev);
+    let secs = d.uptime.as_secs_f64().max(1e-9);
+    let us = |h: Hist, p: f64| d.hist(h).percentile(p) as f64 / 1000.0;
+    let io = d.hist(Hist::VblkIo).count() + d.hist(Hist::RingBatch).sum;
+    let mib_s = (d.counter(Counter::VblkReadBytes) + d.counter(Counter::VblkWriteBytes)) as f64 / secs / (1024.0 * 1024.0);
+    tracing::info!(
+        vblk_iops = format!("{:.0}", io as f64 / secs).as_str(),
+        vblk_mib_s = format!("{mib_s:.1}").as_str(),
+        vblk_p50_us = us(Hist::VblkIo, 50.0), vblk_p99_us = us(Hist::VblkIo, 99.0),
+        vblk_queued = d.gauge(Gauge::VblkQueued), vblk_errors = d.counter(Counter::VblkErrors),
+        pumps = d.hist(Hist::RingPump).count(), pump_p99_us = us(Hist::RingPump, 99.0),
+        ring_batch_mean = format!("{:.1}", d.hist(Hist::RingBatch).mean()).as_str(), ring_batch_p99 = d.hist(Hist::RingBatch).percentile(99.0),
+        backing_io_kib_mean = format!("{:.0}", d.hist(Hist::BackingIo).mean() / 1024.0).as_str(),
+        tick_p50_us = us(Hist::Tick, 50.0), tick_p99_us = us(Hist::Tick, 99.0),
+        vtty_tx = d.counter(Counter::VttyTxBytes), vtty_rx = d.counter(Counter::VttyRxBytes),
+        ioctl_errors = d.counter(Counter::IoctlErrors),
+        "metrics"
+    );
+}
+
+/// Serve `global()` snapshots as Prometheus text on `addr`, which must be a
+/// loopback address: the counters describe the guest's I/O pattern.
+pub fn serve(addr: &str) -> Result<SocketAddr> {
+    serve_registry(global(), addr)
+}
+
+fn serve_registry(reg: &'static Registry, addr: &str) -> Result<SocketAddr> {
+    let sa: SocketAddr = addr.parse().with_context(|| format!("metrics listen address {addr:?}"))?;
+    if !sa.ip().is_loopback() {
+        bail!("metrics endpoint must listen on a loopback address, not {sa}");
+    }
+    let listener = TcpListener::bind(sa).with_context(|| format!("bind metrics endpoint {sa}"))?;
+    let local = listener.local_addr()?;
+    std::thread::Builder::new().name("metrics".into()).spawn(move || {
+        for conn in listener.incoming() {
+            match conn {
+                Ok(s) => {
+                    if let Err(e) = respond(reg, s) {
+                        tracing::debug!("metrics request: {e}");
+                    }
+                }
+                Err(e) => tracing::debug!("metrics accept: {e}"),
+            }
+        }
+    })?;
+    Ok(local)
+}
+
+fn respond(reg: &Registry, mut s: TcpStream) -> std::io::Result<()> {
+    s.set_read_timeout(Some(Duration::from_secs(1)))?;
+    // Only the request line matters
+    let (mut req, mut n) = ([0u8; 1024], 0);
+    while n < req.len() && !req[..n].contains(&b'\n') {
+        match s.read(&mut req[n..])? {
+            0 => break,
+            k => n += k,
+        }
+    }
+    let line = std::str::from_utf8(&req[..n]).unwrap_or("").lines().next().unwrap_or("");
+    const TEXT: &str = "text/plain; version=0.0.4";
+    let (status, kind, body) = match line.split_whitespace().take(2).collect::<Vec<_>>()[..] {
+        ["GET", "/" | "/metrics"] => {
+            let mut body = String::with_capacity(16 * 1024);
+            reg.snapshot().render(&mut body);
+            ("200 OK", TEXT, body)
+        }
+        ["GET", "/trace"] => match crate::trace::chrome_json() {
+            Some(body) => ("200 OK", "application/json", body),
+            None => ("404 Not Found", TEXT, "request tracer off (trace.ring_kb)\n".to_string()),
+        },
+        ["GET", _] => ("404 Not Found", TEXT, "not found\n".to_string()),
+        _ => ("405 Method Not Allowed", TEXT, "GET only\n".to_string()),
+    };
+    write!(s, "HTTP/1.1 {status}\r\nContent-Type: {kind}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{body}", body.len())?;
+    s.flush()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buckets_are_powers_of_two() {
+        assert_eq!((bucket(0), bucket(1), bucket(2), bucket(3), bucket(4)), (0, 1, 2, 2, 3));
+        assert_eq!(bucket(u64::MAX), 64);
+        for v in [1u64, 7, 1000, 1 << 40, u64::MAX] {
+            let b = bucket(v);
+            assert!(bucket_upper(b) >= v && bucket_upper(b - 1) < v, "{v}");
+        }
+    }
+
+    #[test]
+    fn shards_sum_into_snapshots() {
+        let reg: &'static Registry = Box::leak(Box::new(Registry::new()));
+        std::thread::scope(|s| {
+            for _ in 0..4 {
+                s.spawn(|| {
+                    for i in 0..1000u64 {
+                        reg.add(Counter::VttyTxBytes, 2);
+                        reg.record(Hist::Tick, i * 1000);
+                    }
+                });
+            }
+        });
+        let a = reg.snapshot();
+        assert_eq!(a.counter(Counter::VttyTxBytes), 8000);
+        let t = a.hist(Hist::Tick);
+        assert_eq!((t.count(), t.sum), (4000, 4 * 999 * 1000 * 1000 / 2));
+        // p50 is 500 us: its bucket tops out at the next power of two
+        assert_eq!(t.percentile(50.0), (1 << 19) - 1);
+        reg.record(Hist::Tick, 5);
+        reg.set(Gauge::VblkQueued, 3);
+        let d = reg.snapshot().since(&a);
+        assert_eq!((d.hist(Hist::Tick).count(), d.hist(Hist::Tick).sum, d.counter(Counter::VttyTxBytes)), (1, 5, 0));
+        assert_eq!(d.gauge(Gauge::VblkQueued), 3);
+    }
+
+    #[test]
+    fn serves_prometheus_text_on_loopback() {
+        let reg: &'static Registry = Box::leak(Box::new(Registry::new()));
+        reg.add(Counter::IoctlErrors, 7);
+        reg.record(Hist::RingBatch, 3);
+        assert!(serve_registry(reg, "0.0.0.0:0").is_err());
+        let addr = serve_registry(reg, "127.0.0.1:0").unwrap();
+        let get = |path: &str| {
+            let mut s = TcpStream::connect(addr).unwrap();
+            s.write_all(format!("GET {path} HTTP/1.1\r\nHost: x\r\n\r\n").as_bytes()).unwrap();
+            let mut r = String::new();
+            s.read_to_string(&mut r).unwrap();
+            r
+        };
+        let r = get("/metrics");
+        assert!(r.starts_with("HTTP/1.1 200 OK"), "{r}");
+        assert!(r.contains("\ncolx_ioctl_errors_total 7\n"));
+        assert!(r.contains("colx_vblk_ring_batch_slots_bucket{le=\"3\"} 1\n"));
+        assert!(r.contains("colx_vblk_ring_batch_slots_count 1\n"));
+        assert!(get("/nope").starts_with("HTTP/1.1 404"));
+    }
+}
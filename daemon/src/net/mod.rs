@@ -0,0 +1,6 @@
+pub mod passthrough;
+pub mod queue;
+pub mod stealth;
+#[cfg(target_os = "linux")]
+pub mod tap;
+pub mod vnet;
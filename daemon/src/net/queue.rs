@@ -0,0 +1,307 @@
+//! Para-net queue: the shared-memory op queue between a guest network
+//! front-end and a host backend (see docs/hypervisor-net.md).
+//!
+//! One region holds a header, a submission ring (guest -> host), a completion
+//! ring (host -> guest) and a pool of fixed-size data buffers. Descriptors
+//! name a buffer by index. The guest owns a buffer again once the op that
+//! carried it completes, so SEND payloads and RECV data move between the
+//! buffer and the host socket without an intermediate copy. Both rings use
+//! the colx_ring_ctrl convention: prod on the first cache line, cons alone
+//! on the second, acquire/release publication.
+
+use anyhow::{bail, Result};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, Ordering};
+
+pub const MAGIC: u32 = 0x3151_4e50; // "PNQ1"
+pub const HDR_LEN: usize = 64;
+const CTRL_LEN: usize = 128;
+const CONS_OFF: usize = 64;
+pub const DESC_LEN: usize = 48;
+pub const MAX_RING_CAP: u32 = 4096;
+pub const MAX_BUF_SIZE: u32 = 1024 * 1024;
+
+/// Open a flow to addr:port; `flags` picks the protocol. Completes once the
+/// host socket is connected (status 0) or failed.
+pub const OP_CONNECT: u16 = 1;
+/// Send `len` bytes of buffer `buf`; completes when they are all written.
+pub const OP_SEND: u16 = 2;
+/// Receive up to `len` bytes into buffer `buf`; completion `len` 0 is EOF.
+pub const OP_RECV: u16 = 3;
+/// Close the flow after its queued sends (CLOSE_WRITE: only shut down sending).
+pub const OP_CLOSE: u16 = 4;
+
+pub const PROTO_TCP: u16 = 0;
+pub const PROTO_UDP: u16 = 1;
+pub const CLOSE_WRITE: u16 = 1;
+
+pub const FAMILY_V4: u16 = 4;
+pub const FAMILY_V6: u16 = 6;
+
+/// One op or its completion. The completion echoes the request with
+/// `status` (0 or a negative Linux errno) and `len` (bytes moved) filled in.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct NetDesc {
+    pub op: u16,
+    pub flags: u16,
+    pub flow: u32,
+    pub buf: u32,
+    pub len: u32,
+    pub status: i32,
+    pub port: u16,
+    pub family: u16,
+    pub addr: [u8; 16],
+    /// Guest cookie, returned unchanged.
+    pub tag: u64,
+}
+
+const _: () = assert!(std::mem::size_of::<NetDesc>() == DESC_LEN);
+
+impl NetDesc {
+    pub fn connect(flow: u32, proto: u16, addr: std::net::SocketAddr) -> Self {
+        let mut d = Self { op: OP_CONNECT, flags: proto, flow, port: addr.port(), ..Self::default() };
+        match addr.ip() {
+            std::net::IpAddr::V4(ip) => {
+                d.family = FAMILY_V4;
+                d.addr[..4].copy_from_slice(&ip.octets());
+            }
+            std::net::IpAddr::V6(ip) => {
+                d.family = FAMILY_V6;
+                d.addr = ip.octets();
+            }
+        }
+        d
+    }
+
+    pub fn sock_addr(&self) -> Option<std::net::SocketAddr> {
+        let ip: std::net::IpAddr = match self.family {
+            FAMILY_V4 => std::net::Ipv4Addr::new(self.addr[0], self.addr[1], self.addr[2], self.addr[3]).into(),
+            FAMILY_V6 => std::net::Ipv6Addr::from(self.addr).into(),
+            _ => return None,
+        };
+        Some((ip, self.port).into())
+    }
+
+    pub fn completed(mut self, status: i32, len: u32) -> Self {
+        self.status = status;
+        self.len = len;
+        self
+    }
+}
+
+/// Ring sizes and buffer pool of a queue region.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct QueueShape {
+    pub sq_cap: u32,
+    pub cq_cap: u32,
+    pub buf_count: u32,
+    pub buf_size: u32,
+}
+
+impl QueueShape {
+    fn check(&self) -> Result<()> {
+        for cap in [self.sq_cap, self.cq_cap] {
+            if !cap.is_power_of_two() || cap > MAX_RING_CAP {
+                bail!("para-net ring capacity {} is not a power of two up to {}", cap, MAX_RING_CAP);
+            }
+        }
+        if self.buf_count == 0 || self.buf_size == 0 || self.buf_size > MAX_BUF_SIZE || self.buf_size % 64 != 0 {
+            bail!("para-net buffers: {} x {} bytes", self.buf_count, self.buf_size);
+        }
+        Ok(())
+    }
+
+    fn sq_off(&self) -> usize {
+        HDR_LEN
+    }
+
+    fn cq_off(&self) -> usize {
+        self.sq_off() + CTRL_LEN + self.sq_cap as usize * DESC_LEN
+    }
+
+    fn buf_off(&self) -> usize {
+        let end = self.cq_off() + CTRL_LEN + self.cq_cap as usize * DESC_LEN;
+        (end + 4095) & !4095
+    }
+
+    /// Bytes of shared memory the queue needs.
+    pub fn region_len(&self) -> usize {
+        self.buf_off() + self.buf_count as usize * self.buf_size as usize
+    }
+}
+
+/// A queue region mapped into this process. Either end may use it: the host
+/// pops requests and pushes completions, a (simulated) guest the reverse.
+/// Each ring has exactly one producer and one consumer.
+pub struct NetQueue {
+    base: NonNull<u8>,
+    shape: QueueShape,
+}
+
+// The region is shared memory; ring indices are atomics and buffers are
+// owned by whichever side holds the op that names them.
+unsafe impl Send for NetQueue {}
+unsafe impl Sync for NetQueue {}
+
+impl NetQueue {
+    /// Lay out an empty queue in `len` bytes at `base` (the host does this
+    /// before the guest starts).
+    ///
+    /// # Safety
+    /// `base..base+len` must be valid, 8-byte aligned and outlive the queue.
+    pub unsafe fn format(base: *mut u8, len: usize, shape: QueueShape) -> Result<Self> {
+        shape.check()?;
+        if len < shape.region_len() {
+            bail!("para-net region of {} bytes needs {}", len, shape.region_len());
+        }
+        let base = NonNull::new(base).ok_or_else(|| anyhow::anyhow!("null para-net region"))?;
+        std::ptr::write_bytes(base.as_ptr(), 0, shape.buf_off());
+        let hdr = [MAGIC, 1, shape.sq_cap, shape.cq_cap, shape.buf_count, shape.buf_size];
+        for (i, v) in hdr.into_iter().enumerate() {
+            (base.as_ptr().add(i * 4) as *mut u32).write(v.to_le());
+        }
+        Ok(Self { base, shape })
+    }
+
+    /// Use a queue another party formatted.
+    ///
+    /// # Safety
+    /// As for `format`.
+    pub unsafe fn attach(base: *mut u8, len: usize) -> Result<Self> {
+        let base = NonNull::new(base).ok_or_else(|| anyhow::anyhow!("null para-net region"))?;
+        if len < HDR_LEN {
+            bail!("para-net region too small");
+        }
+        let word = |i: usize| u32::from_le((base.as_ptr().add(i * 4) as *const u32).read_volatile());
+        if word(0) != MAGIC || word(1) != 1 {
+            bail!("no para-net queue in the region");
+        }
+        let shape = QueueShape { sq_cap: word(2), cq_cap: word(3), buf_count: word(4), buf_size: word(5) };
+        shape.check()?;
+        if len < shape.region_len() {
+            bail!("para-net queue exceeds its {} byte region", len);
+        }
+        Ok(Self { base, shape })
+    }
+
+    pub fn shape(&self) -> QueueShape {
+        self.shape
+    }
+
+    fn index(&self, off: usize) -> &AtomicU32 {
+        unsafe { &*(self.base.as_ptr().add(off) as *const AtomicU32) }
+    }
+
+    fn desc(&self, ring_off: usize, i: u32) -> *mut NetDesc {
+        unsafe { (self.base.as_ptr().add(ring_off + CTRL_LEN) as *mut NetDesc).add(i as usize) }
+    }
+
+    /// Producer side of a ring: as many of `src` as fit, one release store.
+    fn push(&self, ring_off: usize, cap: u32, src: &[NetDesc]) -> usize {
+        let prod = self.index(ring_off).load(Ordering::Relaxed);
+        let cons = self.index(ring_off + CONS_OFF).load(Ordering::Acquire);
+        let n = (cap - prod.wrapping_sub(cons)).min(src.len() as u32);
+        for (i, d) in src[..n as usize].iter().enumerate() {
+            unsafe { self.desc(ring_off, prod.wrapping_add(i as u32) & (cap - 1)).write_volatile(*d) };
+        }
+        self.index(ring_off).store(prod.wrapping_add(n), Ordering::Release);
+        n as usize
+    }
+
+    /// Consumer side: up to `max` descriptors appended to `out`.
+    fn pop(&self, ring_off: usize, cap: u32, out: &mut Vec<NetDesc>, max: usize) -> usize {
+        let cons = self.index(ring_off + CONS_OFF).load(Ordering::Relaxed);
+        let prod = self.index(ring_off).load(Ordering::Acquire);
+        let n = prod.wrapping_sub(cons).min(cap).min(max as u32);
+        for i in 0..n {
+            out.push(unsafe { self.desc(ring_off, cons.wrapping_add(i) & (cap - 1)).read_volatile() });
+        }
+        self.index(ring_off + CONS_OFF).store(cons.wrapping_add(n), Ordering::Release);
+        n as usize
+    }
+
+    /// Host: take up to `max` guest requests.
+    pub fn pop_requests(&self, out: &mut Vec<NetDesc>, max: usize) -> usize {
+        self.pop(self.shape.sq_off(), self.shape.sq_cap, out, max)
+    }
+
+    /// Host: post completions; returns how many fit.
+    pub fn push_completions(&self, src: &[NetDesc]) -> usize {
+        self.push(self.shape.cq_off(), self.shape.cq_cap, src)
+    }
+
+    /// Guest: queue requests; returns how many fit.
+    pub fn submit(&self, src: &[NetDesc]) -> usize {
+        self.push(self.shape.sq_off(), self.shape.sq_cap, src)
+    }
+
+    /// Guest: collect up to `max` completions.
+    pub fn reap(&self, out: &mut Vec<NetDesc>, max: usize) -> usize {
+        self.pop(self.shape.cq_off(), self.shape.cq_cap, out, max)
+    }
+
+    /// Data buffer `idx`, its first `len` bytes, if both are in range.
+    ///
+    /// # Safety
+    /// The caller must own the buffer: it holds the op naming it (host) or
+    /// has no op in flight naming it (guest).
+    #[allow(clippy::mut_from_ref)]
+    pub unsafe fn buf(&self, idx: u32, len: u32) -> Option<&mut [u8]> {
+        if idx >= self.shape.buf_count || len > self.shape.buf_size {
+            return None;
+        }
+        let off = self.shape.buf_off() + idx as usize * self.shape.buf_size as usize;
+        Some(std::slice::from_raw_parts_mut(self.base.as_ptr().add(off), len as usize))
+    }
+}
+
+/// Page-aligned memory for a simulated region (tests, netbench).
+pub struct SimRegion {
+    mem: Vec<u64>,
+}
+
+impl SimRegion {
+    pub fn new(shape: QueueShape) -> (Self, NetQueue) {
+        let mut mem = vec![0u64; shape.region_len() / 8 + 1];
+        let q = unsafe { NetQueue::format(mem.as_mut_ptr() as *mut u8, mem.len() * 8, shape) }.expect("para-net shape");
+        (Self { mem }, q)
+    }
+
+    /// A second view of the same queue, as the other side would attach it.
+    pub fn attach(&mut self) -> NetQueue {
+        unsafe { NetQueue::attach(self.mem.as_mut_ptr() as *mut u8, self.mem.len() * 8) }.expect("formatted region")
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn rings_wrap_and_report_full() {
+        let shape = QueueShape { sq_cap: 4, cq_cap: 4, buf_count: 2, buf_size: 4096 };
+        let (mut region, host) = SimRegion::new(shape);
+        let guest = region.attach();
+        assert_eq!(guest.shape(), shape);
+        let mut out = Vec::new();
+        for round in 0..5u64 {
+            let reqs: Vec<NetDesc> = (0..6).map(|i| NetDesc { op: OP_SEND, tag: round * 10 + i, ..NetDesc::default() }).collect();
+            assert_eq!(guest.submit(&reqs), 4);
+            out.clear();
+            assert_eq!(host.pop_requests(&mut out, 3), 3);
+            assert_eq!(host.pop_requests(&mut out, 8), 1);
+            assert_eq!(out.iter().map(|d| d.tag).collect::<Vec<_>>(), (0..4).map(|i| round * 10 + i).collect::<Vec<_>>());
+            let done: Vec<NetDesc> = out.iter().map(|d| d.completed(0, 1)).collect();
+            assert_eq!(host.push_completions(&done), 4);
+            assert_eq!(host.push_completions(&done), 0);
+            out.clear();
+            assert_eq!(guest.reap(&mut out, 16), 4);
+        }
+        unsafe {
+            guest.buf(1, 4096).unwrap()[4095] = 7;
+            assert_eq!(host.buf(1, 4096).unwrap()[4095], 7);
+            assert!(host.buf(2, 1).is_none() && host.buf(0, 4097).is_none());
+        }
+    }
+}
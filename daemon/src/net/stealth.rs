@@ -1,13 +1,674 @@
-//! Stealth networking backend (skeleton)
-//! Shared host IP via slirp/host-socket proxy. Outbound TCP/UDP only.
+//! Stealth networking backend: the guest shares the host's IP. Its connect /
+//! send / recv / close ops arrive on a para-net queue (`net::queue`) and are
+//! carried out on host sockets by a tokio runtime. This is slirp-like at the
+//! socket layer: outbound TCP and UDP with NAT semantics, and no L2.
+//!
+//! One dispatcher task drains the submission ring in batches and routes each
+//! op to its flow. A flow is one task owning one host socket, with a bounded
+//! op queue per direction. An op that does not fit completes with EAGAIN. A
+//! flow reads its socket only while the guest has a RECV posted, so a slow
+//! guest closes the TCP window instead of growing host buffers. Payloads
+//! move straight between the shared buffers and the socket.
 
-#[allow(dead_code)]
-pub struct StealthNet;
+use super::queue::{NetDesc, NetQueue, CLOSE_WRITE, OP_CLOSE, OP_CONNECT, OP_RECV, OP_SEND, PROTO_TCP, PROTO_UDP};
+use anyhow::{Context, Result};
+use std::collections::HashMap;
+use std::io;
+use std::net::{Ipv4Addr, Ipv6Addr, SocketAddr};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::net::tcp::{OwnedReadHalf, OwnedWriteHalf};
+use tokio::net::{TcpStream, UdpSocket};
+use tokio::sync::mpsc::{self, error::TrySendError};
+use tokio::sync::Notify;
+
+// Linux errno values, negated in completions
+const EIO: i32 = 5;
+const EBADF: i32 = 9;
+const EAGAIN: i32 = 11;
+const EEXIST: i32 = 17;
+const EINVAL: i32 = 22;
+const EMFILE: i32 = 24;
+const EPIPE: i32 = 32;
+const EAFNOSUPPORT: i32 = 97;
+const ENOTCONN: i32 = 107;
+const ETIMEDOUT: i32 = 110;
+const ECANCELED: i32 = 125;
+
+#[derive(Clone, Debug)]
+pub struct StealthCfg {
+    pub max_flows: usize,
+    /// Ops queued per flow and direction before EAGAIN.
+    pub flow_queue: usize,
+    pub connect_timeout: Duration,
+    /// Runtime worker threads.
+    pub workers: usize,
+    /// Requests taken from the ring per pass.
+    pub batch: usize,
+    /// Longest wait between ring polls when the guest does not kick.
+    pub idle_poll: Duration,
+}
+
+impl Default for StealthCfg {
+    fn default() -> Self {
+        Self {
+            max_flows: 16384,
+            flow_queue: 32,
+            connect_timeout: Duration::from_secs(10),
+            workers: 2,
+            batch: 256,
+            idle_poll: Duration::from_millis(1),
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct StealthStats {
+    pub flows_opened: u64,
+    pub flows_active: u64,
+    pub connect_errors: u64,
+    pub bytes_out: u64,
+    pub bytes_in: u64,
+    /// Ops refused with EAGAIN because their flow's queue was full.
+    pub rejected: u64,
+}
+
+#[derive(Default)]
+struct Counters {
+    flows_opened: AtomicU64,
+    flows_active: AtomicU64,
+    connect_errors: AtomicU64,
+    bytes_out: AtomicU64,
+    bytes_in: AtomicU64,
+    rejected: AtomicU64,
+}
+
+struct Shared {
+    queue: NetQueue,
+    cfg: StealthCfg,
+    kick: Notify,
+    stop: AtomicBool,
+    counters: Counters,
+}
+
+impl Shared {
+    /// The buffer an op names; `route` has checked it is in range.
+    #[allow(clippy::mut_from_ref)]
+    fn buf(&self, d: &NetDesc) -> &mut [u8] {
+        // The op carrying the buffer is ours until its completion is posted
+        unsafe { self.queue.buf(d.buf, d.len) }.expect("buffer checked at dispatch")
+    }
+}
+
+type Done = mpsc::UnboundedSender<NetDesc>;
+
+fn complete(done: &Done, d: NetDesc, status: i32, len: usize) {
+    let _ = done.send(d.completed(status, len as u32));
+}
+
+pub struct StealthNet {
+    cfg: StealthCfg,
+}
 
 impl StealthNet {
-    pub fn new() -> Self { Self }
-    pub fn start(&self) {
-        // TODO: implement TCP connect/send/recv proxy; DNS resolver
+    pub fn new(cfg: StealthCfg) -> Self {
+        Self { cfg }
+    }
+
+    /// Serve `queue` until the returned handle is dropped. `notify_guest`
+    /// runs after each batch of completions is posted (the guest interrupt).
+    pub fn start(&self, queue: NetQueue, notify_guest: impl Fn() + Send + Sync + 'static) -> Result<StealthHandle> {
+        let rt = tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(self.cfg.workers.max(1))
+            .thread_name("stealth-net")
+            .enable_io()
+            .enable_time()
+            .build()
+            .context("stealth-net runtime")?;
+        let shared = Arc::new(Shared {
+            queue,
+            cfg: self.cfg.clone(),
+            kick: Notify::new(),
+            stop: AtomicBool::new(false),
+            counters: Counters::default(),
+        });
+        let (done_tx, done_rx) = mpsc::unbounded_channel();
+        rt.spawn(dispatch(shared.clone(), done_tx));
+        rt.spawn(post_completions(shared.clone(), done_rx, Box::new(notify_guest)));
+        tracing::info!(max_flows = self.cfg.max_flows, workers = self.cfg.workers, "Stealth networking started");
+        Ok(StealthHandle { rt: Some(rt), shared })
+    }
+}
+
+/// A running engine; dropping it closes every flow.
+pub struct StealthHandle {
+    rt: Option<tokio::runtime::Runtime>,
+    shared: Arc<Shared>,
+}
+
+impl StealthHandle {
+    /// The guest rang the doorbell: new requests are on the ring.
+    pub fn kick(&self) {
+        self.shared.kick.notify_one();
+    }
+
+    pub fn stats(&self) -> StealthStats {
+        let c = &self.shared.counters;
+        StealthStats {
+            flows_opened: c.flows_opened.load(Ordering::Relaxed),
+            flows_active: c.flows_active.load(Ordering::Relaxed),
+            connect_errors: c.connect_errors.load(Ordering::Relaxed),
+            bytes_out: c.bytes_out.load(Ordering::Relaxed),
+            bytes_in: c.bytes_in.load(Ordering::Relaxed),
+            rejected: c.rejected.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl Drop for StealthHandle {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        self.shared.kick.notify_one();
+        if let Some(rt) = self.rt.take() {
+            rt.shutdown_timeout(Duration::from_millis(200));
+        }
+    }
+}
+
+/// The dispatcher's handle on a flow task: one op queue per direction.
+struct Flow {
+    tx: mpsc::Sender<NetDesc>,
+    rx: mpsc::Sender<NetDesc>,
+}
+
+async fn dispatch(sh: Arc<Shared>, done: Done) {
+    let mut flows: HashMap<u32, Flow> = HashMap::new();
+    let mut batch = Vec::with_capacity(sh.cfg.batch);
+    while !sh.stop.load(Ordering::Relaxed) {
+        batch.clear();
+        if sh.queue.pop_requests(&mut batch, sh.cfg.batch) == 0 {
+            // A kick, or a periodic look for a guest that did not ring
+            let _ = tokio::time::timeout(sh.cfg.idle_poll, sh.kick.notified()).await;
+            continue;
+        }
+        for &d in &batch {
+            route(&sh, &mut flows, d, &done);
+        }
+    }
+}
+
+fn route(sh: &Arc<Shared>, flows: &mut HashMap<u32, Flow>, d: NetDesc, done: &Done) {
+    match d.op {
+        OP_CONNECT => {
+            if flows.contains_key(&d.flow) {
+                return complete(done, d, -EEXIST, 0);
+            }
+            if flows.len() >= sh.cfg.max_flows {
+                return complete(done, d, -EMFILE, 0);
+            }
+            let Some(addr) = d.sock_addr() else { return complete(done, d, -EAFNOSUPPORT, 0) };
+            if d.flags != PROTO_TCP && d.flags != PROTO_UDP {
+                return complete(done, d, -EINVAL, 0);
+            }
+            // Ops may follow in the same batch: they queue until the connect finishes
+            let (tx, tx_ops) = mpsc::channel(sh.cfg.flow_queue);
+            let (rx, rx_ops) = mpsc::channel(sh.cfg.flow_queue);
+            flows.insert(d.flow, Flow { tx, rx });
+            sh.counters.flows_opened.fetch_add(1, Ordering::Relaxed);
+            sh.counters.flows_active.fetch_add(1, Ordering::Relaxed);
+            tokio::spawn(run_flow(sh.clone(), d, addr, tx_ops, rx_ops, done.clone()));
+        }
+        OP_SEND | OP_RECV | OP_CLOSE => {
+            let Some(f) = flows.get(&d.flow) else { return complete(done, d, -EBADF, 0) };
+            if d.op != OP_CLOSE && unsafe { sh.queue.buf(d.buf, d.len) }.is_none() {
+                return complete(done, d, -EINVAL, 0);
+            }
+            let full_close = d.op == OP_CLOSE && d.flags & CLOSE_WRITE == 0;
+            let q = if d.op == OP_RECV { &f.rx } else { &f.tx };
+            match q.try_send(d) {
+                Ok(()) => {
+                    if full_close {
+                        // The id is free for reuse; the task finishes the close
+                        flows.remove(&d.flow);
+                    }
+                }
+                Err(TrySendError::Full(d)) => {
+                    sh.counters.rejected.fetch_add(1, Ordering::Relaxed);
+                    complete(done, d, -EAGAIN, 0);
+                }
+                // The flow task has ended: only its close is still meaningful
+                Err(TrySendError::Closed(d)) => {
+                    if full_close {
+                        flows.remove(&d.flow);
+                        complete(done, d, 0, 0);
+                    } else {
+                        complete(done, d, -ENOTCONN, 0);
+                    }
+                }
+            }
+        }
+        _ => complete(done, d, -EINVAL, 0),
+    }
+}
+
+/// Move completions to the guest's ring in batches, holding them while the
+/// ring is full.
+async fn post_completions(sh: Arc<Shared>, mut done: mpsc::UnboundedReceiver<NetDesc>, notify_guest: Box<dyn Fn() + Send + Sync>) {
+    let mut pending = Vec::with_capacity(sh.cfg.batch);
+    loop {
+        if pending.is_empty() && done.recv_many(&mut pending, sh.cfg.batch).await == 0 {
+            return;
+        }
+        let n = sh.queue.push_completions(&pending);
+        if n != 0 {
+            pending.drain(..n);
+            notify_guest();
+        }
+        if !pending.is_empty() {
+            tokio::time::sleep(Duration::from_micros(100)).await;
+        }
+    }
+}
+
+enum Tx {
+    Tcp(OwnedWriteHalf),
+    Udp(Arc<UdpSocket>),
+    /// After CLOSE_WRITE.
+    Shut,
+}
+
+enum Rx {
+    Tcp(OwnedReadHalf),
+    Udp(Arc<UdpSocket>),
+}
+
+impl Tx {
+    async fn send_all(&self, mut b: &[u8]) -> io::Result<()> {
+        match self {
+            Tx::Tcp(w) => {
+                while !b.is_empty() {
+                    w.writable().await?;
+                    match w.try_write(b) {
+                        Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+                        Ok(n) => b = &b[n..],
+                        Err(e) if e.kind() == io::ErrorKind::WouldBlock => {}
+                        Err(e) => return Err(e),
+                    }
+                }
+                Ok(())
+            }
+            Tx::Udp(s) => s.send(b).await.map(|_| ()),
+            Tx::Shut => Err(io::ErrorKind::BrokenPipe.into()),
+        }
+    }
+}
+
+impl Rx {
+    /// One read: TCP bytes (0 at EOF) or one datagram, truncated to `b`.
+    async fn recv(&self, b: &mut [u8]) -> io::Result<usize> {
+        match self {
+            Rx::Tcp(r) => loop {
+                r.readable().await?;
+                match r.try_read(b) {
+                    Err(e) if e.kind() == io::ErrorKind::WouldBlock => {}
+                    res => return res,
+                }
+            },
+            Rx::Udp(s) => s.recv(b).await,
+        }
+    }
+}
+
+async fn open(proto: u16, addr: SocketAddr) -> io::Result<(Tx, Rx)> {
+    if proto == PROTO_UDP {
+        let any: SocketAddr = if addr.is_ipv4() { (Ipv4Addr::UNSPECIFIED, 0).into() } else { (Ipv6Addr::UNSPECIFIED, 0).into() };
+        let s = Arc::new(UdpSocket::bind(any).await?);
+        s.connect(addr).await?;
+        return Ok((Tx::Udp(s.clone()), Rx::Udp(s)));
+    }
+    let s = TcpStream::connect(addr).await?;
+    // Guest TCP already batches; don't delay its small writes again
+    s.set_nodelay(true)?;
+    let (r, w) = s.into_split();
+    Ok((Tx::Tcp(w), Rx::Tcp(r)))
+}
+
+/// Linux errno (negated) for a host socket error.
+fn errno(e: &io::Error) -> i32 {
+    #[cfg(unix)]
+    if let Some(n) = e.raw_os_error() {
+        return -n;
+    }
+    use io::ErrorKind::*;
+    -match e.kind() {
+        PermissionDenied => 13,
+        BrokenPipe => EPIPE,
+        AddrInUse => 98,
+        AddrNotAvailable => 99,
+        ConnectionAborted => 103,
+        ConnectionReset => 104,
+        NotConnected => ENOTCONN,
+        TimedOut => ETIMEDOUT,
+        ConnectionRefused => 111,
+        _ => EIO,
+    }
+}
+
+async fn run_flow(sh: Arc<Shared>, conn: NetDesc, addr: SocketAddr, mut tx_ops: mpsc::Receiver<NetDesc>, mut rx_ops: mpsc::Receiver<NetDesc>, done: Done) {
+    let opened = match tokio::time::timeout(sh.cfg.connect_timeout, open(conn.flags, addr)).await {
+        Ok(Ok(halves)) => Ok(halves),
+        Ok(Err(e)) => Err(errno(&e)),
+        Err(_) => Err(-ETIMEDOUT),
+    };
+    let close = match opened {
+        Ok((tx, rx)) => {
+            complete(&done, conn, 0, 0);
+            let closed = Notify::new();
+            let (close, ()) = tokio::join!(write_loop(&sh, tx, &mut tx_ops, &closed, &done), read_loop(&sh, rx, &mut rx_ops, &closed, &done));
+            close
+        }
+        Err(status) => {
+            sh.counters.connect_errors.fetch_add(1, Ordering::Relaxed);
+            complete(&done, conn, status, 0);
+            fail_queued(&mut tx_ops, &mut rx_ops, status, &done).await
+        }
+    };
+    sh.counters.flows_active.fetch_sub(1, Ordering::Relaxed);
+    // Posted last, so every buffer of the flow is back with the guest first
+    if let Some(d) = close {
+        complete(&done, d, 0, 0);
+    }
+}
+
+/// Sends and closes, in guest order. Returns the full CLOSE, if one came.
+async fn write_loop(sh: &Shared, mut tx: Tx, ops: &mut mpsc::Receiver<NetDesc>, closed: &Notify, done: &Done) -> Option<NetDesc> {
+    while let Some(d) = ops.recv().await {
+        if d.op == OP_CLOSE {
+            if d.flags & CLOSE_WRITE == 0 {
+                closed.notify_one();
+                return Some(d);
+            }
+            // Dropping the write half sends FIN; reads go on
+            tx = Tx::Shut;
+            complete(done, d, 0, 0);
+            continue;
+        }
+        match tx.send_all(sh.buf(&d)).await {
+            Ok(()) => {
+                sh.counters.bytes_out.fetch_add(d.len as u64, Ordering::Relaxed);
+                complete(done, d, 0, d.len as usize);
+            }
+            Err(e) => complete(done, d, errno(&e), 0),
+        }
     }
+    closed.notify_one();
+    None
 }
 
+/// Receives, one posted buffer at a time; the socket is not read otherwise.
+async fn read_loop(sh: &Shared, rx: Rx, ops: &mut mpsc::Receiver<NetDesc>, closed: &Notify, done: &Done) {
+    loop {
+        let d = tokio::select! {
+            d = ops.recv() => match d {
+                Some(d) => d,
+                None => return,
+            },
+            _ = closed.notified() => break,
+        };
+        tokio::select! {
+            r = rx.recv(sh.buf(&d)) => match r {
+                Ok(n) => {
+                    sh.counters.bytes_in.fetch_add(n as u64, Ordering::Relaxed);
+                    complete(done, d, 0, n);
+                }
+                Err(e) => complete(done, d, errno(&e), 0),
+            },
+            _ = closed.notified() => {
+                complete(done, d, -ECANCELED, 0);
+                break;
+            }
+        }
+    }
+    // Closed under posted receives: hand their buffers back
+    ops.close();
+    while let Ok(d) = ops.try_recv() {
+        complete(done, d, -ECANCELED, 0);
+    }
+}
+
+/// A flow that never connected: fail what the guest queued behind the
+/// connect until it closes the flow.
+async fn fail_queued(tx_ops: &mut mpsc::Receiver<NetDesc>, rx_ops: &mut mpsc::Receiver<NetDesc>, status: i32, done: &Done) -> Option<NetDesc> {
+    loop {
+        let d = tokio::select! {
+            Some(d) = tx_ops.recv() => d,
+            Some(d) = rx_ops.recv() => d,
+            else => return None,
+        };
+        if d.op == OP_CLOSE && d.flags & CLOSE_WRITE == 0 {
+            rx_ops.close();
+            while let Ok(d) = rx_ops.try_recv() {
+                complete(done, d, status, 0);
+            }
+            return Some(d);
+        }
+        complete(done, d, status, 0);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::queue::{QueueShape, SimRegion};
+    use super::*;
+    use std::io::{Read, Write};
+    use std::time::Instant;
+
+    const BUF: u32 = 16 * 1024;
+
+    /// A simulated guest: its view of the queue and the engine serving it.
+    struct Guest {
+        q: NetQueue,
+        net: StealthHandle,
+        stash: HashMap<u64, NetDesc>,
+        _region: SimRegion,
+    }
+
+    impl Guest {
+        fn new(cfg: StealthCfg) -> Self {
+            let shape = QueueShape { sq_cap: 256, cq_cap: 256, buf_count: 128, buf_size: BUF };
+            let (mut region, host) = SimRegion::new(shape);
+            let q = region.attach();
+            let net = StealthNet::new(cfg).start(host, || {}).unwrap();
+            Self { q, net, stash: HashMap::new(), _region: region }
+        }
+
+        fn submit(&self, d: &[NetDesc]) {
+            assert_eq!(self.q.submit(d), d.len());
+            self.net.kick();
+        }
+
+        /// The completion tagged `tag`, within 5 s.
+        fn wait(&mut self, tag: u64) -> NetDesc {
+            let deadline = Instant::now() + Duration::from_secs(5);
+            let mut out = Vec::new();
+            loop {
+                if let Some(d) = self.stash.remove(&tag) {
+                    return d;
+                }
+                assert!(Instant::now() < deadline, "no completion for tag {tag}");
+                out.clear();
+                if self.q.reap(&mut out, 256) == 0 {
+                    std::thread::sleep(Duration::from_micros(100));
+                }
+                self.stash.extend(out.iter().map(|d| (d.tag, *d)));
+            }
+        }
+
+        fn put(&self, buf: u32, data: &[u8]) {
+            unsafe { self.q.buf(buf, data.len() as u32) }.unwrap().copy_from_slice(data);
+        }
+
+        fn get(&self, d: &NetDesc) -> Vec<u8> {
+            unsafe { self.q.buf(d.buf, d.len) }.unwrap().to_vec()
+        }
+    }
+
+    fn op(op: u16, flow: u32, buf: u32, len: u32, tag: u64) -> NetDesc {
+        NetDesc { op, flow, buf, len, tag, ..NetDesc::default() }
+    }
+
+    fn close(flow: u32, flags: u16, tag: u64) -> NetDesc {
+        NetDesc { flags, ..op(OP_CLOSE, flow, 0, 0, tag) }
+    }
+
+    fn connect(flow: u32, proto: u16, addr: SocketAddr, tag: u64) -> NetDesc {
+        NetDesc { tag, ..NetDesc::connect(flow, proto, addr) }
+    }
+
+    /// Echoes each connection until the client shuts down sending.
+    fn echo_server() -> SocketAddr {
+        let l = std::net::TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = l.local_addr().unwrap();
+        std::thread::spawn(move || {
+            for s in l.incoming() {
+                let Ok(mut s) = s else { continue };
+                std::thread::spawn(move || {
+                    let mut b = [0u8; 4096];
+                    while let Ok(n @ 1..) = s.read(&mut b) {
+                        if s.write_all(&b[..n]).is_err() {
+                            break;
+                        }
+                    }
+                });
+            }
+        });
+        addr
+    }
+
+    #[test]
+    fn tcp_flow_round_trip() {
+        let addr = echo_server();
+        let mut g = Guest::new(StealthCfg::default());
+        let msg: Vec<u8> = (0..10_000u32).map(|i| (i * 7) as u8).collect();
+        g.put(0, &msg);
+        // Pipelined behind the connect, in one batch
+        g.submit(&[connect(7, PROTO_TCP, addr, 1), op(OP_SEND, 7, 0, msg.len() as u32, 2), op(OP_RECV, 7, 1, BUF, 3)]);
+        assert_eq!(g.wait(1).status, 0);
+        let sent = g.wait(2);
+        assert_eq!((sent.status, sent.len), (0, msg.len() as u32));
+        let mut got = Vec::new();
+        let mut tag = 3;
+        while got.len() < msg.len() {
+            let d = g.wait(tag);
+            assert!(d.status == 0 && d.len > 0);
+            got.extend(g.get(&d));
+            tag += 1;
+            g.submit(&[op(OP_RECV, 7, 1, BUF, tag)]);
+        }
+        assert_eq!(got, msg);
+
+        // Half close: the server sees EOF and hangs up, so the posted RECV reads EOF
+        g.submit(&[close(7, CLOSE_WRITE, 100)]);
+        assert_eq!(g.wait(100).status, 0);
+        let eof = g.wait(tag);
+        assert_eq!((eof.status, eof.len), (0, 0));
+        g.submit(&[op(OP_SEND, 7, 0, 1, 101), close(7, 0, 102)]);
+        assert_eq!(g.wait(101).status, -EPIPE);
+        assert_eq!(g.wait(102).status, 0);
+        let s = g.net.stats();
+        assert_eq!((s.flows_opened, s.flows_active), (1, 0));
+        assert_eq!((s.bytes_out, s.bytes_in), (msg.len() as u64, msg.len() as u64));
+    }
+
+    #[test]
+    fn many_short_connections() {
+        let addr = echo_server();
+        let mut g = Guest::new(StealthCfg::default());
+        let (total, window) = (1000u32, 64u32);
+        let mut next = 0;
+        let mut closed = 0;
+        while closed < total {
+            while next < total && next - closed < window {
+                g.submit(&[connect(next, PROTO_TCP, addr, next as u64 * 2), close(next, 0, next as u64 * 2 + 1)]);
+                next += 1;
+            }
+            assert_eq!(g.wait(closed as u64 * 2).status, 0);
+            assert_eq!(g.wait(closed as u64 * 2 + 1).status, 0);
+            closed += 1;
+        }
+        let s = g.net.stats();
+        assert_eq!((s.flows_opened, s.connect_errors), (total as u64, 0));
+        let deadline = Instant::now() + Duration::from_secs(5);
+        while g.net.stats().flows_active != 0 {
+            assert!(Instant::now() < deadline);
+            std::thread::sleep(Duration::from_millis(1));
+        }
+    }
+
+    #[test]
+    fn udp_datagrams() {
+        let srv = std::net::UdpSocket::bind("127.0.0.1:0").unwrap();
+        let addr = srv.local_addr().unwrap();
+        std::thread::spawn(move || {
+            let mut b = [0u8; 2048];
+            while let Ok((n, from)) = srv.recv_from(&mut b) {
+                let _ = srv.send_to(&b[..n], from);
+            }
+        });
+        let mut g = Guest::new(StealthCfg::default());
+        g.put(0, b"ping");
+        g.submit(&[connect(3, PROTO_UDP, addr, 1), op(OP_RECV, 3, 1, BUF, 2), op(OP_SEND, 3, 0, 4, 3)]);
+        assert_eq!(g.wait(1).status, 0);
+        assert_eq!(g.wait(3).status, 0);
+        let d = g.wait(2);
+        assert_eq!((d.status, g.get(&d)), (0, b"ping".to_vec()));
+        g.submit(&[close(3, 0, 4)]);
+        assert_eq!(g.wait(4).status, 0);
+    }
+
+    #[test]
+    fn full_flow_queue_is_eagain() {
+        // Accepts and stays silent, so receives stay posted
+        let l = std::net::TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = l.local_addr().unwrap();
+        std::thread::spawn(move || {
+            let _held: Vec<_> = l.incoming().take(1).collect();
+            std::thread::sleep(Duration::from_secs(10));
+        });
+        let mut g = Guest::new(StealthCfg { flow_queue: 2, ..StealthCfg::default() });
+        g.submit(&[connect(1, PROTO_TCP, addr, 1)]);
+        assert_eq!(g.wait(1).status, 0);
+        // One RECV is in flight on the socket, two queue, the rest bounce
+        let recvs: Vec<NetDesc> = (0..6).map(|i| op(OP_RECV, 1, i, BUF, 10 + i as u64)).collect();
+        g.submit(&recvs[..1]);
+        std::thread::sleep(Duration::from_millis(50));
+        g.submit(&recvs[1..]);
+        for tag in 13..16 {
+            assert_eq!(g.wait(tag).status, -EAGAIN);
+        }
+        assert_eq!(g.net.stats().rejected, 3);
+        g.submit(&[close(1, 0, 20)]);
+        for tag in 10..13 {
+            assert_eq!(g.wait(tag).status, -ECANCELED);
+        }
+        assert_eq!(g.wait(20).status, 0);
+        // The id is free again; ops on a closed flow are refused
+        g.submit(&[op(OP_SEND, 1, 0, 1, 21)]);
+        assert_eq!(g.wait(21).status, -EBADF);
+    }
+
+    #[test]
+    fn refused_connect_fails_queued_ops() {
+        let addr = {
+            let l = std::net::TcpListener::bind("127.0.0.1:0").unwrap();
+            l.local_addr().unwrap()
+        };
+        let mut g = Guest::new(StealthCfg::default());
+        g.submit(&[connect(9, PROTO_TCP, addr, 1), op(OP_SEND, 9, 0, 8, 2), close(9, 0, 3)]);
+        assert_eq!(g.wait(1).status, -111);
+        assert_eq!(g.wait(2).status, -111);
+        assert_eq!(g.wait(3).status, 0);
+        assert_eq!(g.net.stats().connect_errors, 1);
+    }
+}
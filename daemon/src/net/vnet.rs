@@ -0,0 +1,481 @@
+//! Virtual NIC packet rings (colx_vnet_* in colinux_ring.h), host side.
+//!
+//! The guest posts buffers of packed frames on TX and empty buffers on FILL.
+//! The host hands TX buffers back on TXC and returns FILL buffers, packed
+//! with received frames, on RX. Each pass moves every pending descriptor of
+//! a ring and publishes the result with one index store, so a burst of
+//! frames costs one notification rather than one per frame. Frames carry
+//! virtio-net offload metadata (`PktMeta`) that ports take as is: a GSO frame
+//! crosses the ring once, up to a buffer in size, and the host stack cuts it
+//! into segments on the way to the wire.
+
+use crate::device::MapInfo;
+use crate::geom::{Geometry, VNET_DESC_LEN, VNET_RINGS};
+use anyhow::{bail, Result};
+use parking_lot::{Condvar, Mutex};
+use std::collections::VecDeque;
+use std::io;
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+pub const RING_TX: usize = 0;
+pub const RING_TXC: usize = 1;
+pub const RING_FILL: usize = 2;
+pub const RING_RX: usize = 3;
+
+/// colx_vnet_cfg host_features / guest_features
+pub const F_CSUM: u32 = 0x1;
+pub const F_GSO_TCPV4: u32 = 0x2;
+pub const F_GSO_TCPV6: u32 = 0x4;
+pub const F_GSO_UDP_L4: u32 = 0x8;
+
+/// colx_vnet_pkt flags and gso_type (the VIRTIO_NET_HDR_* values)
+pub const PKT_NEEDS_CSUM: u8 = 0x1;
+pub const PKT_DATA_VALID: u8 = 0x2;
+pub const GSO_NONE: u8 = 0;
+pub const GSO_TCPV4: u8 = 1;
+pub const GSO_TCPV6: u8 = 4;
+pub const GSO_UDP_L4: u8 = 5;
+
+/// struct colx_vnet_pkt; frames follow it and are padded to 8 bytes.
+pub const PKT_HDR_LEN: usize = 16;
+const PKT_ALIGN: usize = 8;
+/// colx_vnet_cfg fields
+const CFG_HOST_FEATURES: usize = 0;
+const CFG_GUEST_FEATURES: usize = 4;
+const CFG_MAC: usize = 8;
+const CFG_MTU: usize = 14;
+
+/// Offload state of one frame: the fields of struct virtio_net_hdr.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct PktMeta {
+    pub flags: u8,
+    pub gso_type: u8,
+    pub hdr_len: u16,
+    pub gso_size: u16,
+    pub csum_start: u16,
+    pub csum_offset: u16,
+}
+
+impl PktMeta {
+    /// The struct virtio_net_hdr a TAP device with IFF_VNET_HDR exchanges;
+    /// bytes 4..14 of colx_vnet_pkt.
+    pub fn to_virtio(&self) -> [u8; 10] {
+        let mut b = [0u8; 10];
+        b[0] = self.flags;
+        b[1] = self.gso_type;
+        for (i, v) in [self.hdr_len, self.gso_size, self.csum_start, self.csum_offset].into_iter().enumerate() {
+            b[2 + i * 2..4 + i * 2].copy_from_slice(&v.to_le_bytes());
+        }
+        b
+    }
+
+    pub fn from_virtio(b: &[u8]) -> Self {
+        let u16_at = |o: usize| u16::from_le_bytes([b[o], b[o + 1]]);
+        Self { flags: b[0], gso_type: b[1], hdr_len: u16_at(2), gso_size: u16_at(4), csum_start: u16_at(6), csum_offset: u16_at(8) }
+    }
+
+    /// Offloads (F_*) a receiver must accept to take the frame as is.
+    pub fn needs(&self) -> u32 {
+        let csum = if self.flags & PKT_NEEDS_CSUM != 0 { F_CSUM } else { 0 };
+        csum | match self.gso_type {
+            GSO_TCPV4 => F_GSO_TCPV4,
+            GSO_TCPV6 => F_GSO_TCPV6,
+            GSO_UDP_L4 => F_GSO_UDP_L4,
+            _ => 0,
+        }
+    }
+}
+
+/// Finish a partial checksum in software, for a receiver without F_CSUM:
+/// the one's complement sum from csum_start to the end, stored at
+/// csum_start + csum_offset (which holds the pseudo-header sum). False if
+/// the offsets do not fit the frame.
+pub fn complete_csum(meta: &mut PktMeta, frame: &mut [u8]) -> bool {
+    let start = meta.csum_start as usize;
+    let at = start + meta.csum_offset as usize;
+    if at + 2 > frame.len() {
+        return false;
+    }
+    let mut sum: u64 = 0;
+    let mut words = frame[start..].chunks_exact(2);
+    for w in &mut words {
+        sum += u16::from_be_bytes([w[0], w[1]]) as u64;
+    }
+    if let [last] = words.remainder() {
+        sum += (*last as u64) << 8;
+    }
+    while sum >> 16 != 0 {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    frame[at..at + 2].copy_from_slice(&(!(sum as u16)).to_be_bytes());
+    meta.flags = (meta.flags & !PKT_NEEDS_CSUM) | PKT_DATA_VALID;
+    true
+}
+
+/// struct colx_vnet_desc
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Desc {
+    pub buf: u32,
+    pub len: u32,
+    pub count: u16,
+    pub _rsvd0: u16,
+    pub _rsvd1: u32,
+}
+
+const _: () = assert!(std::mem::size_of::<Desc>() == VNET_DESC_LEN);
+
+/// The frames packed in a buffer, in order. Stops at the first header that
+/// does not fit `len`, which `malformed` then reports.
+pub struct Frames<'a> {
+    buf: &'a [u8],
+    pos: usize,
+    left: u16,
+    pub malformed: bool,
+}
+
+impl<'a> Frames<'a> {
+    pub fn new(buf: &'a [u8], count: u16) -> Self {
+        Self { buf, pos: 0, left: count, malformed: false }
+    }
+}
+
+impl<'a> Iterator for Frames<'a> {
+    type Item = (PktMeta, &'a [u8]);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.left == 0 || self.malformed {
+            return None;
+        }
+        let hdr = self.buf.get(self.pos..self.pos + PKT_HDR_LEN);
+        let len = hdr.map(|h| u32::from_le_bytes(h[..4].try_into().unwrap()) as usize);
+        let body = self.pos + PKT_HDR_LEN;
+        let (Some(hdr), Some(frame)) = (hdr, len.and_then(|n| self.buf.get(body..body.checked_add(n)?))) else {
+            self.malformed = true;
+            return None;
+        };
+        self.left -= 1;
+        self.pos = align(body + frame.len());
+        Some((PktMeta::from_virtio(&hdr[4..14]), frame))
+    }
+}
+
+fn align(n: usize) -> usize {
+    (n + PKT_ALIGN - 1) & !(PKT_ALIGN - 1)
+}
+
+/// Packs frames into one buffer. `reserve` hands out the space after the
+/// next header so a port can receive straight into it.
+pub struct Packer<'a> {
+    buf: &'a mut [u8],
+    len: usize,
+    count: u16,
+}
+
+impl<'a> Packer<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        Self { buf, len: 0, count: 0 }
+    }
+
+    /// Room for a frame of up to `max` bytes, or None if the buffer cannot
+    /// take one that large.
+    pub fn reserve(&mut self, max: usize) -> Option<&mut [u8]> {
+        let body = self.len + PKT_HDR_LEN;
+        if self.count == u16::MAX || body + max > self.buf.len() {
+            return None;
+        }
+        Some(&mut self.buf[body..body + max])
+    }
+
+    /// Account the `n` bytes received into the last `reserve`.
+    pub fn commit(&mut self, meta: &PktMeta, n: usize) {
+        let hdr = &mut self.buf[self.len..self.len + PKT_HDR_LEN];
+        hdr[..4].copy_from_slice(&(n as u32).to_le_bytes());
+        hdr[4..14].copy_from_slice(&meta.to_virtio());
+        hdr[14..].fill(0);
+        self.len = align(self.len + PKT_HDR_LEN + n).min(self.buf.len());
+        self.count += 1;
+    }
+
+    pub fn push(&mut self, meta: &PktMeta, frame: &[u8]) -> bool {
+        match self.reserve(frame.len()) {
+            Some(dst) => {
+                dst.copy_from_slice(frame);
+                self.commit(meta, frame.len());
+                true
+            }
+            None => false,
+        }
+    }
+
+    pub fn count(&self) -> u16 {
+        self.count
+    }
+
+    /// The descriptor publishing this buffer as pool entry `buf`.
+    pub fn desc(&self, buf: u32) -> Desc {
+        Desc { buf, len: self.len as u32, count: self.count, ..Desc::default() }
+    }
+}
+
+/// The NIC's rings and pool inside the shared mapping.
+pub struct VnetRings {
+    base: NonNull<u8>,
+    cfg_off: usize,
+    ring_off: [usize; VNET_RINGS],
+    cons_off: [usize; VNET_RINGS],
+    slots_off: [usize; VNET_RINGS],
+    cap: usize,
+    pool_off: usize,
+    buf_count: usize,
+    buf_size: usize,
+}
+
+// The mapping outlives the daemon's use of it; each ring index has one writer
+unsafe impl Send for VnetRings {}
+
+impl VnetRings {
+    pub fn new(map: MapInfo, geom: &Geometry) -> Result<Self> {
+        if geom.vnet_ring_cap == 0 {
+            bail!("shared map has no NIC rings");
+        }
+        if (map.size as usize) < geom.vnet_pool_off + geom.vnet_buf_count * geom.vnet_buf_size {
+            bail!("shared map too small for the NIC pool");
+        }
+        let base = NonNull::new(map.user_base as *mut u8).ok_or_else(|| anyhow::anyhow!("null map base"))?;
+        Ok(Self {
+            base,
+            cfg_off: geom.vnet_off,
+            ring_off: std::array::from_fn(|r| geom.vnet_ring_off(r)),
+            cons_off: std::array::from_fn(|r| geom.vnet_cons_off(r)),
+            slots_off: std::array::from_fn(|r| geom.vnet_slots_off(r)),
+            cap: geom.vnet_ring_cap,
+            pool_off: geom.vnet_pool_off,
+            buf_count: geom.vnet_buf_count,
+            buf_size: geom.vnet_buf_size,
+        })
+    }
+
+    pub fn buf_count(&self) -> usize {
+        self.buf_count
+    }
+
+    pub fn buf_size(&self) -> usize {
+        self.buf_size
+    }
+
+    fn word(&self, off: usize) -> &AtomicU32 {
+        unsafe { &*(self.base.as_ptr().add(off) as *const AtomicU32) }
+    }
+
+    /// Publish the NIC to the guest: its address and MTU, and the offloads
+    /// the host takes on TX. The MTU goes last; nonzero means attached.
+    pub fn attach(&self, mac: [u8; 6], mtu: u16, host_features: u32) {
+        unsafe {
+            let cfg = self.base.as_ptr().add(self.cfg_off);
+            std::ptr::copy_nonoverlapping(mac.as_ptr(), cfg.add(CFG_MAC), 6);
+        }
+        self.word(self.cfg_off + CFG_HOST_FEATURES).store(host_features, Ordering::Relaxed);
+        // mtu shares a word with the last two MAC bytes
+        let tail = u32::from_le_bytes([mac[4], mac[5], 0, 0]) | (mtu as u32) << 16;
+        self.word(self.cfg_off + CFG_MAC + 4).store(tail, Ordering::Release);
+    }
+
+    /// Offloads the guest takes on RX (0 until its driver says otherwise).
+    pub fn guest_features(&self) -> u32 {
+        self.word(self.cfg_off + CFG_GUEST_FEATURES).load(Ordering::Acquire)
+    }
+
+    pub fn mtu(&self) -> u16 {
+        (self.word(self.cfg_off + CFG_MTU - 2).load(Ordering::Acquire) >> 16) as u16
+    }
+
+    /// Take every descriptor the guest published on TX or FILL, retiring
+    /// them with one store of cons. Returns the number taken.
+    pub fn pop(&self, ring: usize, out: &mut Vec<Desc>) -> usize {
+        debug_assert!(ring == RING_TX || ring == RING_FILL);
+        let cons = self.word(self.cons_off[ring]).load(Ordering::Relaxed);
+        // Pairs with the guest's release store of prod: slots (and TX frames) below it are filled
+        let prod = self.word(self.ring_off[ring]).load(Ordering::Acquire);
+        let n = prod.wrapping_sub(cons) as usize;
+        if n == 0 || n > self.cap {
+            return 0;
+        }
+        let slots = unsafe { self.base.as_ptr().add(self.slots_off[ring]) as *const Desc };
+        out.extend((0..n).map(|i| unsafe { std::ptr::read_volatile(slots.add((cons as usize + i) % self.cap)) }));
+        self.word(self.cons_off[ring]).store(prod, Ordering::Release);
+        n
+    }
+
+    /// Publish descriptors on TXC or RX with one store of prod. Returns how
+    /// many fit; rings hold the whole pool, so only a guest that lost count
+    /// of its buffers can see fewer.
+    pub fn push(&self, ring: usize, src: &[Desc]) -> usize {
+        debug_assert!(ring == RING_TXC || ring == RING_RX);
+        let prod = self.word(self.ring_off[ring]).load(Ordering::Relaxed);
+        let cons = self.word(self.cons_off[ring]).load(Ordering::Acquire);
+        let n = src.len().min(self.cap.saturating_sub(prod.wrapping_sub(cons) as usize));
+        let slots = unsafe { self.base.as_ptr().add(self.slots_off[ring]) as *mut Desc };
+        for (i, d) in src[..n].iter().enumerate() {
+            unsafe { std::ptr::write_volatile(slots.add((prod as usize + i) % self.cap), *d) };
+        }
+        if n != 0 {
+            self.word(self.ring_off[ring]).store(prod.wrapping_add(n as u32), Ordering::Release);
+        }
+        n
+    }
+
+    /// Pool buffer `idx`, or None if the index is out of range.
+    ///
+    /// # Safety
+    /// The host must own the buffer: taken from TX or FILL and not yet
+    /// returned, and not otherwise borrowed.
+    #[allow(clippy::mut_from_ref)]
+    pub unsafe fn buf(&self, idx: u32) -> Option<&mut [u8]> {
+        let idx = idx as usize;
+        (idx < self.buf_count).then(|| std::slice::from_raw_parts_mut(self.base.as_ptr().add(self.pool_off + idx * self.buf_size), self.buf_size))
+    }
+}
+
+/// A host L2 endpoint the NIC is bridged to: a TAP device, or a stand-in.
+pub trait PacketPort: Send {
+    /// Offloads (F_*) `send` accepts; frames needing others are not offered.
+    fn offloads(&self) -> u32;
+    /// Only receive frames needing the offloads in `features`.
+    fn set_rx_offloads(&mut self, features: u32) -> io::Result<()>;
+    /// Largest frame `recv` returns, GSO frames included.
+    fn max_frame(&self) -> usize;
+    fn send(&mut self, meta: &PktMeta, frame: &[u8]) -> io::Result<()>;
+    /// One frame into `buf`; Ok(None) when nothing is waiting.
+    fn recv(&mut self, buf: &mut [u8]) -> io::Result<Option<(PktMeta, usize)>>;
+    /// Block until a frame may be waiting or `timeout` passes.
+    fn wait(&mut self, timeout: Duration);
+}
+
+#[derive(Default)]
+struct Wire {
+    frames: Mutex<VecDeque<(PktMeta, Vec<u8>)>>,
+    ready: Condvar,
+}
+
+/// In-process stand-in for a TAP device: what one end sends, the other
+/// receives, offload metadata included.
+pub struct PairPort {
+    out: Arc<Wire>,
+    inp: Arc<Wire>,
+    offloads: u32,
+    rx_offloads: u32,
+    max_frame: usize,
+}
+
+impl PairPort {
+    /// Two connected ends accepting `offloads`, carrying frames of up to
+    /// `max_frame` bytes.
+    pub fn pair(offloads: u32, max_frame: usize) -> (Self, Self) {
+        let (a, b) = (Arc::new(Wire::default()), Arc::new(Wire::default()));
+        let end = |out: &Arc<Wire>, inp: &Arc<Wire>| Self { out: out.clone(), inp: inp.clone(), offloads, rx_offloads: offloads, max_frame };
+        (end(&a, &b), end(&b, &a))
+    }
+}
+
+impl PacketPort for PairPort {
+    fn offloads(&self) -> u32 {
+        self.offloads
+    }
+
+    fn set_rx_offloads(&mut self, features: u32) -> io::Result<()> {
+        self.rx_offloads = features;
+        Ok(())
+    }
+
+    fn max_frame(&self) -> usize {
+        self.max_frame
+    }
+
+    fn send(&mut self, meta: &PktMeta, frame: &[u8]) -> io::Result<()> {
+        if frame.len() > self.max_frame {
+            return Err(io::ErrorKind::InvalidInput.into());
+        }
+        self.out.frames.lock().push_back((*meta, frame.to_vec()));
+        self.out.ready.notify_one();
+        Ok(())
+    }
+
+    fn recv(&mut self, buf: &mut [u8]) -> io::Result<Option<(PktMeta, usize)>> {
+        let mut q = self.inp.frames.lock();
+        let Some((meta, frame)) = q.front() else { return Ok(None) };
+        if frame.len() > buf.len() {
+            return Err(io::ErrorKind::InvalidInput.into());
+        }
+        let (meta, n) = (*meta, frame.len());
+        buf[..n].copy_from_slice(frame);
+        q.pop_front();
+        Ok(Some((meta, n)))
+    }
+
+    fn wait(&mut self, timeout: Duration) {
+        let mut q = self.inp.frames.lock();
+        if q.is_empty() {
+            self.inp.ready.wait_for(&mut q, timeout);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn packed_frames_round_trip() {
+        let mut buf = vec![0u8; 4096];
+        let gso = PktMeta { flags: PKT_NEEDS_CSUM, gso_type: GSO_TCPV4, hdr_len: 54, gso_size: 1448, csum_start: 34, csum_offset: 16 };
+        let mut p = Packer::new(&mut buf);
+        assert!(p.push(&PktMeta::default(), &[1; 60]));
+        assert!(p.push(&gso, &[2; 1501]));
+        assert!(p.push(&PktMeta::default(), &[3; 42]));
+        assert!(!p.push(&PktMeta::default(), &[4; 4096]));
+        let d = p.desc(7);
+        // Every frame is padded to 8 bytes, the last one included
+        assert_eq!((d.buf, d.count, d.len), (7, 3, 80 + 1520 + 64));
+        let got: Vec<_> = Frames::new(&buf[..d.len as usize], d.count).map(|(m, f)| (m, f.len(), f[0])).collect();
+        assert_eq!(got, [(PktMeta::default(), 60, 1), (gso, 1501, 2), (PktMeta::default(), 42, 3)]);
+        assert_eq!(gso.needs(), F_CSUM | F_GSO_TCPV4);
+
+        // A count past the packed frames, or a length past the buffer, stops the walk
+        let mut f = Frames::new(&buf[..d.len as usize], 4);
+        assert_eq!(f.by_ref().count(), 3);
+        assert!(f.malformed);
+        buf[0..4].copy_from_slice(&5000u32.to_le_bytes());
+        let mut f = Frames::new(&buf[..d.len as usize], 3);
+        assert!(f.next().is_none() && f.malformed);
+    }
+
+    #[test]
+    fn software_checksum_matches_reference() {
+        fn fold(mut sum: u32) -> u16 {
+            while sum >> 16 != 0 {
+                sum = (sum & 0xffff) + (sum >> 16);
+            }
+            sum as u16
+        }
+        // UDP 12345 -> 53 carrying "hello", between 10.0.0.1 and 10.0.0.2
+        let mut frame = vec![0u8; 14 + 20 + 8 + 5];
+        frame[34..40].copy_from_slice(&[0x30, 0x39, 0x00, 0x35, 0x00, 0x0d]);
+        frame[42..].copy_from_slice(b"hello");
+        let pseudo = fold(0x0a00 + 0x0001 + 0x0a00 + 0x0002 + 17 + 13);
+        let words: u32 = frame[34..].chunks(2).map(|w| u16::from_be_bytes([w[0], *w.get(1).unwrap_or(&0)]) as u32).sum();
+        let want = !fold(pseudo as u32 + words);
+        // A NEEDS_CSUM sender leaves the pseudo-header sum in the field
+        frame[40..42].copy_from_slice(&pseudo.to_be_bytes());
+        let mut meta = PktMeta { flags: PKT_NEEDS_CSUM, csum_start: 34, csum_offset: 6, ..PktMeta::default() };
+        assert!(complete_csum(&mut meta, &mut frame));
+        assert_eq!(meta.flags, PKT_DATA_VALID);
+        assert_eq!(u16::from_be_bytes([frame[40], frame[41]]), want);
+
+        let mut bad = PktMeta { flags: PKT_NEEDS_CSUM, csum_start: 40, csum_offset: 6, ..PktMeta::default() };
+        assert!(!complete_csum(&mut bad, &mut frame));
+    }
+}
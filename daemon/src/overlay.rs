@@ -0,0 +1,799 @@
+//! Copy-on-write overlay disks for VBLK.
+//!
+//! A guest disk is a chain: a read-only raw base image, optional frozen
+//! snapshot layers, and one writable top overlay. Each overlay file is
+//!
+//!   [header: 4 KiB][allocation bitmap: 1 bit per block][data, sparse]
+//!
+//! Block `b` of an overlay lives at `data_off + b * block_size` and is valid
+//! only when its bitmap bit is set; reads fall through to the first layer
+//! that has the block, and the base image beyond its end reads as zeros.
+//! Writes allocate whole blocks in the top layer, copying up the rest of a
+//! partially written block from below. Data lands before its bitmap bit: a
+//! request's new bits are persisted only after a `sync_data` of the blocks it
+//! wrote, so a crash can lose a write but never expose a block that was not
+//! written.
+//!
+//! Snapshot = freeze the top layer under a name and start an empty one on
+//! top of it; rollback = replace the top layer with an empty one. Both touch
+//! only a header and a bitmap, never the image data.
+//!
+//! DISCARD, WRITE_ZEROES and all-zero block writes set the block's bit but
+//! punch its data range, so the block reads as zeros without using space.
+//!
+//! Header (little endian):
+//!   0 magic "COLXCOW\0"   8 version:u32   12 block_shift:u32   16 disk_size:u64
+//!  24 bitmap_off:u64     32 data_off:u64  40 parent_len:u32    44 flags:u32
+//!  48 parent path (UTF-8, relative paths resolve against the overlay's directory)
+
+use anyhow::{bail, Context, Result};
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::RwLock;
+
+use crate::blockdev::{byte_offset, BlockBackend};
+use crate::sparse::{is_zero, mark_sparse, punch_hole};
+
+const MAGIC: &[u8; 8] = b"COLXCOW\0";
+const VERSION: u32 = 1;
+const HDR_SIZE: u64 = 4096;
+const HDR_FIXED: usize = 48;
+/// Frozen snapshot layer; never opened as the writable top.
+const FLAG_READONLY: u32 = 0x1;
+pub const DEFAULT_BLOCK_SHIFT: u32 = 16; // 64 KiB
+const MAX_CHAIN: usize = 64;
+
+#[derive(Debug, Clone)]
+struct CowHeader {
+    block_shift: u32,
+    disk_size: u64,
+    bitmap_off: u64,
+    data_off: u64,
+    flags: u32,
+    parent: String,
+}
+
+impl CowHeader {
+    fn new(block_shift: u32, disk_size: u64, parent: &str) -> Self {
+        let block = 1u64 << block_shift;
+        let bitmap_off = HDR_SIZE;
+        let data_off = (bitmap_off + bitmap_len(disk_size, block_shift) as u64).div_ceil(block) * block;
+        Self { block_shift, disk_size, bitmap_off, data_off, flags: 0, parent: parent.to_string() }
+    }
+
+    fn encode(&self) -> Vec<u8> {
+        let mut h = vec![0u8; HDR_SIZE as usize];
+        h[0..8].copy_from_slice(MAGIC);
+        h[8..12].copy_from_slice(&VERSION.to_le_bytes());
+        h[12..16].copy_from_slice(&self.block_shift.to_le_bytes());
+        h[16..24].copy_from_slice(&self.disk_size.to_le_bytes());
+        h[24..32].copy_from_slice(&self.bitmap_off.to_le_bytes());
+        h[32..40].copy_from_slice(&self.data_off.to_le_bytes());
+        h[40..44].copy_from_slice(&(self.parent.len() as u32).to_le_bytes());
+        h[44..48].copy_from_slice(&self.flags.to_le_bytes());
+        h[HDR_FIXED..HDR_FIXED + self.parent.len()].copy_from_slice(self.parent.as_bytes());
+        h
+    }
+
+    fn decode(h: &[u8]) -> Result<Self> {
+        let u32_at = |o: usize| u32::from_le_bytes(h[o..o + 4].try_into().unwrap());
+        let u64_at = |o: usize| u64::from_le_bytes(h[o..o + 8].try_into().unwrap());
+        if h.len() < HDR_SIZE as usize || &h[0..8] != MAGIC {
+            bail!("not a coLinux overlay");
+        }
+        if u32_at(8) != VERSION {
+            bail!("overlay version {} unsupported", u32_at(8));
+        }
+        let block_shift = u32_at(12);
+        if !(9..=24).contains(&block_shift) {
+            bail!("overlay block_shift {} out of range (9..24)", block_shift);
+        }
+        let parent_len = u32_at(40) as usize;
+        if parent_len > HDR_SIZE as usize - HDR_FIXED {
+            bail!("overlay parent path too long");
+        }
+        let parent = std::str::from_utf8(&h[HDR_FIXED..HDR_FIXED + parent_len])
+            .context("overlay parent path not UTF-8")?
+            .to_string();
+        let hdr = Self { block_shift, disk_size: u64_at(16), bitmap_off: u64_at(24), data_off: u64_at(32), flags: u32_at(44), parent };
+        if hdr.bitmap_off < HDR_SIZE || hdr.data_off < hdr.bitmap_off + bitmap_len(hdr.disk_size, block_shift) as u64 {
+            bail!("overlay layout corrupt");
+        }
+        Ok(hdr)
+    }
+}
+
+fn bitmap_len(disk_size: u64, block_shift: u32) -> usize {
+    (disk_size.div_ceil(1u64 << block_shift) as usize).div_ceil(8)
+}
+
+enum Layer {
+    Raw { file: File, len: u64 },
+    Cow { file: File, hdr: CowHeader, bitmap: Vec<u8> },
+}
+
+impl Layer {
+    fn open(path: &Path, writable: bool) -> Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(writable)
+            .open(path)
+            .with_context(|| format!("opening {}", path.display()))?;
+        let len = file.metadata()?.len();
+        let mut magic = [0u8; 8];
+        if len >= HDR_SIZE {
+            read_at(&file, &mut magic, 0)?;
+        }
+        if &magic != MAGIC {
+            if writable {
+                bail!("{} is not an overlay", path.display());
+            }
+            return Ok(Layer::Raw { file, len });
+        }
+        let mut h = vec![0u8; HDR_SIZE as usize];
+        read_at(&file, &mut h, 0)?;
+        let hdr = CowHeader::decode(&h).with_context(|| format!("overlay {}", path.display()))?;
+        if writable && hdr.flags & FLAG_READONLY != 0 {
+            bail!("{} is a frozen snapshot; point vblk_overlay at its child", path.display());
+        }
+        let mut bitmap = vec![0u8; bitmap_len(hdr.disk_size, hdr.block_shift)];
+        read_at(&file, &mut bitmap, hdr.bitmap_off)?;
+        Ok(Layer::Cow { file, hdr, bitmap })
+    }
+
+    fn disk_size(&self) -> u64 {
+        match self {
+            Layer::Raw { len, .. } => *len,
+            Layer::Cow { hdr, .. } => hdr.disk_size,
+        }
+    }
+}
+
+fn has_block(bitmap: &[u8], blk: u64) -> bool {
+    bitmap[(blk / 8) as usize] & (1 << (blk % 8)) != 0
+}
+
+/// Resolve `parent` as stored in a header relative to the overlay at `child`.
+fn parent_path(child: &Path, parent: &str) -> PathBuf {
+    let p = Path::new(parent);
+    if p.is_absolute() {
+        p.to_path_buf()
+    } else {
+        child.parent().unwrap_or(Path::new(".")).join(p)
+    }
+}
+
+/// An open overlay chain; the first layer is the writable top. Reads and
+/// writes into already allocated blocks are positional and share the chain
+/// lock; only allocation (copy-up, bitmap bits, holes) takes it exclusively.
+pub struct Overlay {
+    path: PathBuf,
+    chain: RwLock<Vec<Layer>>,
+    disk_size: u64,
+    block_shift: u32,
+}
+
+impl Overlay {
+    /// Open `path`, creating it over `base` (a raw image or another overlay) if missing.
+    pub fn open_or_create(path: &Path, base: &Path) -> Result<Self> {
+        if !path.exists() {
+            create(path, base, DEFAULT_BLOCK_SHIFT)?;
+            tracing::info!("created overlay {} over {}", path.display(), base.display());
+        }
+        Self::open(path)
+    }
+
+    /// Open the chain with `path` as its writable top. The top file stays
+    /// exclusively locked while open, so `snapshot` and `rollback` cannot
+    /// swap it out from under a running daemon.
+    pub fn open(path: &Path) -> Result<Self> {
+        let top = Layer::open(path, true)?;
+        let Layer::Cow { file, hdr, .. } = &top else { unreachable!() };
+        if !try_lock(file).with_context(|| format!("locking {}", path.display()))? {
+            bail!("overlay {} is already open (is a daemon running on it?)", path.display());
+        }
+        let (disk_size, block_shift) = (hdr.disk_size, hdr.block_shift);
+        let mut chain = vec![top];
+        let mut cur = path.to_path_buf();
+        while let Some(Layer::Cow { hdr, .. }) = chain.last() {
+            if chain.len() >= MAX_CHAIN {
+                bail!("overlay chain deeper than {}", MAX_CHAIN);
+            }
+            let next = parent_path(&cur, &hdr.parent);
+            let layer = Layer::open(&next, false)?;
+            if let Layer::Cow { hdr, .. } = &layer {
+                // Reads walk the chain block by block, so every layer must agree
+                if hdr.block_shift != block_shift {
+                    bail!("overlay {}: block size differs from {}", next.display(), path.display());
+                }
+            }
+            chain.push(layer);
+            cur = next;
+        }
+        Ok(Self { path: path.to_path_buf(), chain: RwLock::new(chain), disk_size, block_shift })
+    }
+
+    pub fn disk_size(&self) -> u64 {
+        self.disk_size
+    }
+
+    pub fn depth(&self) -> usize {
+        self.chain.read().unwrap().len()
+    }
+
+    fn check_range(&self, off: u64, len: usize) -> Result<()> {
+        if off.checked_add(len as u64).map_or(true, |end| end > self.disk_size) {
+            bail!("overlay {}: I/O [{}, +{}) beyond disk size {}", self.path.display(), off, len, self.disk_size);
+        }
+        Ok(())
+    }
+}
+
+/// Read `dst` at byte `off` from the first layer at or below `from` holding each block.
+fn read_chain(chain: &[Layer], from: usize, block_shift: u32, mut off: u64, mut dst: &mut [u8]) -> Result<()> {
+    let block = 1u64 << block_shift;
+    while !dst.is_empty() {
+        let blk = off >> block_shift;
+        let n = ((block - (off & (block - 1))) as usize).min(dst.len());
+        let (chunk, rest) = dst.split_at_mut(n);
+        let mut filled = false;
+        for layer in &chain[from..] {
+            match layer {
+                Layer::Cow { file, hdr, bitmap } => {
+                    // A lower layer may describe a smaller disk
+                    if off < hdr.disk_size && has_block(bitmap, blk) {
+                        read_at(file, chunk, hdr.data_off + off)?;
+                        filled = true;
+                        break;
+                    }
+                }
+                Layer::Raw { file, len } => {
+                    // Past the end of the base image reads as zeros
+                    let avail = len.saturating_sub(off).min(n as u64) as usize;
+                    read_at(file, &mut chunk[..avail], off)?;
+                    chunk[avail..].fill(0);
+                    filled = true;
+                    break;
+                }
+            }
+        }
+        if !filled {
+            chunk.fill(0);
+        }
+        off += n as u64;
+        dst = rest;
+    }
+    Ok(())
+}
+
+impl Overlay {
+    /// Write `src` at byte `off` in place when every block it touches is
+    /// already allocated in the top layer and none is a whole block of zeros
+    /// (those become holes); false, with nothing written, otherwise.
+    fn write_allocated(&self, chain: &[Layer], off: u64, src: &[u8]) -> Result<bool> {
+        let Layer::Cow { file, hdr, bitmap } = &chain[0] else { unreachable!() };
+        let block = 1u64 << self.block_shift;
+        let (mut pos, end) = (off, off + src.len() as u64);
+        while pos < end {
+            let blk = pos >> self.block_shift;
+            let blk_start = blk << self.block_shift;
+            let blk_end = (blk_start + block).min(self.disk_size);
+            let n = blk_end.min(end) - pos;
+            let whole = pos == blk_start && n == blk_end - blk_start;
+            if !has_block(bitmap, blk) || (whole && is_zero(&src[(pos - off) as usize..(pos - off + n) as usize])) {
+                return Ok(false);
+            }
+            pos += n;
+        }
+        // Blocks are laid out linearly after data_off: one positional write
+        write_at(file, src, hdr.data_off + off)?;
+        Ok(true)
+    }
+
+    /// Write `src` at byte `off` into the top layer, allocating blocks as
+    /// needed. Whole blocks of zeros become holes instead of data.
+    fn write_locked(&self, chain: &mut [Layer], mut off: u64, mut src: &[u8], dirty: &mut Dirty) -> Result<()> {
+        let block = 1u64 << self.block_shift;
+        let mut copy_up: Vec<u8> = Vec::new();
+        while !src.is_empty() {
+            let blk = off >> self.block_shift;
+            let in_blk = (off & (block - 1)) as usize;
+            let n = (block as usize - in_blk).min(src.len());
+            let Layer::Cow { file, hdr, bitmap } = &chain[0] else { unreachable!() };
+            let allocated = has_block(bitmap, blk);
+            let blk_start = blk << self.block_shift;
+            // The last block may be short when disk_size is not block aligned
+            let blk_len = block.min(self.disk_size - blk_start) as usize;
+
+            if n == blk_len && is_zero(&src[..n]) {
+                self.zero_block(chain, blk, dirty)?;
+            } else {
+                if !allocated && n < blk_len {
+                    // Copy up the rest of the block from below, then write it whole
+                    copy_up.resize(blk_len, 0);
+                    read_chain(chain, 1, self.block_shift, blk_start, &mut copy_up)?;
+                    copy_up[in_blk..in_blk + n].copy_from_slice(&src[..n]);
+                    write_at(file, &copy_up, hdr.data_off + blk_start)?;
+                } else {
+                    write_at(file, &src[..n], hdr.data_off + off)?;
+                }
+                if !allocated {
+                    mark_allocated(chain, blk, dirty);
+                }
+            }
+            off += n as u64;
+            src = &src[n..];
+        }
+        Ok(())
+    }
+
+    /// Make block `blk` of the top layer read as zeros without storing them:
+    /// its data range becomes a hole and its bit is set so lower layers stay hidden.
+    fn zero_block(&self, chain: &mut [Layer], blk: u64, dirty: &mut Dirty) -> Result<()> {
+        let Layer::Cow { file, hdr, bitmap } = &chain[0] else { unreachable!() };
+        let blk_start = blk << self.block_shift;
+        let len = (1u64 << self.block_shift).min(self.disk_size - blk_start);
+        let (start, end) = (hdr.data_off + blk_start, hdr.data_off + blk_start + len);
+        let file_len = file.metadata()?.len();
+        if start < file_len {
+            match punch_hole(file, start, end.min(file_len) - start) {
+                Ok(()) => {}
+                Err(e) if e.kind() == io::ErrorKind::Unsupported => {
+                    write_at(file, &vec![0u8; (end.min(file_len) - start) as usize], start)?;
+                }
+                Err(e) => return Err(e).context("overlay punch hole"),
+            }
+        }
+        if end > file_len {
+            // Extending a sparse file leaves the new tail unallocated
+            file.set_len(end)?;
+        }
+        if !has_block(bitmap, blk) {
+            mark_allocated(chain, blk, dirty);
+        }
+        Ok(())
+    }
+
+    /// Zero [off, off + len): whole blocks become holes; with `partial`, the
+    /// uncovered edges of the range are written as zeros too.
+    fn zero_range(&self, off: u64, len: u64, partial: bool) -> Result<()> {
+        self.check_range(off, len as usize)?;
+        let mut chain = self.chain.write().unwrap();
+        let block = 1u64 << self.block_shift;
+        let mut dirty = Dirty::default();
+        let (mut off, end) = (off, off + len);
+        while off < end {
+            let blk = off >> self.block_shift;
+            let blk_start = blk << self.block_shift;
+            let blk_end = (blk_start + block).min(self.disk_size);
+            let n = blk_end.min(end) - off;
+            if off == blk_start && n == blk_end - blk_start {
+                self.zero_block(&mut chain, blk, &mut dirty)?;
+            } else if partial {
+                self.write_locked(&mut chain, off, &vec![0u8; n as usize], &mut dirty)?;
+            }
+            off += n;
+        }
+        persist_bits(&chain, dirty)
+    }
+}
+
+/// Bitmap bytes one request changed in memory, not yet on disk.
+#[derive(Default)]
+struct Dirty(Option<(usize, usize)>);
+
+/// Set block `blk`'s bit in the top layer's in-memory bitmap; `persist_bits`
+/// writes it out once the block's data is durable.
+fn mark_allocated(chain: &mut [Layer], blk: u64, dirty: &mut Dirty) {
+    let Layer::Cow { bitmap, .. } = &mut chain[0] else { unreachable!() };
+    let byte = (blk / 8) as usize;
+    bitmap[byte] |= 1 << (blk % 8);
+    dirty.0 = Some(dirty.0.map_or((byte, byte), |(lo, hi)| (lo.min(byte), hi.max(byte))));
+}
+
+/// Sync the top layer's data, then write the bitmap bytes in `dirty`: a bit
+/// never reaches the disk ahead of the block it covers. Bytes in between go
+/// out as they are in memory; the sync covers their blocks too.
+fn persist_bits(chain: &[Layer], dirty: Dirty) -> Result<()> {
+    let Some((lo, hi)) = dirty.0 else { return Ok(()) };
+    let Layer::Cow { file, hdr, bitmap } = &chain[0] else { unreachable!() };
+    file.sync_data().context("overlay data sync")?;
+    write_at(file, &bitmap[lo..=hi], hdr.bitmap_off + lo as u64)?;
+    Ok(())
+}
+
+impl BlockBackend for Overlay {
+    fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+        let off = byte_offset(lba)?;
+        self.check_range(off, dst.len())?;
+        let chain = self.chain.read().unwrap();
+        read_chain(&chain, 0, self.block_shift, off, dst)
+    }
+
+    fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+        let off = byte_offset(lba)?;
+        self.check_range(off, src.len())?;
+        if self.write_allocated(&self.chain.read().unwrap(), off, src)? {
+            return Ok(());
+        }
+        let mut chain = self.chain.write().unwrap();
+        let mut dirty = Dirty::default();
+        self.write_locked(&mut chain, off, src, &mut dirty)?;
+        persist_bits(&chain, dirty)
+    }
+
+    fn flush(&self) -> Result<()> {
+        let chain = self.chain.read().unwrap();
+        let Layer::Cow { file, .. } = &chain[0] else { unreachable!() };
+        file.sync_data().context("overlay flush")
+    }
+
+    /// Only whole blocks are released; partial edges keep their data.
+    fn discard(&self, lba: u64, len: u64) -> Result<()> {
+        self.zero_range(byte_offset(lba)?, len, false)
+    }
+
+    fn write_zeroes(&self, lba: u64, len: u64) -> Result<()> {
+        self.zero_range(byte_offset(lba)?, len, true)
+    }
+}
+
+/// Create an empty overlay at `path` whose parent is `parent`.
+/// Overlays stacked on another overlay inherit its block size.
+pub fn create(path: &Path, parent: &Path, block_shift: u32) -> Result<()> {
+    let (disk_size, block_shift) = match Layer::open(parent, false)? {
+        Layer::Cow { hdr, .. } => (hdr.disk_size, hdr.block_shift),
+        raw => (raw.disk_size(), block_shift),
+    };
+    // Store the parent relative to the overlay when they share a directory
+    let rel = match (path.parent(), parent.parent(), parent.file_name()) {
+        (Some(a), Some(b), Some(name)) if a == b => PathBuf::from(name),
+        _ => parent.to_path_buf(),
+    };
+    let rel = rel.to_str().context("overlay parent path not UTF-8")?;
+    if rel.len() > HDR_SIZE as usize - HDR_FIXED {
+        bail!("overlay parent path too long: {}", rel);
+    }
+    write_fresh(path, &CowHeader::new(block_shift, disk_size, rel))
+}
+
+/// Write header + zeroed bitmap to a temp file and move it over `path`, so
+/// the previous file stays intact until the new one is complete.
+fn write_fresh(path: &Path, hdr: &CowHeader) -> Result<()> {
+    let tmp = path.with_extension("cow.tmp");
+    {
+        let f = File::create(&tmp).with_context(|| format!("creating {}", tmp.display()))?;
+        mark_sparse(&f);
+        write_at(&f, &hdr.encode(), 0)?;
+        write_at(&f, &vec![0u8; bitmap_len(hdr.disk_size, hdr.block_shift)], hdr.bitmap_off)?;
+        f.set_len(hdr.data_off)?;
+        f.sync_all()?;
+    }
+    std::fs::rename(&tmp, path).with_context(|| format!("replacing {}", path.display()))?;
+    Ok(())
+}
+
+/// `<dir>/<stem>.<name>.cow` for the overlay at `top`.
+pub fn snapshot_path(top: &Path, name: &str) -> PathBuf {
+    let stem = top.file_stem().and_then(|s| s.to_str()).unwrap_or("disk");
+    top.with_file_name(format!("{stem}.{name}.cow"))
+}
+
+/// Freeze the current top layer as snapshot `name` and continue on an empty
+/// layer above it. Cost is independent of disk size.
+pub fn snapshot(top: &Path, name: &str) -> Result<PathBuf> {
+    if name.is_empty() || name.contains(['/', '\\', '.']) {
+        bail!("invalid snapshot name {:?}", name);
+    }
+    let frozen = snapshot_path(top, name);
+    if frozen.exists() {
+        bail!("snapshot {} already exists", frozen.display());
+    }
+    // Held until the new top is in place
+    let f = lock_idle(top, true)?;
+    let mut h = vec![0u8; HDR_SIZE as usize];
+    read_at(&f, &mut h, 0)?;
+    let mut hdr = CowHeader::decode(&h)?;
+    hdr.flags |= FLAG_READONLY;
+    write_at(&f, &hdr.encode(), 0)?;
+    f.sync_all()?;
+    std::fs::rename(top, &frozen).with_context(|| format!("renaming {} to {}", top.display(), frozen.display()))?;
+    let child = CowHeader::new(hdr.block_shift, hdr.disk_size, frozen.file_name().unwrap().to_str().unwrap());
+    write_fresh(top, &child)?;
+    Ok(frozen)
+}
+
+/// Discard the top layer's writes: back to its current parent, or onto
+/// snapshot `name` if given. Other snapshot files are left untouched.
+pub fn rollback(top: &Path, name: Option<&str>) -> Result<()> {
+    let f = lock_idle(top, false)?;
+    let mut h = vec![0u8; HDR_SIZE as usize];
+    read_at(&f, &mut h, 0)?;
+    let hdr = CowHeader::decode(&h)?;
+    let parent = match name {
+        None => hdr.parent.clone(),
+        Some(n) => {
+            let p = snapshot_path(top, n);
+            if !p.exists() {
+                bail!("no snapshot {} ({})", n, p.display());
+            }
+            p.file_name().unwrap().to_str().unwrap().to_string()
+        }
+    };
+    write_fresh(top, &CowHeader::new(hdr.block_shift, hdr.disk_size, &parent))
+}
+
+/// Open the top overlay `top` and lock it, refusing while an `Overlay`
+/// (i.e. a running daemon) holds it.
+fn lock_idle(top: &Path, writable: bool) -> Result<File> {
+    let f = OpenOptions::new().read(true).write(writable).open(top).with_context(|| format!("opening {}", top.display()))?;
+    if !try_lock(&f).with_context(|| format!("locking {}", top.display()))? {
+        bail!("overlay {} is in use; stop the daemon first", top.display());
+    }
+    Ok(f)
+}
+
+/// Take an exclusive lock on `f` without waiting; false if another open
+/// handle holds it. Released when `f` is closed.
+#[cfg(target_os = "linux")]
+fn try_lock(f: &File) -> io::Result<bool> {
+    use std::os::unix::io::AsRawFd;
+    if unsafe { libc::flock(f.as_raw_fd(), libc::LOCK_EX | libc::LOCK_NB) } == 0 {
+        return Ok(true);
+    }
+    let e = io::Error::last_os_error();
+    match e.raw_os_error() {
+        Some(libc::EWOULDBLOCK) => Ok(false),
+        _ => Err(e),
+    }
+}
+
+#[cfg(windows)]
+fn try_lock(f: &File) -> io::Result<bool> {
+    use std::os::windows::io::AsRawHandle;
+    use windows::Win32::Foundation::{ERROR_LOCK_VIOLATION, HANDLE};
+    use windows::Win32::Storage::FileSystem::{LockFileEx, LOCKFILE_EXCLUSIVE_LOCK, LOCKFILE_FAIL_IMMEDIATELY};
+    use windows::Win32::System::IO::OVERLAPPED;
+    let mut ov = OVERLAPPED::default();
+    // The whole possible range: other handles can then neither lock nor touch the file
+    match unsafe { LockFileEx(HANDLE(f.as_raw_handle() as _), LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, u32::MAX, u32::MAX, &mut ov) } {
+        Ok(()) => Ok(true),
+        Err(e) => match io::Error::from(e) {
+            e if e.raw_os_error() == Some(ERROR_LOCK_VIOLATION.0 as i32) => Ok(false),
+            e => Err(e),
+        },
+    }
+}
+
+#[cfg(not(any(target_os = "linux", windows)))]
+fn try_lock(_f: &File) -> io::Result<bool> {
+    Ok(true)
+}
+
+#[cfg(unix)]
+fn read_at(f: &File, buf: &mut [u8], off: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    f.read_exact_at(buf, off)
+}
+
+#[cfg(unix)]
+fn write_at(f: &File, buf: &[u8], off: u64) -> io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    f.write_all_at(buf, off)
+}
+
+#[cfg(windows)]
+fn read_at(f: &File, mut buf: &mut [u8], mut off: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        match f.seek_read(buf, off)? {
+            0 => return Err(io::ErrorKind::UnexpectedEof.into()),
+            n => {
+                buf = &mut buf[n..];
+                off += n as u64;
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(windows)]
+fn write_at(f: &File, mut buf: &[u8], mut off: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        let n = f.seek_write(buf, off)?;
+        buf = &buf[n..];
+        off += n as u64;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicU32, Ordering};
+
+    fn tmpdir() -> PathBuf {
+        static N: AtomicU32 = AtomicU32::new(0);
+        let d = std::env::temp_dir().join(format!("colx-ovl-{}-{}", std::process::id(), N.fetch_add(1, Ordering::Relaxed)));
+        std::fs::create_dir_all(&d).unwrap();
+        d
+    }
+
+    fn base_image(dir: &Path, len: usize) -> PathBuf {
+        let p = dir.join("base.img");
+        let data: Vec<u8> = (0..len).map(|i| (i / 512) as u8).collect();
+        std::fs::write(&p, data).unwrap();
+        p
+    }
+
+    #[test]
+    fn reads_fall_through_and_writes_stay_on_top() {
+        let dir = tmpdir();
+        let base = base_image(&dir, 1 << 20);
+        let top = dir.join("guest.cow");
+        let ovl = Overlay::open_or_create(&top, &base).unwrap();
+        assert_eq!(ovl.disk_size(), 1 << 20);
+
+        let mut buf = vec![0u8; 4096];
+        ovl.read(8, &mut buf).unwrap();
+        assert_eq!(buf[0], 8);
+
+        // Partial-block write: the rest of the block is copied up from the base
+        ovl.write(9, &[0xEE; 512]).unwrap();
+        ovl.read(8, &mut buf).unwrap();
+        assert_eq!(buf[0], 8);
+        assert!(buf[512..1024].iter().all(|&b| b == 0xEE));
+        assert_eq!(buf[1024], 10);
+
+        // Base image is untouched
+        let raw = std::fs::read(&base).unwrap();
+        assert_eq!(raw[9 * 512], 9);
+        std::fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn writes_spanning_blocks_and_reopen() {
+        let dir = tmpdir();
+        let base = base_image(&dir, 1 << 20);
+        let top = dir.join("guest.cow");
+        create(&top, &base, 12).unwrap(); // 4 KiB blocks
+        {
+            let ovl = Overlay::open(&top).unwrap();
+            ovl.write(6, &vec![0x11; 8192]).unwrap(); // [3 KiB, 11 KiB): three blocks
+            ovl.flush().unwrap();
+        }
+        let ovl = Overlay::open(&top).unwrap();
+        let mut buf = vec![0u8; 12288];
+        ovl.read(0, &mut buf).unwrap();
+        assert_eq!(buf[3071], 5);
+        assert!(buf[3072..11264].iter().all(|&b| b == 0x11));
+        assert_eq!(buf[11264], 22);
+        assert!(ovl.read((1 << 20) / 512, &mut buf).is_err());
+        // An LBA whose byte offset wraps must not alias a block in range
+        assert!(ovl.read(u64::MAX / 512 + 1, &mut buf).is_err());
+        assert!(ovl.write(u64::MAX / 512 + 1, &buf).is_err());
+        assert!(ovl.write_zeroes(u64::MAX / 512 + 1, 4096).is_err());
+        std::fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn ring_workers_share_the_chain() {
+        let dir = tmpdir();
+        let base = base_image(&dir, 1 << 20);
+        let top = dir.join("guest.cow");
+        create(&top, &base, 12).unwrap(); // 4 KiB blocks
+        let ovl = Overlay::open(&top).unwrap();
+        ovl.write(0, &vec![0x11; 8192]).unwrap();
+        std::thread::scope(|s| {
+            for t in 0..4u8 {
+                let ovl = &ovl;
+                s.spawn(move || {
+                    let mut buf = vec![0u8; 4096];
+                    for i in 0..64u64 {
+                        // Rewrites of allocated blocks go in place under the shared lock
+                        ovl.write(16 + t as u64 * 8, &[t + 1; 512]).unwrap();
+                        ovl.read(i % 2 * 8, &mut buf).unwrap();
+                        assert!(buf.iter().all(|&b| b == 0x11));
+                    }
+                });
+            }
+        });
+        let mut buf = vec![0u8; 512];
+        for t in 0..4u8 {
+            ovl.read(16 + t as u64 * 8, &mut buf).unwrap();
+            assert!(buf.iter().all(|&b| b == t + 1));
+        }
+        std::fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn zeroing_hides_lower_layers() {
+        let dir = tmpdir();
+        let base = base_image(&dir, 1 << 20);
+        let top = dir.join("guest.cow");
+        create(&top, &base, 12).unwrap(); // 4 KiB blocks
+        let ovl = Overlay::open(&top).unwrap();
+        let mut buf = vec![0u8; 16384];
+
+        // [2 KiB, 14 KiB): partial edges written, blocks 1 and 2 punched
+        ovl.write_zeroes(4, 12288).unwrap();
+        ovl.read(0, &mut buf).unwrap();
+        assert_eq!(buf[2047], 3);
+        assert!(is_zero(&buf[2048..14336]));
+        assert_eq!(buf[14336], 28);
+
+        // Discard drops whole blocks only; an all-zero block write is a hole too
+        ovl.discard(33, 8192).unwrap();
+        ovl.write(48, &vec![0u8; 4096]).unwrap();
+        ovl.read(32, &mut buf).unwrap();
+        assert_eq!(buf[0], 32);
+        assert!(is_zero(&buf[4096..12288]));
+        assert_eq!(buf[12288], 56);
+        drop(ovl);
+
+        // Header, bitmap and the two copied-up edge blocks are all that is stored
+        #[cfg(unix)]
+        {
+            use std::os::unix::fs::MetadataExt;
+            let used = std::fs::metadata(&top).unwrap().blocks() * 512;
+            assert!(used <= 6 * 4096, "{used} bytes allocated");
+        }
+        std::fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn snapshot_and_rollback() {
+        let dir = tmpdir();
+        let base = base_image(&dir, 256 * 1024);
+        let top = dir.join("guest.cow");
+        let mut buf = [0u8; 512];
+
+        Overlay::open_or_create(&top, &base).unwrap().write(0, &[1; 512]).unwrap();
+        let frozen = snapshot(&top, "clean").unwrap();
+        assert!(frozen.ends_with("guest.clean.cow"));
+        assert!(Overlay::open(&frozen).is_err(), "frozen layer must not open writable");
+
+        {
+            let ovl = Overlay::open(&top).unwrap();
+            assert_eq!(ovl.depth(), 3);
+            ovl.read(0, &mut buf).unwrap();
+            assert_eq!(buf[0], 1);
+            ovl.write(0, &[2; 512]).unwrap();
+        }
+
+        rollback(&top, None).unwrap();
+        let ovl = Overlay::open(&top).unwrap();
+        ovl.read(0, &mut buf).unwrap();
+        assert_eq!(buf[0], 1, "rollback returns to the snapshot");
+        drop(ovl);
+
+        snapshot(&top, "second").unwrap();
+        rollback(&top, Some("clean")).unwrap();
+        assert_eq!(Overlay::open(&top).unwrap().depth(), 3);
+        assert!(rollback(&top, Some("missing")).is_err());
+        assert!(snapshot(&top, "clean").is_err());
+
+        // Neither may swap the top out from under an open overlay
+        let ovl = Overlay::open(&top).unwrap();
+        assert!(Overlay::open(&top).is_err());
+        assert!(snapshot(&top, "busy").is_err());
+        assert!(!snapshot_path(&top, "busy").exists());
+        assert!(rollback(&top, None).is_err());
+        ovl.write(0, &[3; 512]).unwrap();
+        drop(ovl);
+        Overlay::open(&top).unwrap().read(0, &mut buf).unwrap();
+        assert_eq!(buf[0], 3);
+        std::fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn header_roundtrip_and_rejects_garbage() {
+        let h = CowHeader::new(16, 10 << 30, "base.img");
+        let d = CowHeader::decode(&h.encode()).unwrap();
+        assert_eq!(d.parent, "base.img");
+        assert_eq!(d.data_off % (1 << 16), 0);
+        assert!(CowHeader::decode(&vec![0u8; HDR_SIZE as usize]).is_err());
+    }
+}
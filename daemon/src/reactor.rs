@@ -0,0 +1,677 @@
+//! Portable reactor core: request scheduling, batched completion draining and
+//! throughput/latency accounting. The OS side (IOCP on Windows) plugs in as a
+//! `CompletionSource`; `SimSource` drives the same logic on any host.
+//!
+//! Submissions never poll: `submit` queues the request and posts at most one
+//! wake event until a worker has picked the queue up again. Workers block in
+//! `dequeue` for a batch of events (wakes and completions) and process them
+//! in one pass, so several completions cost one kernel transition.
+//!
+//! The request path is allocation-free once warm: headers ride inline,
+//! payloads use caller memory or `bufpool` buffers, the submit queue is a
+//! fixed ring, and synchronous callers wait on a reusable `CompletionSlot`
+//! instead of a fresh channel.
+
+use anyhow::{anyhow, bail, Result};
+use crossbeam_channel::{Receiver, Sender};
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::bufpool::PoolBuf;
+use crate::metrics::{self, Counter, Hist};
+use crate::trace;
+
+/// Max events taken from the source per dequeue.
+pub const DEQUEUE_BATCH: usize = 64;
+
+/// Largest header/parameter block carried inline in a request.
+pub const INLINE_LEN: usize = 64;
+/// Submissions queued ahead of the workers; `submit` blocks beyond this.
+pub const SUBMIT_QUEUE: usize = 1024;
+
+/// NTSTATUS a driver returns for an IOCTL code it does not implement.
+pub const STATUS_INVALID_DEVICE_REQUEST: u32 = 0xC000_0010;
+// winerror.h: what DeviceIoControl reports for it when the IRP fails inline
+const ERROR_INVALID_FUNCTION: u32 = 1;
+
+/// Why an IOCTL failed, for callers that must tell the cases apart (e.g. a
+/// batch IOCTL an older driver lacks versus one that ran and failed).
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum IoctlError {
+    /// The caller stopped waiting. Requests on caller memory were cancelled
+    /// and have finished by the time this is returned (`wait_in_place`).
+    Timeout,
+    /// The IRP completed with this NTSTATUS.
+    Status(u32),
+    /// DeviceIoControl failed before the IRP was queued (Win32 error).
+    Win32(u32),
+}
+
+impl IoctlError {
+    /// The IOCTL failed as `e` describes, if `e` came from the reactor.
+    pub fn of(e: &anyhow::Error) -> Option<Self> {
+        e.downcast_ref::<IoctlError>().copied()
+    }
+
+    /// The driver does not know the IOCTL code.
+    pub fn unsupported(self) -> bool {
+        matches!(self, IoctlError::Status(STATUS_INVALID_DEVICE_REQUEST) | IoctlError::Win32(ERROR_INVALID_FUNCTION))
+    }
+}
+
+impl std::fmt::Display for IoctlError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            IoctlError::Timeout => write!(f, "ioctl timeout"),
+            IoctlError::Status(st) => write!(f, "ioctl completion failed: 0x{st:08x}"),
+            IoctlError::Win32(err) => write!(f, "DeviceIoControl failed: {err}"),
+        }
+    }
+}
+
+impl std::error::Error for IoctlError {}
+
+pub struct IoctlRequest {
+    pub code: u32,
+    pub inbuf: InBuf,   // parameters (METHOD_* params)
+    pub out: OutBuf,    // out/other buffer (MDL target for direct I/O, or read buffer)
+    pub reply: Reply,
+}
+
+/// Fixed-size byte block stored by value, so small headers and replies need
+/// no heap buffer. Lives inside the in-flight context while the IRP runs.
+#[derive(Clone, Copy)]
+pub struct Inline {
+    buf: [u8; INLINE_LEN],
+    len: u8,
+}
+
+impl Inline {
+    pub fn new(bytes: &[u8]) -> Self {
+        assert!(bytes.len() <= INLINE_LEN, "inline buffer too large: {}", bytes.len());
+        let mut buf = [0u8; INLINE_LEN];
+        buf[..bytes.len()].copy_from_slice(bytes);
+        Self { buf, len: bytes.len() as u8 }
+    }
+
+    /// Zeroed block of `len` bytes, e.g. for a small reply.
+    pub fn zeroed(len: usize) -> Self {
+        assert!(len <= INLINE_LEN, "inline buffer too large: {len}");
+        Self { buf: [0u8; INLINE_LEN], len: len as u8 }
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        &self.buf[..self.len as usize]
+    }
+}
+
+pub enum InBuf {
+    None,
+    Inline(Inline),
+    Owned(Vec<u8>),
+    Pooled(PoolBuf),
+}
+
+impl InBuf {
+    pub fn inline(bytes: &[u8]) -> Self {
+        InBuf::Inline(Inline::new(bytes))
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        match self {
+            InBuf::None => &[],
+            InBuf::Inline(b) => b.as_slice(),
+            InBuf::Owned(v) => v,
+            InBuf::Pooled(p) => p,
+        }
+    }
+}
+
+pub enum OutBuf {
+    None,
+    Inline(Inline),
+    Owned(Vec<u8>),
+    Pooled(PoolBuf),
+    /// Caller memory, used in place (zero-copy; channel replies carry no bytes).
+    User(UserBuf),
+}
+
+impl OutBuf {
+    /// Address and length handed to the driver; null for an empty buffer.
+    pub fn ptr_len(&mut self) -> (*mut u8, usize) {
+        let (p, n) = match self {
+            OutBuf::None => (std::ptr::null_mut(), 0),
+            OutBuf::Inline(b) => (b.buf.as_mut_ptr(), b.len as usize),
+            OutBuf::Owned(v) => (v.as_mut_ptr(), v.len()),
+            OutBuf::Pooled(p) => (p.as_mut_ptr(), p.len()),
+            OutBuf::User(u) => (u.ptr, u.len),
+        };
+        if n == 0 { (std::ptr::null_mut(), 0) } else { (p, n) }
+    }
+
+    /// Bytes the driver returned, for buffers the reactor owns.
+    pub fn filled(&self, bytes: usize) -> &[u8] {
+        let all: &[u8] = match self {
+            OutBuf::None | OutBuf::User(_) => &[],
+            OutBuf::Inline(b) => b.as_slice(),
+            OutBuf::Owned(v) => v,
+            OutBuf::Pooled(p) => p,
+        };
+        &all[..bytes.min(all.len())]
+    }
+
+    /// Reply payload for `bytes` transferred: owned buffers are truncated and
+    /// handed back, caller-owned buffers already hold the data.
+    pub fn into_vec(self, bytes: usize) -> Vec<u8> {
+        match self {
+            OutBuf::Owned(mut v) => {
+                v.truncate(bytes);
+                v
+            }
+            other => other.filled(bytes).to_vec(),
+        }
+    }
+}
+
+/// Caller-owned out buffer handed to the driver as-is, e.g. a data slot in the
+/// shared mapping. The driver locks it with an MDL, so reads land in it and
+/// writes are sourced from it without staging copies. The memory must stay
+/// valid until the IRP completes, so callers wait with `wait_in_place`, which
+/// cancels on timeout and still waits for the completion.
+#[derive(Clone, Copy)]
+pub struct UserBuf {
+    pub ptr: *mut u8,
+    pub len: usize,
+}
+
+unsafe impl Send for UserBuf {}
+
+/// Where a finished request goes.
+pub enum Reply {
+    /// One-shot channel; the payload is copied out of the request's buffer.
+    Channel(Sender<Result<Vec<u8>>>),
+    /// Reusable slot armed for one ticket; the out buffer itself comes back.
+    Slot(Arc<CompletionSlot>, u64),
+}
+
+/// Reusable rendezvous for synchronous callers: arm, submit, wait. A ticket
+/// guards against an IRP that completes after its caller timed out landing in
+/// the next request's wait; such late results are dropped (releasing any
+/// pooled buffer only once the driver is done with it). Requests on caller
+/// memory cannot be abandoned that way and use `wait_in_place` instead.
+pub struct CompletionSlot {
+    st: Mutex<SlotState>,
+    cv: Condvar,
+}
+
+struct SlotState {
+    ticket: u64,
+    done: Option<(Result<u32>, OutBuf)>,
+    /// Source token that cancels the armed request while it is in flight.
+    cancel: Option<usize>,
+}
+
+impl CompletionSlot {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self { st: Mutex::new(SlotState { ticket: 0, done: None, cancel: None }), cv: Condvar::new() })
+    }
+
+    /// Start a new request on this slot, abandoning any previous one.
+    pub fn arm(self: &Arc<Self>) -> Reply {
+        let mut st = self.st.lock().unwrap();
+        st.ticket += 1;
+        st.done = None;
+        st.cancel = None;
+        Reply::Slot(self.clone(), st.ticket)
+    }
+
+    /// Source side: `token` cancels request `ticket` until `clear_cancel`.
+    /// Set before the IRP is issued and cleared before its context is reused.
+    pub fn set_cancel(&self, ticket: u64, token: usize) {
+        let mut st = self.st.lock().unwrap();
+        if st.ticket == ticket {
+            st.cancel = Some(token);
+        }
+    }
+
+    pub fn clear_cancel(&self, ticket: u64) {
+        let mut st = self.st.lock().unwrap();
+        if st.ticket == ticket {
+            st.cancel = None;
+        }
+    }
+
+    fn complete(&self, ticket: u64, result: Result<u32>, out: OutBuf) {
+        let mut st = self.st.lock().unwrap();
+        if st.ticket == ticket {
+            st.done = Some((result, out));
+            self.cv.notify_one();
+        }
+    }
+
+    /// Block for the armed request; returns bytes transferred and the out buffer.
+    pub fn wait(&self, timeout: Duration) -> Result<(usize, OutBuf)> {
+        let deadline = Instant::now() + timeout;
+        let mut st = self.st.lock().unwrap();
+        loop {
+            if let Some((res, out)) = st.done.take() {
+                return res.map(|n| (n as usize, out));
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                bail!(IoctlError::Timeout);
+            }
+            st = self.cv.wait_timeout(st, deadline - now).unwrap().0;
+        }
+    }
+
+    /// As `wait`, for a request whose out buffer is caller memory: past the
+    /// deadline the request is cancelled through `cancel` and waited out, so
+    /// the driver is done with the memory whenever this returns. A request
+    /// that still succeeds is reported as such; anything else as a timeout.
+    pub fn wait_in_place(&self, timeout: Duration, cancel: impl Fn(usize)) -> Result<(usize, OutBuf)> {
+        let deadline = Instant::now() + timeout;
+        let mut st = self.st.lock().unwrap();
+        let mut cancelled = false;
+        loop {
+            if let Some((res, out)) = st.done.take() {
+                return match res {
+                    Ok(n) => Ok((n as usize, out)),
+                    Err(_) if cancelled => Err(IoctlError::Timeout.into()),
+                    Err(e) => Err(e),
+                };
+            }
+            let now = Instant::now();
+            if now < deadline {
+                st = self.cv.wait_timeout(st, deadline - now).unwrap().0;
+                continue;
+            }
+            if !cancelled {
+                // Under the lock: the source clears the token before reusing its context
+                if let Some(token) = st.cancel {
+                    cancel(token);
+                }
+                cancelled = true;
+            }
+            st = self.cv.wait(st).unwrap();
+        }
+    }
+}
+
+/// A finished request, ready to be replied to.
+pub struct Done {
+    pub code: u32,
+    pub reply: Reply,
+    pub result: Result<u32>,
+    pub out: OutBuf,
+    pub submitted: Instant,
+}
+
+pub enum Event {
+    /// Submissions are queued (or shutdown was requested).
+    Wake,
+    Done(Done),
+}
+
+/// OS completion mechanism the reactor schedules against.
+pub trait CompletionSource: Send + Sync + 'static {
+    /// Issue a request. Returns `Some` when it finished (or failed) synchronously
+    /// and will not be reported through `dequeue`.
+    fn start(&self, req: IoctlRequest, submitted: Instant) -> Option<Done>;
+    /// Block until at least one event is ready (or `timeout`), appending up to `max`.
+    fn dequeue(&self, out: &mut Vec<Event>, max: usize, timeout: Option<Duration>);
+    /// Queue one `Event::Wake` for some worker.
+    fn post_wake(&self);
+    /// Ask the OS to cancel the in-flight request `token` names (see
+    /// `CompletionSlot::set_cancel`). Sources whose requests always finish
+    /// promptly may ignore it; callers wait for the completion either way.
+    fn cancel(&self, _token: usize) {}
+}
+
+/// Reactor-level counters; all updates are relaxed atomics.
+#[derive(Default)]
+pub struct ReactorStats {
+    submitted: AtomicU64,
+    completed: AtomicU64,
+    errors: AtomicU64,
+    dequeues: AtomicU64,
+    wakes_posted: AtomicU64,
+    lat_ns_total: AtomicU64,
+    lat_ns_max: AtomicU64,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct ReactorSnapshot {
+    pub submitted: u64,
+    pub completed: u64,
+    pub errors: u64,
+    /// Dequeue calls that returned at least one event.
+    pub dequeues: u64,
+    pub wakes_posted: u64,
+    pub elapsed: Duration,
+    pub mean_latency: Duration,
+    pub max_latency: Duration,
+}
+
+impl ReactorSnapshot {
+    pub fn completions_per_sec(&self) -> f64 {
+        let s = self.elapsed.as_secs_f64();
+        if s > 0.0 { self.completed as f64 / s } else { 0.0 }
+    }
+
+    /// Average events handled per dequeue; >1 means batching is paying off.
+    pub fn events_per_dequeue(&self) -> f64 {
+        if self.dequeues > 0 { (self.completed + self.wakes_posted) as f64 / self.dequeues as f64 } else { 0.0 }
+    }
+}
+
+struct Shared<S: CompletionSource> {
+    src: S,
+    rx_submit: Receiver<(IoctlRequest, Instant)>,
+    wake_pending: AtomicBool,
+    shutdown: AtomicBool,
+    stats: ReactorStats,
+}
+
+pub struct ReactorCore<S: CompletionSource> {
+    shared: Arc<Shared<S>>,
+    tx_submit: Sender<(IoctlRequest, Instant)>,
+    workers: Vec<thread::JoinHandle<()>>,
+    started: Instant,
+}
+
+impl<S: CompletionSource> ReactorCore<S> {
+    /// Run `workers` threads (at least one) against `src`.
+    pub fn with_source(src: S, workers: usize) -> Self {
+        let (tx, rx) = crossbeam_channel::bounded(SUBMIT_QUEUE);
+        let shared = Arc::new(Shared {
+            src,
+            rx_submit: rx,
+            wake_pending: AtomicBool::new(false),
+            shutdown: AtomicBool::new(false),
+            stats: ReactorStats::default(),
+        });
+        let workers = (0..workers.max(1))
+            .map(|_| {
+                let sh = shared.clone();
+                thread::spawn(move || worker_loop(&sh))
+            })
+            .collect();
+        Self { shared, tx_submit: tx, workers, started: Instant::now() }
+    }
+
+    pub fn source(&self) -> &S {
+        &self.shared.src
+    }
+
+    pub fn submit(&self, req: IoctlRequest) -> Result<()> {
+        self.shared.stats.submitted.fetch_add(1, Ordering::Relaxed);
+        self.tx_submit
+            .send((req, Instant::now()))
+            .map_err(|e| anyhow!("submit failed: {e}"))?;
+        // One wake covers everything queued until a worker clears the flag
+        if !self.shared.wake_pending.swap(true, Ordering::AcqRel) {
+            self.shared.stats.wakes_posted.fetch_add(1, Ordering::Relaxed);
+            self.shared.src.post_wake();
+        }
+        Ok(())
+    }
+
+    /// Cancel an in-flight request by its source token.
+    pub fn cancel(&self, token: usize) {
+        self.shared.src.cancel(token);
+    }
+
+    pub fn stats(&self) -> ReactorSnapshot {
+        let st = &self.shared.stats;
+        let completed = st.completed.load(Ordering::Relaxed);
+        let total = st.lat_ns_total.load(Ordering::Relaxed);
+        ReactorSnapshot {
+            submitted: st.submitted.load(Ordering::Relaxed),
+            completed,
+            errors: st.errors.load(Ordering::Relaxed),
+            dequeues: st.dequeues.load(Ordering::Relaxed),
+            wakes_posted: st.wakes_posted.load(Ordering::Relaxed),
+            elapsed: self.started.elapsed(),
+            mean_latency: Duration::from_nanos(if completed > 0 { total / completed } else { 0 }),
+            max_latency: Duration::from_nanos(st.lat_ns_max.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+impl<S: CompletionSource> Drop for ReactorCore<S> {
+    fn drop(&mut self) {
+        // One wake is enough: each exiting worker passes it on to the next
+        self.shared.shutdown.store(true, Ordering::SeqCst);
+        self.shared.src.post_wake();
+        for w in self.workers.drain(..) {
+            let _ = w.join();
+        }
+    }
+}
+
+fn worker_loop<S: CompletionSource>(sh: &Shared<S>) {
+    let mut events = Vec::with_capacity(DEQUEUE_BATCH);
+    loop {
+        events.clear();
+        sh.src.dequeue(&mut events, DEQUEUE_BATCH, None);
+        if events.is_empty() {
+            continue;
+        }
+        sh.stats.dequeues.fetch_add(1, Ordering::Relaxed);
+        let mut stop = false;
+        for ev in events.drain(..) {
+            match ev {
+                Event::Wake => {
+                    // Clear before draining so a concurrent submit re-posts if we miss it
+                    sh.wake_pending.store(false, Ordering::SeqCst);
+                    while let Ok((req, submitted)) = sh.rx_submit.try_recv() {
+                        if let Some(done) = sh.src.start(req, submitted) {
+                            finish(sh, done);
+                        }
+                    }
+                    stop |= sh.shutdown.load(Ordering::SeqCst);
+                }
+                Event::Done(done) => finish(sh, done),
+            }
+        }
+        if stop {
+            // A batch may hold several wakes; hand shutdown on to the next worker
+            sh.src.post_wake();
+            break;
+        }
+    }
+}
+
+fn finish<S: CompletionSource>(sh: &Shared<S>, done: Done) {
+    let st = &sh.stats;
+    let lat = done.submitted.elapsed().as_nanos() as u64;
+    st.completed.fetch_add(1, Ordering::Relaxed);
+    metrics::record(Hist::Ioctl, lat);
+    if done.result.is_err() {
+        st.errors.fetch_add(1, Ordering::Relaxed);
+        metrics::add(Counter::IoctlErrors, 1);
+    }
+    st.lat_ns_total.fetch_add(lat, Ordering::Relaxed);
+    st.lat_ns_max.fetch_max(lat, Ordering::Relaxed);
+    if let Some(t) = trace::active() {
+        // Stamped at issue, with the duration in clock ticks
+        let ticks = (lat as u128 * t.khz() as u128 / 1_000_000) as u64;
+        t.record_at(trace::now().wrapping_sub(ticks), trace::EV_IOCTL, 0, 0, ticks.min(u32::MAX as u64) as u32, done.code);
+    }
+    match done.reply {
+        Reply::Channel(tx) => {
+            let out = done.out;
+            let _ = tx.send(done.result.map(|n| out.into_vec(n as usize)));
+        }
+        Reply::Slot(slot, ticket) => slot.complete(ticket, done.result, done.out),
+    }
+}
+
+/// In-process completion source: every request completes asynchronously,
+/// filling its whole out buffer (or failing for `SimSource::FAIL_CODE`). Used by
+/// tests and benchmarks on hosts without the driver.
+pub struct SimSource {
+    q: Mutex<VecDeque<Event>>,
+    cv: Condvar,
+}
+
+impl SimSource {
+    pub const FAIL_CODE: u32 = 0xFFFF_FFFF;
+
+    pub fn new() -> Self {
+        Self { q: Mutex::new(VecDeque::with_capacity(SUBMIT_QUEUE)), cv: Condvar::new() }
+    }
+
+    fn push(&self, ev: Event) {
+        self.q.lock().unwrap().push_back(ev);
+        self.cv.notify_one();
+    }
+}
+
+impl Default for SimSource {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl CompletionSource for SimSource {
+    fn start(&self, req: IoctlRequest, submitted: Instant) -> Option<Done> {
+        let mut out = req.out;
+        let result = if req.code == Self::FAIL_CODE {
+            Err(anyhow!("sim: ioctl failed"))
+        } else {
+            Ok(out.ptr_len().1 as u32)
+        };
+        self.push(Event::Done(Done { code: req.code, reply: req.reply, result, out, submitted }));
+        None
+    }
+
+    fn dequeue(&self, out: &mut Vec<Event>, max: usize, timeout: Option<Duration>) {
+        let mut q = self.q.lock().unwrap();
+        while q.is_empty() {
+            q = match timeout {
+                Some(t) => {
+                    let (g, res) = self.cv.wait_timeout(q, t).unwrap();
+                    if res.timed_out() { return; }
+                    g
+                }
+                None => self.cv.wait(q).unwrap(),
+            };
+        }
+        let n = q.len().min(max);
+        out.extend(q.drain(..n));
+    }
+
+    fn post_wake(&self) {
+        self.push(Event::Wake);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn req(code: u32, cap: usize) -> (IoctlRequest, Receiver<Result<Vec<u8>>>) {
+        let (tx, rx) = crossbeam_channel::bounded(1);
+        let out = OutBuf::Owned(vec![0u8; cap]);
+        (IoctlRequest { code, inbuf: InBuf::None, out, reply: Reply::Channel(tx) }, rx)
+    }
+
+    #[test]
+    fn completes_every_request_and_counts() {
+        let r = ReactorCore::with_source(SimSource::new(), 1);
+        let rxs: Vec<_> = (0..500).map(|i| {
+            let (q, rx) = req(1, i % 7);
+            r.submit(q).unwrap();
+            rx
+        }).collect();
+        for (i, rx) in rxs.into_iter().enumerate() {
+            let out = rx.recv_timeout(Duration::from_secs(5)).unwrap().unwrap();
+            assert_eq!(out.len(), i % 7);
+        }
+        let s = r.stats();
+        assert_eq!(s.submitted, 500);
+        assert_eq!(s.completed, 500);
+        assert_eq!(s.errors, 0);
+        // Wakes coalesce; each dequeue handles at least one event
+        assert!(s.wakes_posted <= 500);
+        assert!(s.dequeues <= s.wakes_posted + s.completed, "dequeues {}", s.dequeues);
+        assert!(s.events_per_dequeue() >= 1.0);
+    }
+
+    #[test]
+    fn errors_are_reported_and_counted() {
+        let r = ReactorCore::with_source(SimSource::new(), 1);
+        let (q, rx) = req(SimSource::FAIL_CODE, 0);
+        r.submit(q).unwrap();
+        assert!(rx.recv_timeout(Duration::from_secs(5)).unwrap().is_err());
+        assert_eq!(r.stats().errors, 1);
+    }
+
+    #[test]
+    fn multiple_workers_share_one_source() {
+        let r = Arc::new(ReactorCore::with_source(SimSource::new(), 4));
+        let handles: Vec<_> = (0..4).map(|_| {
+            let r = r.clone();
+            thread::spawn(move || {
+                for _ in 0..250 {
+                    let (q, rx) = req(1, 16);
+                    r.submit(q).unwrap();
+                    assert_eq!(rx.recv_timeout(Duration::from_secs(5)).unwrap().unwrap().len(), 16);
+                }
+            })
+        }).collect();
+        for h in handles { h.join().unwrap(); }
+        assert_eq!(r.stats().completed, 1000);
+    }
+
+    #[test]
+    fn slot_returns_the_out_buffer() {
+        let r = ReactorCore::with_source(SimSource::new(), 1);
+        let slot = CompletionSlot::new();
+        for _ in 0..3 {
+            let req = IoctlRequest { code: 1, inbuf: InBuf::inline(&[1, 2, 3]), out: OutBuf::Inline(Inline::zeroed(8)), reply: slot.arm() };
+            r.submit(req).unwrap();
+            let (n, out) = slot.wait(Duration::from_secs(5)).unwrap();
+            assert_eq!(n, 8);
+            assert_eq!(out.filled(n).len(), 8);
+        }
+    }
+
+    #[test]
+    fn stale_ticket_is_ignored() {
+        let slot = CompletionSlot::new();
+        let Reply::Slot(_, old) = slot.arm() else { unreachable!() };
+        let _ = slot.arm();
+        slot.complete(old, Ok(4), OutBuf::None);
+        assert!(slot.wait(Duration::from_millis(20)).is_err());
+    }
+
+    #[test]
+    fn wait_in_place_cancels_then_waits_for_completion() {
+        let slot = Arc::new(CompletionSlot::new());
+        let Reply::Slot(_, ticket) = slot.arm() else { unreachable!() };
+        slot.set_cancel(ticket, 0x1234);
+        let s2 = slot.clone();
+        let res = slot.wait_in_place(Duration::from_millis(10), move |token| {
+            assert_eq!(token, 0x1234);
+            // The source completes a cancelled IRP later, with an error status
+            let s3 = s2.clone();
+            thread::spawn(move || {
+                thread::sleep(Duration::from_millis(20));
+                s3.complete(ticket, Err(IoctlError::Status(0xC000_0120).into()), OutBuf::None);
+            });
+        });
+        assert_eq!(res.err().as_ref().and_then(IoctlError::of), Some(IoctlError::Timeout));
+    }
+
+    #[test]
+    fn drop_joins_idle_workers() {
+        let r = ReactorCore::with_source(SimSource::new(), 3);
+        drop(r);
+    }
+}
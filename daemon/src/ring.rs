@@ -1,52 +1,289 @@
+//! Lock-free single-producer single-consumer byte rings.
+//!
+//! A ring is driven through a [`Producer`] and a [`Consumer`], each owned by
+//! one thread. Besides copying `write`/`read`, the producer reserves free
+//! space and commits it and the consumer peeks at queued bytes and consumes
+//! them, both as up to two slices (the second after the wrap), so framing
+//! code works in place. The batch calls move several messages for one index
+//! store.
+//!
+//! Indices follow struct colx_vtty_ring: both are kept masked and one byte
+//! stays free so a full ring differs from an empty one. The same handles
+//! therefore run over rings in daemon memory ([`ByteRing`]) and over the
+//! shared VTTY rings ([`Producer::from_raw`], [`Consumer::from_raw`]).
+
+use std::cell::UnsafeCell;
 use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+
+/// struct colx_vtty_ring before buf: head, tail, cap, _rsvd.
+const VTTY_RING_HDR: usize = 16;
+
+/// Keeps each index on its own cache line, so the producer's head stores do
+/// not evict the line the consumer publishes tail on.
+#[repr(align(64))]
+struct CachePadded<T>(T);
 
+/// Ring storage in daemon memory; `split` hands out its two ends.
 pub struct ByteRing {
-    buf: Vec<u8>,
-    cap: u32,
-    head: AtomicU32,
-    tail: AtomicU32,
+    head: CachePadded<AtomicU32>,
+    tail: CachePadded<AtomicU32>,
+    buf: Box<[UnsafeCell<u8>]>,
 }
 
+// Only reached through the handles, which own disjoint bytes per head/tail.
+unsafe impl Sync for ByteRing {}
+
 impl ByteRing {
     pub fn with_capacity(cap: usize) -> Self {
-        assert!(cap.is_power_of_two());
+        assert!(cap.is_power_of_two() && cap > 1 && cap <= 1 << 31);
         Self {
-            buf: vec![0u8; cap],
-            cap: cap as u32,
-            head: AtomicU32::new(0),
-            tail: AtomicU32::new(0),
+            head: CachePadded(AtomicU32::new(0)),
+            tail: CachePadded(AtomicU32::new(0)),
+            buf: (0..cap).map(|_| UnsafeCell::new(0)).collect(),
+        }
+    }
+
+    pub fn split(self) -> (Producer, Consumer) {
+        let ring = Arc::new(self);
+        let raw = Raw {
+            head: &ring.head.0,
+            tail: &ring.tail.0,
+            buf: UnsafeCell::raw_get(ring.buf.as_ptr()),
+            mask: ring.buf.len() as u32 - 1,
+        };
+        (Producer { raw, head: 0, tail: 0, _ring: Some(ring.clone()) }, Consumer { raw, tail: 0, head: 0, _ring: Some(ring) })
+    }
+}
+
+/// Where a ring's indices and bytes live.
+#[derive(Clone, Copy)]
+struct Raw {
+    head: *const AtomicU32,
+    tail: *const AtomicU32,
+    buf: *mut u8,
+    mask: u32,
+}
+
+impl Raw {
+    /// # Safety
+    /// `ring` is a struct colx_vtty_ring with `cap` bytes of buf.
+    unsafe fn vtty(ring: *mut u8, cap: usize) -> Self {
+        assert!(cap.is_power_of_two() && cap > 1 && cap <= 1 << 31);
+        Self { head: ring as *const AtomicU32, tail: ring.add(4) as *const AtomicU32, buf: ring.add(VTTY_RING_HDR), mask: cap as u32 - 1 }
+    }
+
+    fn head(&self) -> &AtomicU32 {
+        unsafe { &*self.head }
+    }
+
+    fn tail(&self) -> &AtomicU32 {
+        unsafe { &*self.tail }
+    }
+
+    fn used(&self, head: u32, tail: u32) -> u32 {
+        head.wrapping_sub(tail) & self.mask
+    }
+
+    /// `n` bytes from `at` as (first, wrapped) raw parts.
+    fn spans(&self, at: u32, n: u32) -> ((*mut u8, usize), (*mut u8, usize)) {
+        let first = n.min(self.mask + 1 - at);
+        (unsafe { (self.buf.add(at as usize), first as usize) }, (self.buf, (n - first) as usize))
+    }
+}
+
+/// Write end. Keeps its own head and a cached copy of the consumer's tail,
+/// which is reloaded only when the cached view is short of space.
+pub struct Producer {
+    raw: Raw,
+    head: u32,
+    tail: u32,
+    _ring: Option<Arc<ByteRing>>,
+}
+
+unsafe impl Send for Producer {}
+
+impl Producer {
+    /// Write end of a shared colx_vtty_ring.
+    ///
+    /// # Safety
+    /// `ring` points at the ring header followed by `cap` bytes, a power of
+    /// two, that stay mapped while the handle lives, and nothing else writes
+    /// the ring meanwhile.
+    pub unsafe fn from_raw(ring: *mut u8, cap: usize) -> Self {
+        let raw = Raw::vtty(ring, cap);
+        let (head, tail) = (raw.head().load(Ordering::Relaxed) & raw.mask, raw.tail().load(Ordering::Acquire) & raw.mask);
+        Self { raw, head, tail, _ring: None }
+    }
+
+    fn known_free(&self) -> u32 {
+        self.raw.mask - self.raw.used(self.head, self.tail)
+    }
+
+    fn free_for(&mut self, want: u32) -> u32 {
+        if self.known_free() < want {
+            // The peer may be a guest: never trust an unmasked index
+            self.tail = self.raw.tail().load(Ordering::Acquire) & self.raw.mask;
         }
+        self.known_free()
+    }
+
+    /// Bytes that can be written right now.
+    pub fn free(&mut self) -> usize {
+        self.free_for(u32::MAX) as usize
     }
 
-    #[inline]
-    fn mask(&self) -> u32 { self.cap - 1 }
-
-    pub fn write(&self, src: &[u8]) -> usize {
-        let head = self.head.load(Ordering::Acquire);
-        let tail = self.tail.load(Ordering::Acquire);
-        let used = head.wrapping_sub(tail) & self.mask();
-        let free = self.cap - used - 1;
-        let n = free.min(src.len() as u32) as usize;
-        let idx = (head & self.mask()) as usize;
-        let first = n.min(self.buf.len() - idx);
-        if first > 0 { self.buf[idx..idx+first].copy_from_slice(&src[..first]); }
-        if n > first { self.buf[..(n-first)].copy_from_slice(&src[first..n]); }
-        self.head.store(head.wrapping_add(n as u32) & self.mask(), Ordering::Release);
-        n
-    }
-
-    pub fn read(&self, dst: &mut [u8]) -> usize {
-        let head = self.head.load(Ordering::Acquire);
-        let tail = self.tail.load(Ordering::Acquire);
-        let used = head.wrapping_sub(tail) & self.mask();
-        let n = used.min(dst.len() as u32) as usize;
-        let idx = (tail & self.mask()) as usize;
-        let first = n.min(self.buf.len() - idx);
-        if first > 0 { dst[..first].copy_from_slice(&self.buf[idx..idx+first]); }
-        if n > first { dst[first..n].copy_from_slice(&self.buf[..(n-first)]); }
-        self.tail.store(tail.wrapping_add(n as u32) & self.mask(), Ordering::Release);
-        n
+    /// Up to `n` bytes of free space, the second slice after the wrap. They
+    /// are the caller's to fill until `commit`; both are empty if the ring is
+    /// full.
+    pub fn reserve(&mut self, n: usize) -> (&mut [u8], &mut [u8]) {
+        let want = n.min(self.raw.mask as usize) as u32;
+        let n = self.free_for(want).min(want);
+        let ((a, la), (b, lb)) = self.raw.spans(self.head, n);
+        unsafe { (std::slice::from_raw_parts_mut(a, la), std::slice::from_raw_parts_mut(b, lb)) }
     }
+
+    /// Publish the first `n` bytes of the last reservation.
+    pub fn commit(&mut self, n: usize) {
+        assert!(n <= self.known_free() as usize, "commit past the free space");
+        if n == 0 {
+            return;
+        }
+        self.head = self.head.wrapping_add(n as u32) & self.raw.mask;
+        self.raw.head().store(self.head, Ordering::Release);
+    }
+
+    /// Copy as much of `src` as fits; returns the bytes written.
+    pub fn write(&mut self, src: &[u8]) -> usize {
+        let (a, b) = self.reserve(src.len());
+        let (la, lb) = (a.len(), b.len());
+        a.copy_from_slice(&src[..la]);
+        b.copy_from_slice(&src[la..la + lb]);
+        self.commit(la + lb);
+        la + lb
+    }
+
+    /// Write whole messages in order while they fit and publish them with a
+    /// single head store; returns how many went in.
+    pub fn write_batch<'m>(&mut self, msgs: impl IntoIterator<Item = &'m [u8]>) -> usize {
+        let (a, b) = self.reserve(usize::MAX);
+        let (mut off, mut count) = (0, 0);
+        for m in msgs {
+            if off + m.len() > a.len() + b.len() {
+                break;
+            }
+            copy_in(a, b, off, m);
+            off += m.len();
+            count += 1;
+        }
+        self.commit(off);
+        count
+    }
+}
+
+/// Read end. Keeps its own tail and a cached copy of the producer's head.
+pub struct Consumer {
+    raw: Raw,
+    tail: u32,
+    head: u32,
+    _ring: Option<Arc<ByteRing>>,
+}
+
+unsafe impl Send for Consumer {}
+
+impl Consumer {
+    /// Read end of a shared colx_vtty_ring.
+    ///
+    /// # Safety
+    /// As [`Producer::from_raw`], with nothing else reading the ring.
+    pub unsafe fn from_raw(ring: *mut u8, cap: usize) -> Self {
+        let raw = Raw::vtty(ring, cap);
+        let (tail, head) = (raw.tail().load(Ordering::Relaxed) & raw.mask, raw.head().load(Ordering::Acquire) & raw.mask);
+        Self { raw, tail, head, _ring: None }
+    }
+
+    fn known_used(&self) -> u32 {
+        self.raw.used(self.head, self.tail)
+    }
+
+    fn used_for(&mut self, want: u32) -> u32 {
+        if self.known_used() < want {
+            self.head = self.raw.head().load(Ordering::Acquire) & self.raw.mask;
+        }
+        self.known_used()
+    }
+
+    /// Bytes queued right now.
+    pub fn available(&mut self) -> usize {
+        self.used_for(u32::MAX) as usize
+    }
+
+    /// Up to `n` queued bytes, the second slice after the wrap; both empty if
+    /// the ring is.
+    pub fn peek(&mut self, n: usize) -> (&[u8], &[u8]) {
+        let want = n.min(self.raw.mask as usize) as u32;
+        let n = self.used_for(want).min(want);
+        let ((a, la), (b, lb)) = self.raw.spans(self.tail, n);
+        unsafe { (std::slice::from_raw_parts(a, la), std::slice::from_raw_parts(b, lb)) }
+    }
+
+    /// Hand the first `n` peeked bytes back to the producer.
+    pub fn consume(&mut self, n: usize) {
+        assert!(n <= self.known_used() as usize, "consume past the queued bytes");
+        if n == 0 {
+            return;
+        }
+        self.tail = self.tail.wrapping_add(n as u32) & self.raw.mask;
+        self.raw.tail().store(self.tail, Ordering::Release);
+    }
+
+    /// Copy up to `dst.len()` bytes out; returns the bytes read.
+    pub fn read(&mut self, dst: &mut [u8]) -> usize {
+        let (a, b) = self.peek(dst.len());
+        let (la, lb) = (a.len(), b.len());
+        dst[..la].copy_from_slice(a);
+        dst[la..la + lb].copy_from_slice(b);
+        self.consume(la + lb);
+        la + lb
+    }
+
+    /// Fill each of `dsts` completely in order while enough is queued and
+    /// release them with a single tail store; returns how many were filled.
+    pub fn read_batch(&mut self, dsts: &mut [&mut [u8]]) -> usize {
+        let (a, b) = self.peek(usize::MAX);
+        let (mut off, mut count) = (0, 0);
+        for d in dsts.iter_mut() {
+            if off + d.len() > a.len() + b.len() {
+                break;
+            }
+            copy_out(a, b, off, d);
+            off += d.len();
+            count += 1;
+        }
+        self.consume(off);
+        count
+    }
+}
+
+/// Copy `src` to offset `off` of the span made of `a` then `b`.
+fn copy_in(a: &mut [u8], b: &mut [u8], off: usize, src: &[u8]) {
+    let first = src.len().min(a.len().saturating_sub(off));
+    if first != 0 {
+        a[off..off + first].copy_from_slice(&src[..first]);
+    }
+    let at = (off + first).saturating_sub(a.len());
+    b[at..at + src.len() - first].copy_from_slice(&src[first..]);
+}
+
+/// Copy `dst.len()` bytes from offset `off` of the span made of `a` then `b`.
+fn copy_out(a: &[u8], b: &[u8], off: usize, dst: &mut [u8]) {
+    let first = dst.len().min(a.len().saturating_sub(off));
+    if first != 0 {
+        dst[..first].copy_from_slice(&a[off..off + first]);
+    }
+    let at = (off + first).saturating_sub(a.len());
+    let n = dst.len() - first;
+    dst[first..].copy_from_slice(&b[at..at + n]);
 }
 
 #[cfg(test)]
@@ -55,30 +292,110 @@ mod tests {
 
     #[test]
     fn wraparound() {
-        let r = ByteRing::with_capacity(8);
-        assert_eq!(r.write(&[1,2,3,4,5]), 5);
-        let mut out = [0u8;3];
-        assert_eq!(r.read(&mut out), 3);
-        assert_eq!(&out, &[1,2,3]);
-        assert_eq!(r.write(&[6,7,8,9]), 4);
-        let mut out2 = [0u8;6];
-        let n = r.read(&mut out2);
+        let (mut tx, mut rx) = ByteRing::with_capacity(8).split();
+        assert_eq!(tx.write(&[1, 2, 3, 4, 5]), 5);
+        let mut out = [0u8; 3];
+        assert_eq!(rx.read(&mut out), 3);
+        assert_eq!(&out, &[1, 2, 3]);
+        assert_eq!(tx.write(&[6, 7, 8, 9]), 4);
+        let mut out2 = [0u8; 6];
+        let n = rx.read(&mut out2);
         assert_eq!(n, 6);
-        assert_eq!(&out2[..n], &[4,5,6,7,8,9]);
+        assert_eq!(&out2[..n], &[4, 5, 6, 7, 8, 9]);
     }
 
     #[test]
     fn full_empty() {
-        let r = ByteRing::with_capacity(8);
+        let (mut tx, mut rx) = ByteRing::with_capacity(8).split();
         let mut total = 0;
-        total += r.write(&[0;7]);
-        assert_eq!(total,7);
-        total += r.write(&[1,2,3]);
-        assert_eq!(total,7); // full minus 1 sentinel
-        let mut out = [0u8;4];
-        assert_eq!(r.read(&mut out), 4);
-        assert_eq!(r.read(&mut out), 3);
-        assert_eq!(r.read(&mut out), 0);
+        total += tx.write(&[0; 7]);
+        assert_eq!(total, 7);
+        total += tx.write(&[1, 2, 3]);
+        assert_eq!(total, 7); // full minus 1 sentinel
+        assert_eq!(tx.free(), 0);
+        let mut out = [0u8; 4];
+        assert_eq!(rx.read(&mut out), 4);
+        assert_eq!(rx.read(&mut out), 3);
+        assert_eq!(rx.read(&mut out), 0);
+    }
+
+    #[test]
+    fn reserve_and_peek_split_at_the_wrap() {
+        let (mut tx, mut rx) = ByteRing::with_capacity(16).split();
+        tx.write(&[0; 12]);
+        assert_eq!(rx.available(), 12);
+        rx.consume(12);
+        let (a, b) = tx.reserve(8);
+        assert_eq!((a.len(), b.len()), (4, 4));
+        a.copy_from_slice(b"abcd");
+        b[..2].copy_from_slice(b"ef");
+        tx.commit(6);
+        let (a, b) = rx.peek(usize::MAX);
+        assert_eq!((a, b), (&b"abcd"[..], &b"ef"[..]));
+        rx.consume(5);
+        assert_eq!(rx.peek(8), (&b"f"[..], &[][..]));
     }
-}
 
+    #[test]
+    fn batches_move_whole_messages() {
+        let (mut tx, mut rx) = ByteRing::with_capacity(16).split();
+        tx.write(&[0; 10]);
+        rx.read(&mut [0; 10]);
+        let msgs: [&[u8]; 4] = [b"one", b"two", b"three", b"fourth"];
+        assert_eq!(tx.write_batch(msgs), 3, "fourth does not fit in the 4 bytes left");
+        let (mut m0, mut m1, mut m2) = ([0u8; 3], [0u8; 3], [0u8; 6]);
+        assert_eq!(rx.read_batch(&mut [&mut m0, &mut m1, &mut m2]), 2);
+        assert_eq!((&m0, &m1), (b"one", b"two"));
+        assert_eq!(rx.available(), 5);
+    }
+
+    #[test]
+    fn streams_across_threads() {
+        const TOTAL: usize = 1 << 20;
+        let (mut tx, mut rx) = ByteRing::with_capacity(256).split();
+        let t = std::thread::spawn(move || {
+            let mut sent = 0;
+            while sent < TOTAL {
+                let (a, b) = tx.reserve((sent % 61) + 1);
+                for (i, v) in a.iter_mut().chain(b.iter_mut()).enumerate() {
+                    *v = (sent + i) as u8;
+                }
+                let n = a.len() + b.len();
+                tx.commit(n);
+                sent += n;
+                if n == 0 {
+                    std::thread::yield_now();
+                }
+            }
+        });
+        let mut seen = 0;
+        while seen < TOTAL {
+            let (a, b) = rx.peek(TOTAL - seen);
+            for (i, &v) in a.iter().chain(b).enumerate() {
+                assert_eq!(v, (seen + i) as u8);
+            }
+            let n = a.len() + b.len();
+            rx.consume(n);
+            seen += n;
+            if n == 0 {
+                std::thread::yield_now();
+            }
+        }
+        t.join().unwrap();
+    }
+
+    #[test]
+    fn runs_over_a_vtty_ring_layout() {
+        let cap = 32;
+        let mut mem = vec![0u32; (VTTY_RING_HDR + cap) / 4];
+        mem[..4].copy_from_slice(&[30, 30, cap as u32, 0]);
+        let ring = mem.as_mut_ptr() as *mut u8;
+        let (mut tx, mut rx) = unsafe { (Producer::from_raw(ring, cap), Consumer::from_raw(ring, cap)) };
+        assert_eq!(tx.write(b"wrap"), 4);
+        assert_eq!(mem[0], 2, "head is stored masked");
+        let mut out = [0u8; 8];
+        assert_eq!(rx.read(&mut out), 4);
+        assert_eq!(&out[..4], b"wrap");
+        assert_eq!(mem[1], 2);
+    }
+}
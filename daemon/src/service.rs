@@ -1,6 +1,6 @@
 //! Windows Service wrapper for coLinux 2.0 (SCM install/uninstall, event log).
 use std::ffi::OsString;
-use std::sync::{atomic::{AtomicBool, Ordering}, Arc, OnceLock};
+use std::sync::{Arc, OnceLock};
 use std::time::Duration;
 
 use anyhow::Result;
@@ -16,8 +16,6 @@ pub const SERVICE_NAME: &str = "coLinux2";
 pub const SERVICE_DISPLAY_NAME: &str = "coLinux 2.0 Daemon";
 pub const EVENT_SOURCE: &str = "coLinux2";
 
-pub static STOP_FLAG: AtomicBool = AtomicBool::new(false);
-
 // Holds the main loop to run inside the service context
 static RUNNER: OnceLock<Arc<dyn Fn() -> Result<()> + Send + Sync + 'static>> = OnceLock::new();
 
@@ -72,7 +70,7 @@ fn service_main(_args: Vec<OsString>) {
 
     let status_handle = service_control_handler::register(SERVICE_NAME, move |control| match control {
         ServiceControl::Stop | ServiceControl::Shutdown => {
-            STOP_FLAG.store(true, Ordering::SeqCst);
+            crate::shutdown::request();
             ServiceControlHandlerResult::NoError
         }
         ServiceControl::Interrogate => ServiceControlHandlerResult::NoError,
@@ -107,7 +105,7 @@ fn service_main(_args: Vec<OsString>) {
     let _ = status_handle.set_service_status(status.clone());
 
     // wait for stop
-    while !STOP_FLAG.load(Ordering::SeqCst) {
+    while !crate::shutdown::requested() {
         std::thread::sleep(Duration::from_millis(250));
     }
 
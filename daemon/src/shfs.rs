@@ -0,0 +1,1117 @@
+//! Shared folder (SHFS): serves the configured host directory
+//! (`shared.host_path`) to the guest's colxfs over a request ring in the
+//! shared mapping (`struct colx_shfs_slot` in colinux_ring.h).
+//!
+//! Every slot owns a page-aligned window. Requests carry names and write
+//! payloads in it; replies carry attributes, directory records and file
+//! data. READ fills the window straight from the host file, so file bytes
+//! reach the guest without a daemon-side bounce buffer.
+//!
+//! Node ids name looked-up paths until the guest forgets them. File handles
+//! name open files and directory snapshots until they are released. Each
+//! name is a single path component, and symlinks must resolve inside the
+//! share, so the guest cannot address anything outside it.
+
+use crate::device::MapInfo;
+use crate::geom::{Geometry, SHFS_SLOT_LEN};
+use anyhow::{bail, Context, Result};
+use std::collections::HashMap;
+use std::fs::{self, File, Metadata, OpenOptions};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+pub const OP_LOOKUP: u32 = 1;
+pub const OP_FORGET: u32 = 2;
+pub const OP_GETATTR: u32 = 3;
+pub const OP_SETATTR: u32 = 4;
+pub const OP_OPEN: u32 = 5;
+pub const OP_RELEASE: u32 = 6;
+pub const OP_READ: u32 = 7;
+pub const OP_WRITE: u32 = 8;
+pub const OP_READDIR: u32 = 9;
+pub const OP_CREATE: u32 = 10;
+pub const OP_MKDIR: u32 = 11;
+pub const OP_UNLINK: u32 = 12;
+pub const OP_RMDIR: u32 = 13;
+pub const OP_RENAME: u32 = 14;
+pub const OP_FSYNC: u32 = 15;
+pub const OP_STATFS: u32 = 16;
+
+/// SETATTR flags: which fields of the attr in the window to apply.
+pub const SET_MODE: u32 = 0x1;
+pub const SET_SIZE: u32 = 0x2;
+pub const SET_MTIME: u32 = 0x4;
+
+/// The shared directory's node id.
+pub const ROOT: u64 = 1;
+pub const ATTR_LEN: usize = 64;
+const DIRENT_HDR: usize = 24;
+const STATFS_LEN: usize = 48;
+const NAME_MAX: usize = 255;
+
+// Linux open flags, as the guest sends them
+const O_ACCMODE: u32 = 0o3;
+const O_WRONLY: u32 = 0o1;
+const O_EXCL: u32 = 0o200;
+const O_TRUNC: u32 = 0o1000;
+const O_APPEND: u32 = 0o2000;
+
+#[cfg(not(unix))]
+const S_IFDIR: u32 = 0o040000;
+#[cfg_attr(unix, allow(dead_code))]
+const S_IFREG: u32 = 0o100000;
+const DT_UNKNOWN: u32 = 0;
+const DT_DIR: u32 = 4;
+const DT_REG: u32 = 8;
+
+// Linux errno values the guest returns to its callers
+const ENOENT: i32 = 2;
+const EIO: i32 = 5;
+const EBADF: i32 = 9;
+const EACCES: i32 = 13;
+#[cfg(windows)]
+const EBUSY: i32 = 16;
+const EEXIST: i32 = 17;
+const ENOTDIR: i32 = 20;
+const EINVAL: i32 = 22;
+#[cfg(windows)]
+const ENOSPC: i32 = 28;
+const EROFS: i32 = 30;
+const ENAMETOOLONG: i32 = 36;
+const ENOSYS: i32 = 38;
+#[cfg_attr(unix, allow(dead_code))]
+const ENOTEMPTY: i32 = 39;
+const ESTALE: i32 = 116;
+
+/// A failed request: the errno the guest sees.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Errno(pub i32);
+
+impl From<io::Error> for Errno {
+    fn from(e: io::Error) -> Self {
+        #[cfg(unix)]
+        if let Some(n) = e.raw_os_error() {
+            return Errno(n);
+        }
+        #[cfg(windows)]
+        match e.raw_os_error() {
+            Some(2 | 3) => return Errno(ENOENT), // FILE_ / PATH_NOT_FOUND
+            Some(5) => return Errno(EACCES),
+            Some(32 | 33) => return Errno(EBUSY), // sharing / lock violation
+            Some(80 | 183) => return Errno(EEXIST),
+            Some(112) => return Errno(ENOSPC),
+            Some(145) => return Errno(ENOTEMPTY),
+            Some(206) => return Errno(ENAMETOOLONG),
+            Some(267) => return Errno(ENOTDIR), // ERROR_DIRECTORY
+            _ => {}
+        }
+        Errno(match e.kind() {
+            io::ErrorKind::NotFound => ENOENT,
+            io::ErrorKind::PermissionDenied => EACCES,
+            io::ErrorKind::AlreadyExists => EEXIST,
+            io::ErrorKind::InvalidInput => EINVAL,
+            _ => EIO,
+        })
+    }
+}
+
+type OpResult = std::result::Result<Reply, Errno>;
+
+/// One request as the guest filled its slot.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Request {
+    pub op: u32,
+    pub node: u64,
+    pub fh: u64,
+    pub offset: u64,
+    pub arg: u64,
+    pub len: u32,
+    pub flags: u32,
+}
+
+/// The reply: `len` bytes of it are in the window.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Reply {
+    pub error: i32,
+    pub len: u32,
+    pub fh: u64,
+    pub arg: u64,
+}
+
+impl Reply {
+    fn len(len: usize) -> Self {
+        Self { len: len as u32, ..Self::default() }
+    }
+}
+
+/// struct colx_shfs_attr
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Attr {
+    pub node: u64,
+    pub ino: u64,
+    pub size: u64,
+    pub blocks: u64,
+    pub atime_ns: i64,
+    pub mtime_ns: i64,
+    pub ctime_ns: i64,
+    pub mode: u32,
+    pub nlink: u32,
+}
+
+impl Attr {
+    pub fn encode(&self, b: &mut [u8]) {
+        let words = [self.node, self.ino, self.size, self.blocks, self.atime_ns as u64, self.mtime_ns as u64, self.ctime_ns as u64];
+        for (i, v) in words.into_iter().enumerate() {
+            b[i * 8..i * 8 + 8].copy_from_slice(&v.to_le_bytes());
+        }
+        b[56..60].copy_from_slice(&self.mode.to_le_bytes());
+        b[60..64].copy_from_slice(&self.nlink.to_le_bytes());
+    }
+
+    pub fn decode(b: &[u8]) -> Self {
+        let u64_at = |o: usize| u64::from_le_bytes(b[o..o + 8].try_into().unwrap());
+        let u32_at = |o: usize| u32::from_le_bytes(b[o..o + 4].try_into().unwrap());
+        Self {
+            node: u64_at(0),
+            ino: u64_at(8),
+            size: u64_at(16),
+            blocks: u64_at(24),
+            atime_ns: u64_at(32) as i64,
+            mtime_ns: u64_at(40) as i64,
+            ctime_ns: u64_at(48) as i64,
+            mode: u32_at(56),
+            nlink: u32_at(60),
+        }
+    }
+}
+
+struct Node {
+    /// Relative to the share; None once the path was unlinked or replaced.
+    path: Option<PathBuf>,
+    lookups: u64,
+}
+
+struct DirEntry {
+    name: String,
+    ino: u64,
+    kind: u32,
+}
+
+enum Handle {
+    File { file: Arc<File>, append: bool },
+    /// Taken at OPEN, so READDIR cookies stay valid while the directory changes.
+    Dir(Arc<[DirEntry]>),
+}
+
+struct State {
+    nodes: HashMap<u64, Node>,
+    by_path: HashMap<PathBuf, u64>,
+    next_node: u64,
+    handles: HashMap<u64, Handle>,
+    next_fh: u64,
+}
+
+/// The host side of colxfs: a directory tree, its node ids and open handles.
+pub struct ShfsServer {
+    root: PathBuf,
+    read_only: bool,
+    state: Mutex<State>,
+}
+
+impl ShfsServer {
+    pub fn new(root: &Path, read_only: bool) -> Result<Self> {
+        let root = fs::canonicalize(root).with_context(|| format!("shared folder {}", root.display()))?;
+        if !root.is_dir() {
+            bail!("shared folder {} is not a directory", root.display());
+        }
+        let mut nodes = HashMap::new();
+        nodes.insert(ROOT, Node { path: Some(PathBuf::new()), lookups: 1 });
+        let by_path = HashMap::from([(PathBuf::new(), ROOT)]);
+        let state = State { nodes, by_path, next_node: ROOT + 1, handles: HashMap::new(), next_fh: 1 };
+        Ok(Self { root, read_only, state: Mutex::new(state) })
+    }
+
+    pub fn root(&self) -> &Path {
+        &self.root
+    }
+
+    /// Serve one request whose payload is at the start of `win`; the reply
+    /// replaces it there.
+    pub fn handle(&self, req: &Request, win: &mut [u8]) -> Reply {
+        let r = match req.op {
+            OP_LOOKUP => self.lookup(req, win),
+            OP_FORGET => self.forget(req),
+            OP_GETATTR => self.getattr(req, win),
+            OP_SETATTR => self.setattr(req, win),
+            OP_OPEN => self.open(req),
+            OP_RELEASE => self.release(req),
+            OP_READ => self.read(req, win),
+            OP_WRITE => self.write(req, win),
+            OP_READDIR => self.readdir(req, win),
+            OP_CREATE => self.create(req, win),
+            OP_MKDIR => self.mkdir(req, win),
+            OP_UNLINK | OP_RMDIR => self.remove(req, win),
+            OP_RENAME => self.rename(req, win),
+            OP_FSYNC => self.fsync(req),
+            OP_STATFS => self.statfs(win),
+            _ => Err(Errno(ENOSYS)),
+        };
+        r.unwrap_or_else(|Errno(error)| Reply { error, ..Reply::default() })
+    }
+
+    fn lookup(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        let rel = self.node_path(req.node)?.join(name(payload(req, win)?)?);
+        let meta = self.stat(&rel)?;
+        let node = self.intern(&rel);
+        attr(node, &rel, &meta).encode(win);
+        Ok(Reply::len(ATTR_LEN))
+    }
+
+    fn forget(&self, req: &Request) -> OpResult {
+        let mut st = self.state.lock().unwrap();
+        if req.node != ROOT {
+            if let Some(n) = st.nodes.get_mut(&req.node) {
+                n.lookups = n.lookups.saturating_sub(req.arg);
+                if n.lookups == 0 {
+                    let n = st.nodes.remove(&req.node).unwrap();
+                    if let Some(p) = n.path {
+                        st.by_path.remove(&p);
+                    }
+                }
+            }
+        }
+        Ok(Reply::default())
+    }
+
+    fn getattr(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        let rel = self.node_path(req.node)?;
+        let meta = self.stat(&rel)?;
+        attr(req.node, &rel, &meta).encode(win);
+        Ok(Reply::len(ATTR_LEN))
+    }
+
+    fn setattr(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        self.writable()?;
+        let set = Attr::decode(payload(req, win).and_then(|p| p.get(..ATTR_LEN).ok_or(Errno(EINVAL)))?);
+        let rel = self.node_path(req.node)?;
+        let full = self.resolve(&rel)?;
+        let meta = self.stat(&rel)?;
+        if req.flags & SET_SIZE != 0 {
+            if meta.is_dir() {
+                return Err(Errno(EINVAL));
+            }
+            OpenOptions::new().write(true).open(&full)?.set_len(set.size)?;
+        }
+        if req.flags & SET_MODE != 0 {
+            set_mode(&full, &meta, set.mode)?;
+        }
+        if req.flags & SET_MTIME != 0 && !meta.is_dir() {
+            let t = UNIX_EPOCH + std::time::Duration::from_nanos(set.mtime_ns.max(0) as u64);
+            OpenOptions::new().write(true).open(&full)?.set_modified(t)?;
+        }
+        let meta = self.stat(&rel)?;
+        attr(req.node, &rel, &meta).encode(win);
+        Ok(Reply::len(ATTR_LEN))
+    }
+
+    fn open(&self, req: &Request) -> OpResult {
+        let rel = self.node_path(req.node)?;
+        let meta = self.stat(&rel)?;
+        let handle = if meta.is_dir() {
+            Handle::Dir(self.list_dir(&rel)?.into())
+        } else {
+            let file = open_options(req.flags, self.read_only)?.open(self.resolve(&rel)?)?;
+            Handle::File { file: Arc::new(file), append: req.flags & O_APPEND != 0 }
+        };
+        Ok(Reply { fh: self.add_handle(handle), ..Reply::default() })
+    }
+
+    fn release(&self, req: &Request) -> OpResult {
+        match self.state.lock().unwrap().handles.remove(&req.fh) {
+            Some(_) => Ok(Reply::default()),
+            None => Err(Errno(EBADF)),
+        }
+    }
+
+    /// Fill the window from the file, short only at end of file.
+    fn read(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        let (file, _) = self.file(req.fh)?;
+        let dst = win.get_mut(..req.len as usize).ok_or(Errno(EINVAL))?;
+        let mut n = 0;
+        while n < dst.len() {
+            match read_at(&file, &mut dst[n..], req.offset + n as u64)? {
+                0 => break,
+                k => n += k,
+            }
+        }
+        Ok(Reply::len(n))
+    }
+
+    /// Reply `arg` is the file size afterwards, so the guest keeps i_size
+    /// (and O_APPEND positions) in step with the host.
+    fn write(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        let (file, append) = self.file(req.fh)?;
+        let src = payload(req, win)?;
+        let off = if append { file.metadata()?.len() } else { req.offset };
+        write_at(&file, src, off)?;
+        Ok(Reply { len: src.len() as u32, arg: file.metadata()?.len(), ..Reply::default() })
+    }
+
+    /// Directory records from cookie `offset` on, as many as fit the window.
+    /// Cookies 0 and 1 are the guest's "." and "..".
+    fn readdir(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        let entries = match self.state.lock().unwrap().handles.get(&req.fh) {
+            Some(Handle::Dir(e)) => e.clone(),
+            Some(Handle::File { .. }) => return Err(Errno(ENOTDIR)),
+            None => return Err(Errno(EBADF)),
+        };
+        let mut pos = 0;
+        let start = req.offset.max(2) as usize - 2;
+        for (i, e) in entries.iter().enumerate().skip(start) {
+            let rec = (DIRENT_HDR + e.name.len() + 7) & !7;
+            if pos + rec > win.len() {
+                break;
+            }
+            let b = &mut win[pos..pos + rec];
+            b[0..8].copy_from_slice(&e.ino.to_le_bytes());
+            b[8..16].copy_from_slice(&(i as u64 + 3).to_le_bytes());
+            b[16..20].copy_from_slice(&e.kind.to_le_bytes());
+            b[20..24].copy_from_slice(&(e.name.len() as u32).to_le_bytes());
+            b[DIRENT_HDR..DIRENT_HDR + e.name.len()].copy_from_slice(e.name.as_bytes());
+            b[DIRENT_HDR + e.name.len()..].fill(0);
+            pos += rec;
+        }
+        Ok(Reply::len(pos))
+    }
+
+    fn create(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        self.writable()?;
+        let rel = self.node_path(req.node)?.join(name(payload(req, win)?)?);
+        let mut opts = open_options(req.flags | O_WRONLY, false)?;
+        if req.flags & O_EXCL != 0 {
+            opts.create_new(true);
+        } else {
+            opts.create(true);
+        }
+        #[cfg(unix)]
+        std::os::unix::fs::OpenOptionsExt::mode(&mut opts, req.arg as u32 & 0o7777);
+        // An existing symlink is only followed when its target stays inside
+        // the share (a dangling one is refused too: creating would write
+        // through it); the final open never follows one, so a link swapped in
+        // after the check fails with ELOOP instead of escaping.
+        let mut full = self.resolve(&rel)?;
+        if fs::symlink_metadata(&full).is_ok_and(|m| m.file_type().is_symlink()) {
+            full = fs::canonicalize(&full).map_err(|_| Errno(EACCES))?;
+            if !full.starts_with(&self.root) {
+                return Err(Errno(EACCES));
+            }
+        }
+        #[cfg(target_os = "linux")]
+        std::os::unix::fs::OpenOptionsExt::custom_flags(&mut opts, libc::O_NOFOLLOW);
+        let file = opts.read(true).open(full)?;
+        let meta = file.metadata()?;
+        let node = self.intern(&rel);
+        let fh = self.add_handle(Handle::File { file: Arc::new(file), append: req.flags & O_APPEND != 0 });
+        attr(node, &rel, &meta).encode(win);
+        Ok(Reply { len: ATTR_LEN as u32, fh, ..Reply::default() })
+    }
+
+    fn mkdir(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        self.writable()?;
+        let rel = self.node_path(req.node)?.join(name(payload(req, win)?)?);
+        let full = self.resolve(&rel)?;
+        fs::create_dir(&full)?;
+        let meta = fs::metadata(&full)?;
+        set_mode(&full, &meta, req.arg as u32)?;
+        let node = self.intern(&rel);
+        attr(node, &rel, &fs::metadata(&full)?).encode(win);
+        Ok(Reply::len(ATTR_LEN))
+    }
+
+    fn remove(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        self.writable()?;
+        let rel = self.node_path(req.node)?.join(name(payload(req, win)?)?);
+        let full = self.resolve(&rel)?;
+        if req.op == OP_RMDIR {
+            fs::remove_dir(&full)?;
+        } else {
+            if fs::symlink_metadata(&full)?.is_dir() {
+                return Err(Errno(21)); // EISDIR
+            }
+            fs::remove_file(&full)?;
+        }
+        self.detach(&rel);
+        Ok(Reply::default())
+    }
+
+    /// Payload "old\0new"; `node` is the old directory, `arg` the new one.
+    fn rename(&self, req: &Request, win: &mut [u8]) -> OpResult {
+        self.writable()?;
+        let p = payload(req, win)?;
+        let nul = p.iter().position(|&b| b == 0).ok_or(Errno(EINVAL))?;
+        let from = self.node_path(req.node)?.join(name(&p[..nul])?);
+        let to = self.node_path(req.arg)?.join(name(&p[nul + 1..])?);
+        fs::rename(self.resolve(&from)?, self.resolve(&to)?)?;
+        // Nodes under the old path follow it; whatever `to` named is gone
+        self.detach(&to);
+        let mut st = self.state.lock().unwrap();
+        let moved: Vec<(PathBuf, u64)> = st.by_path.iter().filter(|(p, _)| p.starts_with(&from)).map(|(p, &n)| (p.clone(), n)).collect();
+        for (old, node) in moved {
+            // join("") would append a separator
+            let rest = old.strip_prefix(&from).unwrap();
+            let new = if rest.as_os_str().is_empty() { to.clone() } else { to.join(rest) };
+            st.by_path.remove(&old);
+            st.by_path.insert(new.clone(), node);
+            if let Some(n) = st.nodes.get_mut(&node) {
+                n.path = Some(new);
+            }
+        }
+        Ok(Reply::default())
+    }
+
+    fn fsync(&self, req: &Request) -> OpResult {
+        match self.state.lock().unwrap().handles.get(&req.fh) {
+            Some(Handle::File { file, .. }) => file.sync_all()?,
+            Some(Handle::Dir(_)) => {}
+            None => return Err(Errno(EBADF)),
+        }
+        Ok(Reply::default())
+    }
+
+    fn statfs(&self, win: &mut [u8]) -> OpResult {
+        const BSIZE: u64 = 4096;
+        let (total, free, avail) = disk_space(&self.root)?;
+        for (i, v) in [total / BSIZE, free / BSIZE, avail / BSIZE, 0, 0].into_iter().enumerate() {
+            win[i * 8..i * 8 + 8].copy_from_slice(&v.to_le_bytes());
+        }
+        win[40..44].copy_from_slice(&(BSIZE as u32).to_le_bytes());
+        win[44..48].copy_from_slice(&(NAME_MAX as u32).to_le_bytes());
+        Ok(Reply::len(STATFS_LEN))
+    }
+
+    fn writable(&self) -> std::result::Result<(), Errno> {
+        if self.read_only {
+            return Err(Errno(EROFS));
+        }
+        Ok(())
+    }
+
+    fn host(&self, rel: &Path) -> PathBuf {
+        self.root.join(rel)
+    }
+
+    fn node_path(&self, node: u64) -> std::result::Result<PathBuf, Errno> {
+        let st = self.state.lock().unwrap();
+        st.nodes.get(&node).and_then(|n| n.path.clone()).ok_or(Errno(ESTALE))
+    }
+
+    /// Host path of `rel` with its directory resolved, refused unless that
+    /// directory is inside the share. Node paths are joined under directory
+    /// symlinks once looked up, and a relative one the guest renames to
+    /// another depth may point outside by then. The final component is left
+    /// as is: callers check it (or refuse to follow it) themselves.
+    fn resolve(&self, rel: &Path) -> std::result::Result<PathBuf, Errno> {
+        let (Some(dir), Some(leaf)) = (rel.parent(), rel.file_name()) else { return Ok(self.root.clone()) };
+        if dir.as_os_str().is_empty() {
+            return Ok(self.root.join(leaf));
+        }
+        let dir = fs::canonicalize(self.host(dir))?;
+        if !dir.starts_with(&self.root) {
+            return Err(Errno(EACCES));
+        }
+        Ok(dir.join(leaf))
+    }
+
+    /// Metadata of what `rel` names, following a symlink only if its target
+    /// stays inside the share.
+    fn stat(&self, rel: &Path) -> std::result::Result<Metadata, Errno> {
+        let full = self.resolve(rel)?;
+        if fs::symlink_metadata(&full)?.file_type().is_symlink() && !fs::canonicalize(&full)?.starts_with(&self.root) {
+            return Err(Errno(EACCES));
+        }
+        Ok(fs::metadata(&full)?)
+    }
+
+    /// Node id for `rel`, counting one more guest lookup of it.
+    fn intern(&self, rel: &Path) -> u64 {
+        let mut st = self.state.lock().unwrap();
+        if let Some(&node) = st.by_path.get(rel) {
+            st.nodes.get_mut(&node).unwrap().lookups += 1;
+            return node;
+        }
+        let node = st.next_node;
+        st.next_node += 1;
+        st.nodes.insert(node, Node { path: Some(rel.to_path_buf()), lookups: 1 });
+        st.by_path.insert(rel.to_path_buf(), node);
+        node
+    }
+
+    /// `rel` no longer exists: its node (and any below it) goes stale.
+    fn detach(&self, rel: &Path) {
+        let mut st = self.state.lock().unwrap();
+        let gone: Vec<(PathBuf, u64)> = st.by_path.iter().filter(|(p, _)| p.starts_with(rel)).map(|(p, &n)| (p.clone(), n)).collect();
+        for (p, node) in gone {
+            st.by_path.remove(&p);
+            if let Some(n) = st.nodes.get_mut(&node) {
+                n.path = None;
+            }
+        }
+    }
+
+    fn add_handle(&self, h: Handle) -> u64 {
+        let mut st = self.state.lock().unwrap();
+        let fh = st.next_fh;
+        st.next_fh += 1;
+        st.handles.insert(fh, h);
+        fh
+    }
+
+    /// The open file behind `fh`; I/O on it runs without the state lock.
+    fn file(&self, fh: u64) -> std::result::Result<(Arc<File>, bool), Errno> {
+        match self.state.lock().unwrap().handles.get(&fh) {
+            Some(Handle::File { file, append }) => Ok((file.clone(), *append)),
+            Some(Handle::Dir(_)) => Err(Errno(21)), // EISDIR
+            None => Err(Errno(EBADF)),
+        }
+    }
+
+    fn list_dir(&self, rel: &Path) -> std::result::Result<Vec<DirEntry>, Errno> {
+        let mut out = Vec::new();
+        for e in fs::read_dir(self.resolve(rel)?)? {
+            let e = e?;
+            // Names the guest could not send back are not listed
+            let Some(name) = e.file_name().to_str().map(str::to_string) else { continue };
+            if check_name(&name).is_err() {
+                continue;
+            }
+            let ft = e.file_type()?;
+            // Symlinks are followed on lookup, so their type is the target's
+            let kind = if ft.is_dir() { DT_DIR } else if ft.is_file() { DT_REG } else { DT_UNKNOWN };
+            out.push(DirEntry { ino: ino(&rel.join(&name)), name, kind });
+        }
+        out.sort_by(|a, b| a.name.cmp(&b.name));
+        Ok(out)
+    }
+}
+
+fn payload<'w>(req: &Request, win: &'w [u8]) -> std::result::Result<&'w [u8], Errno> {
+    win.get(..req.len as usize).ok_or(Errno(EINVAL))
+}
+
+/// One path component, valid on both sides.
+fn name(b: &[u8]) -> std::result::Result<&str, Errno> {
+    let s = std::str::from_utf8(b).map_err(|_| Errno(EINVAL))?;
+    check_name(s)?;
+    Ok(s)
+}
+
+fn check_name(s: &str) -> std::result::Result<(), Errno> {
+    if s.len() > NAME_MAX {
+        return Err(Errno(ENAMETOOLONG));
+    }
+    let bad = |c: char| c == '/' || c == '\\' || c == '\0' || (cfg!(windows) && c == ':');
+    if s.is_empty() || s == "." || s == ".." || s.contains(bad) {
+        return Err(Errno(EINVAL));
+    }
+    Ok(())
+}
+
+fn open_options(flags: u32, read_only: bool) -> std::result::Result<OpenOptions, Errno> {
+    let access = flags & O_ACCMODE;
+    let write = access != 0;
+    if write && read_only {
+        return Err(Errno(EROFS));
+    }
+    let mut o = OpenOptions::new();
+    o.read(access != O_WRONLY).write(write).truncate(write && flags & O_TRUNC != 0);
+    Ok(o)
+}
+
+/// Stable per path (the guest sees it in stat and readdir); the share is 1.
+fn ino(rel: &Path) -> u64 {
+    if rel.as_os_str().is_empty() {
+        return ROOT;
+    }
+    // FNV-1a over the components, '/'-joined on every host
+    let mut h: u64 = 0xcbf2_9ce4_8422_2325;
+    for (i, c) in rel.iter().enumerate() {
+        let sep: &[u8] = if i == 0 { b"" } else { b"/" };
+        for &b in sep.iter().chain(c.to_string_lossy().as_bytes()) {
+            h = (h ^ b as u64).wrapping_mul(0x100_0000_01b3);
+        }
+    }
+    h.max(ROOT + 1)
+}
+
+fn nanos(t: io::Result<SystemTime>) -> i64 {
+    t.ok().and_then(|t| t.duration_since(UNIX_EPOCH).ok()).map_or(0, |d| d.as_nanos() as i64)
+}
+
+#[cfg(unix)]
+fn attr(node: u64, rel: &Path, m: &Metadata) -> Attr {
+    use std::os::unix::fs::MetadataExt;
+    Attr {
+        node,
+        ino: ino(rel),
+        size: m.len(),
+        blocks: m.blocks(),
+        atime_ns: nanos(m.accessed()),
+        mtime_ns: nanos(m.modified()),
+        ctime_ns: m.ctime() * 1_000_000_000 + m.ctime_nsec(),
+        mode: m.mode(),
+        nlink: m.nlink() as u32,
+    }
+}
+
+/// NTFS has no mode bits: directories are 0755, files 0644 (0444 read-only).
+#[cfg(not(unix))]
+fn attr(node: u64, rel: &Path, m: &Metadata) -> Attr {
+    let perm = if m.permissions().readonly() { 0o555 } else { 0o755 };
+    let mode = if m.is_dir() { S_IFDIR | perm } else { S_IFREG | (perm & 0o666) };
+    Attr {
+        node,
+        ino: ino(rel),
+        size: m.len(),
+        blocks: m.len().div_ceil(512),
+        atime_ns: nanos(m.accessed()),
+        mtime_ns: nanos(m.modified()),
+        ctime_ns: nanos(m.created().or_else(|_| m.modified())),
+        mode,
+        nlink: if m.is_dir() { 2 } else { 1 },
+    }
+}
+
+#[cfg(unix)]
+fn set_mode(full: &Path, _m: &Metadata, mode: u32) -> io::Result<()> {
+    use std::os::unix::fs::PermissionsExt;
+    fs::set_permissions(full, fs::Permissions::from_mode(mode & 0o7777))
+}
+
+/// Only the owner write bit maps onto NTFS, as the read-only attribute.
+#[cfg(not(unix))]
+fn set_mode(full: &Path, m: &Metadata, mode: u32) -> io::Result<()> {
+    let mut p = m.permissions();
+    p.set_readonly(mode & 0o200 == 0);
+    fs::set_permissions(full, p)
+}
+
+#[cfg(unix)]
+fn read_at(f: &File, buf: &mut [u8], off: u64) -> io::Result<usize> {
+    std::os::unix::fs::FileExt::read_at(f, buf, off)
+}
+
+#[cfg(unix)]
+fn write_at(f: &File, buf: &[u8], off: u64) -> io::Result<()> {
+    std::os::unix::fs::FileExt::write_all_at(f, buf, off)
+}
+
+#[cfg(windows)]
+fn read_at(f: &File, buf: &mut [u8], off: u64) -> io::Result<usize> {
+    use std::os::windows::fs::FileExt;
+    match f.seek_read(buf, off) {
+        // ReadFile past the end reports EOF as an error on some handles
+        Err(e) if e.raw_os_error() == Some(38) => Ok(0), // ERROR_HANDLE_EOF
+        r => r,
+    }
+}
+
+#[cfg(windows)]
+fn write_at(f: &File, mut buf: &[u8], mut off: u64) -> io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        let n = f.seek_write(buf, off)?;
+        buf = &buf[n..];
+        off += n as u64;
+    }
+    Ok(())
+}
+
+/// (total, free, available to us) bytes of the volume holding `path`.
+#[cfg(unix)]
+fn disk_space(path: &Path) -> io::Result<(u64, u64, u64)> {
+    use std::os::unix::ffi::OsStrExt;
+    let c = std::ffi::CString::new(path.as_os_str().as_bytes()).map_err(|_| io::Error::from(io::ErrorKind::InvalidInput))?;
+    let mut s: libc::statvfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statvfs(c.as_ptr(), &mut s) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    let f = s.f_frsize as u64;
+    Ok((s.f_blocks as u64 * f, s.f_bfree as u64 * f, s.f_bavail as u64 * f))
+}
+
+#[cfg(windows)]
+fn disk_space(path: &Path) -> io::Result<(u64, u64, u64)> {
+    use windows::core::HSTRING;
+    use windows::Win32::Storage::FileSystem::GetDiskFreeSpaceExW;
+    let (mut avail, mut total, mut free) = (0u64, 0u64, 0u64);
+    unsafe { GetDiskFreeSpaceExW(&HSTRING::from(path), Some(&mut avail), Some(&mut total), Some(&mut free)) }
+        .map_err(|e| io::Error::from_raw_os_error(e.code().0 & 0xFFFF))?;
+    Ok((total, free, avail))
+}
+
+/// struct colx_shfs_slot
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Slot {
+    id: u64,
+    op: u32,
+    error: i32,
+    node: u64,
+    fh: u64,
+    offset: u64,
+    arg: u64,
+    len: u32,
+    flags: u32,
+    _rsvd: u64,
+}
+
+const _: () = assert!(std::mem::size_of::<Slot>() == SHFS_SLOT_LEN);
+
+/// The shared-folder ring of a mapping, serviced by `server`.
+pub struct ShfsRing<'a> {
+    server: &'a ShfsServer,
+    base: NonNull<u8>,
+    ring_off: usize,
+    cons_off: usize,
+    slots_off: usize,
+    data_off: usize,
+    cap: usize,
+    stride: usize,
+}
+
+impl<'a> ShfsRing<'a> {
+    pub fn new(server: &'a ShfsServer, map: MapInfo, geom: &Geometry) -> Result<Self> {
+        let cap = geom.shfs_ring_cap;
+        if cap == 0 {
+            bail!("shared map has no shared-folder ring");
+        }
+        if (map.size as usize) < geom.shfs_data_off + cap * geom.shfs_slot_stride {
+            bail!("shared map too small for the shared-folder ring");
+        }
+        let base = NonNull::new(map.user_base as *mut u8).ok_or_else(|| anyhow::anyhow!("null map base"))?;
+        Ok(Self {
+            server,
+            base,
+            ring_off: geom.shfs_ring_off,
+            cons_off: geom.shfs_cons_off(),
+            slots_off: geom.shfs_slots_off(),
+            data_off: geom.shfs_data_off,
+            cap,
+            stride: geom.shfs_slot_stride,
+        })
+    }
+
+    pub fn depth(&self) -> usize {
+        self.cap
+    }
+
+    /// Largest READ / WRITE per request.
+    pub fn max_io(&self) -> usize {
+        self.stride
+    }
+
+    fn prod(&self) -> &AtomicU32 {
+        unsafe { &*(self.base.as_ptr().add(self.ring_off) as *const AtomicU32) }
+    }
+
+    fn cons(&self) -> &AtomicU32 {
+        unsafe { &*(self.base.as_ptr().add(self.cons_off) as *const AtomicU32) }
+    }
+
+    pub fn pending(&self) -> bool {
+        self.prod().load(Ordering::Acquire) != self.cons().load(Ordering::Relaxed)
+    }
+
+    /// Serve every published request in ring order. Replies are written in
+    /// place and retired with one release store of cons per pass. Returns
+    /// the number served.
+    pub fn pump(&self) -> usize {
+        let mut cons = self.cons().load(Ordering::Relaxed);
+        let mut served = 0;
+        loop {
+            // Pairs with the guest's release store of prod: slots and payloads below it are filled
+            let prod = self.prod().load(Ordering::Acquire);
+            if prod == cons {
+                return served;
+            }
+            while cons != prod {
+                let idx = cons as usize % self.cap;
+                unsafe {
+                    let slot = (self.base.as_ptr().add(self.slots_off) as *mut Slot).add(idx);
+                    let s = std::ptr::read_volatile(slot);
+                    let req = Request { op: s.op, node: s.node, fh: s.fh, offset: s.offset, arg: s.arg, len: s.len, flags: s.flags };
+                    let win = std::slice::from_raw_parts_mut(self.base.as_ptr().add(self.data_off + idx * self.stride), self.stride);
+                    let r = self.server.handle(&req, win);
+                    std::ptr::write_volatile(std::ptr::addr_of_mut!((*slot).error), r.error);
+                    std::ptr::write_volatile(std::ptr::addr_of_mut!((*slot).len), r.len);
+                    std::ptr::write_volatile(std::ptr::addr_of_mut!((*slot).fh), r.fh);
+                    std::ptr::write_volatile(std::ptr::addr_of_mut!((*slot).arg), r.arg);
+                }
+                cons = cons.wrapping_add(1);
+                served += 1;
+            }
+            self.cons().store(cons, Ordering::Release);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicU32 as Counter;
+
+    fn tmpdir() -> PathBuf {
+        static N: Counter = Counter::new(0);
+        let d = std::env::temp_dir().join(format!("colx-shfs-{}-{}", std::process::id(), N.fetch_add(1, Ordering::Relaxed)));
+        let _ = fs::remove_dir_all(&d);
+        fs::create_dir_all(&d).unwrap();
+        d
+    }
+
+    /// A mapping holding only the shared-folder ring, set up as mem.c does.
+    struct Guest {
+        _mem: Vec<u64>,
+        map: MapInfo,
+        geom: Geometry,
+        prod: u32,
+    }
+
+    impl Guest {
+        fn new(cap: usize, stride: usize) -> Self {
+            let geom = Geometry::layout_with_shfs(0, 8, 4096, &[64 * 1024], cap, stride);
+            let mut mem = vec![0u64; geom.span() / 8 + 1];
+            let base = mem.as_mut_ptr() as *mut u8;
+            geom.write(unsafe { std::slice::from_raw_parts_mut(base, 0x1000) });
+            let map = MapInfo { user_base: base as usize, kernel_base: 0, size: (geom.span() + 8) as u64, ver: 1, flags: 0 };
+            Self { _mem: mem, map, geom, prod: 0 }
+        }
+
+        fn win(&self, seq: u32) -> &mut [u8] {
+            let idx = seq as usize % self.geom.shfs_ring_cap;
+            let stride = self.geom.shfs_slot_stride;
+            unsafe { std::slice::from_raw_parts_mut((self.map.user_base + self.geom.shfs_data_off + idx * stride) as *mut u8, stride) }
+        }
+
+        fn slot(&self, seq: u32) -> *mut Slot {
+            let idx = seq as usize % self.geom.shfs_ring_cap;
+            unsafe { ((self.map.user_base + self.geom.shfs_slots_off()) as *mut Slot).add(idx) }
+        }
+
+        /// Fill the next slot as colx_fs.c does; publish later.
+        fn post(&mut self, req: Request, payload: &[u8]) -> u32 {
+            let seq = self.prod;
+            self.win(seq)[..payload.len()].copy_from_slice(payload);
+            let s = Slot { id: seq as u64, op: req.op, error: -1, node: req.node, fh: req.fh, offset: req.offset, arg: req.arg, len: payload.len() as u32 | req.len, flags: req.flags, _rsvd: 0 };
+            unsafe { *self.slot(seq) = s };
+            self.prod += 1;
+            seq
+        }
+
+        fn publish(&self) {
+            let prod = unsafe { &*((self.map.user_base + self.geom.shfs_ring_off) as *const AtomicU32) };
+            prod.store(self.prod, Ordering::Release);
+        }
+
+        fn reply(&self, seq: u32) -> (Reply, Vec<u8>) {
+            let s = unsafe { *self.slot(seq) };
+            let r = Reply { error: s.error, len: s.len, fh: s.fh, arg: s.arg };
+            (r, self.win(seq)[..s.len as usize].to_vec())
+        }
+
+        fn call(&mut self, ring: &ShfsRing, req: Request, payload: &[u8]) -> (Reply, Vec<u8>) {
+            let seq = self.post(req, payload);
+            self.publish();
+            assert_eq!(ring.pump(), 1);
+            self.reply(seq)
+        }
+    }
+
+    fn req(op: u32, node: u64) -> Request {
+        Request { op, node, ..Request::default() }
+    }
+
+    fn lookup(g: &mut Guest, ring: &ShfsRing, dir: u64, name: &str) -> std::result::Result<Attr, i32> {
+        match g.call(ring, req(OP_LOOKUP, dir), name.as_bytes()) {
+            (r, b) if r.error == 0 => Ok(Attr::decode(&b)),
+            (r, _) => Err(r.error),
+        }
+    }
+
+    fn names(b: &[u8]) -> Vec<(String, u64)> {
+        let mut out = Vec::new();
+        let mut pos = 0;
+        while pos < b.len() {
+            let next = u64::from_le_bytes(b[pos + 8..pos + 16].try_into().unwrap());
+            let len = u32::from_le_bytes(b[pos + 20..pos + 24].try_into().unwrap()) as usize;
+            out.push((String::from_utf8(b[pos + DIRENT_HDR..pos + DIRENT_HDR + len].to_vec()).unwrap(), next));
+            pos += (DIRENT_HDR + len + 7) & !7;
+        }
+        out
+    }
+
+    #[test]
+    fn files_round_trip_through_the_ring() {
+        let dir = tmpdir();
+        let srv = ShfsServer::new(&dir, false).unwrap();
+        let mut g = Guest::new(8, 16 * 1024);
+        let ring = ShfsRing::new(&srv, g.map, &g.geom).unwrap();
+
+        let (r, b) = g.call(&ring, Request { arg: 0o640, flags: 2, ..req(OP_CREATE, ROOT) }, b"notes.txt");
+        assert_eq!((r.error, r.len), (0, ATTR_LEN as u32));
+        let created = Attr::decode(&b);
+        assert_eq!(created.mode & S_IFREG, S_IFREG);
+        let (r, _) = g.call(&ring, Request { fh: r.fh, offset: 3, ..req(OP_WRITE, 0) }, b"hello");
+        assert_eq!((r.error, r.len, r.arg), (0, 5, 8));
+        assert_eq!(fs::read(dir.join("notes.txt")).unwrap(), b"\0\0\0hello");
+
+        let (r, b) = g.call(&ring, Request { fh: 1, offset: 3, len: 100, ..req(OP_READ, 0) }, b"");
+        assert_eq!((r.error, &b[..]), (0, &b"hello"[..]));
+
+        let (r, b) = g.call(&ring, req(OP_MKDIR, ROOT), b"pcaps");
+        assert_eq!(r.error, 0);
+        let pcaps = Attr::decode(&b).node;
+        let rename = b"notes.txt\0moved.txt";
+        assert_eq!(g.call(&ring, Request { arg: pcaps, ..req(OP_RENAME, ROOT) }, rename).0.error, 0);
+        // The node follows the file; its old name is gone
+        let (r, b) = g.call(&ring, req(OP_GETATTR, created.node), b"");
+        assert_eq!((r.error, Attr::decode(&b).size), (0, 8));
+        assert_eq!(lookup(&mut g, &ring, ROOT, "notes.txt"), Err(ENOENT));
+        assert_eq!(lookup(&mut g, &ring, pcaps, "moved.txt").unwrap().node, created.node);
+
+        let (r, _) = g.call(&ring, req(OP_OPEN, ROOT), b"");
+        let (r, b) = g.call(&ring, Request { fh: r.fh, ..req(OP_READDIR, 0) }, b"");
+        assert_eq!(r.error, 0);
+        assert_eq!(names(&b), vec![("pcaps".to_string(), 3)]);
+
+        assert_eq!(g.call(&ring, req(OP_RMDIR, ROOT), b"pcaps").0.error, ENOTEMPTY);
+        assert_eq!(g.call(&ring, req(OP_UNLINK, pcaps), b"moved.txt").0.error, 0);
+        assert_eq!(g.call(&ring, req(OP_GETATTR, created.node), b"").0.error, ESTALE);
+        assert_eq!(g.call(&ring, req(OP_RMDIR, ROOT), b"pcaps").0.error, 0);
+        let _ = fs::remove_dir_all(dir);
+    }
+
+    #[test]
+    fn names_cannot_leave_the_share() {
+        let dir = tmpdir();
+        fs::create_dir(dir.join("share")).unwrap();
+        fs::write(dir.join("secret"), b"x").unwrap();
+        let srv = ShfsServer::new(&dir.join("share"), false).unwrap();
+        let mut g = Guest::new(4, 4096);
+        let ring = ShfsRing::new(&srv, g.map, &g.geom).unwrap();
+        for bad in ["..", ".", "", "../secret", "a/b", "a\\b"] {
+            assert_eq!(lookup(&mut g, &ring, ROOT, bad), Err(EINVAL), "{bad:?}");
+        }
+        assert_eq!(lookup(&mut g, &ring, ROOT, &"n".repeat(300)), Err(ENAMETOOLONG));
+        assert_eq!(lookup(&mut g, &ring, 999, "x"), Err(ESTALE));
+        #[cfg(unix)]
+        {
+            std::os::unix::fs::symlink(dir.join("secret"), dir.join("share/out")).unwrap();
+            std::os::unix::fs::symlink("inside", dir.join("share/link")).unwrap();
+            fs::write(dir.join("share/inside"), b"ok").unwrap();
+            assert_eq!(lookup(&mut g, &ring, ROOT, "out"), Err(EACCES));
+            assert_eq!(lookup(&mut g, &ring, ROOT, "link").unwrap().size, 2);
+            let create = Request { arg: 0o644, flags: 2 | O_TRUNC, ..req(OP_CREATE, ROOT) };
+            assert_eq!(g.call(&ring, create, b"out").0.error, EACCES);
+            assert_eq!(fs::read(dir.join("secret")).unwrap(), b"x");
+            std::os::unix::fs::symlink(dir.join("nowhere"), dir.join("share/dangling")).unwrap();
+            assert_eq!(g.call(&ring, create, b"dangling").0.error, EACCES);
+            assert!(!dir.join("nowhere").exists());
+            assert_eq!(g.call(&ring, create, b"link").0.error, 0);
+            assert_eq!(fs::read(dir.join("share/inside")).unwrap(), b"");
+        }
+        let _ = fs::remove_dir_all(dir);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn directory_links_moved_outward_are_not_followed() {
+        let dir = tmpdir();
+        for d in ["share/sub", "share/d", "d"] {
+            fs::create_dir_all(dir.join(d)).unwrap();
+        }
+        fs::write(dir.join("share/d/f"), b"in").unwrap();
+        fs::write(dir.join("d/f"), b"secret").unwrap();
+        // share/sub/l -> share/d; moved up a level it names <tmp>/d instead
+        std::os::unix::fs::symlink("../d", dir.join("share/sub/l")).unwrap();
+        let srv = ShfsServer::new(&dir.join("share"), false).unwrap();
+        let mut g = Guest::new(4, 4096);
+        let ring = ShfsRing::new(&srv, g.map, &g.geom).unwrap();
+        let sub = lookup(&mut g, &ring, ROOT, "sub").unwrap().node;
+        let l = lookup(&mut g, &ring, sub, "l").unwrap().node;
+        let f = lookup(&mut g, &ring, l, "f").unwrap();
+        assert_eq!(f.size, 2);
+
+        let rename = Request { arg: ROOT, ..req(OP_RENAME, sub) };
+        assert_eq!(g.call(&ring, rename, b"l\0l").0.error, 0);
+        assert_eq!(g.call(&ring, req(OP_GETATTR, f.node), b"").0.error, EACCES);
+        assert_eq!(g.call(&ring, req(OP_OPEN, f.node), b"").0.error, EACCES);
+        assert_eq!(lookup(&mut g, &ring, l, "f"), Err(EACCES));
+        let create = Request { arg: 0o644, flags: 2 | O_TRUNC, ..req(OP_CREATE, l) };
+        assert_eq!(g.call(&ring, create, b"f").0.error, EACCES);
+        assert_eq!(g.call(&ring, req(OP_MKDIR, l), b"x").0.error, EACCES);
+        assert_eq!(fs::read(dir.join("d/f")).unwrap(), b"secret");
+        assert!(!dir.join("d/x").exists());
+        let _ = fs::remove_dir_all(dir);
+    }
+
+    #[test]
+    fn reads_fill_whole_windows_and_stop_short_at_eof() {
+        let dir = tmpdir();
+        let data: Vec<u8> = (0..20_000u32).map(|i| (i * 13) as u8).collect();
+        fs::write(dir.join("wordlist"), &data).unwrap();
+        let srv = ShfsServer::new(&dir, true).unwrap();
+        let mut g = Guest::new(4, 8192);
+        let ring = ShfsRing::new(&srv, g.map, &g.geom).unwrap();
+        let node = lookup(&mut g, &ring, ROOT, "wordlist").unwrap().node;
+        let (r, _) = g.call(&ring, req(OP_OPEN, node), b"");
+        let fh = r.fh;
+
+        // Several requests in flight, retired by one pump
+        let seqs: Vec<u32> = (0..3u64).map(|i| g.post(Request { fh, offset: i * 8192, len: 8192, ..req(OP_READ, 0) }, b"")).collect();
+        g.publish();
+        assert_eq!(ring.pump(), 3);
+        let got: Vec<u8> = seqs.iter().flat_map(|&s| g.reply(s).1).collect();
+        assert_eq!(got, data);
+        assert_eq!(g.reply(seqs[2]).0.len, 20_000 - 16_384);
+
+        // More than a window, or writing to a read-only share, is refused
+        assert_eq!(g.call(&ring, Request { fh, len: 8193, ..req(OP_READ, 0) }, b"").0.error, EINVAL);
+        assert_eq!(g.call(&ring, Request { flags: 2, ..req(OP_OPEN, node) }, b"").0.error, EROFS);
+        assert_eq!(g.call(&ring, req(OP_CREATE, ROOT), b"new").0.error, EROFS);
+        let (r, _) = g.call(&ring, req(OP_RELEASE, 0), b"");
+        assert_eq!(r.error, EBADF);
+        let _ = fs::remove_dir_all(dir);
+    }
+
+    #[test]
+    fn readdir_resumes_from_its_cookie() {
+        let dir = tmpdir();
+        for i in 0..300 {
+            fs::write(dir.join(format!("capture-{i:04}.pcap")), b"").unwrap();
+        }
+        let srv = ShfsServer::new(&dir, false).unwrap();
+        let mut g = Guest::new(4, 4096);
+        let ring = ShfsRing::new(&srv, g.map, &g.geom).unwrap();
+        let fh = g.call(&ring, req(OP_OPEN, ROOT), b"").0.fh;
+        // Entries created after OPEN are not in the snapshot
+        fs::write(dir.join("late"), b"").unwrap();
+        let (mut cookie, mut seen) = (2u64, Vec::new());
+        loop {
+            let (r, b) = g.call(&ring, Request { fh, offset: cookie, ..req(OP_READDIR, 0) }, b"");
+            assert_eq!(r.error, 0);
+            if r.len == 0 {
+                break;
+            }
+            let batch = names(&b);
+            cookie = batch.last().unwrap().1;
+            seen.extend(batch.into_iter().map(|(n, _)| n));
+        }
+        assert_eq!(seen.len(), 300);
+        assert_eq!(seen[299], "capture-0299.pcap");
+        let _ = fs::remove_dir_all(dir);
+    }
+}
@@ -0,0 +1,57 @@
+//! Process-wide stop request. The main loop polls `requested()`; it is set by
+//! the Windows service control handler, or by Ctrl-C / SIGTERM in console mode
+//! once `install_handlers` has run. A second signal terminates as usual.
+
+use std::sync::atomic::{AtomicBool, Ordering};
+
+static STOP: AtomicBool = AtomicBool::new(false);
+
+pub fn request() {
+    STOP.store(true, Ordering::SeqCst);
+}
+
+pub fn requested() -> bool {
+    STOP.load(Ordering::SeqCst)
+}
+
+#[cfg(target_os = "linux")]
+pub fn install_handlers() -> anyhow::Result<()> {
+    extern "C" fn on_signal(_sig: libc::c_int) {
+        // Only an atomic store: async-signal-safe
+        request();
+    }
+    for sig in [libc::SIGINT, libc::SIGTERM] {
+        unsafe {
+            let mut sa: libc::sigaction = std::mem::zeroed();
+            sa.sa_sigaction = on_signal as extern "C" fn(libc::c_int) as libc::sighandler_t;
+            sa.sa_flags = libc::SA_RESETHAND;
+            libc::sigemptyset(&mut sa.sa_mask);
+            if libc::sigaction(sig, &sa, std::ptr::null_mut()) != 0 {
+                anyhow::bail!("sigaction({sig}): {}", std::io::Error::last_os_error());
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(windows)]
+pub fn install_handlers() -> anyhow::Result<()> {
+    use std::sync::atomic::AtomicU32;
+    use windows::Win32::Foundation::BOOL;
+    use windows::Win32::System::Console::{SetConsoleCtrlHandler, CTRL_BREAK_EVENT, CTRL_C_EVENT, CTRL_CLOSE_EVENT};
+
+    static SEEN: AtomicU32 = AtomicU32::new(0);
+
+    unsafe extern "system" fn on_ctrl(kind: u32) -> BOOL {
+        match kind {
+            // Handled the first time; a second one falls through to the default (exit)
+            CTRL_C_EVENT | CTRL_BREAK_EVENT | CTRL_CLOSE_EVENT if SEEN.fetch_add(1, Ordering::SeqCst) == 0 => {
+                request();
+                true.into()
+            }
+            _ => false.into(),
+        }
+    }
+    unsafe { SetConsoleCtrlHandler(Some(on_ctrl), true)? };
+    Ok(())
+}
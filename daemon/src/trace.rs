@@ -0,0 +1,425 @@
+//! Cross-boundary request tracer (`struct colx_trace_hdr` in colinux_ring.h).
+//!
+//! A flight-recorder ring in the shared mapping that the guest front-ends and
+//! the daemon both append to, on one clock, so a slow request can be split
+//! into guest queueing, daemon pickup, backing I/O and guest completion.
+//! `install` attaches to the ring the driver laid out and switches it on;
+//! `chrome_json` turns a snapshot into Chrome / Perfetto trace JSON, served
+//! at `GET /trace` on the metrics endpoint.
+//!
+//! The header's `tick_count` only advances once per daemon tick, far too
+//! coarse for a request that completes in microseconds, so records carry
+//! the TSC: coLinux guests run on the host's CPUs and read the same counter.
+
+use crate::device::MapInfo;
+use crate::geom::{Geometry, TRACE_HDR_LEN, TRACE_REC_LEN};
+use anyhow::{bail, Result};
+use serde_json::{json, Value};
+use std::collections::HashMap;
+use std::sync::atomic::{fence, AtomicU32, AtomicU64, Ordering};
+use std::sync::OnceLock;
+use std::time::{Duration, Instant};
+
+/// colx_trace_hdr.clock
+pub const CLOCK_TSC: u32 = 1;
+/// Host-only monotonic nanoseconds, where there is no TSC; guests skip the ring.
+pub const CLOCK_HOST: u32 = 2;
+
+/// COLX_TRACE_EV_*
+pub const EV_VBLK_SUBMIT: u16 = 1;
+pub const EV_VBLK_PICKUP: u16 = 2;
+pub const EV_VBLK_IO_START: u16 = 3;
+pub const EV_VBLK_IO_END: u16 = 4;
+pub const EV_VBLK_COMPLETE: u16 = 5;
+pub const EV_VBLK_END: u16 = 6;
+pub const EV_VTTY_GUEST_TX: u16 = 16;
+pub const EV_VTTY_GUEST_RX: u16 = 17;
+pub const EV_VTTY_HOST_TX: u16 = 18;
+pub const EV_VTTY_HOST_RX: u16 = 19;
+pub const EV_IOCTL: u16 = 32;
+
+#[repr(C)]
+struct Hdr {
+    clock: AtomicU32,
+    _rsvd: u32,
+    tsc_khz: AtomicU64,
+    _pad0: [u32; 12],
+    head: AtomicU32,
+    _pad1: [u32; 15],
+}
+
+/// struct colx_trace_rec, as atomics: event (low 16 bits) and queue (top 8)
+/// share a word, arg and arg2 another.
+#[repr(C)]
+struct Rec {
+    seq: AtomicU32,
+    kind: AtomicU32,
+    ts: AtomicU64,
+    id: AtomicU64,
+    args: AtomicU64,
+}
+
+const _: () = assert!(std::mem::size_of::<Hdr>() == TRACE_HDR_LEN && std::mem::size_of::<Rec>() == TRACE_REC_LEN);
+
+/// One record read back out of the ring.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Record {
+    pub event: u16,
+    pub queue: u8,
+    pub ts: u64,
+    pub id: u64,
+    pub arg: u32,
+    pub arg2: u32,
+}
+
+/// A ring in memory shared with the guest (or, in tests, a buffer).
+pub struct TraceRing {
+    hdr: *const Hdr,
+    recs: *const Rec,
+    mask: u32,
+    clock: u32,
+    khz: u64,
+}
+
+// Every access goes through atomics; writers on both sides claim records with fetch_add.
+unsafe impl Send for TraceRing {}
+unsafe impl Sync for TraceRing {}
+
+/// Current clock reading.
+#[inline]
+pub fn now() -> u64 {
+    #[cfg(target_arch = "x86_64")]
+    unsafe {
+        core::arch::x86_64::_rdtsc()
+    }
+    #[cfg(not(target_arch = "x86_64"))]
+    {
+        static EPOCH: OnceLock<Instant> = OnceLock::new();
+        EPOCH.get_or_init(Instant::now).elapsed().as_nanos() as u64
+    }
+}
+
+/// The clock `now` reads and its ticks per millisecond.
+fn clock() -> (u32, u64) {
+    if !cfg!(target_arch = "x86_64") {
+        return (CLOCK_HOST, 1_000_000);
+    }
+    // Calibrate the TSC against the monotonic clock
+    let (t0, c0) = (Instant::now(), now());
+    std::thread::sleep(Duration::from_millis(20));
+    let (ns, ticks) = (t0.elapsed().as_nanos() as u64, now().wrapping_sub(c0));
+    (CLOCK_TSC, (ticks as u128 * 1_000_000 / ns.max(1) as u128).max(1) as u64)
+}
+
+impl TraceRing {
+    /// Attach to the ring `geom` places in `map` and switch it on.
+    pub fn attach(map: MapInfo, geom: &Geometry) -> Result<Self> {
+        if geom.trace_cap == 0 {
+            bail!("no trace ring in the shared mapping (old driver, trace.ring_kb 0, or mapping too small)");
+        }
+        let (clock, khz) = clock();
+        unsafe { Ok(Self::from_raw((map.user_base + geom.trace_off) as *mut u8, geom.trace_cap, clock, khz)) }
+    }
+
+    /// Publish `clock` over the ring at `base` (header, then `cap` records).
+    ///
+    /// # Safety
+    /// `base` must be 64-byte aligned and valid for the ring's span for as
+    /// long as the returned value lives.
+    pub unsafe fn from_raw(base: *mut u8, cap: usize, clock: u32, khz: u64) -> Self {
+        debug_assert!(cap.is_power_of_two());
+        let hdr = base as *const Hdr;
+        (*hdr).tsc_khz.store(khz, Ordering::Relaxed);
+        // Writers check clock before anything else: it goes last
+        (*hdr).clock.store(clock, Ordering::Release);
+        Self { hdr, recs: base.add(TRACE_HDR_LEN) as *const Rec, mask: cap as u32 - 1, clock, khz }
+    }
+
+    fn hdr(&self) -> &Hdr {
+        unsafe { &*self.hdr }
+    }
+
+    fn rec(&self, seq: u32) -> &Rec {
+        unsafe { &*self.recs.add((seq & self.mask) as usize) }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.mask as usize + 1
+    }
+
+    /// Clock ticks per millisecond.
+    pub fn khz(&self) -> u64 {
+        self.khz
+    }
+
+    #[inline]
+    pub fn record(&self, event: u16, queue: u8, id: u64, arg: u32, arg2: u32) {
+        self.record_at(now(), event, queue, id, arg, arg2);
+    }
+
+    /// Append a record stamped `ts`, overwriting the oldest.
+    pub fn record_at(&self, ts: u64, event: u16, queue: u8, id: u64, arg: u32, arg2: u32) {
+        let seq = self.hdr().head.fetch_add(1, Ordering::Relaxed);
+        let r = self.rec(seq);
+        r.seq.store(0, Ordering::Relaxed);
+        fence(Ordering::Release);
+        r.kind.store(event as u32 | (queue as u32) << 24, Ordering::Relaxed);
+        r.ts.store(ts, Ordering::Relaxed);
+        r.id.store(id, Ordering::Relaxed);
+        r.args.store(arg as u64 | (arg2 as u64) << 32, Ordering::Relaxed);
+        r.seq.store(seq.wrapping_add(1), Ordering::Release);
+    }
+
+    /// Records still in the ring, oldest first, and how many were
+    /// overwritten or caught mid-write.
+    pub fn snapshot(&self) -> (Vec<Record>, u64) {
+        let head = self.hdr().head.load(Ordering::Acquire);
+        let n = head.min(self.mask + 1);
+        let mut out = Vec::with_capacity(n as usize);
+        for seq in head.wrapping_sub(n)..head {
+            let r = self.rec(seq);
+            let s = r.seq.load(Ordering::Acquire);
+            let (kind, ts, id, args) = (r.kind.load(Ordering::Relaxed), r.ts.load(Ordering::Relaxed), r.id.load(Ordering::Relaxed), r.args.load(Ordering::Relaxed));
+            fence(Ordering::Acquire);
+            if s != seq.wrapping_add(1) || r.seq.load(Ordering::Relaxed) != s {
+                continue;
+            }
+            out.push(Record { event: kind as u16, queue: (kind >> 24) as u8, ts, id, arg: args as u32, arg2: (args >> 32) as u32 });
+        }
+        let lost = head as u64 - out.len() as u64;
+        (out, lost)
+    }
+
+    /// The ring as a Chrome / Perfetto trace.
+    pub fn chrome_json(&self) -> String {
+        let (recs, lost) = self.snapshot();
+        let mut v = chrome_trace(&recs, self.khz);
+        v["otherData"] = json!({
+            "clock": if self.clock == CLOCK_TSC { "tsc" } else { "host" },
+            "clock_khz": self.khz,
+            "records": recs.len(),
+            "lost": lost,
+        });
+        v.to_string()
+    }
+}
+
+const PID_VBLK: u32 = 1;
+const PID_VTTY: u32 = 2;
+const PID_IOCTL: u32 = 3;
+
+fn vblk_op(op: u32) -> &'static str {
+    match op {
+        0 => "read",
+        1 => "write",
+        2 => "flush",
+        3 => "discard",
+        4 => "write_zeroes",
+        _ => "vblk",
+    }
+}
+
+/// What a request is doing between `ev` and the next event.
+fn phase(ev: u16) -> &'static str {
+    match ev {
+        EV_VBLK_SUBMIT => "guest queue",
+        EV_VBLK_PICKUP => "host dispatch",
+        EV_VBLK_IO_START => "backing I/O",
+        EV_VBLK_IO_END => "host complete",
+        _ => "guest completion",
+    }
+}
+
+/// Build trace events from `recs`: one async span per VBLK request with a
+/// nested slice per phase, instants for VTTY traffic, and a span per IOCTL.
+/// Records need not be in order; timestamps are rebased to the earliest.
+pub fn chrome_trace(recs: &[Record], khz: u64) -> Value {
+    let mut recs = recs.to_vec();
+    recs.sort_by_key(|r| r.ts);
+    let t0 = recs.first().map_or(0, |r| r.ts);
+    let us = |ticks: u64| ticks as f64 * 1000.0 / khz.max(1) as f64;
+    let at = |ts: u64| us(ts.saturating_sub(t0));
+    let mut events = Vec::new();
+    let mut tracks: Vec<(u32, u8)> = Vec::new();
+    let (mut next_id, mut ioctl_id) = (0u64, 0u64);
+
+    // Requests are keyed by (queue, slot id); blk-mq reuses ids, so a new
+    // submit (or a pickup after a completion) starts a new request
+    let mut open: HashMap<(u8, u64), Vec<Record>> = HashMap::new();
+    let mut flush = |reqs: Vec<Record>, events: &mut Vec<Value>| {
+        let (Some(first), Some(last)) = (reqs.first(), reqs.last()) else { return };
+        next_id += 1;
+        let op = reqs.iter().find(|r| matches!(r.event, EV_VBLK_SUBMIT | EV_VBLK_PICKUP)).map_or(u32::MAX, |r| r.arg2);
+        let status = reqs.iter().rev().find(|r| r.event >= EV_VBLK_IO_END).map(|r| r.arg2);
+        let common = json!({ "cat": "vblk", "id": next_id, "pid": PID_VBLK, "tid": first.queue });
+        let span = |ph: &str, name: &str, ts: u64, args: Value| {
+            let mut e = common.clone();
+            e["ph"] = json!(ph);
+            e["name"] = json!(name);
+            e["ts"] = json!(at(ts));
+            if !args.is_null() {
+                e["args"] = args;
+            }
+            e
+        };
+        let name = format!("{} {}", vblk_op(op), first.arg);
+        events.push(span("b", &name, first.ts, json!({ "bytes": first.arg, "status": status, "complete": last.event == EV_VBLK_END })));
+        for w in reqs.windows(2) {
+            events.push(span("b", phase(w[0].event), w[0].ts, Value::Null));
+            events.push(span("e", phase(w[0].event), w[1].ts, Value::Null));
+        }
+        events.push(span("e", &name, last.ts, Value::Null));
+    };
+
+    for r in &recs {
+        match r.event {
+            EV_VBLK_SUBMIT..=EV_VBLK_END => {
+                let key = (r.queue, r.id);
+                if !tracks.contains(&(PID_VBLK, r.queue)) {
+                    tracks.push((PID_VBLK, r.queue));
+                }
+                let restart = open.get(&key).is_some_and(|reqs| {
+                    r.event == EV_VBLK_SUBMIT || (r.event == EV_VBLK_PICKUP && reqs.iter().any(|p| p.event >= EV_VBLK_PICKUP))
+                });
+                if restart {
+                    flush(open.remove(&key).unwrap(), &mut events);
+                }
+                open.entry(key).or_default().push(*r);
+                if r.event == EV_VBLK_END {
+                    flush(open.remove(&key).unwrap(), &mut events);
+                }
+            }
+            EV_VTTY_GUEST_TX..=EV_VTTY_HOST_RX => {
+                if !tracks.contains(&(PID_VTTY, r.queue)) {
+                    tracks.push((PID_VTTY, r.queue));
+                }
+                let name = ["guest tx", "guest rx", "host tx", "host rx"][(r.event - EV_VTTY_GUEST_TX) as usize];
+                events.push(json!({
+                    "ph": "i", "s": "t", "cat": "vtty", "name": name, "pid": PID_VTTY, "tid": r.queue,
+                    "ts": at(r.ts), "args": { "bytes": r.arg },
+                }));
+            }
+            EV_IOCTL => {
+                ioctl_id += 1;
+                let name = format!("ioctl 0x{:03x}", (r.arg2 >> 2) & 0xfff);
+                for (ph, ts) in [("b", at(r.ts)), ("e", at(r.ts) + us(r.arg as u64))] {
+                    events.push(json!({ "ph": ph, "cat": "ioctl", "name": name, "id": ioctl_id, "pid": PID_IOCTL, "tid": 0, "ts": ts }));
+                }
+            }
+            _ => {}
+        }
+    }
+    // Still in flight when the snapshot was taken
+    let mut rest: Vec<_> = open.into_values().collect();
+    rest.sort_by_key(|reqs| reqs[0].ts);
+    for reqs in rest {
+        flush(reqs, &mut events);
+    }
+
+    let mut meta = Vec::new();
+    for (pid, name) in [(PID_VBLK, "VBLK"), (PID_VTTY, "VTTY"), (PID_IOCTL, "driver IOCTLs")] {
+        meta.push(json!({ "ph": "M", "name": "process_name", "pid": pid, "args": { "name": name } }));
+    }
+    for (pid, tid) in tracks {
+        let name = if pid == PID_VBLK { format!("queue {tid}") } else { format!("channel {tid}") };
+        meta.push(json!({ "ph": "M", "name": "thread_name", "pid": pid, "tid": tid, "args": { "name": name } }));
+    }
+    meta.extend(events);
+    json!({ "traceEvents": meta, "displayTimeUnit": "ns" })
+}
+
+static RING: OnceLock<TraceRing> = OnceLock::new();
+
+/// Make `ring` the one the daemon's hooks append to; later calls are ignored.
+pub fn install(ring: TraceRing) {
+    let _ = RING.set(ring);
+}
+
+/// The installed ring, for hooks that append several records at once.
+#[inline]
+pub fn active() -> Option<&'static TraceRing> {
+    RING.get()
+}
+
+/// Append to the installed ring, if any.
+#[inline]
+pub fn record(event: u16, queue: u8, id: u64, arg: u32, arg2: u32) {
+    if let Some(r) = RING.get() {
+        r.record(event, queue, id, arg, arg2);
+    }
+}
+
+/// The installed ring as Chrome trace JSON.
+pub fn chrome_json() -> Option<String> {
+    RING.get().map(TraceRing::chrome_json)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A ring over a 64-byte aligned buffer.
+    fn ring(cap: usize) -> (TraceRing, Vec<[u64; 8]>) {
+        let mut buf = vec![[0u64; 8]; (TRACE_HDR_LEN + cap * TRACE_REC_LEN) / 64];
+        let r = unsafe { TraceRing::from_raw(buf.as_mut_ptr() as *mut u8, cap, CLOCK_TSC, 1000) };
+        (r, buf)
+    }
+
+    #[test]
+    fn overwrites_the_oldest_records() {
+        let (r, _buf) = ring(8);
+        for i in 0..20u64 {
+            r.record_at(i, EV_VBLK_PICKUP, 1, i, 512, 0);
+        }
+        let (recs, lost) = r.snapshot();
+        assert_eq!(lost, 12);
+        assert_eq!(recs.iter().map(|r| r.id).collect::<Vec<_>>(), (12..20).collect::<Vec<_>>());
+        assert_eq!(recs[0], Record { event: EV_VBLK_PICKUP, queue: 1, ts: 12, id: 12, arg: 512, arg2: 0 });
+    }
+
+    #[test]
+    fn concurrent_writers_lose_nothing_that_fits() {
+        let (r, _buf) = ring(4096);
+        std::thread::scope(|s| {
+            for t in 0..4u8 {
+                let r = &r;
+                s.spawn(move || (0..1000u64).for_each(|i| r.record(EV_VTTY_HOST_TX, t, i, 1, 0)));
+            }
+        });
+        let (recs, lost) = r.snapshot();
+        assert_eq!((recs.len(), lost), (4000, 0));
+        for t in 0..4 {
+            assert_eq!(recs.iter().filter(|r| r.queue == t).count(), 1000);
+        }
+    }
+
+    #[test]
+    fn requests_become_nested_phases() {
+        // 1000 ticks per ms: one tick is one microsecond
+        let ev = |ts, event, arg2| Record { event, queue: 0, ts, id: 0xabc, arg: 4096, arg2 };
+        let recs = [
+            ev(100, EV_VBLK_SUBMIT, 0),
+            ev(130, EV_VBLK_PICKUP, 0),
+            ev(135, EV_VBLK_IO_START, 0),
+            ev(335, EV_VBLK_IO_END, 0),
+            ev(336, EV_VBLK_COMPLETE, 0),
+            ev(400, EV_VBLK_END, 0),
+            // The same id reused for the next request
+            ev(500, EV_VBLK_SUBMIT, 1),
+            Record { event: EV_IOCTL, queue: 0, ts: 450, id: 0, arg: 20, arg2: 0x0022_2008 },
+        ];
+        let v = chrome_trace(&recs, 1000);
+        let events = v["traceEvents"].as_array().unwrap();
+        let find = |ph: &str, name: &str| events.iter().filter(|e| e["ph"] == ph && e["name"] == name).map(|e| e["ts"].as_f64().unwrap()).collect::<Vec<_>>();
+        assert_eq!(find("b", "read 4096"), [0.0]);
+        assert_eq!(find("e", "read 4096"), [300.0]);
+        assert_eq!((find("b", "guest queue"), find("e", "guest queue")), (vec![0.0], vec![30.0]));
+        assert_eq!((find("b", "backing I/O"), find("e", "backing I/O")), (vec![35.0], vec![235.0]));
+        assert_eq!(find("e", "guest completion"), [300.0]);
+        // The second request is still in flight: a span with no phases yet
+        assert_eq!((find("b", "write 4096"), find("e", "write 4096")), (vec![400.0], vec![400.0]));
+        assert_eq!((find("b", "ioctl 0x802"), find("e", "ioctl 0x802")), (vec![350.0], vec![370.0]));
+        let ids: Vec<_> = events.iter().filter(|e| e["cat"] == "vblk" && e["ph"] == "b").map(|e| e["id"].as_u64().unwrap()).collect();
+        assert_eq!(ids.iter().filter(|&&i| i == ids[0]).count(), 6);
+    }
+}
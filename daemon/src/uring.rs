@@ -0,0 +1,277 @@
+//! Minimal io_uring binding over raw syscalls (Linux): one submission and one
+//! completion queue, shared by any number of submitting threads and a single
+//! reaper. Only what the host backend needs (read, write, fsync, fallocate,
+//! nop); SQ polling, registered buffers and linked SQEs are left out.
+
+use parking_lot::Mutex;
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::atomic::{AtomicU32, Ordering};
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x800_0000;
+const IORING_OFF_SQES: libc::off_t = 0x1000_0000;
+const IORING_ENTER_GETEVENTS: u32 = 1;
+
+pub const OP_NOP: u8 = 0;
+pub const OP_FSYNC: u8 = 3;
+pub const OP_FALLOCATE: u8 = 17;
+pub const OP_READ: u8 = 22;
+pub const OP_WRITE: u8 = 23;
+pub const FSYNC_DATASYNC: u32 = 1;
+
+/// struct io_uring_params
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: [u32; 10], // head, tail, ring_mask, ring_entries, flags, dropped, array, resv1, user_addr (u64)
+    cq_off: [u32; 10], // head, tail, ring_mask, ring_entries, overflow, cqes, flags, resv1, user_addr (u64)
+}
+
+const _: () = assert!(std::mem::size_of::<Params>() == 120);
+
+/// struct io_uring_sqe, with the fields the ops here use.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Sqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    pub off: u64,
+    pub addr: u64,
+    pub len: u32,
+    pub op_flags: u32,
+    pub user_data: u64,
+    pub pad: [u64; 3],
+}
+
+const _: () = assert!(std::mem::size_of::<Sqe>() == 64);
+
+impl Sqe {
+    pub fn read(fd: RawFd, buf: *mut u8, len: u32, off: u64, user_data: u64) -> Self {
+        Self { opcode: OP_READ, fd, off, addr: buf as u64, len, user_data, ..Self::default() }
+    }
+
+    pub fn write(fd: RawFd, buf: *const u8, len: u32, off: u64, user_data: u64) -> Self {
+        Self { opcode: OP_WRITE, fd, off, addr: buf as u64, len, user_data, ..Self::default() }
+    }
+
+    pub fn fdatasync(fd: RawFd, user_data: u64) -> Self {
+        Self { opcode: OP_FSYNC, fd, op_flags: FSYNC_DATASYNC, user_data, ..Self::default() }
+    }
+
+    /// fallocate(fd, mode, off, len): the length rides in `addr`, the mode in `len`.
+    pub fn fallocate(fd: RawFd, mode: i32, off: u64, len: u64, user_data: u64) -> Self {
+        Self { opcode: OP_FALLOCATE, fd, off, addr: len, len: mode as u32, user_data, ..Self::default() }
+    }
+
+    pub fn nop(user_data: u64) -> Self {
+        Self { opcode: OP_NOP, user_data, ..Self::default() }
+    }
+}
+
+/// struct io_uring_cqe
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Cqe {
+    pub user_data: u64,
+    /// Bytes transferred, or -errno.
+    pub res: i32,
+    pub flags: u32,
+}
+
+struct Map {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Map {
+    fn new(fd: RawFd, len: usize, off: libc::off_t) -> io::Result<Self> {
+        let ptr = unsafe { libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED | libc::MAP_POPULATE, fd, off) };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { ptr: ptr as *mut u8, len })
+    }
+
+    fn u32_at(&self, off: u32) -> &AtomicU32 {
+        unsafe { &*(self.ptr.add(off as usize) as *const AtomicU32) }
+    }
+}
+
+impl Drop for Map {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut _, self.len) };
+    }
+}
+
+struct Sq {
+    ring: Map,
+    sqes: Map,
+    head: u32,
+    tail: u32,
+    mask: u32,
+    entries: u32,
+    /// SQEs queued since the last enter.
+    queued: u32,
+}
+
+struct Cq {
+    ring: Map,
+    head: u32,
+    tail: u32,
+    mask: u32,
+    cqes: u32,
+}
+
+pub struct Uring {
+    fd: OwnedFd,
+    sq: Mutex<Sq>,
+    cq: Mutex<Cq>,
+}
+
+unsafe impl Send for Uring {}
+unsafe impl Sync for Uring {}
+
+impl Uring {
+    /// A ring of `entries` SQEs (rounded up to a power of two by the kernel)
+    /// and twice as many CQEs.
+    pub fn new(entries: u32) -> io::Result<Self> {
+        let mut p = Params::default();
+        let fd = unsafe { libc::syscall(libc::SYS_io_uring_setup, entries, &mut p as *mut Params) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd as RawFd) };
+        let raw = fd.as_raw_fd();
+        let sq_ring = Map::new(raw, (p.sq_off[6] + p.sq_entries * 4) as usize, IORING_OFF_SQ_RING)?;
+        let cq_ring = Map::new(raw, p.cq_off[5] as usize + p.cq_entries as usize * std::mem::size_of::<Cqe>(), IORING_OFF_CQ_RING)?;
+        let sqes = Map::new(raw, p.sq_entries as usize * std::mem::size_of::<Sqe>(), IORING_OFF_SQES)?;
+        // Slot i of the index array always names SQE i
+        let array = unsafe { std::slice::from_raw_parts_mut(sq_ring.ptr.add(p.sq_off[6] as usize) as *mut u32, p.sq_entries as usize) };
+        for (i, a) in array.iter_mut().enumerate() {
+            *a = i as u32;
+        }
+        let sq = Sq {
+            head: p.sq_off[0],
+            tail: p.sq_off[1],
+            mask: sq_ring.u32_at(p.sq_off[2]).load(Ordering::Relaxed),
+            entries: p.sq_entries,
+            queued: 0,
+            ring: sq_ring,
+            sqes,
+        };
+        let cq = Cq { head: p.cq_off[0], tail: p.cq_off[1], mask: cq_ring.u32_at(p.cq_off[2]).load(Ordering::Relaxed), cqes: p.cq_off[5], ring: cq_ring };
+        Ok(Self { fd, sq: Mutex::new(sq), cq: Mutex::new(cq) })
+    }
+
+    pub fn entries(&self) -> u32 {
+        self.sq.lock().entries
+    }
+
+    /// Queue `sqes` and submit them in one syscall. Entries that do not fit
+    /// the SQ are submitted in further rounds.
+    pub fn submit(&self, sqes: &[Sqe]) -> io::Result<()> {
+        let mut sq = self.sq.lock();
+        let mut rest = sqes;
+        while !rest.is_empty() {
+            let head = sq.ring.u32_at(sq.head).load(Ordering::Acquire);
+            let tail = sq.ring.u32_at(sq.tail).load(Ordering::Relaxed);
+            let n = (sq.entries - tail.wrapping_sub(head)).min(rest.len() as u32);
+            for (i, sqe) in rest[..n as usize].iter().enumerate() {
+                let idx = (tail.wrapping_add(i as u32) & sq.mask) as usize;
+                unsafe { *(sq.sqes.ptr as *mut Sqe).add(idx) = *sqe };
+            }
+            sq.ring.u32_at(sq.tail).store(tail.wrapping_add(n), Ordering::Release);
+            sq.queued += n;
+            rest = &rest[n as usize..];
+            while sq.queued > 0 {
+                let done = self.enter(sq.queued, 0, 0)?;
+                sq.queued -= done;
+            }
+        }
+        Ok(())
+    }
+
+    /// Block until at least one completion is ready, then append every ready
+    /// one to `out`. Only one thread may reap.
+    pub fn wait(&self, out: &mut Vec<Cqe>) -> io::Result<()> {
+        let cq = self.cq.lock();
+        loop {
+            let head = cq.ring.u32_at(cq.head).load(Ordering::Relaxed);
+            let tail = cq.ring.u32_at(cq.tail).load(Ordering::Acquire);
+            if head != tail {
+                let base = unsafe { cq.ring.ptr.add(cq.cqes as usize) as *const Cqe };
+                out.extend((head..tail).map(|i| unsafe { *base.add((i & cq.mask) as usize) }));
+                cq.ring.u32_at(cq.head).store(tail, Ordering::Release);
+                return Ok(());
+            }
+            self.enter(0, 1, IORING_ENTER_GETEVENTS)?;
+        }
+    }
+
+    fn enter(&self, to_submit: u32, min_complete: u32, flags: u32) -> io::Result<u32> {
+        loop {
+            let n = unsafe { libc::syscall(libc::SYS_io_uring_enter, self.fd.as_raw_fd(), to_submit, min_complete, flags, std::ptr::null::<libc::sigset_t>(), 0usize) };
+            if n >= 0 {
+                return Ok(n as u32);
+            }
+            let e = io::Error::last_os_error();
+            if e.kind() != io::ErrorKind::Interrupted {
+                return Err(e);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn reads_and_writes_through_the_ring() {
+        let ring = match Uring::new(8) {
+            Ok(r) => r,
+            // Seccomp profiles in some CI sandboxes refuse io_uring
+            Err(e) => return eprintln!("skipping: io_uring unavailable: {e}"),
+        };
+        let mut f = tempfile();
+        f.write_all(&[7u8; 8192]).unwrap();
+        let fd = f.as_raw_fd();
+        let src = [0x5au8; 4096];
+        let mut dst = vec![0u8; 8192];
+        ring.submit(&[Sqe::write(fd, src.as_ptr(), 4096, 4096, 1), Sqe::fdatasync(fd, 2)]).unwrap();
+        let mut cqes = Vec::new();
+        while cqes.len() < 2 {
+            ring.wait(&mut cqes).unwrap();
+        }
+        cqes.sort_by_key(|c| c.user_data);
+        assert_eq!((cqes[0].res, cqes[1].res), (4096, 0));
+        // More SQEs than the ring holds go in several rounds
+        let reads: Vec<_> = (0..16u64).map(|i| Sqe::read(fd, unsafe { dst.as_mut_ptr().add(i as usize * 512) }, 512, i * 512, 10 + i)).collect();
+        ring.submit(&reads).unwrap();
+        cqes.clear();
+        while cqes.len() < 16 {
+            ring.wait(&mut cqes).unwrap();
+        }
+        assert!(cqes.iter().all(|c| c.res == 512));
+        assert!(dst[..4096].iter().all(|&b| b == 7) && dst[4096..].iter().all(|&b| b == 0x5a));
+    }
+
+    fn tempfile() -> std::fs::File {
+        let path = std::env::temp_dir().join(format!("colx-uring-{}", std::process::id()));
+        let f = std::fs::OpenOptions::new().read(true).write(true).create(true).truncate(true).open(&path).unwrap();
+        let _ = std::fs::remove_file(&path);
+        f
+    }
+}
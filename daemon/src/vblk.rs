@@ -1,15 +1,36 @@
 //! VBLK ring + dispatcher over IOCP-backed DeviceIoControl.
 //! This is a queueing layer that enforces queue_depth and tracks completions.
+//!
+//! Requests are tracked in a slab whose index doubles as the request tag. A
+//! fixed pool of workers performs the blocking IOCTLs and reports back on one
+//! shared completion channel, so draining costs O(completed) rather than
+//! O(in-flight) and no thread is created per request. The pool starts with
+//! the first request, so a dispatcher nothing submits to costs no threads.
+//!
+//! Queue depth bounds backing I/Os, not requests. A request larger than the
+//! driver's transfer cap goes out in `BATCH_MAX_XFER` pieces, and queued
+//! requests of the same op that continue the one ahead on disk are merged
+//! into its I/O up to the merge limit, so a sequential stream that backs up
+//! behind a full queue reaches the image in a few large IOCTLs.
 
-use std::collections::{HashMap, VecDeque};
-use crossbeam_channel::{Receiver, TryRecvError};
-use uuid::Uuid;
+use std::collections::VecDeque;
+use std::iter;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use crossbeam_channel::{Receiver, Sender};
 
-use anyhow::Result;
+use anyhow::{anyhow, Result};
 
 use crate::device::Device;
+use crate::metrics::{self, Counter, Gauge, Hist};
+use crate::vblk_batch::BATCH_MAX_XFER;
 
-#[derive(Clone, Copy, Debug)]
+/// Upper bound on blocking IOCTL workers; queue_depth beyond this stays queued.
+const MAX_WORKERS: usize = 16;
+const IO_TIMEOUT: Duration = Duration::from_secs(2);
+const SECTOR: u32 = 512;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
 pub enum Op {
     Read,
     Write,
@@ -23,8 +44,22 @@ pub struct VblkReq {
     pub buf: Vec<u8>, // for Write: payload; for Read: capacity (len) will be used
 }
 
+/// Slab index identifying a request from `submit` until its completion.
+pub type Tag = u32;
+
+/// A finished request. For reads `result` carries the data (the request's own
+/// buffer, filled in place); for writes it is the emptied payload buffer.
+#[derive(Debug)]
+pub struct Completion {
+    pub tag: Tag,
+    pub op: Op,
+    pub lba: u64,
+    pub len: u32,
+    pub result: Result<Vec<u8>>,
+}
+
 // Wire format to driver: [op:1][reserved:3][lba:8][len:4][data…]
-fn encode_req(req: &VblkReq) -> Vec<u8> {
+pub fn encode_req(req: &VblkReq) -> Vec<u8> {
     let mut out = Vec::with_capacity(1 + 3 + 8 + 4 + req.buf.len());
     out.push(match req.op {
         Op::Read => 0u8,
@@ -38,109 +73,365 @@ fn encode_req(req: &VblkReq) -> Vec<u8> {
 }
 
 pub struct Inflight {
-    pub id: Uuid,
-    pub rx: Receiver<Result<Vec<u8>>>,
     pub op: Op,
     pub lba: u64,
     pub len: u32,
+    pub submitted: Instant,
+    /// The request's buffer while it is split or merged; empty while a job owns it.
+    buf: Vec<u8>,
+    /// Bytes handed to jobs / finished by them.
+    issued: u32,
+    done: u32,
+    /// First failure among the request's pieces.
+    err: Option<anyhow::Error>,
+}
+
+/// One request's share of a job: `len` bytes at byte `off` of the request.
+#[derive(Clone, Copy)]
+struct Part {
+    tag: Tag,
+    off: u32,
+    len: u32,
+}
+
+/// One backing I/O: `part`, then any requests merged behind it, back to back in `buf`.
+struct Job {
+    op: Op,
+    lba: u64,
+    len: u32,
+    buf: Vec<u8>,
+    part: Part,
+    merged: Vec<Part>,
+}
+
+impl Job {
+    fn parts(&self) -> impl Iterator<Item = Part> + '_ {
+        iter::once(self.part).chain(self.merged.iter().copied())
+    }
 }
 
 pub struct Vblk<'a> {
     dev: &'a Device,
     depth: usize,
-    pending: VecDeque<(Uuid, VblkReq)>,
-    inflight: HashMap<Uuid, Inflight>,
+    merge_len: u32,
+    /// Requests with bytes not yet handed to a job, oldest first.
+    pending: VecDeque<Tag>,
+    slab: Vec<Option<Inflight>>,
+    free: Vec<Tag>,
+    /// Requests handed to jobs and not completed; `busy` counts the jobs.
+    inflight: usize,
+    busy: usize,
+    jobs: Option<Sender<Job>>,
+    /// Handed to the workers when the first job is queued.
+    jobs_rx: Option<Receiver<Job>>,
+    done_tx: Sender<(Job, Result<()>)>,
+    done: Receiver<(Job, Result<()>)>,
+    workers: Vec<JoinHandle<()>>,
 }
 
 impl<'a> Vblk<'a> {
+    /// A dispatcher keeping up to `depth` IOCTLs in flight, merging into
+    /// backing I/Os of up to `BATCH_MAX_XFER`.
     pub fn new(dev: &'a Device, depth: usize) -> Self {
+        Self::with_merge(dev, depth, BATCH_MAX_XFER)
+    }
+
+    /// As `new`, merging queued requests into I/Os of at most `merge_len`
+    /// bytes (capped at `BATCH_MAX_XFER`; 0 issues every request on its own).
+    pub fn with_merge(dev: &'a Device, depth: usize, merge_len: u32) -> Self {
+        let (jobs_tx, jobs_rx) = crossbeam_channel::bounded::<Job>(depth.max(1));
+        let (done_tx, done_rx) = crossbeam_channel::unbounded();
         Self {
             dev,
             depth,
+            merge_len: merge_len.min(BATCH_MAX_XFER),
             pending: VecDeque::new(),
-            inflight: HashMap::new(),
+            slab: Vec::with_capacity(depth),
+            free: Vec::new(),
+            inflight: 0,
+            busy: 0,
+            jobs: Some(jobs_tx),
+            jobs_rx: Some(jobs_rx),
+            done_tx,
+            done: done_rx,
+            workers: Vec::new(),
         }
     }
 
-    pub fn submit(&mut self, req: VblkReq) {
-        let id = Uuid::new_v4();
-        self.pending.push_back((id, req));
+    /// Start the worker pool; the job receiver goes to the workers alone, so
+    /// the channel disconnects if they all exit.
+    fn spawn_workers(&mut self) {
+        let Some(jobs_rx) = self.jobs_rx.take() else { return };
+        // Workers never outlive `self` (joined in Drop), which cannot outlive `dev`.
+        let dev_static = unsafe { std::mem::transmute::<&Device, &'static Device>(self.dev) };
+        self.workers = (0..self.depth.clamp(1, MAX_WORKERS))
+            .map(|_| {
+                let jobs = jobs_rx.clone();
+                let done = self.done_tx.clone();
+                thread::spawn(move || worker(dev_static, jobs, done))
+            })
+            .collect();
+    }
+
+    pub fn device(&self) -> &'a Device {
+        self.dev
+    }
+
+    /// Queue a request; returns the tag its `Completion` will carry.
+    pub fn submit(&mut self, req: VblkReq) -> Tag {
+        let mut buf = req.buf;
+        match req.op {
+            Op::Read => buf.resize(req.len as usize, 0),
+            Op::Write => debug_assert_eq!(buf.len(), req.len as usize, "vblk write payload length"),
+        }
+        let meta = Inflight { op: req.op, lba: req.lba, len: req.len, submitted: Instant::now(), buf, issued: 0, done: 0, err: None };
+        let tag = match self.free.pop() {
+            Some(t) => {
+                self.slab[t as usize] = Some(meta);
+                t
+            }
+            None => {
+                self.slab.push(Some(meta));
+                (self.slab.len() - 1) as Tag
+            }
+        };
+        self.pending.push_back(tag);
         self.kick();
+        tag
     }
 
     fn kick(&mut self) {
-        while self.inflight.len() < self.depth {
-            if let Some((id, req)) = self.pending.pop_front() {
-                let rx = match req.op {
-                    Op::Read => {
-                        let (tx, ch) = crossbeam_channel::bounded(1);
-                        // Submit via direct read IOCTL using Device wrapper, but adapt to existing async pattern by spawning a lightweight task thread.
-                        let dev = self.dev;
-                        let lba = req.lba; let len = req.len;
-                        std::thread::spawn(move || {
-                            let res = dev.vblk_read_sync(lba, len, std::time::Duration::from_secs(2));
-                            let _ = tx.send(res);
-                        });
-                        ch
-                    }
-                    Op::Write => {
-                        let (tx, ch) = crossbeam_channel::bounded(1);
-                        let dev = self.dev; let lba = req.lba; let buf = req.buf.clone();
-                        std::thread::spawn(move || {
-                            let res = dev.vblk_write_sync(lba, &buf, std::time::Duration::from_secs(2)).map(|_| Vec::new());
-                            let _ = tx.send(res);
-                        });
-                        ch
-                    }
-                };
-                self.inflight.insert(
-                    id,
-                    Inflight {
-                        id,
-                        rx,
-                        op: req.op,
-                        lba: req.lba,
-                        len: req.len,
-                    },
-                );
-            } else {
+        while self.busy < self.depth && self.jobs.is_some() {
+            let Some(job) = self.next_job() else { break };
+            self.spawn_workers();
+            self.busy += 1;
+            if let Err(e) = self.jobs.as_ref().expect("vblk job channel").send(job) {
+                // Workers gone: fail the job's requests rather than leave them stuck
+                let job = e.into_inner();
+                tracing::error!("vblk dispatcher stopped; failing I/O at LBA {}", job.lba);
+                let _ = self.done_tx.send((job, Err(anyhow!("vblk dispatcher stopped"))));
+            }
+        }
+    }
+
+    /// Cut the next backing I/O from the queue: the oldest request's next
+    /// piece of at most `BATCH_MAX_XFER`, then, once it is fully issued,
+    /// following requests that continue it on disk with the same op while
+    /// the I/O stays within `merge_len`.
+    fn next_job(&mut self) -> Option<Job> {
+        let &tag = self.pending.front()?;
+        let r = self.slab[tag as usize].as_mut().expect("pending vblk tag");
+        let part = Part { tag, off: r.issued, len: (r.len - r.issued).min(BATCH_MAX_XFER) };
+        r.issued += part.len;
+        if part.off == 0 {
+            self.inflight += 1;
+        }
+        let mut job = Job { op: r.op, lba: r.lba + (part.off / SECTOR) as u64, len: part.len, buf: Vec::new(), part, merged: Vec::new() };
+        if r.issued < r.len {
+            return Some(self.fill(job));
+        }
+        self.pending.pop_front();
+        while let Some(&next) = self.pending.front() {
+            let n = self.slab[next as usize].as_mut().expect("pending vblk tag");
+            if n.op != job.op || n.issued != 0 || n.lba != job.lba + (job.len / SECTOR) as u64 || job.len as u64 + n.len as u64 > self.merge_len as u64 {
                 break;
             }
+            n.issued = n.len;
+            job.merged.push(Part { tag: next, off: 0, len: n.len });
+            job.len += n.len;
+            self.inflight += 1;
+            self.pending.pop_front();
         }
+        Some(self.fill(job))
     }
 
-    pub fn drain_completions(&mut self) {
-        // try each inflight; finished ones are collected
-        let mut done_ids = Vec::new();
-        for (id, infl) in self.inflight.iter() {
-            match infl.rx.try_recv() {
-                Ok(Ok(buf)) => {
-                    // TODO: hand off to upper layers (e.g., filesystem, boot logic)
-                    if matches!(infl.op, Op::Read) && buf.len() != infl.len as usize {
-                        tracing::warn!(
-                            "vblk short read at LBA {}: got {}, expected {}",
-                            infl.lba,
-                            buf.len(),
-                            infl.len
-                        );
+    /// Give `job` its buffer: the request's own when it is the whole of one
+    /// request, else a fresh one (holding the payloads, for a write).
+    fn fill(&mut self, mut job: Job) -> Job {
+        let p = job.part;
+        let r = self.slab[p.tag as usize].as_mut().expect("pending vblk tag");
+        if job.merged.is_empty() && p.off == 0 && p.len == r.len {
+            job.buf = std::mem::take(&mut r.buf);
+            return job;
+        }
+        let mut buf = Vec::with_capacity(job.len as usize);
+        for p in job.parts() {
+            let r = self.slab[p.tag as usize].as_ref().expect("pending vblk tag");
+            match job.op {
+                Op::Read => buf.resize(buf.len() + p.len as usize, 0),
+                Op::Write => buf.extend_from_slice(&r.buf[p.off as usize..(p.off + p.len) as usize]),
+            }
+        }
+        job.buf = buf;
+        job
+    }
+
+    /// Hand every finished request to `on_done`, then backfill the queue.
+    pub fn drain_completions(&mut self, mut on_done: impl FnMut(Completion)) {
+        while let Ok((mut job, res)) = self.done.try_recv() {
+            self.busy -= 1;
+            if res.is_ok() {
+                metrics::record(Hist::BackingIo, job.len as u64);
+            }
+            let single = job.merged.is_empty();
+            let mut at = 0usize;
+            for p in iter::once(job.part).chain(std::mem::take(&mut job.merged)) {
+                let Some(r) = self.slab.get_mut(p.tag as usize).and_then(Option::as_mut) else {
+                    tracing::error!("vblk completion for unknown tag {}", p.tag);
+                    continue;
+                };
+                match &res {
+                    Ok(()) if single && p.off == 0 && p.len == r.len => r.buf = std::mem::take(&mut job.buf),
+                    Ok(()) if r.op == Op::Read => r.buf[p.off as usize..(p.off + p.len) as usize]
+                        .copy_from_slice(&job.buf[at..at + p.len as usize]),
+                    Ok(()) => {}
+                    Err(e) => {
+                        r.err.get_or_insert_with(|| anyhow!("{e:#}"));
                     }
-                    done_ids.push(*id);
                 }
-                Ok(Err(e)) => {
-                    tracing::error!("vblk error at LBA {}: {:?}", infl.lba, e);
-                    done_ids.push(*id);
-                }
-                Err(TryRecvError::Empty) => { /* not ready */ }
-                Err(TryRecvError::Disconnected) => {
-                    tracing::error!("vblk channel closed for LBA {}", infl.lba);
-                    done_ids.push(*id);
+                at += p.len as usize;
+                r.done += p.len;
+                if r.done == r.len {
+                    self.complete(p.tag, &mut on_done);
                 }
             }
         }
-        for id in done_ids {
-            self.inflight.remove(&id);
-        }
-        // backfill queue
         self.kick();
+        metrics::set(Gauge::VblkQueued, (self.inflight + self.pending()) as u64);
+    }
+
+    fn complete(&mut self, tag: Tag, on_done: &mut impl FnMut(Completion)) {
+        let Some(mut meta) = self.slab[tag as usize].take() else { return };
+        self.free.push(tag);
+        self.inflight -= 1;
+        metrics::record_since(Hist::VblkIo, meta.submitted);
+        let result = match meta.err.take() {
+            None if meta.op == Op::Read => {
+                metrics::add(Counter::VblkReadBytes, meta.len as u64);
+                Ok(meta.buf)
+            }
+            None => {
+                metrics::add(Counter::VblkWriteBytes, meta.len as u64);
+                meta.buf.clear();
+                Ok(meta.buf)
+            }
+            Some(e) => {
+                metrics::add(Counter::VblkErrors, 1);
+                tracing::error!("vblk error at LBA {}: {:?}", meta.lba, e);
+                Err(e)
+            }
+        };
+        on_done(Completion { tag, op: meta.op, lba: meta.lba, len: meta.len, result });
+    }
+
+    pub fn inflight(&self) -> usize {
+        self.inflight
+    }
+
+    /// Requests none of whose bytes went out yet.
+    pub fn pending(&self) -> usize {
+        let split = self.pending.front().is_some_and(|&t| self.slab[t as usize].as_ref().is_some_and(|r| r.issued != 0));
+        self.pending.len() - split as usize
+    }
+}
+
+impl Drop for Vblk<'_> {
+    fn drop(&mut self) {
+        // Closing the job channel lets workers finish their current IOCTL and exit
+        self.jobs.take();
+        for w in self.workers.drain(..) {
+            let _ = w.join();
+        }
+    }
+}
+
+fn worker(dev: &'static Device, jobs: Receiver<Job>, done: Sender<(Job, Result<()>)>) {
+    for mut job in jobs.iter() {
+        // Straight into / out of the job's buffer: the request's own unless split
+        // or merged. The IRP owns it while in flight; a timed-out job loses it.
+        let mut buf = std::mem::take(&mut job.buf);
+        buf.truncate(job.len as usize);
+        let res = match job.op {
+            Op::Read => dev.vblk_read_owned(job.lba, buf, IO_TIMEOUT),
+            Op::Write => dev.vblk_write_owned(job.lba, buf, IO_TIMEOUT),
+        };
+        let res = res.map(|buf| job.buf = buf);
+        if done.send((job, res)).is_err() {
+            break;
+        }
+    }
+}
+
+#[cfg(all(test, target_os = "linux"))]
+mod tests {
+    use super::*;
+    use crate::hostdev::IoEngine;
+
+    const MIB: usize = 1024 * 1024;
+
+    fn image(tag: &str, len: usize) -> std::path::PathBuf {
+        let path = std::env::temp_dir().join(format!("colx-vblk-{tag}-{}", std::process::id()));
+        std::fs::write(&path, vec![0u8; len]).unwrap();
+        path
+    }
+
+    fn run(vblk: &mut Vblk, reqs: impl IntoIterator<Item = VblkReq>) -> Vec<Completion> {
+        let tags: Vec<Tag> = reqs.into_iter().map(|r| vblk.submit(r)).collect();
+        let mut done = Vec::new();
+        while done.len() < tags.len() {
+            vblk.drain_completions(|c| done.push(c));
+            thread::yield_now();
+        }
+        done.sort_by_key(|c| tags.iter().position(|&t| t == c.tag));
+        done
+    }
+
+    #[test]
+    fn oversize_requests_are_split() {
+        let dev = Device::open_host(IoEngine::Inline, 2).unwrap();
+        let path = image("split", 4 * MIB);
+        dev.vblk_set_backing_sync(path.to_str().unwrap(), IO_TIMEOUT).unwrap();
+        let mut vblk = Vblk::new(&dev, 2);
+        // No threads until something is submitted
+        vblk.drain_completions(|_| {});
+        assert!(vblk.workers.is_empty());
+        let payload: Vec<u8> = (0..(2 * MIB + 512) as u32).map(|i| (i / 512) as u8).collect();
+        let w = run(&mut vblk, [VblkReq { op: Op::Write, lba: 8, len: payload.len() as u32, buf: payload.clone() }]);
+        assert!(w[0].result.as_ref().unwrap().is_empty());
+        let r = run(&mut vblk, [VblkReq { op: Op::Read, lba: 8, len: payload.len() as u32, buf: Vec::new() }]);
+        assert!(r[0].result.as_ref().unwrap() == &payload);
+        assert_eq!((vblk.inflight(), vblk.pending()), (0, 0));
+        assert_eq!(vblk.workers.len(), 2);
+        let _ = std::fs::remove_file(path);
+    }
+
+    #[test]
+    fn queued_sequential_requests_are_merged() {
+        let dev = Device::open_host(IoEngine::Inline, 2).unwrap();
+        let path = image("merge", MIB);
+        dev.vblk_set_backing_sync(path.to_str().unwrap(), IO_TIMEOUT).unwrap();
+        let mut vblk = Vblk::with_merge(&dev, 1, 16 * 1024);
+        // One in flight, then six 4 KiB writes queue up behind it
+        let reqs = (0..7u8).map(|i| VblkReq { op: Op::Write, lba: i as u64 * 8, len: 4096, buf: vec![i + 1; 4096] });
+        let tags: Vec<Tag> = reqs.map(|r| vblk.submit(r)).collect();
+        assert_eq!((vblk.inflight(), vblk.pending()), (1, 6));
+        let mut done = 0;
+        while done < tags.len() {
+            vblk.drain_completions(|c| {
+                assert!(c.result.is_ok());
+                done += 1;
+            });
+            // Each job after the first carries up to four requests
+            assert!(vblk.busy <= 1 && vblk.inflight() <= 4);
+            thread::yield_now();
+        }
+        let back = run(&mut vblk, [VblkReq { op: Op::Read, lba: 0, len: 7 * 4096, buf: Vec::new() }]);
+        let data = back[0].result.as_ref().unwrap();
+        assert!((0..7).all(|i| data[i * 4096..(i + 1) * 4096].iter().all(|&b| b == i as u8 + 1)));
+
+        // Reads merge too, and each request gets its own slice back
+        let got = run(&mut vblk, (0..7u64).map(|i| VblkReq { op: Op::Read, lba: i * 8, len: 4096, buf: Vec::new() }));
+        assert!(got.iter().enumerate().all(|(i, c)| c.result.as_ref().unwrap() == &vec![i as u8 + 1; 4096]));
+        let _ = std::fs::remove_file(path);
     }
 }
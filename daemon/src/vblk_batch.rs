@@ -0,0 +1,348 @@
+//! Encode/decode layer for IOCTL_COLINUX_VBLK_SUBMIT_BATCH.
+//! Mirrors VBLK_BATCH_HDR / VBLK_BATCH_DESC in driver_c/include/colinux_ioctls.h:
+//!   in:  [count:4][status_off:4][flags:4][rsvd:4] + count * [op:1][rsvd:3][len:4][lba:8][buf_off:8]
+//!   out: one MDL buffer holding every data window plus a LONG status per descriptor.
+//! FLUSH, DISCARD and WRITE_ZEROES carry no data window: `buf_off` is ignored,
+//! FLUSH has len 0 and the others may cover up to `BATCH_MAX_TRIM` bytes.
+//! Pure byte-level code so it can be tested without the driver.
+
+use anyhow::{bail, Result};
+
+pub const BATCH_HDR_LEN: usize = 16;
+pub const BATCH_DESC_LEN: usize = 24;
+pub const BATCH_MAX: usize = 64;
+/// Largest ring slot window the driver grants; must match COLINUX_VBLK_MAX_XFER.
+pub const BATCH_MAX_XFER: u32 = 1024 * 1024;
+/// Largest DISCARD / WRITE_ZEROES range; must match MAX_TRIM in driver_c/vblk.c.
+pub const BATCH_MAX_TRIM: u32 = 1 << 30;
+const SECTOR: u32 = 512;
+
+pub const OP_READ: u8 = 0;
+pub const OP_WRITE: u8 = 1;
+pub const OP_FLUSH: u8 = 2;
+pub const OP_DISCARD: u8 = 3;
+pub const OP_WRITE_ZEROES: u8 = 4;
+
+// NTSTATUS values reported per descriptor
+pub const STATUS_SUCCESS: i32 = 0;
+pub const STATUS_INVALID_PARAMETER: i32 = 0xC000_000Du32 as i32;
+
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct BatchDesc {
+    pub op: u8,
+    pub len: u32,
+    pub lba: u64,
+    pub buf_off: u64,
+}
+
+impl BatchDesc {
+    pub fn read(lba: u64, len: u32, buf_off: u64) -> Self {
+        Self { op: OP_READ, len, lba, buf_off }
+    }
+
+    pub fn write(lba: u64, len: u32, buf_off: u64) -> Self {
+        Self { op: OP_WRITE, len, lba, buf_off }
+    }
+
+    pub fn flush() -> Self {
+        Self { op: OP_FLUSH, ..Default::default() }
+    }
+
+    pub fn discard(lba: u64, len: u32) -> Self {
+        Self { op: OP_DISCARD, len, lba, buf_off: 0 }
+    }
+
+    pub fn write_zeroes(lba: u64, len: u32) -> Self {
+        Self { op: OP_WRITE_ZEROES, len, lba, buf_off: 0 }
+    }
+
+    /// READ and WRITE move data through a window; the other ops do not.
+    pub fn has_data(&self) -> bool {
+        self.op == OP_READ || self.op == OP_WRITE
+    }
+
+    fn end(&self) -> u64 {
+        self.buf_off + self.len as u64
+    }
+
+    /// This descriptor's data window in `span`; None when it does not fit.
+    pub fn window<'s>(&self, span: &'s mut [u8]) -> Option<&'s mut [u8]> {
+        let end = self.buf_off.checked_add(self.len as u64)?;
+        span.get_mut(usize::try_from(self.buf_off).ok()?..usize::try_from(end).ok()?)
+    }
+}
+
+/// Bytes occupied by the status table for `count` descriptors.
+pub fn status_table_len(count: usize) -> usize {
+    count * 4
+}
+
+/// Check a batch against an out buffer of `out_len` bytes with the same rules
+/// the driver applies, so malformed batches fail before the IRP is issued.
+pub fn validate(descs: &[BatchDesc], status_off: usize, out_len: usize) -> Result<()> {
+    if descs.is_empty() || descs.len() > BATCH_MAX {
+        bail!("vblk batch: {} descriptors (1..{})", descs.len(), BATCH_MAX);
+    }
+    if status_off % 4 != 0 {
+        bail!("vblk batch: status_off {} not 4-byte aligned", status_off);
+    }
+    let status_end = status_off + status_table_len(descs.len());
+    if status_end > out_len {
+        bail!("vblk batch: status table [{}, {}) exceeds buffer {}", status_off, status_end, out_len);
+    }
+    for (i, d) in descs.iter().enumerate() {
+        match d.op {
+            OP_READ | OP_WRITE => {}
+            OP_FLUSH if d.len == 0 => continue,
+            OP_DISCARD | OP_WRITE_ZEROES if d.len != 0 && d.len <= BATCH_MAX_TRIM && d.len % SECTOR == 0 => continue,
+            OP_FLUSH | OP_DISCARD | OP_WRITE_ZEROES => bail!("vblk batch: desc {} bad len {}", i, d.len),
+            _ => bail!("vblk batch: desc {} bad op {}", i, d.op),
+        }
+        if d.len == 0 || d.len > BATCH_MAX_XFER || d.len % SECTOR != 0 {
+            bail!("vblk batch: desc {} bad len {}", i, d.len);
+        }
+        if d.end() > out_len as u64 {
+            bail!("vblk batch: desc {} window exceeds buffer", i);
+        }
+        if d.buf_off < status_end as u64 && d.end() > status_off as u64 {
+            bail!("vblk batch: desc {} overlaps status table", i);
+        }
+    }
+    Ok(())
+}
+
+/// Elevator back-merge: fold each READ or WRITE into the descriptor before it
+/// when it has the same op and continues it both on disk and in the window,
+/// up to `max_len` bytes per descriptor. Works in place and keeps order, so
+/// FLUSH and the data-less ops stay barriers; `into[i]` receives the merged
+/// index of input descriptor `i`. Returns the merged count. Consecutive ring
+/// slots have consecutive windows, so a request chained across slots and a
+/// sequential stream of small ones both become one backing I/O.
+pub fn merge(descs: &mut [BatchDesc], max_len: u32, into: &mut [usize]) -> usize {
+    let mut n = 0;
+    for i in 0..descs.len() {
+        let d = descs[i];
+        if n > 0 {
+            let p = &mut descs[n - 1];
+            if d.has_data()
+                && p.op == d.op
+                && p.lba + (p.len / SECTOR) as u64 == d.lba
+                && p.end() == d.buf_off
+                && p.len as u64 + d.len as u64 <= max_len as u64
+            {
+                p.len += d.len;
+                into[i] = n - 1;
+                continue;
+            }
+        }
+        descs[n] = d;
+        into[i] = n;
+        n += 1;
+    }
+    n
+}
+
+/// Bytes `encode` produces for `count` descriptors.
+pub fn encoded_len(count: usize) -> usize {
+    BATCH_HDR_LEN + count * BATCH_DESC_LEN
+}
+
+/// Serialize header + descriptors into the IOCTL input buffer.
+pub fn encode(descs: &[BatchDesc], status_off: u32) -> Vec<u8> {
+    let mut out = vec![0u8; encoded_len(descs.len())];
+    encode_into(descs, status_off, &mut out);
+    out
+}
+
+/// As `encode`, into a caller buffer (e.g. a pooled one); returns bytes written.
+pub fn encode_into(descs: &[BatchDesc], status_off: u32, out: &mut [u8]) -> usize {
+    let len = encoded_len(descs.len());
+    let out = &mut out[..len];
+    out[0..4].copy_from_slice(&(descs.len() as u32).to_le_bytes());
+    out[4..8].copy_from_slice(&status_off.to_le_bytes());
+    out[8..16].fill(0); // flags, rsvd
+    for (d, c) in descs.iter().zip(out[BATCH_HDR_LEN..].chunks_exact_mut(BATCH_DESC_LEN)) {
+        c[0] = d.op;
+        c[1..4].fill(0);
+        c[4..8].copy_from_slice(&d.len.to_le_bytes());
+        c[8..16].copy_from_slice(&d.lba.to_le_bytes());
+        c[16..24].copy_from_slice(&d.buf_off.to_le_bytes());
+    }
+    len
+}
+
+/// Parse an input buffer back into (status_off, descriptors); the inverse of `encode`.
+pub fn decode(inbuf: &[u8]) -> Result<(u32, Vec<BatchDesc>)> {
+    if inbuf.len() < BATCH_HDR_LEN {
+        bail!("vblk batch: short header {}", inbuf.len());
+    }
+    let count = u32::from_le_bytes(inbuf[0..4].try_into().unwrap()) as usize;
+    let status_off = u32::from_le_bytes(inbuf[4..8].try_into().unwrap());
+    let flags = u32::from_le_bytes(inbuf[8..12].try_into().unwrap());
+    if flags != 0 {
+        bail!("vblk batch: unknown flags 0x{:x}", flags);
+    }
+    if count > BATCH_MAX || inbuf.len() < BATCH_HDR_LEN + count * BATCH_DESC_LEN {
+        bail!("vblk batch: {} descriptors in {} bytes", count, inbuf.len());
+    }
+    let descs = inbuf[BATCH_HDR_LEN..BATCH_HDR_LEN + count * BATCH_DESC_LEN]
+        .chunks_exact(BATCH_DESC_LEN)
+        .map(|c| BatchDesc {
+            op: c[0],
+            len: u32::from_le_bytes(c[4..8].try_into().unwrap()),
+            lba: u64::from_le_bytes(c[8..16].try_into().unwrap()),
+            buf_off: u64::from_le_bytes(c[16..24].try_into().unwrap()),
+        })
+        .collect();
+    Ok((status_off, descs))
+}
+
+/// Read the per-descriptor NTSTATUS table the driver wrote into the out buffer.
+pub fn decode_statuses(out: &[u8], status_off: usize, count: usize) -> Result<Vec<i32>> {
+    Ok(statuses(out, status_off, count)?.collect())
+}
+
+/// Non-allocating form of `decode_statuses`.
+pub fn statuses(out: &[u8], status_off: usize, count: usize) -> Result<impl Iterator<Item = i32> + '_> {
+    let end = status_off + status_table_len(count);
+    if end > out.len() {
+        bail!("vblk batch: status table exceeds buffer");
+    }
+    Ok(out[status_off..end]
+        .chunks_exact(4)
+        .map(|c| i32::from_le_bytes(c.try_into().unwrap())))
+}
+
+/// Store a status the way the driver does (used by tests and simulated backends).
+pub fn store_status(out: &mut [u8], status_off: usize, idx: usize, status: i32) {
+    let at = status_off + idx * 4;
+    out[at..at + 4].copy_from_slice(&status.to_le_bytes());
+}
+
+#[inline]
+pub fn nt_success(status: i32) -> bool {
+    status >= 0
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn encode_decode_roundtrip() {
+        let descs = vec![BatchDesc::read(0x100, 4096, 0), BatchDesc::write(0x900, 512, 128 * 1024)];
+        let enc = encode(&descs, 256 * 1024);
+        assert_eq!(enc.len(), BATCH_HDR_LEN + 2 * BATCH_DESC_LEN);
+        let (status_off, dec) = decode(&enc).unwrap();
+        assert_eq!(status_off, 256 * 1024);
+        assert_eq!(dec, descs);
+        let mut pooled = [0xFFu8; 256];
+        assert_eq!(encode_into(&descs, 256 * 1024, &mut pooled), enc.len());
+        assert_eq!(&pooled[..enc.len()], &enc[..]);
+    }
+
+    #[test]
+    fn wire_layout_matches_driver_structs() {
+        let enc = encode(&[BatchDesc::write(0x0102_0304_0506_0708, 0x200, 0x1122)], 0x40);
+        assert_eq!(&enc[0..4], &1u32.to_le_bytes());
+        assert_eq!(&enc[4..8], &0x40u32.to_le_bytes());
+        let d = &enc[BATCH_HDR_LEN..];
+        assert_eq!(d[0], OP_WRITE);
+        assert_eq!(&d[4..8], &0x200u32.to_le_bytes());
+        assert_eq!(&d[8..16], &0x0102_0304_0506_0708u64.to_le_bytes());
+        assert_eq!(&d[16..24], &0x1122u64.to_le_bytes());
+    }
+
+    #[test]
+    fn validate_rejects_bad_batches() {
+        let ok = [BatchDesc::read(0, 4096, 0)];
+        assert!(validate(&ok, 4096, 4096 + 4).is_ok());
+        assert!(validate(&[], 0, 4096).is_err());
+        assert!(validate(&[BatchDesc::read(0, 100, 0)], 4096, 8192).is_err()); // unaligned len
+        assert!(validate(&[BatchDesc::read(0, 4096, 4096)], 0, 4096).is_err()); // past end
+        assert!(validate(&ok, 2048, 8192).is_err()); // overlaps status table
+        assert!(validate(&ok, 4097, 8192).is_err()); // misaligned status
+        let many = vec![BatchDesc::read(0, 512, 0); BATCH_MAX + 1];
+        assert!(validate(&many, 1 << 20, 2 << 20).is_err());
+        let bad_op = [BatchDesc { op: 7, ..ok[0] }];
+        assert!(validate(&bad_op, 4096, 8192).is_err());
+    }
+
+    #[test]
+    fn validate_dataless_ops() {
+        // No window: buf_off is ignored and len may exceed the transfer cap
+        let descs = [BatchDesc::flush(), BatchDesc::discard(8, 16 << 20), BatchDesc::write_zeroes(0, 4096)];
+        assert!(validate(&descs, 0, 12).is_ok());
+        assert!(descs.iter().all(|d| !d.has_data()));
+        assert!(validate(&[BatchDesc { len: 512, ..BatchDesc::flush() }], 0, 4).is_err());
+        assert!(validate(&[BatchDesc::discard(0, 0)], 0, 4).is_err());
+        assert!(validate(&[BatchDesc::write_zeroes(0, 1000)], 0, 4).is_err());
+        assert!(validate(&[BatchDesc::discard(0, BATCH_MAX_TRIM + 512)], 0, 4).is_err());
+    }
+
+    #[test]
+    fn merge_folds_contiguous_runs() {
+        let mut descs = [
+            BatchDesc::read(0, 4096, 0),
+            BatchDesc::read(8, 4096, 4096),
+            BatchDesc::read(16, 4096, 8192),
+            BatchDesc::write(24, 4096, 12288), // op changes
+            BatchDesc::write(40, 4096, 16384), // LBA gap
+            BatchDesc::write(48, 4096, 24576), // window gap
+            BatchDesc::flush(),
+            BatchDesc::write(56, 4096, 28672), // not across the barrier
+        ];
+        let mut into = [0; 8];
+        let n = merge(&mut descs, 1 << 20, &mut into);
+        assert_eq!(n, 6);
+        assert_eq!(descs[0], BatchDesc::read(0, 12288, 0));
+        assert_eq!(&descs[1..6], &[
+            BatchDesc::write(24, 4096, 12288),
+            BatchDesc::write(40, 4096, 16384),
+            BatchDesc::write(48, 4096, 24576),
+            BatchDesc::flush(),
+            BatchDesc::write(56, 4096, 28672),
+        ]);
+        assert_eq!(into, [0, 0, 0, 1, 2, 3, 4, 5]);
+    }
+
+    #[test]
+    fn merge_respects_the_size_limit() {
+        let mut descs: Vec<_> = (0..6).map(|i| BatchDesc::write(i * 8, 4096, i * 4096)).collect();
+        let mut into = [0; 6];
+        assert_eq!(merge(&mut descs, 8192, &mut into), 3);
+        assert_eq!(into, [0, 0, 1, 1, 2, 2]);
+        assert!(descs[..3].iter().all(|d| d.len == 8192));
+        // A limit below one descriptor leaves the batch as it was
+        let mut descs = [BatchDesc::read(0, 4096, 0), BatchDesc::read(8, 4096, 4096)];
+        assert_eq!(merge(&mut descs, 0, &mut into), 2);
+        assert_eq!(descs[1], BatchDesc::read(8, 4096, 4096));
+    }
+
+    #[test]
+    fn decode_rejects_truncated_input() {
+        let enc = encode(&[BatchDesc::read(0, 512, 0); 3], 4096);
+        assert!(decode(&enc[..enc.len() - 1]).is_err());
+        assert!(decode(&enc[..8]).is_err());
+    }
+
+    #[test]
+    fn windows_outside_the_span_are_refused() {
+        let mut span = vec![0u8; 4096];
+        assert_eq!(BatchDesc::read(0, 512, 3584).window(&mut span).map(|w| w.len()), Some(512));
+        assert!(BatchDesc::read(0, 1024, 3584).window(&mut span).is_none());
+        assert!(BatchDesc::write(0, 512, u64::MAX - 100).window(&mut span).is_none());
+    }
+
+    #[test]
+    fn statuses_roundtrip() {
+        let mut out = vec![0u8; 64];
+        store_status(&mut out, 32, 0, STATUS_SUCCESS);
+        store_status(&mut out, 32, 1, STATUS_INVALID_PARAMETER);
+        let st = decode_statuses(&out, 32, 2).unwrap();
+        assert_eq!(st, vec![STATUS_SUCCESS, STATUS_INVALID_PARAMETER]);
+        assert!(nt_success(st[0]));
+        assert!(!nt_success(st[1]));
+        assert!(decode_statuses(&out, 60, 2).is_err());
+    }
+}
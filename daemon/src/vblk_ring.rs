@@ -1,91 +1,647 @@
-use crate::device::{Device, MapInfo};
+use crate::blockdev::BlockBackend;
+use crate::device::MapInfo;
+use crate::geom::{Geometry, RING_CAP_OFF};
+use crate::metrics::{self, Counter, Hist};
+use crate::sparse::is_zero;
+use crate::trace::{self, TraceRing};
+use crate::vblk_batch::{self, BatchDesc, BATCH_MAX, BATCH_MAX_TRIM, BATCH_MAX_XFER};
 use anyhow::{bail, Result};
-use std::mem::size_of;
-use std::ptr::NonNull;
+use crossbeam_channel::{bounded, Sender};
+use std::ptr::{self, NonNull};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, Condvar, Mutex, PoisonError};
+use std::thread::{self, JoinHandle};
+use std::time::Instant;
 
-const VBLK_RING_OFF: usize = 0x1000;
-const VBLK_DATA_OFF: usize = 0x4000;
-const VBLK_SLOT_DATA_STRIDE: usize = 128 * 1024;
-// Prototype maximum data window: matches mem.c default cap (8 slots)
-const VBLK_DATA_MAX: usize = VBLK_SLOT_DATA_STRIDE * 8;
+// COLX_HDR_F_VBLK_TRIM (geometry features / colx_ring_hdr.flags): the driver services the data-less ops
+const HDR_F_VBLK_TRIM: u32 = 0x2;
 
 const OP_READ: u8 = 0;
 const OP_WRITE: u8 = 1;
+const OP_FLUSH: u8 = 2;
+const OP_DISCARD: u8 = 3;
+const OP_WRITE_ZEROES: u8 = 4;
+
+/// Smallest all-zero write worth turning into WRITE_ZEROES: one host cluster.
+const ZERO_SCAN_MIN: usize = 4096;
+
+/// COLX_VBLK_SLOT_F_CHAIN: more slots of the same guest request follow. The
+/// host needs no chain state (each slot is a complete piece, merged like any
+/// contiguous run), so only the tests set it.
+#[cfg_attr(not(test), allow(dead_code))]
+const SLOT_F_CHAIN: u16 = 0x1;
 
 const ST_OK: u8 = 0;
 const ST_EINVAL: u8 = 1;
 const ST_EIO: u8 = 5;
 
-#[repr(C)]
-struct RingCtrl {
-    prod: u32,
-    cons: u32,
-    cap: u32,
-    slot_size: u32,
-}
-
 #[repr(C)]
 struct VblkSlot {
     id: u64,
     op: u8,
     status: u8,
-    _pad: u16,
+    #[cfg_attr(not(test), allow(dead_code))]
+    flags: u16,
     lba: u64,
     len: u32,
     data_off: u32,
 }
 
+/// One VBLK ring (hardware queue) of the shared mapping.
 pub struct VblkRing<'a> {
-    dev: &'a Device,
+    backend: &'a dyn BlockBackend,
     base: NonNull<u8>,
     size: usize,
+    ring_off: usize,
+    cons_off: usize,
+    slots_off: usize,
+    /// Offset of this ring's windows from the geometry's vblk_data_off, as slots express it.
+    data_base: usize,
+    data_off: usize,
+    slot_stride: usize,
+    /// Slot windows plus the host-private batch status table after them.
+    batch_span: usize,
+    trim: bool,
+    /// Largest backing I/O contiguous slots are merged into; 0 disables merging.
+    merge_len: u32,
+    /// Ring index, as trace records name it.
+    queue: u8,
 }
 
+// Each ring is pumped by one thread at a time (see `VblkQueues`); the backend is Sync.
+unsafe impl Send for VblkRing<'_> {}
+unsafe impl Sync for VblkRing<'_> {}
+
 impl<'a> VblkRing<'a> {
-    pub fn new(dev: &'a Device, map: MapInfo) -> Result<Self> {
-        if map.size as usize <= VBLK_DATA_OFF + VBLK_DATA_MAX {
-            bail!("shared map too small for vblk ring");
+    /// Ring `queue` of the layout `geom` describes: its control block, slot
+    /// windows and scratch page are wherever the driver placed them.
+    pub fn new(backend: &'a dyn BlockBackend, map: MapInfo, geom: &Geometry, queue: usize) -> Result<Self> {
+        if queue >= geom.vblk_queues {
+            bail!("vblk queue {} out of range (0..{})", queue, geom.vblk_queues);
+        }
+        let data_base = geom.data_base(queue);
+        let batch_span = geom.window() + BATCH_MAX * 4;
+        if map.size as usize <= geom.vblk_data_off + data_base + batch_span {
+            bail!("shared map too small for vblk ring {}", queue);
         }
         let base = NonNull::new(map.user_base as *mut u8).ok_or_else(|| anyhow::anyhow!("null map base"))?;
-        Ok(Self { dev, base, size: map.size as usize })
+        Ok(Self {
+            backend,
+            base,
+            size: map.size as usize,
+            ring_off: geom.ring_off(queue),
+            cons_off: geom.cons_off(queue),
+            slots_off: geom.slots_off(queue),
+            data_base,
+            data_off: geom.vblk_data_off,
+            slot_stride: geom.vblk_slot_stride,
+            batch_span,
+            trim: geom.features & HDR_F_VBLK_TRIM != 0,
+            merge_len: BATCH_MAX_XFER,
+            queue: queue as u8,
+        })
+    }
+
+    /// The host initialised this ring at map time (absent rings keep cap 0).
+    fn present(&self) -> bool {
+        unsafe { ptr::read_volatile(self.ptr::<u32>(self.ring_off + RING_CAP_OFF)) != 0 }
+    }
+
+    /// Published slots the ring has not consumed yet.
+    pub fn pending(&self) -> bool {
+        self.prod().load(Ordering::Acquire) != self.cons().load(Ordering::Acquire)
+    }
+
+    /// Guest-owned producer index; each side's index has its own cache line.
+    fn prod(&self) -> &AtomicU32 {
+        unsafe { &*self.ptr::<AtomicU32>(self.ring_off) }
+    }
+
+    /// Host-owned consumer index; only the thread pumping this ring stores it.
+    fn cons(&self) -> &AtomicU32 {
+        unsafe { &*self.ptr::<AtomicU32>(self.cons_off) }
     }
 
     unsafe fn ptr<T>(&self, off: usize) -> *mut T {
+        debug_assert!(off < self.size);
         self.base.as_ptr().add(off) as *mut T
     }
 
+    /// Service every published slot. Up to BATCH_MAX slots go to the backend as
+    /// one batch over the data-window area of the shared mapping, so each slot
+    /// is read into / written from in place. FLUSH, DISCARD and WRITE_ZEROES
+    /// ride in the same batch, keeping ring order; all-zero write payloads
+    /// become WRITE_ZEROES so sparse backings store a hole instead. READs and
+    /// WRITEs that continue the previous slot on disk are merged into one
+    /// backing I/O of up to `merge_len` bytes: a request the guest chained
+    /// across slots, or a sequential stream, reaches the image in large pieces.
+    ///
+    /// Each batch costs one acquire load of prod and one release store of
+    /// cons, however many slots it retires. Pumps that find work are timed
+    /// into `metrics`; idle ones record nothing. With the request tracer on,
+    /// every slot is stamped at pickup, around its batch and at completion.
     pub fn pump(&self) -> Result<()> {
         unsafe {
-            let ctrl = &mut *self.ptr::<RingCtrl>(VBLK_RING_OFF);
-            let cap = ctrl.cap as usize;
-            let slots_base = self.ptr::<u8>(VBLK_RING_OFF + size_of::<RingCtrl>()) as *mut VblkSlot;
-            while ctrl.prod != ctrl.cons {
-                let idx = (ctrl.cons % (cap as u32)) as usize;
-                let slot = &mut *slots_base.add(idx);
-                // validate
-                let len = slot.len as usize;
-                let data_off = slot.data_off as usize;
-                if len == 0 || (len & 511) != 0 || len > VBLK_SLOT_DATA_STRIDE || data_off + len > (VBLK_SLOT_DATA_STRIDE * cap) {
-                    slot.status = ST_EINVAL;
-                    ctrl.cons = ctrl.cons.wrapping_add(1);
-                    continue;
+            let trim = self.trim;
+            let tr = trace::active();
+            if !self.present() {
+                return Ok(());
+            }
+            // Index by the geometry, not the guest-writable cap in the ring
+            let window = self.batch_span - BATCH_MAX * 4;
+            let cap = window / self.slot_stride;
+            let slots_base = self.ptr::<VblkSlot>(self.slots_off);
+            // Stack-resident batch: the pump path makes no heap allocations
+            let mut descs = [BatchDesc::default(); BATCH_MAX];
+            let mut owners = [0usize; BATCH_MAX];
+            let mut cons = self.cons().load(Ordering::Relaxed);
+            let mut started = None;
+            let (mut retired, mut errors, mut rd, mut wr) = (0u64, 0u64, 0u64, 0u64);
+            loop {
+                // Pairs with the guest's release store of prod: slots below it are filled
+                let prod = self.prod().load(Ordering::Acquire);
+                if prod == cons {
+                    break;
+                }
+                started.get_or_insert_with(Instant::now);
+                let avail = prod.wrapping_sub(cons) as usize;
+                let n = avail.min(cap).min(BATCH_MAX);
+                let mut nd = 0;
+                for k in 0..n {
+                    let idx = (cons.wrapping_add(k as u32) % (cap as u32)) as usize;
+                    let slot = slots_base.add(idx);
+                    // The guest can rewrite a slot at any time: fetch each field once, and
+                    // validate and build the descriptor from these copies only
+                    let id = ptr::read_volatile(ptr::addr_of!((*slot).id));
+                    let op = ptr::read_volatile(ptr::addr_of!((*slot).op));
+                    let lba = ptr::read_volatile(ptr::addr_of!((*slot).lba));
+                    let len32 = ptr::read_volatile(ptr::addr_of!((*slot).len));
+                    let slot_off = ptr::read_volatile(ptr::addr_of!((*slot).data_off));
+                    let len = len32 as usize;
+                    if let Some(t) = tr {
+                        t.record(trace::EV_VBLK_PICKUP, self.queue, id, len32, op as u32);
+                    }
+                    // Windows are addressed from vblk_data_off; descriptors from this ring's span
+                    let data_off = (slot_off as usize).wrapping_sub(self.data_base);
+                    let d = match op {
+                        OP_READ | OP_WRITE => {
+                            if len == 0 || (len & 511) != 0 || len > self.slot_stride || data_off >= window || data_off + len > window {
+                                (*slot).status = ST_EINVAL;
+                                errors += 1;
+                                continue;
+                            }
+                            if op == OP_READ {
+                                rd += len as u64;
+                                BatchDesc::read(lba, len32, data_off as u64)
+                            } else if trim && len >= ZERO_SCAN_MIN
+                                && is_zero(core::slice::from_raw_parts(self.ptr::<u8>(self.data_off + self.data_base + data_off), len))
+                            {
+                                wr += len as u64;
+                                BatchDesc::write_zeroes(lba, len32)
+                            } else {
+                                wr += len as u64;
+                                BatchDesc::write(lba, len32, data_off as u64)
+                            }
+                        }
+                        OP_FLUSH if len == 0 => BatchDesc::flush(),
+                        OP_DISCARD | OP_WRITE_ZEROES if len != 0 && (len & 511) == 0 && len32 <= BATCH_MAX_TRIM => {
+                            if op == OP_DISCARD {
+                                BatchDesc::discard(lba, len32)
+                            } else {
+                                BatchDesc::write_zeroes(lba, len32)
+                            }
+                        }
+                        _ => { (*slot).status = ST_EINVAL; errors += 1; continue; }
+                    };
+                    descs[nd] = d;
+                    owners[nd] = idx;
+                    nd += 1;
+                }
+                if nd > 0 {
+                    errors += self.service(slots_base, &mut descs[..nd], &owners[..nd], tr);
+                }
+                // Stamped just before the store: the guest may reuse the slots after it
+                if let Some(t) = tr {
+                    let ts = trace::now();
+                    for k in 0..n as u32 {
+                        let slot = &*slots_base.add((cons.wrapping_add(k) % (cap as u32)) as usize);
+                        t.record_at(ts, trace::EV_VBLK_COMPLETE, self.queue, slot.id, slot.len, slot.status as u32);
+                    }
+                }
+                // Statuses are written; one release store retires the whole batch
+                cons = cons.wrapping_add(n as u32);
+                self.cons().store(cons, Ordering::Release);
+                retired += n as u64;
+            }
+            if let Some(t0) = started {
+                metrics::record_since(Hist::RingPump, t0);
+                metrics::record(Hist::RingBatch, retired);
+                metrics::add(Counter::VblkReadBytes, rd);
+                metrics::add(Counter::VblkWriteBytes, wr);
+                if errors != 0 {
+                    metrics::add(Counter::VblkErrors, errors);
                 }
-                let lba = slot.lba;
-                let data_ptr = self.ptr::<u8>(VBLK_DATA_OFF + data_off);
-                let data = core::slice::from_raw_parts_mut(data_ptr, len);
-                // service
-                let res = match slot.op {
-                    OP_READ => self.dev.vblk_read_sync(lba, slot.len, std::time::Duration::from_secs(2)).map(|out| {
-                        let n = out.len().min(len);
-                        data[..n].copy_from_slice(&out[..n]);
-                    }),
-                    OP_WRITE => self.dev.vblk_write_sync(lba, data, std::time::Duration::from_secs(2)).map(|_| {}),
-                    _ => { slot.status = ST_EINVAL; ctrl.cons = ctrl.cons.wrapping_add(1); continue; }
-                };
-                slot.status = if res.is_ok() { ST_OK } else { ST_EIO };
-                ctrl.cons = ctrl.cons.wrapping_add(1);
             }
         }
         Ok(())
     }
+
+    /// Merge and run one batch, then post each slot's status from the backing
+    /// I/O it went out in; returns how many slots failed.
+    unsafe fn service(&self, slots_base: *mut VblkSlot, descs: &mut [BatchDesc], owners: &[usize], tr: Option<&TraceRing>) -> u64 {
+        let span = core::slice::from_raw_parts_mut(self.ptr::<u8>(self.data_off + self.data_base), self.batch_span);
+        let mut into = [0usize; BATCH_MAX];
+        let nm = vblk_batch::merge(descs, self.merge_len, &mut into[..owners.len()]);
+        let mut ok = [false; BATCH_MAX];
+        let stamp = |ev: u16, ok: &[bool]| {
+            let Some(t) = tr else { return };
+            let ts = trace::now();
+            for (k, &idx) in owners.iter().enumerate() {
+                let slot = &*slots_base.add(idx);
+                t.record_at(ts, ev, self.queue, slot.id, slot.len, ok.get(k).map_or(0, |&ok| if ok { ST_OK } else { ST_EIO }) as u32);
+            }
+        };
+        stamp(trace::EV_VBLK_IO_START, &[]);
+        let mut merged_ok = [false; BATCH_MAX];
+        self.backend.submit_batch(&descs[..nm], span, &mut merged_ok[..nm]);
+        for d in descs[..nm].iter().filter(|d| d.has_data()) {
+            metrics::record(Hist::BackingIo, d.len as u64);
+        }
+        for (ok, &m) in ok.iter_mut().zip(&into[..owners.len()]) {
+            *ok = merged_ok[m];
+        }
+        stamp(trace::EV_VBLK_IO_END, &ok[..owners.len()]);
+        let mut failed = 0;
+        for (&ok, &idx) in ok.iter().zip(owners) {
+            (*slots_base.add(idx)).status = if ok { ST_OK } else { ST_EIO };
+            failed += !ok as u64;
+        }
+        failed
+    }
+}
+
+/// Every ring the host set up at map time. Ring 0 is pumped by the caller;
+/// each further ring has a worker thread, so guest CPUs submitting on
+/// different hardware queues are serviced in parallel.
+pub struct VblkQueues<'a> {
+    rings: Box<[VblkRing<'a>]>,
+    geom: Geometry,
+    kicks: Vec<Sender<()>>,
+    workers: Vec<JoinHandle<()>>,
+    state: Arc<(Mutex<Workers>, Condvar)>,
+}
+
+/// Per ring, indexed like `rings` (ring 0 has no worker and stays false).
+struct Workers {
+    /// Kicked in the current `pump` and not finished yet.
+    busy: Vec<bool>,
+    /// The worker thread has exited, e.g. its pump panicked.
+    dead: Vec<bool>,
+}
+
+impl<'a> VblkQueues<'a> {
+    /// Rings as the mapping's geometry descriptor lays them out, merging
+    /// contiguous slots into backing I/Os of up to `BATCH_MAX_XFER`.
+    pub fn new(backend: &'a dyn BlockBackend, map: MapInfo) -> Result<Self> {
+        Self::with_merge(backend, map, BATCH_MAX_XFER)
+    }
+
+    /// As `new`, merging into backing I/Os of at most `merge_len` bytes
+    /// (capped at `BATCH_MAX_XFER`; 0 sends every slot on its own).
+    pub fn with_merge(backend: &'a dyn BlockBackend, map: MapInfo, merge_len: u32) -> Result<Self> {
+        let geom = Geometry::read(&map)?;
+        if geom.vblk_queues == 0 {
+            bail!("shared map has no vblk rings");
+        }
+        let mut rings = Vec::new();
+        for q in 0..geom.vblk_queues {
+            match VblkRing::new(backend, map, &geom, q) {
+                Ok(r) if q == 0 || r.present() => rings.push(VblkRing { merge_len: merge_len.min(BATCH_MAX_XFER), ..r }),
+                Ok(_) => break,
+                Err(e) if q == 0 => return Err(e),
+                Err(_) => break,
+            }
+        }
+        let rings = rings.into_boxed_slice();
+        let state = Arc::new((Mutex::new(Workers { busy: vec![false; rings.len()], dead: vec![false; rings.len()] }), Condvar::new()));
+        let mut kicks = Vec::new();
+        let mut workers = Vec::new();
+        for q in 1..rings.len() {
+            // Workers are joined in Drop, before the rings they borrow go away
+            let ring: &'static VblkRing<'static> = unsafe { std::mem::transmute(&rings[q]) };
+            let (tx, rx) = bounded::<()>(1);
+            let state = state.clone();
+            workers.push(thread::Builder::new().name(format!("vblk-q{q}")).spawn(move || {
+                // Armed first: however the thread ends, `pump` stops waiting on it
+                let _exit = Exit(&state, q);
+                while rx.recv().is_ok() {
+                    if let Err(e) = ring.pump() {
+                        tracing::error!("vblk queue {q}: {e:?}");
+                    }
+                    let (w, cv) = &*state;
+                    w.lock().unwrap().busy[q] = false;
+                    cv.notify_all();
+                }
+            })?);
+            kicks.push(tx);
+        }
+        Ok(Self { rings, geom, kicks, workers, state })
+    }
+
+    pub fn queues(&self) -> usize {
+        self.rings.len()
+    }
+
+    /// Layout the driver granted at map time.
+    pub fn geometry(&self) -> &Geometry {
+        &self.geom
+    }
+
+    /// Service every ring with published slots and return once all are drained,
+    /// so a following doorbell wait does not see work still in progress. A
+    /// ring whose worker has died (its pump panicked) is an error rather than
+    /// a wait that never ends.
+    pub fn pump(&self) -> Result<()> {
+        let (w, cv) = &*self.state;
+        let mut dead = None;
+        {
+            // Under the lock, so a worker exiting now either is seen dead here
+            // or clears the busy flag set for it
+            let mut st = w.lock().unwrap();
+            for (q, kick) in (1..self.rings.len()).zip(&self.kicks) {
+                if !self.rings[q].pending() {
+                    continue;
+                }
+                // The previous pump drained every kick, so this never blocks
+                if st.dead[q] || kick.send(()).is_err() {
+                    dead = Some(q);
+                    continue;
+                }
+                st.busy[q] = true;
+            }
+        }
+        let res = self.rings[0].pump();
+        let mut st = w.lock().unwrap();
+        while st.busy.contains(&true) {
+            st = cv.wait(st).unwrap();
+        }
+        if let Some(q) = dead {
+            bail!("vblk queue {q}: worker thread exited");
+        }
+        res
+    }
+}
+
+/// Marks ring `.1`'s worker dead when its thread ends, returning or unwinding.
+struct Exit<'b>(&'b (Mutex<Workers>, Condvar), usize);
+
+impl Drop for Exit<'_> {
+    fn drop(&mut self) {
+        let (w, cv) = self.0;
+        let mut st = w.lock().unwrap_or_else(PoisonError::into_inner);
+        st.busy[self.1] = false;
+        st.dead[self.1] = true;
+        cv.notify_all();
+    }
+}
+
+impl Drop for VblkQueues<'_> {
+    fn drop(&mut self) {
+        self.kicks.clear();
+        for w in self.workers.drain(..) {
+            let _ = w.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::mem::size_of;
+    use std::sync::Mutex;
+
+    const SECTOR: usize = 512;
+
+    /// Records which thread served each write.
+    struct Disk {
+        data: Mutex<Vec<u8>>,
+        threads: Mutex<Vec<Option<String>>>,
+    }
+
+    impl BlockBackend for Disk {
+        fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+            let d = self.data.lock().unwrap();
+            let off = lba as usize * SECTOR;
+            dst.copy_from_slice(&d[off..off + dst.len()]);
+            Ok(())
+        }
+        fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+            let off = lba as usize * SECTOR;
+            self.data.lock().unwrap()[off..off + src.len()].copy_from_slice(src);
+            self.threads.lock().unwrap().push(thread::current().name().map(str::to_string));
+            Ok(())
+        }
+    }
+
+    /// Shared mapping with `queues` rings of `cap` 64 KiB slots, laid out and
+    /// initialised the way mem.c does.
+    fn mapping(queues: usize, cap: usize) -> (Vec<u64>, MapInfo, Geometry) {
+        map_geometry(Geometry::layout(queues, cap, 64 * 1024), true)
+    }
+
+    /// A mapping holding `geom`'s rings; without the descriptor it reads as legacy.
+    fn map_geometry(geom: Geometry, descriptor: bool) -> (Vec<u64>, MapInfo, Geometry) {
+        let (queues, cap) = (geom.vblk_queues, geom.vblk_ring_cap);
+        let size = geom.span();
+        let mut mem = vec![0u64; size / 8];
+        let base = mem.as_mut_ptr() as *mut u8;
+        if descriptor {
+            geom.write(unsafe { std::slice::from_raw_parts_mut(base, 0x1000) });
+        }
+        for q in 0..queues {
+            unsafe {
+                *(base.add(geom.ring_off(q) + RING_CAP_OFF) as *mut [u32; 2]) = [cap as u32, size_of::<VblkSlot>() as u32];
+            }
+        }
+        let map = MapInfo { user_base: base as usize, kernel_base: 0, size: size as u64, ver: 1, flags: 0 };
+        (mem, map, geom)
+    }
+
+    fn slot(map: &MapInfo, g: &Geometry, q: usize, idx: usize) -> *mut VblkSlot {
+        unsafe { ((map.user_base as *mut u8).add(g.slots_off(q)) as *mut VblkSlot).add(idx) }
+    }
+
+    /// Publish a one-sector write of `fill` to `lba` on ring `q`, as colx_vblk.c does.
+    fn publish_write(map: &MapInfo, g: &Geometry, q: usize, lba: u64, fill: u8) {
+        let base = map.user_base as *mut u8;
+        unsafe {
+            let prod = &*(base.add(g.ring_off(q)) as *const AtomicU32);
+            let p = prod.load(Ordering::Relaxed);
+            let idx = p as usize % g.vblk_ring_cap;
+            let data_off = g.data_base(q) + idx * g.vblk_slot_stride;
+            std::ptr::write_bytes(base.add(g.vblk_data_off + data_off), fill, SECTOR);
+            *slot(map, g, q, idx) = VblkSlot { id: lba, op: OP_WRITE, status: 0xFF, flags: 0, lba, len: SECTOR as u32, data_off: data_off as u32 };
+            prod.store(p + 1, Ordering::Release);
+        }
+    }
+
+    /// Publish a write of `slots` full windows from `lba`, chained across
+    /// consecutive slots the way colx_vblk.c splits a large request.
+    fn publish_chain(map: &MapInfo, g: &Geometry, lba: u64, slots: usize) {
+        let base = map.user_base as *mut u8;
+        let stride = g.vblk_slot_stride;
+        unsafe {
+            let prod = &*(base.add(g.ring_off(0)) as *const AtomicU32);
+            let p = prod.load(Ordering::Relaxed);
+            for k in 0..slots {
+                let idx = (p as usize + k) % g.vblk_ring_cap;
+                let data_off = g.data_base(0) + idx * stride;
+                std::ptr::write_bytes(base.add(g.vblk_data_off + data_off), 0x40 + k as u8, stride);
+                let lba = lba + (k * stride / SECTOR) as u64;
+                let flags = if k + 1 < slots { SLOT_F_CHAIN } else { 0 };
+                *slot(map, g, 0, idx) = VblkSlot { id: 7, op: OP_WRITE, status: 0xFF, flags, lba, len: stride as u32, data_off: data_off as u32 };
+            }
+            prod.store(p + slots as u32, Ordering::Release);
+        }
+    }
+
+    fn status(map: &MapInfo, g: &Geometry, q: usize, idx: usize) -> u8 {
+        unsafe { (*slot(map, g, q, idx)).status }
+    }
+
+    #[test]
+    fn every_ring_is_serviced_by_its_own_thread() {
+        let disk = Disk { data: Mutex::new(vec![0; 64 * SECTOR]), threads: Mutex::new(Vec::new()) };
+        let (_mem, map, g) = mapping(4, 64);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        assert_eq!(queues.queues(), 4);
+
+        for q in 0..4 {
+            publish_write(&map, &g, q, q as u64 * 2, 0x10 + q as u8);
+            publish_write(&map, &g, q, q as u64 * 2 + 1, 0x20 + q as u8);
+        }
+        queues.pump().unwrap();
+        for q in 0..4 {
+            assert!(!queues.rings[q].pending());
+            assert_eq!(status(&map, &g, q, 0), ST_OK);
+            assert_eq!(status(&map, &g, q, 1), ST_OK);
+        }
+        let d = disk.data.lock().unwrap();
+        for q in 0..4 {
+            assert_eq!(d[q * 2 * SECTOR], 0x10 + q as u8);
+            assert_eq!(d[(q * 2 + 1) * SECTOR], 0x20 + q as u8);
+        }
+        let threads = disk.threads.lock().unwrap();
+        for q in 1..4 {
+            let name = format!("vblk-q{q}");
+            assert_eq!(threads.iter().filter(|t| t.as_deref() == Some(name.as_str())).count(), 2);
+        }
+    }
+
+    #[test]
+    fn a_dead_worker_is_reported_not_waited_on() {
+        struct Panicky(Disk);
+        impl BlockBackend for Panicky {
+            fn read(&self, lba: u64, dst: &mut [u8]) -> Result<()> {
+                self.0.read(lba, dst)
+            }
+            fn write(&self, lba: u64, src: &[u8]) -> Result<()> {
+                assert_ne!(lba, 13, "backend bug");
+                self.0.write(lba, src)
+            }
+        }
+        let disk = Panicky(Disk { data: Mutex::new(vec![0; 64 * SECTOR]), threads: Mutex::new(Vec::new()) });
+        let (_mem, map, g) = mapping(2, 64);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        publish_write(&map, &g, 1, 13, 0x13);
+        queues.pump().unwrap();
+        while !queues.workers[0].is_finished() {
+            thread::yield_now();
+        }
+        // The next kick finds the worker gone; ring 0 is still serviced
+        publish_write(&map, &g, 1, 14, 0x14);
+        publish_write(&map, &g, 0, 1, 0x01);
+        assert!(queues.pump().is_err());
+        assert_eq!(status(&map, &g, 0, 0), ST_OK);
+    }
+
+    #[test]
+    fn windows_of_other_rings_are_rejected() {
+        let disk = Disk { data: Mutex::new(vec![0; 64 * SECTOR]), threads: Mutex::new(Vec::new()) };
+        let (_mem, map, g) = mapping(2, 64);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        assert_eq!(queues.queues(), 2);
+        // Ring 1 slot pointing into ring 0's windows
+        publish_write(&map, &g, 1, 0, 0xAA);
+        unsafe { (*slot(&map, &g, 1, 0)).data_off = 0 };
+        queues.pump().unwrap();
+        assert_eq!(status(&map, &g, 1, 0), ST_EINVAL);
+        assert!(disk.threads.lock().unwrap().is_empty());
+    }
+
+    #[test]
+    fn ring_depth_comes_from_the_geometry() {
+        let disk = Disk { data: Mutex::new(vec![0; 256 * SECTOR]), threads: Mutex::new(Vec::new()) };
+        let (_mem, map, g) = mapping(1, 256);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        // More slots in flight than the old fixed 64-slot ring could hold
+        for lba in 0..200 {
+            publish_write(&map, &g, 0, lba, lba as u8 + 1);
+        }
+        queues.pump().unwrap();
+        assert!((0..200).all(|i| status(&map, &g, 0, i) == ST_OK));
+        let d = disk.data.lock().unwrap();
+        assert!((0..200).all(|lba| d[lba * SECTOR] == lba as u8 + 1));
+
+        // A slot whose window lies past the last slot of the geometry is refused
+        let last = g.data_base(0) + g.window();
+        publish_write(&map, &g, 0, 0, 0);
+        unsafe { (*slot(&map, &g, 0, 200)).data_off = last as u32 };
+        queues.pump().unwrap();
+        assert_eq!(status(&map, &g, 0, 200), ST_EINVAL);
+    }
+
+    #[test]
+    fn chained_slots_become_one_backing_write() {
+        let disk = Disk { data: Mutex::new(vec![0; 2048 * SECTOR]), threads: Mutex::new(Vec::new()) };
+        let (_mem, map, g) = mapping(1, 8);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        publish_chain(&map, &g, 0, 3);
+        queues.pump().unwrap();
+        assert!((0..3).all(|i| status(&map, &g, 0, i) == ST_OK));
+        assert_eq!(disk.threads.lock().unwrap().len(), 1);
+        {
+            let d = disk.data.lock().unwrap();
+            assert!((0..3).all(|k| d[k * 64 * 1024] == 0x40 + k as u8 && d[(k + 1) * 64 * 1024 - 1] == 0x40 + k as u8));
+        }
+
+        // Slots 3..7 and the wrap to 0..1 are not contiguous in the window
+        publish_chain(&map, &g, 384, 7);
+        queues.pump().unwrap();
+        assert_eq!(disk.threads.lock().unwrap().len(), 3);
+        drop(queues);
+
+        // Merging off: one backing write per slot
+        disk.threads.lock().unwrap().clear();
+        let (_mem, map, g) = mapping(1, 8);
+        let queues = VblkQueues::with_merge(&disk, map, 0).unwrap();
+        publish_chain(&map, &g, 0, 4);
+        queues.pump().unwrap();
+        assert_eq!(disk.threads.lock().unwrap().len(), 4);
+    }
+
+    #[test]
+    fn legacy_hosts_keep_the_packed_control_block() {
+        let disk = Disk { data: Mutex::new(vec![0; 64 * SECTOR]), threads: Mutex::new(Vec::new()) };
+        let g = Geometry { vblk_queues: 1, ..Geometry::legacy(0) };
+        let (_mem, map, g) = map_geometry(g, false);
+        let queues = VblkQueues::new(&disk, map).unwrap();
+        assert_eq!(queues.queues(), 1);
+        publish_write(&map, &g, 0, 3, 0x5A);
+        queues.pump().unwrap();
+        assert_eq!(status(&map, &g, 0, 0), ST_OK);
+        // cons lands right after prod, where old guests look for it
+        assert_eq!(unsafe { *((map.user_base as *const u8).add(g.ring_off(0) + 4) as *const u32) }, 1);
+        assert_eq!(disk.data.lock().unwrap()[3 * SECTOR], 0x5A);
+    }
 }
@@ -1,43 +1,172 @@
+//! Host ends of the VTTY channels as byte streams.
+//!
+//! Each channel is its own pair of rings in the shared mapping (see
+//! `geom::VttyChan`), so a stream on the bulk channel can sit on a full ring
+//! without holding up console bytes. `VttyStream` turns the driver's
+//! non-blocking push/pull into `Read` / `Write` with a short sleep back-off.
+
+use crate::device::Device;
 use anyhow::Result;
-use crossbeam_channel::{bounded, Receiver};
-use std::time::Duration;
+use std::io::{self, Read, Write};
+use std::time::{Duration, Instant};
+
+pub const CH_CONSOLE: u32 = 0;
+/// Large copies; the guest's ttyCOLX1.
+pub const CH_BULK: u32 = 1;
+
+/// Per-IOCTL timeout; the rings themselves never block.
+const CALL_TIMEOUT: Duration = Duration::from_millis(200);
+const BACKOFF_MIN: Duration = Duration::from_micros(50);
+const BACKOFF_MAX: Duration = Duration::from_millis(2);
+
+/// Moves bytes on one channel without blocking: `push` returns how many the
+/// guest's ring accepted, `pull` how many it held (0 when full / empty).
+pub trait VttyPort: Sync {
+    fn push(&self, ch: u32, data: &[u8]) -> Result<usize>;
+    fn pull(&self, ch: u32, buf: &mut [u8]) -> Result<usize>;
+}
+
+impl VttyPort for Device {
+    fn push(&self, ch: u32, data: &[u8]) -> Result<usize> {
+        self.vtty_push_chan(ch, data, CALL_TIMEOUT)
+    }
+
+    fn pull(&self, ch: u32, buf: &mut [u8]) -> Result<usize> {
+        self.vtty_pull_chan(ch, buf, CALL_TIMEOUT)
+    }
+}
 
-use crate::iocp::{IoctlRequest, Reactor};
+/// One VTTY channel as a blocking stream. `read` waits for at least one byte
+/// and `write` for room for at least one, each up to the stream's timeout
+/// (`TimedOut`); with no timeout they wait indefinitely.
+pub struct VttyStream<'a> {
+    port: &'a dyn VttyPort,
+    ch: u32,
+    timeout: Option<Duration>,
+}
 
-const IOCTL_COLINUX_VTTY_PUSH: u32 = 0x0022201C; // 0x22<<16 | 0x807<<2
-const IOCTL_COLINUX_VTTY_PULL: u32 = 0x00222020; // 0x22<<16 | 0x808<<2
+impl<'a> VttyStream<'a> {
+    pub fn new(port: &'a dyn VttyPort, ch: u32) -> Self {
+        Self { port, ch, timeout: None }
+    }
+
+    pub fn channel(&self) -> u32 {
+        self.ch
+    }
 
-pub struct Vtty {
-    reactor: Reactor,
+    pub fn set_timeout(&mut self, timeout: Option<Duration>) {
+        self.timeout = timeout;
+    }
+
+    /// Retry `op` until it moves a byte, sleeping between empty attempts.
+    fn wait(&self, mut op: impl FnMut() -> Result<usize>) -> io::Result<usize> {
+        let start = Instant::now();
+        let mut sleep = BACKOFF_MIN;
+        loop {
+            match op() {
+                Ok(0) => {}
+                Ok(n) => return Ok(n),
+                Err(e) => return Err(io::Error::new(io::ErrorKind::Other, format!("vtty channel {}: {e:#}", self.ch))),
+            }
+            if self.timeout.is_some_and(|t| start.elapsed() >= t) {
+                return Err(io::ErrorKind::TimedOut.into());
+            }
+            std::thread::sleep(sleep);
+            sleep = (sleep * 2).min(BACKOFF_MAX);
+        }
+    }
 }
 
-impl Vtty {
-    pub fn new(reactor: Reactor) -> Self { Self { reactor } }
-
-    pub fn push(&self, data: &[u8]) -> Result<usize> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VTTY_PUSH,
-            inbuf: Some(data.to_vec()),
-            out_capacity: 0,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = rx.recv_timeout(Duration::from_secs(2)).map_err(|_| anyhow::anyhow!("vtty push timeout"))??;
-        Ok(out.len())
-    }
-
-    pub fn pull(&self, capacity: usize, timeout: Duration) -> Result<Vec<u8>> {
-        let (tx, rx) = bounded(1);
-        self.reactor.submit(IoctlRequest {
-            code: IOCTL_COLINUX_VTTY_PULL,
-            inbuf: None,
-            out_capacity: capacity,
-            prefill_out: None,
-            reply: tx,
-        })?;
-        let out = rx.recv_timeout(timeout).map_err(|_| anyhow::anyhow!("vtty pull timeout"))??;
-        Ok(out)
+impl Read for VttyStream<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+        self.wait(|| self.port.pull(self.ch, buf))
     }
 }
 
+impl Write for VttyStream<'_> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+        self.wait(|| self.port.push(self.ch, buf))
+    }
+
+    /// Bytes are in the guest's ring once `write` returns.
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::collections::VecDeque;
+    use std::sync::Mutex;
+
+    /// Loopback rings: what the host pushes on a channel, it pulls back.
+    struct Loopback {
+        rings: Vec<Mutex<VecDeque<u8>>>,
+        cap: Vec<usize>,
+    }
+
+    impl Loopback {
+        fn new(cap: &[usize]) -> Self {
+            Self { rings: cap.iter().map(|_| Mutex::new(VecDeque::new())).collect(), cap: cap.to_vec() }
+        }
+    }
+
+    impl VttyPort for Loopback {
+        fn push(&self, ch: u32, data: &[u8]) -> Result<usize> {
+            let mut r = self.rings[ch as usize].lock().unwrap();
+            let n = data.len().min(self.cap[ch as usize] - r.len());
+            r.extend(&data[..n]);
+            Ok(n)
+        }
+
+        fn pull(&self, ch: u32, buf: &mut [u8]) -> Result<usize> {
+            let mut r = self.rings[ch as usize].lock().unwrap();
+            let n = buf.len().min(r.len());
+            for (d, s) in buf.iter_mut().zip(r.drain(..n)) {
+                *d = s;
+            }
+            Ok(n)
+        }
+    }
+
+    #[test]
+    fn a_full_bulk_channel_does_not_block_the_console() {
+        let port = Loopback::new(&[64, 4096]);
+        let mut bulk = VttyStream::new(&port, CH_BULK);
+        bulk.set_timeout(Some(Duration::from_millis(5)));
+        bulk.write_all(&[7u8; 4096]).unwrap();
+        assert_eq!(bulk.write(b"x").unwrap_err().kind(), io::ErrorKind::TimedOut);
+
+        let mut console = VttyStream::new(&port, CH_CONSOLE);
+        console.set_timeout(Some(Duration::from_millis(5)));
+        console.write_all(b"ls\r").unwrap();
+        let mut line = [0u8; 8];
+        assert_eq!(console.read(&mut line).unwrap(), 3);
+        assert_eq!(&line[..3], b"ls\r");
+        assert_eq!(console.read(&mut line).unwrap_err().kind(), io::ErrorKind::TimedOut);
+    }
+
+    #[test]
+    fn writes_larger_than_the_ring_stream_through() {
+        let port = Loopback::new(&[64, 256]);
+        let data: Vec<u8> = (0..20_000u32).map(|i| (i * 7) as u8).collect();
+        let mut got = Vec::new();
+        std::thread::scope(|s| {
+            s.spawn(|| VttyStream::new(&port, CH_BULK).write_all(&data).unwrap());
+            let mut rx = VttyStream::new(&port, CH_BULK);
+            let mut buf = [0u8; 100];
+            while got.len() < data.len() {
+                let n = rx.read(&mut buf).unwrap();
+                got.extend_from_slice(&buf[..n]);
+            }
+        });
+        assert_eq!(got, data);
+    }
+}
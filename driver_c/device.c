@@ -15,6 +15,7 @@ DRIVER_DISPATCH CoLinuxDeviceControl;
 
 extern NTSTATUS CoLinuxHandleMapShared(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 extern NTSTATUS CoLinuxHandleRunTick(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
+extern NTSTATUS CoLinuxHandleWaitDoorbell(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 extern NTSTATUS CoLinuxHandleVblkSubmit(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 extern NTSTATUS CoLinuxHandleVblkSetBacking(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 extern VOID CoLinuxVblkCloseBackingOnUnload(VOID);
@@ -22,6 +23,8 @@ extern VOID CoLinuxOnCreate(_In_ PFILE_OBJECT FileObject);
 extern VOID CoLinuxOnCleanup(_In_ PFILE_OBJECT FileObject);
 extern NTSTATUS CoLinuxHandleVttyPush(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 extern NTSTATUS CoLinuxHandleVttyPull(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
+extern NTSTATUS CoLinuxHandleVttyPushChan(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
+extern NTSTATUS CoLinuxHandleVttyPullChan(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
 
 UNICODE_STRING g_DeviceName;
 UNICODE_STRING g_SymLink;
@@ -123,6 +126,8 @@ NTSTATUS CoLinuxDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
             return CoLinuxHandleMapShared(Irp, irpSp);
         case IOCTL_COLINUX_RUN_TICK:
             return CoLinuxHandleRunTick(Irp, irpSp);
+        case IOCTL_COLINUX_WAIT_DOORBELL:
+            return CoLinuxHandleWaitDoorbell(DeviceObject, Irp, irpSp);
         case IOCTL_COLINUX_VBLK_SUBMIT:
             return CoLinuxHandleVblkSubmit(DeviceObject, Irp, irpSp);
         case IOCTL_COLINUX_VBLK_READ:
@@ -131,12 +136,19 @@ NTSTATUS CoLinuxDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         case IOCTL_COLINUX_VBLK_WRITE:
             extern NTSTATUS CoLinuxHandleVblkWrite(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
             return CoLinuxHandleVblkWrite(Irp, irpSp);
+        case IOCTL_COLINUX_VBLK_SUBMIT_BATCH:
+            extern NTSTATUS CoLinuxHandleVblkBatch(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp);
+            return CoLinuxHandleVblkBatch(Irp, irpSp);
         case IOCTL_COLINUX_VBLK_SET_BACKING:
             return CoLinuxHandleVblkSetBacking(Irp, irpSp);
         case IOCTL_COLINUX_VTTY_PUSH:
             return CoLinuxHandleVttyPush(Irp, irpSp);
         case IOCTL_COLINUX_VTTY_PULL:
             return CoLinuxHandleVttyPull(Irp, irpSp);
+        case IOCTL_COLINUX_VTTY_PUSH_CHAN:
+            return CoLinuxHandleVttyPushChan(Irp, irpSp);
+        case IOCTL_COLINUX_VTTY_PULL_CHAN:
+            return CoLinuxHandleVttyPullChan(Irp, irpSp);
         default:
             Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
             Irp->IoStatus.Information = 0;
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <ntddk.h>
+
+// Shared-mapping geometry descriptor; mirrors struct colx_geom in
+// linux/include/uapi/linux/colinux_ring.h. mem.c fills it in at map time and
+// keeps a private copy in the handle context, so bounds checks never trust
+// the guest-writable one in the header page.
+#define COLX_GEOM_OFF   0x100
+#define COLX_GEOM_MAGIC 0x4d4f4547 // "GEOM"
+#define COLX_GEOM_VER_1 1
+
+// VTTY channels (struct colx_vtty_chan); channel 0 is the console and
+// repeats vtty_tx_off / vtty_rx_off / vtty_cap
+#define COLX_VTTY_MAX_CHANNELS 4
+#define COLX_VTTY_MIN_CAP (4 * 1024)
+#define COLX_VTTY_MAX_CAP (16 * 1024 * 1024)
+
+// Shared folder ring (struct colx_shfs_slot): daemon-serviced, the driver
+// only lays it out and zeroes it
+#define COLX_SHFS_MAX_RING_CAP 256
+#define COLX_SHFS_MIN_SLOT_STRIDE (4 * 1024)
+#define COLX_SHFS_MAX_SLOT_STRIDE (1024 * 1024)
+#define COLX_SHFS_SLOT_SIZE 64
+
+// Virtual NIC (struct colx_vnet_desc rings over a shared buffer pool): the
+// daemon services it; vnet.c lays out and zeroes the rings
+#define COLX_VNET_RINGS 4
+#define COLX_VNET_RING_TX 0
+#define COLX_VNET_MAX_RING_CAP 4096
+#define COLX_VNET_MIN_BUF_SIZE (4 * 1024)
+#define COLX_VNET_MAX_BUF_SIZE (256 * 1024)
+#define COLX_VNET_DESC_SIZE 16
+
+// Request tracer (struct colx_trace_hdr, then colx_trace_rec records): the
+// daemon and the guest append to it; the driver only lays it out and zeroes it
+#define COLX_TRACE_MAX_CAP (1024 * 1024)
+#define COLX_TRACE_HDR_SIZE 128
+#define COLX_TRACE_REC_SIZE 32
+
+typedef struct _COLX_VTTY_CHAN {
+    ULONGLONG tx_off; // host->guest VTTY ring
+    ULONGLONG rx_off; // guest->host VTTY ring
+    ULONG     cap;    // bytes per ring buffer, power of two; 0 if absent
+    ULONG     rsvd;
+} COLX_VTTY_CHAN, *PCOLX_VTTY_CHAN;
+
+typedef struct _COLX_GEOM {
+    ULONG     magic;
+    USHORT    ver;
+    USHORT    size;              // sizeof(COLX_GEOM)
+    ULONG     features;          // RING_HDR_F_* serviced by this driver
+    ULONG     vblk_queues;       // rings initialised (0 if none fit)
+    ULONG     vblk_ring_cap;     // slots per ring, power of two
+    ULONG     vblk_slot_size;    // sizeof(VBLK_SLOT)
+    ULONG     vblk_slot_stride;  // data window per slot
+    ULONG     vblk_ring_stride;  // bytes between rings' RING_CTRL
+    ULONGLONG vblk_ring_off;     // ring 0's RING_CTRL
+    ULONGLONG vblk_data_off;     // base of slot data_off
+    ULONGLONG vblk_queue_stride; // windows + one host scratch page per queue
+    ULONGLONG vtty_tx_off;       // host->guest VTTY ring
+    ULONGLONG vtty_rx_off;       // guest->host VTTY ring
+    ULONG     vtty_cap;          // bytes per VTTY ring buffer, power of two
+    ULONG     rsvd;
+    ULONG     vtty_channels;     // entries of vtty_chan in use
+    ULONG     rsvd1;
+    COLX_VTTY_CHAN vtty_chan[COLX_VTTY_MAX_CHANNELS];
+    ULONGLONG shfs_ring_off;     // SHFS RING_CTRL, then shfs_ring_cap slots
+    ULONGLONG shfs_data_off;     // slot windows, shfs_slot_stride apart
+    ULONG     shfs_ring_cap;     // power of two; 0 if no shared folder
+    ULONG     shfs_slot_stride;  // page multiple
+    ULONGLONG vnet_off;          // NIC config page, then its rings
+    ULONGLONG vnet_pool_off;     // buffer i at vnet_pool_off + i * vnet_buf_size
+    ULONG     vnet_ring_cap;     // power of two >= vnet_buf_count; 0 if no NIC
+    ULONG     vnet_ring_stride;  // bytes between the NIC rings' RING_CTRL
+    ULONG     vnet_buf_count;
+    ULONG     vnet_buf_size;     // page multiple
+    ULONGLONG trace_off;         // tracer header, then trace_cap records
+    ULONG     trace_cap;         // power of two; 0 if no tracer
+    ULONG     rsvd2;
+} COLX_GEOM, *PCOLX_GEOM;
+
+C_ASSERT(FIELD_OFFSET(COLX_GEOM, vtty_channels) == 80 && FIELD_OFFSET(COLX_GEOM, shfs_ring_off) == 184);
+C_ASSERT(FIELD_OFFSET(COLX_GEOM, vnet_off) == 208 && FIELD_OFFSET(COLX_GEOM, trace_off) == 240);
+C_ASSERT(sizeof(COLX_GEOM) == 256);
+
+// NIC shape requested at map time (vnet.c places it); cap 0 leaves it out
+typedef struct _VNET_SHAPE {
+    ULONG cap;
+    ULONG buf_count;
+    ULONG buf_size;
+} VNET_SHAPE;
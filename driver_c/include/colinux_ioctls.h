@@ -8,6 +8,9 @@
 #define FILE_DEVICE_COLINUX FILE_DEVICE_UNKNOWN
 #endif
 
+// Map shared (METHOD_BUFFERED). In: MAP_SHARED_IN; callers may send only a
+// prefix of it, and omitted or zero fields take their defaults. The driver
+// publishes the resulting layout as a COLX_GEOM in the header page.
 #define IOCTL_COLINUX_MAP_SHARED  CTL_CODE(FILE_DEVICE_COLINUX, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_COLINUX_RUN_TICK    CTL_CODE(FILE_DEVICE_COLINUX, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_COLINUX_VBLK_SUBMIT CTL_CODE(FILE_DEVICE_COLINUX, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -16,6 +19,88 @@
 #define IOCTL_COLINUX_VBLK_READ  CTL_CODE(FILE_DEVICE_COLINUX, 0x805, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_COLINUX_VBLK_WRITE CTL_CODE(FILE_DEVICE_COLINUX, 0x806, METHOD_IN_DIRECT,  FILE_ANY_ACCESS)
 
+typedef struct _MAP_SHARED_IN {
+    ULONG pages;
+    ULONG vblk_queues;      // 1..8 (default 1)
+    ULONG vblk_ring_cap;    // slots per ring, rounded down to a power of two in 8..1024 (default 64)
+    ULONG vblk_slot_stride; // bytes per slot window = largest transfer per slot, rounded to pages, <= COLINUX_VBLK_MAX_XFER (default 128K)
+    ULONG vtty_chan_kb[4];  // KiB per ring of each VTTY channel, rounded down to a power of two in 4..16384;
+                            // 0 = absent (channel 0, the console: 64)
+    ULONG shfs_ring_cap;    // shared folder requests in flight, rounded down to a power of two <= 256; 0 = none
+    ULONG shfs_slot_kb;     // KiB per request window = largest READ / WRITE, 4..1024 (default 128)
+    ULONG vnet_bufs;        // NIC pool buffers, <= 4096; 0 = no NIC
+    ULONG vnet_buf_kb;      // KiB per NIC buffer = largest burst or GSO frame, 4..256 (default 64)
+    ULONG trace_kb;         // KiB of request-trace records (32 bytes each), rounded down to a power
+                            // of two <= 32768; 0 = no tracer
+} MAP_SHARED_IN, *PMAP_SHARED_IN;
+
+// Largest single READ / WRITE on any VBLK path
+#define COLINUX_VBLK_MAX_XFER (1024 * 1024)
+
 // VTTY byte-stream IOCTLs (METHOD_BUFFERED)
 #define IOCTL_COLINUX_VTTY_PUSH  CTL_CODE(FILE_DEVICE_COLINUX, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS) // In: bytes to guest
 #define IOCTL_COLINUX_VTTY_PULL  CTL_CODE(FILE_DEVICE_COLINUX, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS) // Out: bytes from guest
+// Per-channel forms (METHOD_BUFFERED); PUSH/PULL above address channel 0.
+// PUSH_CHAN In: VTTY_CHAN_IN then the bytes. PULL_CHAN In: VTTY_CHAN_IN, Out: bytes.
+// Information is the number of bytes moved; 0 when the ring is full / empty.
+#define IOCTL_COLINUX_VTTY_PUSH_CHAN CTL_CODE(FILE_DEVICE_COLINUX, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_COLINUX_VTTY_PULL_CHAN CTL_CODE(FILE_DEVICE_COLINUX, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _VTTY_CHAN_IN {
+    ULONG channel; // < COLX_GEOM.vtty_channels
+    ULONG rsvd;
+} VTTY_CHAN_IN, *PVTTY_CHAN_IN;
+
+// Batched scatter-gather VBLK submit (METHOD_OUT_DIRECT).
+// In (buffered):  VBLK_BATCH_HDR followed by hdr.count VBLK_BATCH_DESC entries.
+// Out (MDL):      one data buffer; each descriptor reads into / writes from
+//                 [buf_off, buf_off + len). The driver stores one NTSTATUS per
+//                 descriptor at status_off (LONG[count]) inside the same buffer.
+// The IRP itself succeeds once every descriptor has been attempted; per-I/O
+// failures are only reported through the status table.
+#define IOCTL_COLINUX_VBLK_SUBMIT_BATCH CTL_CODE(FILE_DEVICE_COLINUX, 0x809, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+#define COLINUX_VBLK_BATCH_MAX   64
+#define COLINUX_VBLK_BATCH_READ  0
+#define COLINUX_VBLK_BATCH_WRITE 1
+// Data-less descriptors: buf_off is ignored. FLUSH has len 0; DISCARD and
+// WRITE_ZEROES cover len bytes (<= COLINUX_VBLK_MAX_TRIM) and become holes in
+// the sparse backing file.
+#define COLINUX_VBLK_BATCH_FLUSH        2
+#define COLINUX_VBLK_BATCH_DISCARD      3
+#define COLINUX_VBLK_BATCH_WRITE_ZEROES 4
+#define COLINUX_VBLK_MAX_TRIM (1UL << 30)
+
+typedef struct _VBLK_BATCH_HDR {
+    ULONG count;      // number of descriptors (1..COLINUX_VBLK_BATCH_MAX)
+    ULONG status_off; // byte offset of the LONG status table in the out buffer
+    ULONG flags;      // reserved, must be 0
+    ULONG rsvd;
+} VBLK_BATCH_HDR, *PVBLK_BATCH_HDR;
+
+typedef struct _VBLK_BATCH_DESC {
+    UCHAR     op;      // COLINUX_VBLK_BATCH_*
+    UCHAR     rsvd[3];
+    ULONG     len;     // bytes, multiple of 512 (0 for FLUSH)
+    ULONGLONG lba;     // sector units (512B)
+    ULONGLONG buf_off; // byte offset in the out buffer
+} VBLK_BATCH_DESC, *PVBLK_BATCH_DESC;
+
+// Doorbell wait (METHOD_BUFFERED). Completes when the shared header's doorbell
+// differs from last_seen, any VBLK, SHFS or VNET TX ring has unconsumed slots, or timeout_ms
+// elapses. The driver re-checks every coalesce_us, backing off to max_sleep_us;
+// timeout_ms is clamped to 10000 and max_sleep_us to 100000. A cancelled wait
+// completes with STATUS_CANCELLED.
+#define IOCTL_COLINUX_WAIT_DOORBELL CTL_CODE(FILE_DEVICE_COLINUX, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _DOORBELL_WAIT_IN {
+    ULONG last_seen;
+    ULONG timeout_ms;
+    ULONG coalesce_us;
+    ULONG max_sleep_us;
+} DOORBELL_WAIT_IN, *PDOORBELL_WAIT_IN;
+
+typedef struct _DOORBELL_WAIT_OUT {
+    ULONG doorbell; // current doorbell value
+    ULONG pending;  // VBLK, SHFS and VNET TX slots published but not yet consumed
+} DOORBELL_WAIT_OUT, *PDOORBELL_WAIT_OUT;
@@ -1,17 +1,47 @@
 // Shared memory mapping via section object; per-handle context tracks maps.
 #include <ntddk.h>
 #include "include/colinux_ioctls.h"
+#include "include/colinux_geom.h"
 
 #define TAG_MEM 'meLC'
 
+// Ring geometry bounds and defaults; must match UAPI (colinux_ring.h). The
+// actual layout is computed per mapping and published as a COLX_GEOM.
+#define VBLK_MAX_QUEUES 8
+#define VBLK_MIN_RING_CAP 8
+#define VBLK_MAX_RING_CAP 1024
+#define VBLK_DEFAULT_RING_CAP 64
+#define VBLK_DEFAULT_SLOT_STRIDE (128 * 1024)
+#define VTTY_CAP (64 * 1024)         // console channel default
+#define VTTY_RING_HDR 16             // head, tail, cap, rsvd (VTTY_RING in vtty.c)
+#define SHFS_DEFAULT_SLOT_STRIDE (128 * 1024)
+#define VNET_DEFAULT_BUF_SIZE (64 * 1024)
+#define MAP_PAGE 0x1000
+#define ROUND_PAGE(x) (((ULONGLONG)(x) + MAP_PAGE - 1) & ~(ULONGLONG)(MAP_PAGE - 1))
+
 typedef struct _FILE_CTX {
     HANDLE Section;
     PVOID  UserBase;
     SIZE_T UserSize;
     PVOID  KernelBase;
     SIZE_T KernelSize;
+    COLX_GEOM Geom;           // layout published at map time (private copy; vtty.c reads it too)
+    // Doorbell waits (fields after this point are private to mem.c)
+    IO_CSQ WaitCsq;           // pending WAIT_DOORBELL IRPs; cancel-safe
+    LIST_ENTRY WaitList;
+    KSPIN_LOCK WaitLock;
+    KEVENT Kick;              // wakes the watcher: new wait, cleanup
+    PKTHREAD Watcher;         // started by the first wait, joined by cleanup
+    volatile LONG WatcherStarted;
+    volatile LONG PollUs;     // watcher re-check interval and back-off ceiling,
+    volatile LONG MaxPollUs;  //   from the latest wait
+    EX_RUNDOWN_REF WaitRundown; // held by the wait handler while it queues
+    volatile LONG Closing;    // set by cleanup; no new waits are queued
 } FILE_CTX, *PFILE_CTX;
 
+static VOID DoorbellInit(PFILE_CTX ctx);
+static VOID DoorbellShutdown(PFILE_CTX ctx);
+
 static PFILE_CTX GetFileCtx(PFILE_OBJECT fo) {
     return (PFILE_CTX)fo->FsContext;
 }
@@ -21,6 +51,7 @@ VOID CoLinuxOnCreate(_In_ PFILE_OBJECT FileObject) {
     PFILE_CTX ctx = (PFILE_CTX)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(FILE_CTX), TAG_MEM);
     if (ctx) {
         RtlZeroMemory(ctx, sizeof(*ctx));
+        DoorbellInit(ctx);
         FileObject->FsContext = ctx;
     }
 }
@@ -28,6 +59,8 @@ VOID CoLinuxOnCreate(_In_ PFILE_OBJECT FileObject) {
 VOID CoLinuxOnCleanup(_In_ PFILE_OBJECT FileObject) {
     PFILE_CTX ctx = GetFileCtx(FileObject);
     if (!ctx) return;
+    // Stop the watcher and cancel queued waits before the mapping goes away
+    DoorbellShutdown(ctx);
     if (ctx->UserBase) {
         ZwUnmapViewOfSection(ZwCurrentProcess(), ctx->UserBase);
         ctx->UserBase = NULL; ctx->UserSize = 0;
@@ -58,15 +91,30 @@ typedef struct _RING_HEADER {
     ULONGLONG tick_count;
     ULONG ping_req;
     ULONG ping_resp;
+    volatile ULONG doorbell;     // guest increments after publishing ring work
+    volatile ULONG host_waiting; // nonzero while the daemon sleeps in WAIT_DOORBELL
+    volatile ULONG guest_doorbell; // bumped by vtty.c on VTTY traffic (RING_HDR_F_VTTY_NOTIFY)
+    volatile ULONG guest_waiting;  // nonzero while the guest waits for its interrupt
 } RING_HEADER, *PRING_HEADER;
 
+#define RING_HDR_F_DOORBELL 0x1 // must match COLX_HDR_F_DOORBELL
+#define RING_HDR_F_VBLK_TRIM 0x2 // must match COLX_HDR_F_VBLK_TRIM; batch FLUSH/DISCARD/WRITE_ZEROES
+#define RING_HDR_F_VTTY_NOTIFY 0x4 // must match COLX_HDR_F_VTTY_NOTIFY
+
+// Producer and consumer indices on separate cache lines (colx_ring_ctrl);
+// slots follow the 128-byte block
 typedef struct _RING_CTRL {
-    ULONG prod;
-    ULONG cons;
+    volatile ULONG prod; // guest only
+    ULONG rsvd0;
     ULONG cap;
     ULONG slot_size;
+    ULONG pad0[12];
+    volatile ULONG cons; // daemon only
+    ULONG pad1[15];
 } RING_CTRL, *PRING_CTRL;
 
+C_ASSERT(FIELD_OFFSET(RING_CTRL, cons) == 64 && sizeof(RING_CTRL) == 128);
+
 typedef struct _VBLK_SLOT {
     ULONGLONG id;
     UCHAR op;
@@ -77,8 +125,99 @@ typedef struct _VBLK_SLOT {
     ULONG data_off;
 } VBLK_SLOT, *PVBLK_SLOT;
 
+// Shared folder ring shape; cap 0 leaves it out of the layout
+typedef struct _SHFS_SHAPE {
+    ULONG cap;
+    ULONG stride;
+} SHFS_SHAPE;
+
+extern ULONGLONG VnetLayout(PCOLX_GEOM g, ULONGLONG off, VNET_SHAPE shape);
+extern VOID VnetInitRings(PVOID kbase, const COLX_GEOM* g);
+extern ULONG VnetPending(PVOID kbase, const COLX_GEOM* g);
+
+// Lay the mapping out for `queues` rings of `cap` slots: the header page (with
+// the geometry descriptor), one ring control block per queue, the ring pair
+// of each VTTY channel with a nonzero entry in `chans`, the shared folder
+// ring and its page-aligned windows, the NIC rings and buffer pool, the
+// request tracer of `trace_cap` records, then each queue's slot windows
+// followed by its host scratch page.
+static VOID GeomLayout(PCOLX_GEOM g, ULONG queues, ULONG cap, ULONG stride, const ULONG* chans, SHFS_SHAPE shfs,
+                       VNET_SHAPE vnet, ULONG trace_cap) {
+    RtlZeroMemory(g, sizeof(*g));
+    g->magic = COLX_GEOM_MAGIC;
+    g->ver = COLX_GEOM_VER_1;
+    g->size = sizeof(*g);
+    g->features = RING_HDR_F_DOORBELL | RING_HDR_F_VBLK_TRIM | RING_HDR_F_VTTY_NOTIFY;
+    g->vblk_queues = queues;
+    g->vblk_ring_cap = cap;
+    g->vblk_slot_size = sizeof(VBLK_SLOT);
+    g->vblk_slot_stride = stride;
+    g->vblk_ring_stride = (ULONG)ROUND_PAGE(sizeof(RING_CTRL) + (ULONGLONG)cap * sizeof(VBLK_SLOT));
+    g->vblk_ring_off = MAP_PAGE;
+    ULONGLONG off = g->vblk_ring_off + (ULONGLONG)queues * g->vblk_ring_stride;
+    for (ULONG c = 0; c < COLX_VTTY_MAX_CHANNELS; ++c) {
+        if (!chans[c]) continue;
+        g->vtty_channels = c + 1;
+        g->vtty_chan[c].cap = chans[c];
+        g->vtty_chan[c].tx_off = off;
+        g->vtty_chan[c].rx_off = off + ROUND_PAGE(VTTY_RING_HDR + chans[c]);
+        off = g->vtty_chan[c].rx_off + ROUND_PAGE(VTTY_RING_HDR + chans[c]);
+    }
+    g->vtty_cap = g->vtty_chan[0].cap;
+    g->vtty_tx_off = g->vtty_chan[0].tx_off;
+    g->vtty_rx_off = g->vtty_chan[0].rx_off;
+    if (shfs.cap) {
+        g->shfs_ring_cap = shfs.cap;
+        g->shfs_slot_stride = shfs.stride;
+        g->shfs_ring_off = off;
+        g->shfs_data_off = off + ROUND_PAGE(sizeof(RING_CTRL) + (ULONGLONG)shfs.cap * COLX_SHFS_SLOT_SIZE);
+        off = g->shfs_data_off + (ULONGLONG)shfs.cap * shfs.stride;
+    }
+    off = VnetLayout(g, off, vnet);
+    if (trace_cap) {
+        g->trace_cap = trace_cap;
+        g->trace_off = off;
+        off += ROUND_PAGE(COLX_TRACE_HDR_SIZE + (ULONGLONG)trace_cap * COLX_TRACE_REC_SIZE);
+    }
+    g->vblk_data_off = off;
+    g->vblk_queue_stride = (ULONGLONG)cap * stride + MAP_PAGE;
+}
+
+static BOOLEAN GeomFits(PCOLX_GEOM g, ULONG queues, SIZE_T size) {
+    ULONGLONG span = (ULONGLONG)queues * g->vblk_queue_stride;
+    return span <= MAXULONG && g->vblk_data_off + span <= size;
+}
+
+// Shrink the request until it fits `size`. The shared folder, the NIC and the
+// tracer are granted only alongside the full VBLK request; otherwise they go first, then
+// queues, then ring depth. Slot data_off is 32-bit, so all windows must also sit within
+// 4 GiB of vblk_data_off. Falls back to VTTY only (no VBLK rings), then to
+// the console channel alone, before giving up.
+static BOOLEAN GeomFit(PCOLX_GEOM g, SIZE_T size, ULONG queues, ULONG cap, ULONG stride, const ULONG* chans,
+                       SHFS_SHAPE shfs, VNET_SHAPE vnet, ULONG trace_cap) {
+    SHFS_SHAPE none = { 0 };
+    VNET_SHAPE no_nic = { 0 };
+    if (shfs.cap || vnet.cap || trace_cap) {
+        GeomLayout(g, queues, cap, stride, chans, shfs, vnet, trace_cap);
+        if (GeomFits(g, queues, size)) return TRUE;
+    }
+    for (;;) {
+        GeomLayout(g, queues, cap, stride, chans, none, no_nic, 0);
+        if (GeomFits(g, queues, size)) return TRUE;
+        if (queues > 1) queues--;
+        else if (cap > VBLK_MIN_RING_CAP) cap /= 2;
+        else break;
+    }
+    GeomLayout(g, 0, cap, stride, chans, none, no_nic, 0);
+    if (g->vblk_data_off <= size) return TRUE;
+    ULONG console[COLX_VTTY_MAX_CHANNELS] = { chans[0] };
+    GeomLayout(g, 0, cap, stride, console, none, no_nic, 0);
+    return g->vblk_data_off <= size;
+}
+
 NTSTATUS CoLinuxHandleMapShared(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
-    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG) ||
+    ULONG in_len = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+    if (in_len < RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, pages) ||
         IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(MAP_INFO_OUT) ||
         Irp->AssociatedIrp.SystemBuffer == NULL) {
         Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
@@ -87,10 +226,60 @@ NTSTATUS CoLinuxHandleMapShared(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
         return STATUS_BUFFER_TOO_SMALL;
     }
 
-    ULONG pages = *(ULONG*)Irp->AssociatedIrp.SystemBuffer;
+    // In: a prefix of MAP_SHARED_IN; omitted or zero fields take defaults
+    PMAP_SHARED_IN in = (PMAP_SHARED_IN)Irp->AssociatedIrp.SystemBuffer;
+    ULONG pages = in->pages;
+    ULONG queues = in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, vblk_queues) ? in->vblk_queues : 0;
+    ULONG cap = in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, vblk_ring_cap) ? in->vblk_ring_cap : 0;
+    ULONG stride = in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, vblk_slot_stride) ? in->vblk_slot_stride : 0;
+    if (queues == 0) queues = 1;
+    if (queues > VBLK_MAX_QUEUES) queues = VBLK_MAX_QUEUES;
+    if (cap == 0) cap = VBLK_DEFAULT_RING_CAP;
+    if (cap < VBLK_MIN_RING_CAP) cap = VBLK_MIN_RING_CAP;
+    if (cap > VBLK_MAX_RING_CAP) cap = VBLK_MAX_RING_CAP;
+    while (cap & (cap - 1)) cap &= cap - 1; // power of two: free-running prod/cons index by modulo
+    if (stride == 0) stride = VBLK_DEFAULT_SLOT_STRIDE;
+    if (stride > COLINUX_VBLK_MAX_XFER) stride = COLINUX_VBLK_MAX_XFER;
+    stride = (ULONG)ROUND_PAGE(stride);
+    ULONG chans[COLX_VTTY_MAX_CHANNELS] = { 0 };
+    for (ULONG c = 0; c < COLX_VTTY_MAX_CHANNELS; ++c) {
+        ULONG kb = in_len >= FIELD_OFFSET(MAP_SHARED_IN, vtty_chan_kb) + (c + 1) * sizeof(ULONG) ? in->vtty_chan_kb[c] : 0;
+        if (kb == 0) { chans[c] = c == 0 ? VTTY_CAP : 0; continue; }
+        ULONGLONG bytes = (ULONGLONG)kb * 1024;
+        if (bytes < COLX_VTTY_MIN_CAP) bytes = COLX_VTTY_MIN_CAP;
+        if (bytes > COLX_VTTY_MAX_CAP) bytes = COLX_VTTY_MAX_CAP;
+        while (bytes & (bytes - 1)) bytes &= bytes - 1; // ring indices are masked
+        chans[c] = (ULONG)bytes;
+    }
+    SHFS_SHAPE shfs = { 0 };
+    if (in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, shfs_ring_cap) && in->shfs_ring_cap) {
+        ULONG kb = in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, shfs_slot_kb) ? in->shfs_slot_kb : 0;
+        shfs.cap = in->shfs_ring_cap > COLX_SHFS_MAX_RING_CAP ? COLX_SHFS_MAX_RING_CAP : in->shfs_ring_cap;
+        while (shfs.cap & (shfs.cap - 1)) shfs.cap &= shfs.cap - 1;
+        shfs.stride = kb ? kb * 1024 : SHFS_DEFAULT_SLOT_STRIDE;
+        if (kb > COLX_SHFS_MAX_SLOT_STRIDE / 1024) shfs.stride = COLX_SHFS_MAX_SLOT_STRIDE;
+        shfs.stride = (ULONG)ROUND_PAGE(shfs.stride);
+    }
+    VNET_SHAPE vnet = { 0 };
+    if (in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, vnet_bufs) && in->vnet_bufs) {
+        ULONG kb = in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, vnet_buf_kb) ? in->vnet_buf_kb : 0;
+        vnet.buf_count = in->vnet_bufs > COLX_VNET_MAX_RING_CAP ? COLX_VNET_MAX_RING_CAP : in->vnet_bufs;
+        // Every ring holds the whole pool, so returning a buffer never finds it full
+        for (vnet.cap = 1; vnet.cap < vnet.buf_count; vnet.cap <<= 1) {}
+        vnet.buf_size = kb ? kb * 1024 : VNET_DEFAULT_BUF_SIZE;
+        if (kb > COLX_VNET_MAX_BUF_SIZE / 1024) vnet.buf_size = COLX_VNET_MAX_BUF_SIZE;
+        if (vnet.buf_size < COLX_VNET_MIN_BUF_SIZE) vnet.buf_size = COLX_VNET_MIN_BUF_SIZE;
+        vnet.buf_size = (ULONG)ROUND_PAGE(vnet.buf_size);
+    }
+    ULONG trace_cap = 0;
+    if (in_len >= RTL_SIZEOF_THROUGH_FIELD(MAP_SHARED_IN, trace_kb) && in->trace_kb) {
+        ULONGLONG recs = (ULONGLONG)in->trace_kb * 1024 / COLX_TRACE_REC_SIZE;
+        trace_cap = recs > COLX_TRACE_MAX_CAP ? COLX_TRACE_MAX_CAP : (ULONG)recs;
+        while (trace_cap & (trace_cap - 1)) trace_cap &= trace_cap - 1; // records are claimed by masked index
+    }
     SIZE_T size = (SIZE_T)pages * 4096ULL;
 
-    PIO_STACK_LOCATION sp = irpSp; // alias
+    PIO_STACK_LOCATION sp = IrpSp; // alias
     PFILE_OBJECT fo = sp->FileObject;
     if (!fo) {
         Irp->IoStatus.Status = STATUS_INVALID_HANDLE;
@@ -148,21 +337,44 @@ NTSTATUS CoLinuxHandleMapShared(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
     ctx->UserBase = ubase;
     ctx->UserSize = uview;
 
-    // Initialize ring header at start of mapping
-    if (kbase && kview >= sizeof(RING_HEADER)) {
+    // Size the layout to the mapping; a zeroed geometry (no magic) means
+    // the mapping is too small for any ring and every ring IOCTL refuses it
+    COLX_GEOM geom;
+    if (!kbase || !GeomFit(&geom, kview, queues, cap, stride, chans, shfs, vnet, trace_cap)) RtlZeroMemory(&geom, sizeof(geom));
+    ctx->Geom = geom;
+
+    // Initialize ring header and geometry descriptor at start of mapping
+    if (kbase && kview >= COLX_GEOM_OFF + sizeof(COLX_GEOM)) {
         PRING_HEADER hdr = (PRING_HEADER)kbase;
-        hdr->ver = 1; hdr->flags = 0; hdr->tick_count = 0; hdr->ping_req = 0; hdr->ping_resp = 0;
+        hdr->ver = 1; hdr->flags = geom.features; hdr->tick_count = 0; hdr->ping_req = 0; hdr->ping_resp = 0;
+        hdr->doorbell = 0; hdr->host_waiting = 0; hdr->guest_doorbell = 0; hdr->guest_waiting = 0;
+        RtlCopyMemory((PUCHAR)kbase + COLX_GEOM_OFF, &geom, sizeof(geom));
     }
 
-    // Initialize VBLK ring control (multi-slot) at COLX_VBLK_RING_OFF
-    if (kbase && kview >= (0x1000 + sizeof(RING_CTRL))) {
-        PRING_CTRL ctrl = (PRING_CTRL)((PUCHAR)kbase + 0x1000);
-        ctrl->prod = 0; ctrl->cons = 0; ctrl->cap = 8; ctrl->slot_size = sizeof(VBLK_SLOT);
-        // Zero slots area just after ctrl
-        SIZE_T slots_bytes = ctrl->cap * ctrl->slot_size;
-        if (kview >= (0x1000 + sizeof(RING_CTRL) + slots_bytes)) {
-            RtlZeroMemory((PUCHAR)ctrl + sizeof(RING_CTRL), slots_bytes);
-        }
+    // Initialize one VBLK ring per queue and both VTTY rings where the
+    // geometry placed them; rings past vblk_queues keep cap 0 (absent)
+    for (ULONG q = 0; q < geom.vblk_queues; ++q) {
+        PRING_CTRL ctrl = (PRING_CTRL)((PUCHAR)kbase + geom.vblk_ring_off + (SIZE_T)q * geom.vblk_ring_stride);
+        ctrl->prod = 0; ctrl->cons = 0; ctrl->cap = geom.vblk_ring_cap; ctrl->slot_size = sizeof(VBLK_SLOT);
+        RtlZeroMemory((PUCHAR)ctrl + sizeof(RING_CTRL), (SIZE_T)geom.vblk_ring_cap * sizeof(VBLK_SLOT));
+    }
+    for (ULONG c = 0; c < geom.vtty_channels; ++c) {
+        if (!geom.vtty_chan[c].cap) continue;
+        PULONG tx = (PULONG)((PUCHAR)kbase + geom.vtty_chan[c].tx_off);
+        PULONG rx = (PULONG)((PUCHAR)kbase + geom.vtty_chan[c].rx_off);
+        tx[0] = tx[1] = 0; tx[2] = geom.vtty_chan[c].cap; // head, tail, cap
+        rx[0] = rx[1] = 0; rx[2] = geom.vtty_chan[c].cap;
+    }
+    if (geom.shfs_ring_cap) {
+        PRING_CTRL ctrl = (PRING_CTRL)((PUCHAR)kbase + geom.shfs_ring_off);
+        ctrl->prod = 0; ctrl->cons = 0; ctrl->cap = geom.shfs_ring_cap; ctrl->slot_size = COLX_SHFS_SLOT_SIZE;
+        RtlZeroMemory((PUCHAR)ctrl + sizeof(RING_CTRL), (SIZE_T)geom.shfs_ring_cap * COLX_SHFS_SLOT_SIZE);
+    }
+    VnetInitRings(kbase, &geom);
+    // Tracer: clock NONE (off) until the daemon publishes one
+    if (geom.trace_cap) {
+        RtlZeroMemory((PUCHAR)kbase + geom.trace_off,
+                      COLX_TRACE_HDR_SIZE + (SIZE_T)geom.trace_cap * COLX_TRACE_REC_SIZE);
     }
 
     PMAP_INFO_OUT out = (PMAP_INFO_OUT)Irp->AssociatedIrp.SystemBuffer;
@@ -207,3 +419,266 @@ NTSTATUS CoLinuxHandleRunTick(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     return STATUS_SUCCESS;
 }
+
+// Slots published but not yet consumed, over every VBLK ring, the SHFS ring
+// and the NIC's TX ring.
+static ULONG RingPending(PFILE_CTX ctx) {
+    ULONG pending = 0;
+    for (ULONG q = 0; q < ctx->Geom.vblk_queues; ++q) {
+        PRING_CTRL ctrl = (PRING_CTRL)((PUCHAR)ctx->KernelBase + ctx->Geom.vblk_ring_off + (SIZE_T)q * ctx->Geom.vblk_ring_stride);
+        pending += ctrl->prod - ctrl->cons;
+    }
+    if (ctx->Geom.shfs_ring_cap) {
+        PRING_CTRL ctrl = (PRING_CTRL)((PUCHAR)ctx->KernelBase + ctx->Geom.shfs_ring_off);
+        pending += ctrl->prod - ctrl->cons;
+    }
+    pending += VnetPending(ctx->KernelBase, &ctx->Geom);
+    return pending;
+}
+
+// Doorbell wait. WAIT_DOORBELL IRPs are parked in a cancel-safe queue and
+// completed by the handle's watcher thread once the guest rings the doorbell,
+// any ring has unconsumed slots, or the IRP's deadline passes. The guest
+// cannot interrupt the host, so while waits are queued the watcher re-checks
+// the header every PollUs, backing off to MaxPollUs; with none queued it
+// sleeps until the next wait arrives. Bounds match the daemon's config.
+#define DOORBELL_MAX_TIMEOUT_MS 10000
+#define DOORBELL_MAX_SLEEP_US 100000
+
+// Per-IRP wait state in Tail.Overlay.DriverContext; [3] belongs to the CSQ
+typedef struct _DOORBELL_IRP_CTX {
+    ULONG DeadlineMs; // interrupt time in ms, compared wrap-safe
+    ULONG LastSeen;
+} DOORBELL_IRP_CTX, *PDOORBELL_IRP_CTX;
+
+C_ASSERT(sizeof(DOORBELL_IRP_CTX) <= 3 * sizeof(PVOID));
+
+static PDOORBELL_IRP_CTX DoorbellIrpCtx(PIRP Irp) {
+    return (PDOORBELL_IRP_CTX)&Irp->Tail.Overlay.DriverContext[0];
+}
+
+static ULONG NowMs(VOID) {
+    return (ULONG)(KeQueryInterruptTime() / 10000ULL);
+}
+
+// One watcher pass's view of the header; the CSQ peek context
+typedef struct _DOORBELL_SNAP {
+    ULONG Doorbell;
+    ULONG Pending;
+    ULONG NowMs;
+} DOORBELL_SNAP, *PDOORBELL_SNAP;
+
+static BOOLEAN DoorbellReady(PIRP Irp, const DOORBELL_SNAP* snap) {
+    PDOORBELL_IRP_CTX w = DoorbellIrpCtx(Irp);
+    return snap->Doorbell != w->LastSeen || snap->Pending != 0 || (LONG)(snap->NowMs - w->DeadlineMs) >= 0;
+}
+
+static PFILE_CTX CsqCtx(PIO_CSQ Csq) {
+    return CONTAINING_RECORD(Csq, FILE_CTX, WaitCsq);
+}
+
+static VOID WaitCsqInsert(_In_ PIO_CSQ Csq, _In_ PIRP Irp) {
+    InsertTailList(&CsqCtx(Csq)->WaitList, &Irp->Tail.Overlay.ListEntry);
+}
+
+static VOID WaitCsqRemove(_In_ PIO_CSQ Csq, _In_ PIRP Irp) {
+    UNREFERENCED_PARAMETER(Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+// Next queued IRP after Irp (or the first) that the snapshot satisfies; any
+// IRP when there is no snapshot
+static PIRP WaitCsqPeekNext(_In_ PIO_CSQ Csq, _In_opt_ PIRP Irp, _In_opt_ PVOID PeekContext) {
+    PLIST_ENTRY head = &CsqCtx(Csq)->WaitList;
+    for (PLIST_ENTRY e = Irp ? Irp->Tail.Overlay.ListEntry.Flink : head->Flink; e != head; e = e->Flink) {
+        PIRP next = CONTAINING_RECORD(e, IRP, Tail.Overlay.ListEntry);
+        if (!PeekContext || DoorbellReady(next, (PDOORBELL_SNAP)PeekContext)) return next;
+    }
+    return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+static VOID WaitCsqAcquire(_In_ PIO_CSQ Csq, _Out_ _At_(*Irql, _IRQL_saves_) PKIRQL Irql) {
+    KeAcquireSpinLock(&CsqCtx(Csq)->WaitLock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static VOID WaitCsqRelease(_In_ PIO_CSQ Csq, _In_ _IRQL_restores_ KIRQL Irql) {
+    KeReleaseSpinLock(&CsqCtx(Csq)->WaitLock, Irql);
+}
+
+static VOID WaitCsqCompleteCanceled(_In_ PIO_CSQ Csq, _In_ PIRP Irp) {
+    UNREFERENCED_PARAMETER(Csq);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static VOID DoorbellInit(PFILE_CTX ctx) {
+    InitializeListHead(&ctx->WaitList);
+    KeInitializeSpinLock(&ctx->WaitLock);
+    IoCsqInitialize(&ctx->WaitCsq, WaitCsqInsert, WaitCsqRemove, WaitCsqPeekNext,
+                    WaitCsqAcquire, WaitCsqRelease, WaitCsqCompleteCanceled);
+    KeInitializeEvent(&ctx->Kick, SynchronizationEvent, FALSE);
+    ExInitializeRundownProtection(&ctx->WaitRundown);
+    ctx->PollUs = ctx->MaxPollUs = 1;
+}
+
+// Milliseconds until the earliest queued deadline; FALSE if nothing is queued
+static BOOLEAN WaitNextDeadline(PFILE_CTX ctx, PULONG left_ms) {
+    KIRQL irql;
+    ULONG now = NowMs(), left = MAXULONG;
+    KeAcquireSpinLock(&ctx->WaitLock, &irql);
+    BOOLEAN queued = !IsListEmpty(&ctx->WaitList);
+    for (PLIST_ENTRY e = ctx->WaitList.Flink; e != &ctx->WaitList; e = e->Flink) {
+        LONG d = (LONG)(DoorbellIrpCtx(CONTAINING_RECORD(e, IRP, Tail.Overlay.ListEntry))->DeadlineMs - now);
+        ULONG l = d > 0 ? (ULONG)d : 0;
+        if (l < left) left = l;
+    }
+    KeReleaseSpinLock(&ctx->WaitLock, irql);
+    *left_ms = left;
+    return queued;
+}
+
+// The doorbell path: complete every queued wait the header now satisfies
+static ULONG DoorbellCompleteReady(PFILE_CTX ctx) {
+    PRING_HEADER hdr = (PRING_HEADER)ctx->KernelBase;
+    DOORBELL_SNAP snap;
+    ULONG n = 0;
+    PIRP Irp;
+
+    KeMemoryBarrier();
+    snap.Doorbell = hdr->doorbell;
+    snap.Pending = RingPending(ctx);
+    snap.NowMs = NowMs();
+    while ((Irp = IoCsqRemoveNextIrp(&ctx->WaitCsq, &snap)) != NULL) {
+        PDOORBELL_WAIT_OUT out = (PDOORBELL_WAIT_OUT)Irp->AssociatedIrp.SystemBuffer;
+        out->doorbell = snap.Doorbell;
+        out->pending = snap.Pending;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = sizeof(DOORBELL_WAIT_OUT);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        n++;
+    }
+    return n;
+}
+
+static VOID DoorbellWatcher(_In_ PVOID Context) {
+    PFILE_CTX ctx = (PFILE_CTX)Context;
+    PRING_HEADER hdr = (PRING_HEADER)ctx->KernelBase;
+    ULONG sleep_us = (ULONG)ctx->PollUs;
+
+    while (!ctx->Closing) {
+        LARGE_INTEGER due, *timeout = NULL;
+        ULONG left_ms;
+        if (WaitNextDeadline(ctx, &left_ms)) {
+            // Advertise before checking: a guest publishing after this sees
+            // the flag and rings (the full barrier pairs with the guest's mb()
+            // in colx_ring_doorbell), one publishing before is seen below
+            InterlockedExchange((volatile LONG*)&hdr->host_waiting, 1);
+            if (DoorbellCompleteReady(ctx)) {
+                sleep_us = (ULONG)ctx->PollUs; // progress: stay responsive
+            } else if (sleep_us < (ULONG)ctx->MaxPollUs) {
+                sleep_us = (sleep_us * 2 < (ULONG)ctx->MaxPollUs) ? sleep_us * 2 : (ULONG)ctx->MaxPollUs;
+            }
+            if (WaitNextDeadline(ctx, &left_ms)) {
+                ULONGLONG us = (ULONGLONG)left_ms * 1000ULL;
+                due.QuadPart = -(LONGLONG)((sleep_us < us ? sleep_us : us) * 10ULL);
+                timeout = &due;
+            } else {
+                InterlockedExchange((volatile LONG*)&hdr->host_waiting, 0);
+            }
+        }
+        if (KeWaitForSingleObject(&ctx->Kick, Executive, KernelMode, FALSE, timeout) == STATUS_SUCCESS) {
+            sleep_us = (ULONG)ctx->PollUs; // new wait or cleanup
+        }
+    }
+    InterlockedExchange((volatile LONG*)&hdr->host_waiting, 0);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Start the handle's watcher once. Callers hold WaitRundown, so cleanup
+// cannot run until Watcher is set (or the start failed).
+static NTSTATUS DoorbellStartWatcher(PFILE_CTX ctx) {
+    OBJECT_ATTRIBUTES oa;
+    HANDLE h;
+    if (InterlockedCompareExchange(&ctx->WatcherStarted, 1, 0) != 0) return STATUS_SUCCESS;
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    NTSTATUS status = PsCreateSystemThread(&h, THREAD_ALL_ACCESS, &oa, NULL, NULL, DoorbellWatcher, ctx);
+    if (NT_SUCCESS(status)) {
+        status = ObReferenceObjectByHandle(h, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&ctx->Watcher, NULL);
+        ZwClose(h);
+    }
+    if (!NT_SUCCESS(status)) InterlockedExchange(&ctx->WatcherStarted, 0);
+    return status;
+}
+
+// Cleanup: refuse new waits, join the watcher, cancel whatever is still queued
+static VOID DoorbellShutdown(PFILE_CTX ctx) {
+    PIRP Irp;
+    InterlockedExchange(&ctx->Closing, 1);
+    ExWaitForRundownProtectionRelease(&ctx->WaitRundown);
+    KeSetEvent(&ctx->Kick, IO_NO_INCREMENT, FALSE);
+    if (ctx->Watcher) {
+        KeWaitForSingleObject(ctx->Watcher, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(ctx->Watcher);
+        ctx->Watcher = NULL;
+    }
+    while ((Irp = IoCsqRemoveNextIrp(&ctx->WaitCsq, NULL)) != NULL) {
+        WaitCsqCompleteCanceled(&ctx->WaitCsq, Irp);
+    }
+}
+
+NTSTATUS CoLinuxHandleWaitDoorbell(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NTSTATUS status = STATUS_SUCCESS;
+    PFILE_CTX ctx = IrpSp->FileObject ? GetFileCtx(IrpSp->FileObject) : NULL;
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(DOORBELL_WAIT_IN) ||
+        IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(DOORBELL_WAIT_OUT) ||
+        Irp->AssociatedIrp.SystemBuffer == NULL) {
+        status = STATUS_BUFFER_TOO_SMALL;
+    } else if (!ctx || !ctx->KernelBase || ctx->Geom.magic != COLX_GEOM_MAGIC) {
+        status = STATUS_DEVICE_NOT_READY;
+    }
+    if (!NT_SUCCESS(status)) {
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+    if (!ExAcquireRundownProtection(&ctx->WaitRundown)) {
+        Irp->IoStatus.Status = STATUS_DELETE_PENDING;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return STATUS_DELETE_PENDING;
+    }
+    status = DoorbellStartWatcher(ctx);
+    if (!NT_SUCCESS(status)) {
+        ExReleaseRundownProtection(&ctx->WaitRundown);
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+    // User-mode values are clamped: no wait outlives DOORBELL_MAX_TIMEOUT_MS
+    PDOORBELL_WAIT_IN in = (PDOORBELL_WAIT_IN)Irp->AssociatedIrp.SystemBuffer;
+    ULONG timeout_ms = in->timeout_ms < DOORBELL_MAX_TIMEOUT_MS ? in->timeout_ms : DOORBELL_MAX_TIMEOUT_MS;
+    ULONG coalesce_us = in->coalesce_us ? in->coalesce_us : 1;
+    ULONG max_sleep_us = in->max_sleep_us;
+    if (coalesce_us > DOORBELL_MAX_SLEEP_US) coalesce_us = DOORBELL_MAX_SLEEP_US;
+    if (max_sleep_us > DOORBELL_MAX_SLEEP_US) max_sleep_us = DOORBELL_MAX_SLEEP_US;
+    if (max_sleep_us < coalesce_us) max_sleep_us = coalesce_us;
+    InterlockedExchange(&ctx->PollUs, (LONG)coalesce_us);
+    InterlockedExchange(&ctx->MaxPollUs, (LONG)max_sleep_us);
+
+    PDOORBELL_IRP_CTX w = DoorbellIrpCtx(Irp);
+    w->LastSeen = in->last_seen;
+    w->DeadlineMs = NowMs() + timeout_ms;
+
+    // Marks the IRP pending; one cancelled meanwhile is completed right here
+    IoCsqInsertIrp(&ctx->WaitCsq, Irp, NULL);
+    KeSetEvent(&ctx->Kick, IO_NO_INCREMENT, FALSE);
+    ExReleaseRundownProtection(&ctx->WaitRundown);
+    return STATUS_PENDING;
+}
@@ -1,14 +1,14 @@
 // Virtual block IOCTL handling with async completion using work items.
 // Wire format (METHOD_BUFFERED): [op:1][resv:3][lba:8][len:4][data...]
 
-#include <ntddk.h>
+#include <ntifs.h> // ZwFsControlFile, ZwFlushBuffersFile
 #include "include/colinux_ioctls.h"
 
 #define TAG_VBLK 'kbLV'
 
 static HANDLE g_vblk_file = NULL;
 static const ULONG SECTOR_SIZE = 512; // LBA in sectors
-static const ULONG MAX_XFER = 128 * 1024; // cap single transfer
+static const ULONG MAX_XFER = COLINUX_VBLK_MAX_XFER; // cap single transfer (largest ring slot window)
 
 typedef struct _VBLK_WORK {
     PDEVICE_OBJECT DeviceObject;
@@ -161,6 +161,15 @@ NTSTATUS CoLinuxHandleVblkSubmit(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp
     return STATUS_PENDING;
 }
 
+// Deallocate [off, off + len) of the sparse backing file; the range reads as zeros.
+static NTSTATUS VblkZeroRange(ULONGLONG off, ULONG len) {
+    FILE_ZERO_DATA_INFORMATION zi;
+    IO_STATUS_BLOCK iosb;
+    zi.FileOffset.QuadPart = (LONGLONG)off;
+    zi.BeyondFinalZero.QuadPart = (LONGLONG)(off + len);
+    return ZwFsControlFile(g_vblk_file, NULL, NULL, NULL, &iosb, FSCTL_SET_ZERO_DATA, &zi, sizeof(zi), NULL, 0);
+}
+
 // Open a backing file for vblk I/O. Input buffer is a UTF-16 Windows path (e.g., C:\\path\\file.img),
 // we prepend "\\??\\" to form a kernel path.
 NTSTATUS CoLinuxHandleVblkSetBacking(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
@@ -224,6 +233,9 @@ NTSTATUS CoLinuxHandleVblkSetBacking(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpS
         return status;
     }
 
+    // Best effort: without the sparse flag FSCTL_SET_ZERO_DATA writes zeros instead of freeing clusters
+    ZwFsControlFile(h, NULL, NULL, NULL, &iosb, FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+
     if (g_vblk_file) ZwClose(g_vblk_file);
     g_vblk_file = h;
 
@@ -283,3 +295,63 @@ NTSTATUS CoLinuxHandleVblkWrite(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
     if (NT_SUCCESS(status)) { Irp->IoStatus.Information = 0; } else { Irp->IoStatus.Information = 0; }
     Irp->IoStatus.Status = status; IoCompleteRequest(Irp, IO_NO_INCREMENT); return status;
 }
+
+// Batched scatter-gather submit: one IRP carries up to COLINUX_VBLK_BATCH_MAX
+// descriptors against a single MDL-described buffer (see colinux_ioctls.h).
+NTSTATUS CoLinuxHandleVblkBatch(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    if (!g_vblk_file) { Irp->IoStatus.Status = STATUS_DEVICE_NOT_READY; Irp->IoStatus.Information = 0; IoCompleteRequest(Irp, IO_NO_INCREMENT); return STATUS_DEVICE_NOT_READY; }
+    ULONG in_len = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG out_len = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    PVBLK_BATCH_HDR hdr = (PVBLK_BATCH_HDR)Irp->AssociatedIrp.SystemBuffer;
+    if (in_len < sizeof(VBLK_BATCH_HDR) || !hdr || !Irp->MdlAddress) {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER; Irp->IoStatus.Information = 0; IoCompleteRequest(Irp, IO_NO_INCREMENT); return STATUS_INVALID_PARAMETER;
+    }
+    ULONG count = hdr->count;
+    ULONGLONG status_end = (ULONGLONG)hdr->status_off + (ULONGLONG)count * sizeof(LONG);
+    if (count == 0 || count > COLINUX_VBLK_BATCH_MAX || hdr->flags != 0 ||
+        in_len < sizeof(VBLK_BATCH_HDR) + count * sizeof(VBLK_BATCH_DESC) ||
+        (hdr->status_off & (sizeof(LONG) - 1)) != 0 || status_end > out_len) {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER; Irp->IoStatus.Information = 0; IoCompleteRequest(Irp, IO_NO_INCREMENT); return STATUS_INVALID_PARAMETER;
+    }
+    PUCHAR out_sys = (PUCHAR)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (!out_sys) { Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES; Irp->IoStatus.Information = 0; IoCompleteRequest(Irp, IO_NO_INCREMENT); return STATUS_INSUFFICIENT_RESOURCES; }
+
+    PVBLK_BATCH_DESC descs = (PVBLK_BATCH_DESC)(hdr + 1);
+    PLONG statuses = (PLONG)(out_sys + hdr->status_off);
+    for (ULONG i = 0; i < count; ++i) {
+        VBLK_BATCH_DESC d = descs[i];
+        ULONGLONG end = d.buf_off + d.len;
+        NTSTATUS st;
+        if (d.op == COLINUX_VBLK_BATCH_FLUSH || d.op == COLINUX_VBLK_BATCH_DISCARD || d.op == COLINUX_VBLK_BATCH_WRITE_ZEROES) {
+            // No data window: buf_off is ignored
+            IO_STATUS_BLOCK iosb;
+            if (d.op == COLINUX_VBLK_BATCH_FLUSH) {
+                st = d.len == 0 ? ZwFlushBuffersFile(g_vblk_file, &iosb) : STATUS_INVALID_PARAMETER;
+            } else if (d.len == 0 || d.len > COLINUX_VBLK_MAX_TRIM || (d.len % SECTOR_SIZE) != 0) {
+                st = STATUS_INVALID_PARAMETER;
+            } else {
+                st = VblkZeroRange(d.lba * SECTOR_SIZE, d.len);
+            }
+            statuses[i] = st;
+            continue;
+        }
+        // Reject windows outside the buffer or overlapping the status table
+        if (d.len == 0 || d.len > MAX_XFER || (d.len % SECTOR_SIZE) != 0 || end > out_len ||
+            (d.buf_off < status_end && end > hdr->status_off)) {
+            st = STATUS_INVALID_PARAMETER;
+        } else {
+            LARGE_INTEGER off; off.QuadPart = (LONGLONG)d.lba * SECTOR_SIZE;
+            IO_STATUS_BLOCK iosb;
+            if (d.op == COLINUX_VBLK_BATCH_READ) {
+                st = ZwReadFile(g_vblk_file, NULL, NULL, NULL, &iosb, out_sys + d.buf_off, d.len, &off, NULL);
+            } else if (d.op == COLINUX_VBLK_BATCH_WRITE) {
+                st = ZwWriteFile(g_vblk_file, NULL, NULL, NULL, &iosb, out_sys + d.buf_off, d.len, &off, NULL);
+            } else {
+                st = STATUS_INVALID_PARAMETER;
+            }
+            if (NT_SUCCESS(st) && iosb.Information != d.len) st = STATUS_END_OF_FILE;
+        }
+        statuses[i] = st;
+    }
+    Irp->IoStatus.Status = STATUS_SUCCESS; Irp->IoStatus.Information = 0; IoCompleteRequest(Irp, IO_NO_INCREMENT); return STATUS_SUCCESS;
+}
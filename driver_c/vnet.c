@@ -1,2 +1,59 @@
-// Placeholder virtual network device packet ring handling.
+// Virtual NIC packet rings: placement, initialisation and doorbell accounting.
+// The rings and buffer pool are serviced by the daemon; the driver only lays
+// them out at map time and counts TX work for doorbell waits.
+#include <ntddk.h>
+#include "include/colinux_ioctls.h"
+#include "include/colinux_geom.h"
 
+#define VNET_PAGE 0x1000
+#define VNET_ROUND_PAGE(x) (((ULONGLONG)(x) + VNET_PAGE - 1) & ~(ULONGLONG)(VNET_PAGE - 1))
+
+// Mirror of the mem.c RING_CTRL (colx_ring_ctrl; layout must match)
+typedef struct _VNET_RING_CTRL {
+    volatile ULONG prod;
+    ULONG rsvd0;
+    ULONG cap;
+    ULONG slot_size;
+    ULONG pad0[12];
+    volatile ULONG cons;
+    ULONG pad1[15];
+} VNET_RING_CTRL, *PVNET_RING_CTRL;
+
+C_ASSERT(sizeof(VNET_RING_CTRL) == 128);
+
+static PVNET_RING_CTRL vnet_ring(PVOID kbase, const COLX_GEOM* g, ULONG r) {
+    return (PVNET_RING_CTRL)((PUCHAR)kbase + g->vnet_off + VNET_PAGE + (SIZE_T)r * g->vnet_ring_stride);
+}
+
+// Place the NIC at `off`: the config page, the TX, TXC, FILL and RX rings,
+// then the page-aligned pool. Returns the first free offset after it.
+ULONGLONG VnetLayout(PCOLX_GEOM g, ULONGLONG off, VNET_SHAPE shape) {
+    if (!shape.cap) return off;
+    g->vnet_ring_cap = shape.cap;
+    g->vnet_ring_stride = (ULONG)VNET_ROUND_PAGE(sizeof(VNET_RING_CTRL) + (ULONGLONG)shape.cap * COLX_VNET_DESC_SIZE);
+    g->vnet_buf_count = shape.buf_count;
+    g->vnet_buf_size = shape.buf_size;
+    g->vnet_off = off;
+    g->vnet_pool_off = off + VNET_PAGE + (ULONGLONG)COLX_VNET_RINGS * g->vnet_ring_stride;
+    return g->vnet_pool_off + (ULONGLONG)shape.buf_count * shape.buf_size;
+}
+
+// Zero the config page (mtu 0: no host attached yet) and empty every ring.
+// The pool is left as the section created it: zeroed.
+VOID VnetInitRings(PVOID kbase, const COLX_GEOM* g) {
+    if (!g->vnet_ring_cap) return;
+    RtlZeroMemory((PUCHAR)kbase + g->vnet_off, VNET_PAGE);
+    for (ULONG r = 0; r < COLX_VNET_RINGS; ++r) {
+        PVNET_RING_CTRL ctrl = vnet_ring(kbase, g, r);
+        ctrl->prod = 0; ctrl->cons = 0; ctrl->cap = g->vnet_ring_cap; ctrl->slot_size = COLX_VNET_DESC_SIZE;
+        RtlZeroMemory((PUCHAR)ctrl + sizeof(VNET_RING_CTRL), (SIZE_T)g->vnet_ring_cap * COLX_VNET_DESC_SIZE);
+    }
+}
+
+// Guest TX descriptors the daemon has not consumed. FILL buffers only wait
+// for traffic, so they never wake the daemon.
+ULONG VnetPending(PVOID kbase, const COLX_GEOM* g) {
+    if (!g->vnet_ring_cap) return 0;
+    PVNET_RING_CTRL tx = vnet_ring(kbase, g, COLX_VNET_RING_TX);
+    return tx->prod - tx->cons;
+}
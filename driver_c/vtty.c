@@ -1,6 +1,7 @@
-// VTTY byte-stream over shared mapping: host<->guest console rings.
+// VTTY byte-stream over shared mapping: host<->guest rings, one pair per channel.
 #include <ntddk.h>
 #include "include/colinux_ioctls.h"
+#include "include/colinux_geom.h"
 
 #define TAG_VTTY 'ytVC'
 
@@ -11,25 +12,61 @@ typedef struct _FILE_CTX {
     SIZE_T UserSize;
     PVOID  KernelBase;
     SIZE_T KernelSize;
+    COLX_GEOM Geom;
 } FILE_CTX, *PFILE_CTX;
 
-// Offsets and capacity must match UAPI
-#define COLX_VTTY_TX_OFF   0x40000
-#define COLX_VTTY_RX_OFF   0x50000
-#define COLX_VTTY_CAP      (64 * 1024)
+// Mirror of the mem.c RING_HEADER (layout must match)
+typedef struct _VTTY_HDR {
+    ULONG ver;
+    ULONG flags;
+    ULONGLONG tick_count;
+    ULONG ping_req;
+    ULONG ping_resp;
+    volatile ULONG doorbell;
+    volatile ULONG host_waiting;
+    volatile LONG guest_doorbell;
+    volatile ULONG guest_waiting;
+} VTTY_HDR, *PVTTY_HDR;
 
+#define VTTY_HDR_F_VTTY_NOTIFY 0x4 // RING_HDR_F_VTTY_NOTIFY in mem.c
+
+// Placed and sized by the geometry mem.c publishes at map time
 typedef struct _VTTY_RING {
     volatile ULONG head;
     volatile ULONG tail;
     ULONG cap;
     ULONG _pad;
-    UCHAR buf[COLX_VTTY_CAP];
+    UCHAR buf[ANYSIZE_ARRAY]; // the channel's cap bytes
 } VTTY_RING, *PVTTY_RING;
 
+// Channel `ch` as the driver laid it out, or NULL before a mapping with
+// that channel exists. Bounds come from the driver's copy of the geometry,
+// never the shared one.
+static PCOLX_VTTY_CHAN vtty_chan(PFILE_CTX ctx, ULONG ch) {
+    if (!ctx->KernelBase || ch >= ctx->Geom.vtty_channels || !ctx->Geom.vtty_chan[ch].cap) return NULL;
+    PCOLX_VTTY_CHAN c = &ctx->Geom.vtty_chan[ch];
+    if (c->tx_off + FIELD_OFFSET(VTTY_RING, buf) + c->cap > ctx->KernelSize ||
+        c->rx_off + FIELD_OFFSET(VTTY_RING, buf) + c->cap > ctx->KernelSize) return NULL;
+    return c;
+}
+
+static PVTTY_RING vtty_ring(PFILE_CTX ctx, ULONGLONG off) {
+    return (PVTTY_RING)((PUCHAR)ctx->KernelBase + off);
+}
+
+// Tell the guest a ring moved: new bytes for it, or room freed for its
+// writers. The interlocked increment orders the ring update before it. An
+// interrupt for a guest in guest_waiting belongs here once the run loop can
+// inject one (COLX_HDR_F_GUEST_IRQ); until then the guest's fallback poll sees it.
+static VOID vtty_notify(PFILE_CTX ctx) {
+    if (!(ctx->Geom.features & VTTY_HDR_F_VTTY_NOTIFY)) return;
+    InterlockedIncrement(&((PVTTY_HDR)ctx->KernelBase)->guest_doorbell);
+}
+
 static __forceinline ULONG vmin(ULONG a, ULONG b) { return a < b ? a : b; }
 
-static ULONG vtty_write_ring(PVTTY_RING ring, const UCHAR* src, ULONG len) {
-    ULONG head = ring->head, tail = ring->tail, cap = ring->cap;
+static ULONG vtty_write_ring(PVTTY_RING ring, ULONG cap, const UCHAR* src, ULONG len) {
+    ULONG head = ring->head, tail = ring->tail;
     ULONG used = (head - tail) & (cap - 1);
     ULONG free = cap - used - 1;
     ULONG n = vmin(len, free);
@@ -41,8 +78,8 @@ static ULONG vtty_write_ring(PVTTY_RING ring, const UCHAR* src, ULONG len) {
     return n;
 }
 
-static ULONG vtty_read_ring(PVTTY_RING ring, UCHAR* dst, ULONG len) {
-    ULONG head = ring->head, tail = ring->tail, cap = ring->cap;
+static ULONG vtty_read_ring(PVTTY_RING ring, ULONG cap, UCHAR* dst, ULONG len) {
+    ULONG head = ring->head, tail = ring->tail;
     ULONG used = (head - tail) & (cap - 1);
     ULONG n = vmin(len, used);
     ULONG first = vmin(n, cap - (tail & (cap - 1)));
@@ -53,41 +90,61 @@ static ULONG vtty_read_ring(PVTTY_RING ring, UCHAR* dst, ULONG len) {
     return n;
 }
 
-NTSTATUS CoLinuxHandleVttyPush(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
-    if (!IrpSp->FileObject || !IrpSp->FileObject->FsContext) goto invalid;
-    PFILE_CTX ctx = (PFILE_CTX)IrpSp->FileObject->FsContext;
-    if (!ctx->KernelBase || ctx->KernelSize < (COLX_VTTY_TX_OFF + sizeof(VTTY_RING))) goto invalid;
-    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength == 0 || Irp->AssociatedIrp.SystemBuffer == NULL) goto invalid;
-    PVTTY_RING tx = (PVTTY_RING)((PUCHAR)ctx->KernelBase + COLX_VTTY_TX_OFF);
-    if (tx->cap == 0) tx->cap = COLX_VTTY_CAP; // init on first use
-    ULONG n = vtty_write_ring(tx, (const UCHAR*)Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.InputBufferLength);
-    Irp->IoStatus.Status = STATUS_SUCCESS;
-    Irp->IoStatus.Information = n;
+static NTSTATUS vtty_complete(PIRP Irp, NTSTATUS status, ULONG n) {
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = NT_SUCCESS(status) ? n : 0;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_SUCCESS;
-invalid:
-    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
-    Irp->IoStatus.Information = 0;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_INVALID_PARAMETER;
+    return status;
 }
 
-NTSTATUS CoLinuxHandleVttyPull(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
-    if (!IrpSp->FileObject || !IrpSp->FileObject->FsContext) goto invalid;
+// Channel number from a VTTY_CHAN_IN prefix of `hdr_len` bytes (0: channel 0)
+static BOOLEAN vtty_chan_in(PIRP Irp, PIO_STACK_LOCATION IrpSp, ULONG hdr_len, PULONG ch) {
+    *ch = 0;
+    if (!hdr_len) return TRUE;
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < hdr_len || Irp->AssociatedIrp.SystemBuffer == NULL) return FALSE;
+    *ch = ((PVTTY_CHAN_IN)Irp->AssociatedIrp.SystemBuffer)->channel;
+    return TRUE;
+}
+
+// Bytes after the `hdr_len` prefix go to the guest on the channel it names
+static NTSTATUS VttyPush(PIRP Irp, PIO_STACK_LOCATION IrpSp, ULONG hdr_len) {
+    if (!IrpSp->FileObject || !IrpSp->FileObject->FsContext) return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
     PFILE_CTX ctx = (PFILE_CTX)IrpSp->FileObject->FsContext;
-    if (!ctx->KernelBase || ctx->KernelSize < (COLX_VTTY_RX_OFF + sizeof(VTTY_RING))) goto invalid;
-    if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength == 0 || Irp->AssociatedIrp.SystemBuffer == NULL) goto invalid;
-    PVTTY_RING rx = (PVTTY_RING)((PUCHAR)ctx->KernelBase + COLX_VTTY_RX_OFF);
-    if (rx->cap == 0) rx->cap = COLX_VTTY_CAP; // init on first use
-    ULONG n = vtty_read_ring(rx, (UCHAR*)Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.OutputBufferLength);
-    Irp->IoStatus.Status = STATUS_SUCCESS;
-    Irp->IoStatus.Information = n;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_SUCCESS;
-invalid:
-    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
-    Irp->IoStatus.Information = 0;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return STATUS_INVALID_PARAMETER;
+    ULONG ch;
+    if (!vtty_chan_in(Irp, IrpSp, hdr_len, &ch)) return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
+    PCOLX_VTTY_CHAN c = vtty_chan(ctx, ch);
+    ULONG len = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+    if (!c || len <= hdr_len || Irp->AssociatedIrp.SystemBuffer == NULL) return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
+    ULONG n = vtty_write_ring(vtty_ring(ctx, c->tx_off), c->cap, (const UCHAR*)Irp->AssociatedIrp.SystemBuffer + hdr_len, len - hdr_len);
+    if (n) vtty_notify(ctx);
+    return vtty_complete(Irp, STATUS_SUCCESS, n);
+}
+
+static NTSTATUS VttyPull(PIRP Irp, PIO_STACK_LOCATION IrpSp, ULONG hdr_len) {
+    if (!IrpSp->FileObject || !IrpSp->FileObject->FsContext) return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
+    PFILE_CTX ctx = (PFILE_CTX)IrpSp->FileObject->FsContext;
+    ULONG ch; // read before the output overwrites the shared system buffer
+    if (!vtty_chan_in(Irp, IrpSp, hdr_len, &ch)) return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
+    PCOLX_VTTY_CHAN c = vtty_chan(ctx, ch);
+    if (!c || IrpSp->Parameters.DeviceIoControl.OutputBufferLength == 0 || Irp->AssociatedIrp.SystemBuffer == NULL)
+        return vtty_complete(Irp, STATUS_INVALID_PARAMETER, 0);
+    ULONG n = vtty_read_ring(vtty_ring(ctx, c->rx_off), c->cap, (UCHAR*)Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.OutputBufferLength);
+    if (n) vtty_notify(ctx);
+    return vtty_complete(Irp, STATUS_SUCCESS, n);
+}
+
+NTSTATUS CoLinuxHandleVttyPush(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    return VttyPush(Irp, IrpSp, 0);
 }
 
+NTSTATUS CoLinuxHandleVttyPull(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    return VttyPull(Irp, IrpSp, 0);
+}
+
+NTSTATUS CoLinuxHandleVttyPushChan(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    return VttyPush(Irp, IrpSp, sizeof(VTTY_CHAN_IN));
+}
+
+NTSTATUS CoLinuxHandleVttyPullChan(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION IrpSp) {
+    return VttyPull(Irp, IrpSp, sizeof(VTTY_CHAN_IN));
+}
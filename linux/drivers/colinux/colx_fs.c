@@ -0,0 +1,1168 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * colxfs: the host's shared folder over the SHFS ring (see colinux_ring.h).
+ *
+ *   mount -t colxfs colx /mnt/win -o attr_timeout=1000,entry_timeout=1000
+ *
+ * File data is not cached between calls: read() and write() go to the host
+ * a slot window at a time, copied straight between the window and the
+ * caller's buffer, so the guest never serves bytes the host has changed
+ * since. The page cache only backs mmap. Attributes and dentries are trusted
+ * for attr_timeout / entry_timeout milliseconds (0: ask the host each time).
+ */
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/delay.h>
+#include <linux/wait.h>
+#include <linux/namei.h>
+#include <linux/seq_file.h>
+#include <linux/statfs.h>
+#include <linux/sched/signal.h>
+#include <linux/io.h>
+#include <uapi/linux/colinux_ring.h>
+#include "colx_geom.h"
+
+static unsigned long colx_base;
+static unsigned long colx_size;
+static unsigned int request_timeout_ms = 30000;
+module_param(colx_base, ulong, 0644);
+module_param(colx_size, ulong, 0644);
+module_param(request_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(colx_base, "Shared mapping base");
+MODULE_PARM_DESC(colx_size, "Shared mapping size");
+MODULE_PARM_DESC(request_timeout_ms, "Fail a request the host has not answered after this long");
+
+#define COLXFS_MAGIC 0x636f6c78 /* "colx" */
+#define COLXFS_DEFAULT_TIMEOUT_MS 1000
+/* Reply polling backs off from the first to the second */
+#define COLXFS_POLL_MIN_US 10
+#define COLXFS_POLL_MAX_US 1000
+
+static void __iomem *io;
+static struct colx_geom geom;                   /* layout the host published at map time */
+static struct colx_ctrl_layout ctrl_layout;
+static struct kmem_cache *inode_cache;
+
+/*
+ * Ring state private to the guest. A caller claims the slot at prod, fills
+ * it and publishes it; slots reach the shared prod in ring order, so one
+ * filled ahead of an earlier slot waits in `ready`. The caller owns the slot
+ * (`busy`) until it has copied the reply out. A caller that gives up marks
+ * it `abandoned`, and the slot is reused only once the host's cons passes it.
+ */
+static struct {
+    spinlock_t lock;
+    u32 cap;
+    u32 prod;                                   /* next slot to claim */
+    u32 published;                              /* last prod stored to the ring */
+    unsigned long *busy;
+    unsigned long *ready;
+    unsigned long *abandoned;
+    wait_queue_head_t free_wq;
+} ring;
+
+struct colxfs_sb {
+    unsigned long attr_timeout;                 /* jiffies */
+    unsigned long entry_timeout;
+    kuid_t uid;                                 /* owner of every file */
+    kgid_t gid;
+};
+
+struct colxfs_inode {
+    struct inode vfs_inode;
+    u64 node;
+    u64 nlookup;                                /* host lookups to FORGET at eviction */
+    unsigned long attr_expires;
+};
+
+static inline struct colxfs_inode *COLXFS_I(struct inode *inode)
+{
+    return container_of(inode, struct colxfs_inode, vfs_inode);
+}
+
+static inline struct colxfs_sb *COLXFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+static inline struct colx_ring_ctrl __iomem *colxfs_ctrl(void)
+{
+    return (void __iomem *)((char __iomem *)io + geom.shfs_ring_off);
+}
+
+/* Consumer index: host-written, on its own cache line */
+static inline __u32 __iomem *colxfs_cons(void)
+{
+    return (void __iomem *)((char __iomem *)colxfs_ctrl() + ctrl_layout.cons_off);
+}
+
+static inline struct colx_shfs_slot __iomem *colxfs_slot(u32 idx)
+{
+    struct colx_shfs_slot __iomem *slots = (void __iomem *)((char __iomem *)colxfs_ctrl() +
+        ctrl_layout.slots_off);
+    return slots + idx;
+}
+
+static inline void __iomem *colxfs_window(u32 idx)
+{
+    return (char __iomem *)io + geom.shfs_data_off + (u64)idx * geom.shfs_slot_stride;
+}
+
+/* Wake a host sleeping in its doorbell wait, if it is (see colx_vblk.c) */
+static inline void colx_ring_doorbell(void)
+{
+    struct colx_ring_hdr __iomem *hdr = io;
+
+    mb();
+    if (readl(&hdr->host_waiting))
+        writel(readl(&hdr->doorbell) + 1, &hdr->doorbell);
+}
+
+/* One request in flight: its slot and window are the caller's until colxfs_end */
+struct colxfs_call {
+    u32 seq;
+    struct colx_shfs_slot __iomem *slot;
+    void __iomem *win;
+    bool abandoned;
+};
+
+/*
+ * Claim the slot at prod if it is free. Its previous user was prod - cap; if
+ * that caller gave up, the slot is free once the host has retired it.
+ */
+static bool colxfs_try_claim(struct colxfs_call *c)
+{
+    u32 idx;
+    bool ok = false;
+
+    spin_lock(&ring.lock);
+    idx = ring.prod & (ring.cap - 1);
+    if (test_bit(idx, ring.abandoned) && (s32)(readl(colxfs_cons()) - (ring.prod - ring.cap)) > 0) {
+        __clear_bit(idx, ring.abandoned);
+        __clear_bit(idx, ring.busy);
+    }
+    if (!test_bit(idx, ring.busy)) {
+        __set_bit(idx, ring.busy);
+        c->seq = ring.prod++;
+        ok = true;
+    }
+    spin_unlock(&ring.lock);
+    return ok;
+}
+
+static int colxfs_begin(struct colxfs_call *c)
+{
+    u32 idx;
+    long ret;
+
+    /* Abandoned slots free up without a wake-up, hence the timeout */
+    while (!colxfs_try_claim(c)) {
+        ret = wait_event_killable_timeout(ring.free_wq,
+            !test_bit(READ_ONCE(ring.prod) & (ring.cap - 1), ring.busy), HZ / 100);
+        if (ret < 0)
+            return ret;
+    }
+    idx = c->seq & (ring.cap - 1);
+    c->slot = colxfs_slot(idx);
+    c->win = colxfs_window(idx);
+    c->abandoned = false;
+    return 0;
+}
+
+/*
+ * Mark seq filled and hand every filled slot at the head of the ring to the
+ * host with one index store and one doorbell. The release barrier orders
+ * slot and window contents before prod; it pairs with the host's acquire.
+ */
+static void colxfs_publish(u32 seq)
+{
+    bool moved = false;
+
+    spin_lock(&ring.lock);
+    __set_bit(seq & (ring.cap - 1), ring.ready);
+    while (ring.published != ring.prod && test_bit(ring.published & (ring.cap - 1), ring.ready)) {
+        __clear_bit(ring.published & (ring.cap - 1), ring.ready);
+        ring.published++;
+        moved = true;
+    }
+    if (moved) {
+        dma_wmb();
+        writel_relaxed(ring.published, &colxfs_ctrl()->prod);
+        colx_ring_doorbell();
+    }
+    spin_unlock(&ring.lock);
+}
+
+/* Poll cons past seq, backing off; the host answers most requests in microseconds */
+static int colxfs_wait(u32 seq)
+{
+    unsigned long deadline = jiffies + msecs_to_jiffies(request_timeout_ms);
+    unsigned int delay = COLXFS_POLL_MIN_US;
+
+    while ((s32)(readl(colxfs_cons()) - seq) <= 0) {
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        if (time_after(jiffies, deadline))
+            return -EIO;
+        usleep_range(delay, delay * 2);
+        delay = min(delay * 2, COLXFS_POLL_MAX_US);
+    }
+    /* The reply was written before cons moved */
+    dma_rmb();
+    return 0;
+}
+
+/*
+ * Send `req` (its payload, req->len bytes, already in c->win) and wait for
+ * the reply; on success req->len, fh and arg hold the host's. Returns 0 or a
+ * negative errno. A request the host has not answered leaves the slot to it.
+ */
+static int colxfs_submit(struct colxfs_call *c, struct colx_shfs_slot *req)
+{
+    struct colx_shfs_slot __iomem *s = c->slot;
+    int err;
+
+    writeq_relaxed(c->seq, &s->id);
+    writel_relaxed(req->op, &s->op);
+    writel_relaxed(0, &s->error);
+    writeq_relaxed(req->node, &s->node);
+    writeq_relaxed(req->fh, &s->fh);
+    writeq_relaxed(req->offset, &s->offset);
+    writeq_relaxed(req->arg, &s->arg);
+    writel_relaxed(req->len, &s->len);
+    writel_relaxed(req->flags, &s->flags);
+    colxfs_publish(c->seq);
+    err = colxfs_wait(c->seq);
+    if (err) {
+        c->abandoned = true;
+        return err;
+    }
+    err = (s32)readl_relaxed(&s->error);
+    req->len = readl_relaxed(&s->len);
+    req->fh = readq_relaxed(&s->fh);
+    req->arg = readq_relaxed(&s->arg);
+    if (err)
+        return err > 0 && err < MAX_ERRNO ? -err : -EIO;
+    return req->len > geom.shfs_slot_stride ? -EIO : 0;
+}
+
+static void colxfs_end(struct colxfs_call *c)
+{
+    u32 idx = c->seq & (ring.cap - 1);
+
+    spin_lock(&ring.lock);
+    if (c->abandoned)
+        __set_bit(idx, ring.abandoned);
+    else
+        __clear_bit(idx, ring.busy);
+    spin_unlock(&ring.lock);
+    wake_up(&ring.free_wq);
+}
+
+/*
+ * One round trip: in_len bytes of `in` go out in the window, and on success
+ * the first out_len bytes of the reply come back in `out`.
+ */
+static int colxfs_call(struct colx_shfs_slot *req, const void *in, u32 in_len, void *out, u32 out_len)
+{
+    struct colxfs_call c;
+    int err;
+
+    err = colxfs_begin(&c);
+    if (err)
+        return err;
+    if (in_len)
+        memcpy_toio(c.win, in, in_len);
+    req->len = in_len;
+    err = colxfs_submit(&c, req);
+    if (!err && out_len) {
+        if (req->len < out_len)
+            err = -EIO;
+        else
+            memcpy_fromio(out, c.win, out_len);
+    }
+    colxfs_end(&c);
+    return err;
+}
+
+static void colxfs_forget(u64 node, u64 n)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_FORGET, .node = node, .arg = n };
+
+    colxfs_call(&req, NULL, 0, NULL, 0);
+}
+
+static void colxfs_release_fh(u64 fh)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_RELEASE, .fh = fh };
+
+    colxfs_call(&req, NULL, 0, NULL, 0);
+}
+
+static inline u64 colxfs_fh(struct file *file)
+{
+    return (uintptr_t)file->private_data;
+}
+
+static const struct inode_operations colxfs_dir_iops;
+static const struct inode_operations colxfs_file_iops;
+static const struct file_operations colxfs_dir_fops;
+static const struct file_operations colxfs_file_fops;
+static const struct address_space_operations colxfs_aops;
+
+static inline void colxfs_invalidate_attr(struct inode *inode)
+{
+    COLXFS_I(inode)->attr_expires = jiffies - 1;
+}
+
+static inline void colxfs_set_entry_time(struct dentry *dentry)
+{
+    dentry->d_time = jiffies + COLXFS_SB(dentry->d_sb)->entry_timeout;
+}
+
+static void colxfs_apply_attr(struct inode *inode, const struct colx_shfs_attr *a)
+{
+    struct colxfs_sb *sbi = COLXFS_SB(inode->i_sb);
+    struct timespec64 mtime = ns_to_timespec64(a->mtime_ns);
+
+    /* Changed on the host: drop what mmap has cached */
+    if (S_ISREG(inode->i_mode) &&
+        (i_size_read(inode) != a->size || !timespec64_equal(&inode->i_mtime, &mtime)))
+        invalidate_mapping_pages(inode->i_mapping, 0, -1);
+    inode->i_ino = a->ino;
+    inode->i_mode = (inode->i_mode & S_IFMT) | (a->mode & 07777);
+    set_nlink(inode, a->nlink);
+    inode->i_uid = sbi->uid;
+    inode->i_gid = sbi->gid;
+    i_size_write(inode, a->size);
+    inode->i_blocks = a->blocks;
+    inode->i_atime = ns_to_timespec64(a->atime_ns);
+    inode->i_mtime = mtime;
+    inode->i_ctime = ns_to_timespec64(a->ctime_ns);
+    COLXFS_I(inode)->attr_expires = jiffies + sbi->attr_timeout;
+}
+
+/* A node whose path now names a different kind of file is a different inode */
+static int colxfs_test(struct inode *inode, void *data)
+{
+    const struct colx_shfs_attr *a = data;
+
+    return COLXFS_I(inode)->node == a->node && !((inode->i_mode ^ a->mode) & S_IFMT);
+}
+
+static int colxfs_set(struct inode *inode, void *data)
+{
+    const struct colx_shfs_attr *a = data;
+
+    COLXFS_I(inode)->node = a->node;
+    inode->i_mode = a->mode & S_IFMT;
+    return 0;
+}
+
+/* The inode for a LOOKUP / CREATE / MKDIR reply, which counted one host lookup */
+static struct inode *colxfs_iget(struct super_block *sb, struct colx_shfs_attr *a)
+{
+    struct inode *inode;
+
+    inode = iget5_locked(sb, (unsigned long)a->node, colxfs_test, colxfs_set, a);
+    if (!inode) {
+        colxfs_forget(a->node, 1);
+        return ERR_PTR(-ENOMEM);
+    }
+    spin_lock(&inode->i_lock);
+    COLXFS_I(inode)->nlookup++;
+    spin_unlock(&inode->i_lock);
+    if (!(inode->i_state & I_NEW)) {
+        colxfs_apply_attr(inode, a);
+        return inode;
+    }
+    if (S_ISDIR(a->mode)) {
+        inode->i_op = &colxfs_dir_iops;
+        inode->i_fop = &colxfs_dir_fops;
+    } else if (S_ISREG(a->mode)) {
+        inode->i_op = &colxfs_file_iops;
+        inode->i_fop = &colxfs_file_fops;
+        inode->i_mapping->a_ops = &colxfs_aops;
+    } else {
+        inode->i_op = &colxfs_file_iops;
+        init_special_inode(inode, a->mode & S_IFMT, 0);
+    }
+    colxfs_apply_attr(inode, a);
+    unlock_new_inode(inode);
+    return inode;
+}
+
+static int colxfs_refresh(struct inode *inode)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_GETATTR, .node = COLXFS_I(inode)->node };
+    struct colx_shfs_attr a;
+    int err;
+
+    err = colxfs_call(&req, NULL, 0, &a, sizeof(a));
+    if (err)
+        return err;
+    if ((inode->i_mode ^ a.mode) & S_IFMT)
+        return -ESTALE;
+    colxfs_apply_attr(inode, &a);
+    return 0;
+}
+
+static int colxfs_revalidate_attr(struct inode *inode)
+{
+    if (time_before(jiffies, COLXFS_I(inode)->attr_expires))
+        return 0;
+    return colxfs_refresh(inode);
+}
+
+/* Namespace ops carry the name as their payload */
+static int colxfs_name_call(struct colx_shfs_slot *req, const struct qstr *name, struct colx_shfs_attr *out)
+{
+    if (name->len > COLX_SHFS_NAME_MAX)
+        return -ENAMETOOLONG;
+    return colxfs_call(req, name->name, name->len, out, out ? sizeof(*out) : 0);
+}
+
+static struct dentry *colxfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_LOOKUP, .node = COLXFS_I(dir)->node };
+    struct colx_shfs_attr a;
+    struct inode *inode = NULL;
+    int err;
+
+    err = colxfs_name_call(&req, &dentry->d_name, &a);
+    if (err && err != -ENOENT)
+        return ERR_PTR(err);
+    if (!err) {
+        inode = colxfs_iget(dir->i_sb, &a);
+        if (IS_ERR(inode))
+            return ERR_CAST(inode);
+    }
+    /* Negative dentries are cached for entry_timeout too */
+    colxfs_set_entry_time(dentry);
+    return d_splice_alias(inode, dentry);
+}
+
+static int colxfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_LOOKUP };
+    struct colx_shfs_attr a;
+    struct inode *inode;
+    struct dentry *parent;
+    int err;
+
+    if (IS_ROOT(dentry) || time_before(jiffies, dentry->d_time))
+        return 1;
+    if (flags & LOOKUP_RCU)
+        return -ECHILD;
+    parent = dget_parent(dentry);
+    req.node = COLXFS_I(d_inode(parent))->node;
+    err = colxfs_name_call(&req, &dentry->d_name, &a);
+    dput(parent);
+    inode = d_inode(dentry);
+    if (err == -ENOENT && !inode) {
+        colxfs_set_entry_time(dentry);
+        return 1;
+    }
+    if (err)
+        return err == -EINTR ? err : 0;
+    if (!inode || COLXFS_I(inode)->node != a.node || ((inode->i_mode ^ a.mode) & S_IFMT)) {
+        colxfs_forget(a.node, 1);
+        return 0;
+    }
+    spin_lock(&inode->i_lock);
+    COLXFS_I(inode)->nlookup++;
+    spin_unlock(&inode->i_lock);
+    colxfs_apply_attr(inode, &a);
+    colxfs_set_entry_time(dentry);
+    return 1;
+}
+
+static const struct dentry_operations colxfs_dops = {
+    .d_revalidate = colxfs_d_revalidate,
+};
+
+static int colxfs_instantiate(struct inode *dir, struct dentry *dentry, struct colx_shfs_attr *a)
+{
+    struct inode *inode = colxfs_iget(dir->i_sb, a);
+
+    if (IS_ERR(inode))
+        return PTR_ERR(inode);
+    d_instantiate(dentry, inode);
+    colxfs_set_entry_time(dentry);
+    colxfs_invalidate_attr(dir);
+    return 0;
+}
+
+static int colxfs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry,
+                         umode_t mode, bool excl)
+{
+    struct colx_shfs_slot req = {
+        .op = COLX_SHFS_OP_CREATE, .node = COLXFS_I(dir)->node,
+        .arg = mode & 07777, .flags = O_RDWR | (excl ? O_EXCL : 0),
+    };
+    struct colx_shfs_attr a;
+    int err;
+
+    err = colxfs_name_call(&req, &dentry->d_name, &a);
+    if (err)
+        return err;
+    /* The file is opened again through ->open */
+    colxfs_release_fh(req.fh);
+    return colxfs_instantiate(dir, dentry, &a);
+}
+
+static int colxfs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry,
+                        umode_t mode)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_MKDIR, .node = COLXFS_I(dir)->node, .arg = mode & 07777 };
+    struct colx_shfs_attr a;
+    int err;
+
+    err = colxfs_name_call(&req, &dentry->d_name, &a);
+    if (err)
+        return err;
+    return colxfs_instantiate(dir, dentry, &a);
+}
+
+static int colxfs_remove(struct inode *dir, struct dentry *dentry, u32 op)
+{
+    struct colx_shfs_slot req = { .op = op, .node = COLXFS_I(dir)->node };
+    struct inode *inode = d_inode(dentry);
+    int err;
+
+    err = colxfs_name_call(&req, &dentry->d_name, NULL);
+    if (err)
+        return err;
+    if (op == COLX_SHFS_OP_RMDIR)
+        clear_nlink(inode);
+    else
+        drop_nlink(inode);
+    colxfs_invalidate_attr(inode);
+    colxfs_invalidate_attr(dir);
+    return 0;
+}
+
+static int colxfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    return colxfs_remove(dir, dentry, COLX_SHFS_OP_UNLINK);
+}
+
+static int colxfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    return colxfs_remove(dir, dentry, COLX_SHFS_OP_RMDIR);
+}
+
+static int colxfs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
+                         struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+    const struct qstr *from = &old_dentry->d_name, *to = &new_dentry->d_name;
+    struct colx_shfs_slot req = {
+        .op = COLX_SHFS_OP_RENAME, .node = COLXFS_I(old_dir)->node, .arg = COLXFS_I(new_dir)->node,
+    };
+    struct inode *target = d_inode(new_dentry);
+    struct colxfs_call c;
+    int err;
+
+    /* The host's rename replaces; it can neither refuse to nor exchange */
+    if (flags)
+        return -EINVAL;
+    if (from->len > COLX_SHFS_NAME_MAX || to->len > COLX_SHFS_NAME_MAX)
+        return -ENAMETOOLONG;
+    err = colxfs_begin(&c);
+    if (err)
+        return err;
+    memcpy_toio(c.win, from->name, from->len);
+    writeb(0, (char __iomem *)c.win + from->len);
+    memcpy_toio((char __iomem *)c.win + from->len + 1, to->name, to->len);
+    req.len = from->len + 1 + to->len;
+    err = colxfs_submit(&c, &req);
+    colxfs_end(&c);
+    if (err)
+        return err;
+    if (target) {
+        if (S_ISDIR(target->i_mode))
+            clear_nlink(target);
+        else
+            drop_nlink(target);
+        colxfs_invalidate_attr(target);
+    }
+    colxfs_invalidate_attr(d_inode(old_dentry));
+    colxfs_invalidate_attr(old_dir);
+    colxfs_invalidate_attr(new_dir);
+    return 0;
+}
+
+static int colxfs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *iattr)
+{
+    struct inode *inode = d_inode(dentry);
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_SETATTR, .node = COLXFS_I(inode)->node };
+    struct colx_shfs_attr a = {};
+    int err;
+
+    err = setattr_prepare(&init_user_ns, dentry, iattr);
+    if (err)
+        return err;
+    /* Ownership is the mount's uid= / gid= */
+    if (iattr->ia_valid & (ATTR_UID | ATTR_GID))
+        return -EPERM;
+    if (iattr->ia_valid & ATTR_MODE) {
+        req.flags |= COLX_SHFS_SET_MODE;
+        a.mode = iattr->ia_mode;
+    }
+    if (iattr->ia_valid & ATTR_SIZE) {
+        req.flags |= COLX_SHFS_SET_SIZE;
+        a.size = iattr->ia_size;
+    }
+    if (iattr->ia_valid & ATTR_MTIME) {
+        req.flags |= COLX_SHFS_SET_MTIME;
+        a.mtime_ns = timespec64_to_ns(&iattr->ia_mtime);
+    }
+    if (!req.flags)
+        return 0;
+    err = colxfs_call(&req, &a, sizeof(a), &a, sizeof(a));
+    if (err)
+        return err;
+    if (iattr->ia_valid & ATTR_SIZE)
+        truncate_pagecache(inode, a.size);
+    colxfs_apply_attr(inode, &a);
+    return 0;
+}
+
+static int colxfs_getattr(struct user_namespace *mnt_userns, const struct path *path, struct kstat *stat,
+                          u32 request_mask, unsigned int flags)
+{
+    struct inode *inode = d_inode(path->dentry);
+    int err = 0;
+
+    if (flags & AT_STATX_FORCE_SYNC)
+        err = colxfs_refresh(inode);
+    else if (!(flags & AT_STATX_DONT_SYNC))
+        err = colxfs_revalidate_attr(inode);
+    if (err)
+        return err;
+    generic_fillattr(&init_user_ns, inode, stat);
+    return 0;
+}
+
+static const struct inode_operations colxfs_dir_iops = {
+    .lookup  = colxfs_lookup,
+    .create  = colxfs_create,
+    .mkdir   = colxfs_mkdir,
+    .unlink  = colxfs_unlink,
+    .rmdir   = colxfs_rmdir,
+    .rename  = colxfs_rename,
+    .setattr = colxfs_setattr,
+    .getattr = colxfs_getattr,
+};
+
+static const struct inode_operations colxfs_file_iops = {
+    .setattr = colxfs_setattr,
+    .getattr = colxfs_getattr,
+};
+
+static int colxfs_open(struct inode *inode, struct file *file)
+{
+    /* The VFS truncates through ->setattr after open */
+    struct colx_shfs_slot req = {
+        .op = COLX_SHFS_OP_OPEN, .node = COLXFS_I(inode)->node,
+        .flags = file->f_flags & (O_ACCMODE | O_APPEND),
+    };
+    int err;
+
+    /* Close-to-open: size and mtime as of now */
+    if (S_ISREG(inode->i_mode)) {
+        err = colxfs_refresh(inode);
+        if (err)
+            return err;
+    }
+    err = colxfs_call(&req, NULL, 0, NULL, 0);
+    if (err)
+        return err;
+    file->private_data = (void *)(uintptr_t)req.fh;
+    return 0;
+}
+
+static int colxfs_release(struct inode *inode, struct file *file)
+{
+    colxfs_release_fh(colxfs_fh(file));
+    return 0;
+}
+
+static ssize_t colxfs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct colx_shfs_slot req;
+    struct colxfs_call c;
+    ssize_t done = 0;
+    int err = 0;
+
+    while (iov_iter_count(to)) {
+        u32 want = min_t(size_t, iov_iter_count(to), geom.shfs_slot_stride);
+        size_t got = 0;
+
+        err = colxfs_begin(&c);
+        if (err)
+            break;
+        req = (struct colx_shfs_slot){
+            .op = COLX_SHFS_OP_READ, .fh = colxfs_fh(iocb->ki_filp), .offset = iocb->ki_pos, .len = want,
+        };
+        err = colxfs_submit(&c, &req);
+        /* The host read into the window: one copy, straight to the caller */
+        if (!err) {
+            req.len = min(req.len, want);
+            got = copy_to_iter((const void __force *)c.win, req.len, to);
+            if (got < req.len)
+                err = -EFAULT;
+        }
+        colxfs_end(&c);
+        iocb->ki_pos += got;
+        done += got;
+        if (err || req.len < want)
+            break;
+    }
+    return done ? done : err;
+}
+
+static ssize_t colxfs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    struct colx_shfs_slot req;
+    struct colxfs_call c;
+    ssize_t done = 0, ret;
+    loff_t start;
+    int err = 0;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    start = iocb->ki_pos;
+    while (iov_iter_count(from)) {
+        u32 len = min_t(size_t, iov_iter_count(from), geom.shfs_slot_stride);
+
+        err = colxfs_begin(&c);
+        if (err)
+            break;
+        len = copy_from_iter((void __force *)c.win, len, from);
+        if (!len) {
+            colxfs_end(&c);
+            err = -EFAULT;
+            break;
+        }
+        req = (struct colx_shfs_slot){
+            .op = COLX_SHFS_OP_WRITE, .fh = colxfs_fh(file), .offset = iocb->ki_pos, .len = len,
+        };
+        err = colxfs_submit(&c, &req);
+        colxfs_end(&c);
+        if (err) {
+            iov_iter_revert(from, len);
+            break;
+        }
+        /* arg is the host's file size; an O_APPEND write landed at its end */
+        i_size_write(inode, req.arg);
+        iocb->ki_pos = (file->f_flags & O_APPEND) ? req.arg : iocb->ki_pos + req.len;
+        done += req.len;
+    }
+    if (done) {
+        invalidate_inode_pages2_range(inode->i_mapping, start >> PAGE_SHIFT, -1);
+        colxfs_invalidate_attr(inode);
+    }
+    ret = done ? done : err;
+out:
+    inode_unlock(inode);
+    return ret;
+}
+
+static loff_t colxfs_llseek(struct file *file, loff_t offset, int whence)
+{
+    int err;
+
+    if (whence == SEEK_END || whence == SEEK_DATA || whence == SEEK_HOLE) {
+        err = colxfs_refresh(file_inode(file));
+        if (err)
+            return err;
+    }
+    return generic_file_llseek(file, offset, whence);
+}
+
+static int colxfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_FSYNC, .fh = colxfs_fh(file) };
+
+    return colxfs_call(&req, NULL, 0, NULL, 0);
+}
+
+/* mmap faults: one page from the host */
+static int colxfs_readpage(struct file *file, struct page *page)
+{
+    struct colx_shfs_slot req = {
+        .op = COLX_SHFS_OP_READ, .fh = colxfs_fh(file), .offset = page_offset(page), .len = PAGE_SIZE,
+    };
+    struct colxfs_call c;
+    void *dst;
+    int err;
+
+    err = colxfs_begin(&c);
+    if (!err) {
+        err = colxfs_submit(&c, &req);
+        if (!err) {
+            req.len = min_t(u32, req.len, PAGE_SIZE);
+            dst = kmap_local_page(page);
+            memcpy_fromio(dst, c.win, req.len);
+            memset(dst + req.len, 0, PAGE_SIZE - req.len);
+            kunmap_local(dst);
+            flush_dcache_page(page);
+            SetPageUptodate(page);
+        }
+        colxfs_end(&c);
+    }
+    if (err)
+        SetPageError(page);
+    unlock_page(page);
+    return err;
+}
+
+static const struct address_space_operations colxfs_aops = {
+    .readpage = colxfs_readpage,
+};
+
+static const struct file_operations colxfs_file_fops = {
+    .owner       = THIS_MODULE,
+    .open        = colxfs_open,
+    .release     = colxfs_release,
+    .read_iter   = colxfs_read_iter,
+    .write_iter  = colxfs_write_iter,
+    .llseek      = colxfs_llseek,
+    .fsync       = colxfs_fsync,
+    /* Shared writable mappings would need page writeback: not offered */
+    .mmap        = generic_file_readonly_mmap,
+    .splice_read = generic_file_splice_read,
+};
+
+/*
+ * Records from the host's snapshot of the directory, taken at open; ctx->pos
+ * is the host's resume cookie (0 and 1 are the dots).
+ */
+static int colxfs_readdir(struct file *file, struct dir_context *ctx)
+{
+    struct colx_shfs_slot req;
+    struct colxfs_call c;
+    bool full = false;
+    u32 pos;
+    int err;
+
+    if (!dir_emit_dots(file, ctx))
+        return 0;
+    while (!full) {
+        err = colxfs_begin(&c);
+        if (err)
+            return err;
+        req = (struct colx_shfs_slot){ .op = COLX_SHFS_OP_READDIR, .fh = colxfs_fh(file), .offset = ctx->pos };
+        err = colxfs_submit(&c, &req);
+        if (err || !req.len) {
+            colxfs_end(&c);
+            return err;
+        }
+        for (pos = 0; pos + sizeof(struct colx_shfs_dirent) <= req.len;) {
+            /* Ordinary shared RAM, ours until colxfs_end (see colx_tty.c) */
+            const struct colx_shfs_dirent *d = (const void __force *)((char __iomem *)c.win + pos);
+            u32 namelen = d->namelen;
+            u32 reclen = ALIGN(sizeof(*d) + namelen, 8);
+
+            if (!namelen || namelen > COLX_SHFS_NAME_MAX || pos + reclen > req.len) {
+                err = -EIO;
+                break;
+            }
+            if (!dir_emit(ctx, d->name, namelen, d->ino, d->type)) {
+                full = true;
+                break;
+            }
+            ctx->pos = d->next;
+            pos += reclen;
+        }
+        colxfs_end(&c);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static const struct file_operations colxfs_dir_fops = {
+    .owner          = THIS_MODULE,
+    .open           = colxfs_open,
+    .release        = colxfs_release,
+    .iterate_shared = colxfs_readdir,
+    .llseek         = generic_file_llseek,
+    .read           = generic_read_dir,
+    .fsync          = colxfs_fsync,
+};
+
+static struct inode *colxfs_alloc_inode(struct super_block *sb)
+{
+    struct colxfs_inode *ci = kmem_cache_alloc(inode_cache, GFP_KERNEL);
+
+    if (!ci)
+        return NULL;
+    ci->node = 0;
+    ci->nlookup = 0;
+    ci->attr_expires = jiffies;
+    return &ci->vfs_inode;
+}
+
+static void colxfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(inode_cache, COLXFS_I(inode));
+}
+
+static void colxfs_evict_inode(struct inode *inode)
+{
+    struct colxfs_inode *ci = COLXFS_I(inode);
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    if (ci->nlookup && ci->node != COLX_SHFS_ROOT)
+        colxfs_forget(ci->node, ci->nlookup);
+}
+
+static int colxfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_STATFS };
+    struct colx_shfs_statfs st;
+    int err;
+
+    err = colxfs_call(&req, NULL, 0, &st, sizeof(st));
+    if (err)
+        return err;
+    buf->f_type = COLXFS_MAGIC;
+    buf->f_bsize = st.bsize;
+    buf->f_blocks = st.blocks;
+    buf->f_bfree = st.bfree;
+    buf->f_bavail = st.bavail;
+    buf->f_files = st.files;
+    buf->f_ffree = st.ffree;
+    buf->f_namelen = st.namelen;
+    return 0;
+}
+
+static int colxfs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct colxfs_sb *sbi = COLXFS_SB(root->d_sb);
+
+    seq_printf(m, ",attr_timeout=%u,entry_timeout=%u",
+               jiffies_to_msecs(sbi->attr_timeout), jiffies_to_msecs(sbi->entry_timeout));
+    if (!uid_eq(sbi->uid, GLOBAL_ROOT_UID))
+        seq_printf(m, ",uid=%u", from_kuid_munged(&init_user_ns, sbi->uid));
+    if (!gid_eq(sbi->gid, GLOBAL_ROOT_GID))
+        seq_printf(m, ",gid=%u", from_kgid_munged(&init_user_ns, sbi->gid));
+    return 0;
+}
+
+static const struct super_operations colxfs_sops = {
+    .alloc_inode  = colxfs_alloc_inode,
+    .free_inode   = colxfs_free_inode,
+    .evict_inode  = colxfs_evict_inode,
+    .statfs       = colxfs_statfs,
+    .show_options = colxfs_show_options,
+};
+
+enum { Opt_attr_timeout, Opt_entry_timeout, Opt_uid, Opt_gid };
+
+static const struct fs_parameter_spec colxfs_params[] = {
+    fsparam_u32("attr_timeout",  Opt_attr_timeout),
+    fsparam_u32("entry_timeout", Opt_entry_timeout),
+    fsparam_u32("uid",           Opt_uid),
+    fsparam_u32("gid",           Opt_gid),
+    {}
+};
+
+static int colxfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+    struct colxfs_sb *sbi = fc->s_fs_info;
+    struct fs_parse_result result;
+    int opt;
+
+    opt = fs_parse(fc, colxfs_params, param, &result);
+    if (opt < 0)
+        return opt;
+    switch (opt) {
+    case Opt_attr_timeout:
+        sbi->attr_timeout = msecs_to_jiffies(result.uint_32);
+        break;
+    case Opt_entry_timeout:
+        sbi->entry_timeout = msecs_to_jiffies(result.uint_32);
+        break;
+    case Opt_uid:
+        sbi->uid = make_kuid(current_user_ns(), result.uint_32);
+        if (!uid_valid(sbi->uid))
+            return invalfc(fc, "Invalid uid");
+        break;
+    case Opt_gid:
+        sbi->gid = make_kgid(current_user_ns(), result.uint_32);
+        if (!gid_valid(sbi->gid))
+            return invalfc(fc, "Invalid gid");
+        break;
+    }
+    return 0;
+}
+
+static int colxfs_fill_super(struct super_block *sb, struct fs_context *fc)
+{
+    struct colx_shfs_slot req = { .op = COLX_SHFS_OP_GETATTR, .node = COLX_SHFS_ROOT };
+    struct colx_shfs_attr a;
+    struct inode *root;
+    int err;
+
+    sb->s_magic = COLXFS_MAGIC;
+    sb->s_op = &colxfs_sops;
+    sb->s_d_op = &colxfs_dops;
+    sb->s_maxbytes = MAX_LFS_FILESIZE;
+    sb->s_blocksize = PAGE_SIZE;
+    sb->s_blocksize_bits = PAGE_SHIFT;
+    sb->s_time_gran = 1;
+    err = colxfs_call(&req, NULL, 0, &a, sizeof(a));
+    if (err)
+        return err;
+    if (!S_ISDIR(a.mode))
+        return -ENOTDIR;
+    root = colxfs_iget(sb, &a);
+    if (IS_ERR(root))
+        return PTR_ERR(root);
+    sb->s_root = d_make_root(root);
+    return sb->s_root ? 0 : -ENOMEM;
+}
+
+static int colxfs_get_tree(struct fs_context *fc)
+{
+    return get_tree_nodev(fc, colxfs_fill_super);
+}
+
+static void colxfs_free_fc(struct fs_context *fc)
+{
+    kfree(fc->s_fs_info);
+}
+
+static const struct fs_context_operations colxfs_context_ops = {
+    .parse_param = colxfs_parse_param,
+    .get_tree    = colxfs_get_tree,
+    .free        = colxfs_free_fc,
+};
+
+static int colxfs_init_fs_context(struct fs_context *fc)
+{
+    struct colxfs_sb *sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+
+    if (!sbi)
+        return -ENOMEM;
+    sbi->attr_timeout = msecs_to_jiffies(COLXFS_DEFAULT_TIMEOUT_MS);
+    sbi->entry_timeout = msecs_to_jiffies(COLXFS_DEFAULT_TIMEOUT_MS);
+    sbi->uid = GLOBAL_ROOT_UID;
+    sbi->gid = GLOBAL_ROOT_GID;
+    fc->s_fs_info = sbi;
+    fc->ops = &colxfs_context_ops;
+    return 0;
+}
+
+static void colxfs_kill_sb(struct super_block *sb)
+{
+    struct colxfs_sb *sbi = COLXFS_SB(sb);
+
+    kill_anon_super(sb);
+    kfree(sbi);
+}
+
+static struct file_system_type colxfs_type = {
+    .owner           = THIS_MODULE,
+    .name            = "colxfs",
+    .init_fs_context = colxfs_init_fs_context,
+    .parameters      = colxfs_params,
+    .kill_sb         = colxfs_kill_sb,
+};
+MODULE_ALIAS_FS("colxfs");
+
+static void colxfs_inode_init_once(void *p)
+{
+    inode_init_once(&((struct colxfs_inode *)p)->vfs_inode);
+}
+
+static void colx_fs_free_ring(void)
+{
+    bitmap_free(ring.busy); ring.busy = NULL;
+    bitmap_free(ring.ready); ring.ready = NULL;
+    bitmap_free(ring.abandoned); ring.abandoned = NULL;
+}
+
+static int __init colx_fs_init(void)
+{
+    u32 seq, cons;
+    int ret;
+
+    if (!colx_base || !colx_size)
+        return -EINVAL;
+    io = ioremap(colx_base, colx_size);
+    if (!io) return -ENOMEM;
+    ret = colx_read_geom(io, colx_size, &geom, &ctrl_layout);
+    if (ret || !geom.shfs_ring_cap) {
+        pr_err("colx_fs: no shared-folder ring in the shared mapping\n");
+        ret = ret ?: -ENODEV;
+        goto err_unmap;
+    }
+    spin_lock_init(&ring.lock);
+    init_waitqueue_head(&ring.free_wq);
+    ring.cap = geom.shfs_ring_cap;
+    ring.busy = bitmap_zalloc(ring.cap, GFP_KERNEL);
+    ring.ready = bitmap_zalloc(ring.cap, GFP_KERNEL);
+    ring.abandoned = bitmap_zalloc(ring.cap, GFP_KERNEL);
+    if (!ring.busy || !ring.ready || !ring.abandoned) { ret = -ENOMEM; goto err_ring; }
+    /* A previous load may have left requests with the host: let them drain */
+    ring.prod = ring.published = readl(&colxfs_ctrl()->prod);
+    cons = readl(colxfs_cons());
+    if ((s32)(ring.prod - cons) < 0 || ring.prod - cons > ring.cap) {
+        pr_err("colx_fs: shared-folder ring indices are corrupt\n");
+        ret = -EIO;
+        goto err_ring;
+    }
+    for (seq = cons; seq != ring.prod; seq++) {
+        __set_bit(seq & (ring.cap - 1), ring.busy);
+        __set_bit(seq & (ring.cap - 1), ring.abandoned);
+    }
+
+    inode_cache = kmem_cache_create("colxfs_inode", sizeof(struct colxfs_inode), 0,
+                                    SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT, colxfs_inode_init_once);
+    if (!inode_cache) { ret = -ENOMEM; goto err_ring; }
+    ret = register_filesystem(&colxfs_type);
+    if (ret) goto err_cache;
+    pr_info("colx_fs: colxfs ready (%u requests in flight, %u KiB per request)\n",
+            ring.cap, geom.shfs_slot_stride / 1024);
+    return 0;
+
+err_cache:
+    kmem_cache_destroy(inode_cache); inode_cache = NULL;
+err_ring:
+    colx_fs_free_ring();
+err_unmap:
+    iounmap(io); io = NULL;
+    return ret;
+}
+
+static void __exit colx_fs_exit(void)
+{
+    unregister_filesystem(&colxfs_type);
+    /* Inodes are freed after an RCU grace period */
+    rcu_barrier();
+    kmem_cache_destroy(inode_cache); inode_cache = NULL;
+    colx_fs_free_ring();
+    if (io) { iounmap(io); io = NULL; }
+}
+
+module_init(colx_fs_init);
+module_exit(colx_fs_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("coLinux shared folder (prototype)");
+MODULE_AUTHOR("coLinux 2.0");
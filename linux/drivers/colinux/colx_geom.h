@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _COLX_GEOM_H
+#define _COLX_GEOM_H
+
+#include <linux/io.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <uapi/linux/colinux_ring.h>
+
+/* Where a ring's consumer index and slots sit inside its control block */
+struct colx_ctrl_layout {
+    u32 cons_off;
+    u32 slots_off;
+};
+
+/*
+ * Read the geometry descriptor the host published at map time. Hosts that
+ * predate it get the legacy fixed layout (rings then end at the first cap of
+ * 0) and its packed control block; hosts without the channel table get one
+ * VTTY channel, the console, and older hosts no shared folder, NIC or
+ * request tracer. Every offset is checked against the mapping, so callers
+ * may trust the result.
+ * Returns -EINVAL if the descriptor is malformed. `cl` may be NULL.
+ */
+static inline int colx_read_geom(void __iomem *io, unsigned long size, struct colx_geom *g,
+                                 struct colx_ctrl_layout *cl)
+{
+    struct colx_ctrl_layout layout = {
+        .cons_off = offsetof(struct colx_ring_ctrl, cons),
+        .slots_off = sizeof(struct colx_ring_ctrl),
+    };
+    u64 span, end;
+    u32 i;
+
+    memset(g, 0, sizeof(*g));
+    if (size < COLX_GEOM_OFF + sizeof(*g))
+        return -EINVAL;
+    if (readl((char __iomem *)io + COLX_GEOM_OFF) != COLX_GEOM_MAGIC) {
+        g->features = readl(&((struct colx_ring_hdr __iomem *)io)->flags);
+        g->vblk_queues = COLX_VBLK_MAX_QUEUES;
+        g->vblk_ring_cap = COLX_VBLK_RING_CAP;
+        g->vblk_slot_size = sizeof(struct colx_vblk_slot);
+        g->vblk_slot_stride = COLX_VBLK_SLOT_DATA_STRIDE;
+        g->vblk_ring_stride = COLX_VBLK_RING_STRIDE;
+        g->vblk_ring_off = COLX_VBLK_RING_OFF;
+        g->vblk_data_off = COLX_VBLK_DATA_OFF;
+        g->vblk_queue_stride = COLX_VBLK_QUEUE_STRIDE;
+        g->vtty_tx_off = COLX_VTTY_TX_OFF;
+        g->vtty_rx_off = COLX_VTTY_RX_OFF;
+        g->vtty_cap = COLX_VTTY_CAP;
+        g->vtty_channels = 1;
+        g->vtty_chan[0] = (struct colx_vtty_chan){
+            .tx_off = g->vtty_tx_off, .rx_off = g->vtty_rx_off, .cap = g->vtty_cap,
+        };
+        if (cl) {
+            cl->cons_off = offsetof(struct colx_ring_ctrl_legacy, cons);
+            cl->slots_off = sizeof(struct colx_ring_ctrl_legacy);
+        }
+        /* Legacy hosts size nothing: keep only the queues the mapping holds */
+        while (g->vblk_queues &&
+               g->vblk_data_off + (u64)g->vblk_queues * g->vblk_queue_stride > size)
+            g->vblk_queues--;
+        return 0;
+    }
+
+    memcpy_fromio(g, (char __iomem *)io + COLX_GEOM_OFF, sizeof(*g));
+    if (g->ver != COLX_GEOM_VER_1 || g->size < COLX_GEOM_SIZE_V1)
+        return -EINVAL;
+    if (g->size < COLX_GEOM_SIZE_TRACE)
+        memset((char *)g + COLX_GEOM_SIZE_VNET, 0, sizeof(*g) - COLX_GEOM_SIZE_VNET);
+    if (g->size < COLX_GEOM_SIZE_VNET)
+        memset((char *)g + COLX_GEOM_SIZE_SHFS, 0, sizeof(*g) - COLX_GEOM_SIZE_SHFS);
+    if (g->size < COLX_GEOM_SIZE_SHFS)
+        memset((char *)g + COLX_GEOM_SIZE_CHAN, 0, sizeof(*g) - COLX_GEOM_SIZE_CHAN);
+    if (g->size < COLX_GEOM_SIZE_CHAN) {
+        /* Older host: one channel, the rings the v1 fields describe */
+        memset((char *)g + COLX_GEOM_SIZE_V1, 0, sizeof(*g) - COLX_GEOM_SIZE_V1);
+        if (g->vtty_cap) {
+            g->vtty_channels = 1;
+            g->vtty_chan[0] = (struct colx_vtty_chan){
+                .tx_off = g->vtty_tx_off, .rx_off = g->vtty_rx_off, .cap = g->vtty_cap,
+            };
+        }
+    }
+    if (g->vblk_queues) {
+        if (g->vblk_queues > COLX_VBLK_MAX_QUEUES ||
+            !is_power_of_2(g->vblk_ring_cap) || g->vblk_ring_cap > COLX_VBLK_MAX_RING_CAP ||
+            g->vblk_slot_size != sizeof(struct colx_vblk_slot) ||
+            !g->vblk_slot_stride || (g->vblk_slot_stride & 511) ||
+            g->vblk_slot_stride > COLX_VBLK_MAX_SLOT_STRIDE ||
+            g->vblk_ring_stride < layout.slots_off + g->vblk_ring_cap * sizeof(struct colx_vblk_slot) ||
+            g->vblk_queue_stride < (u64)g->vblk_ring_cap * g->vblk_slot_stride)
+            return -EINVAL;
+        if (check_add_overflow(g->vblk_ring_off, (u64)g->vblk_queues * g->vblk_ring_stride, &end) ||
+            end > size)
+            return -EINVAL;
+        /* Slot data_off is 32-bit */
+        if (check_mul_overflow(g->vblk_queue_stride, (u64)g->vblk_queues, &span) || span > U32_MAX ||
+            check_add_overflow(g->vblk_data_off, span, &end) || end > size)
+            return -EINVAL;
+    }
+    /* Channel 0 is the v1 console ring pair; absent channels have cap 0 */
+    if (g->vtty_channels > COLX_VTTY_MAX_CHANNELS || !g->vtty_channels != !g->vtty_cap ||
+        (g->vtty_channels && (g->vtty_chan[0].tx_off != g->vtty_tx_off ||
+                              g->vtty_chan[0].rx_off != g->vtty_rx_off ||
+                              g->vtty_chan[0].cap != g->vtty_cap)))
+        return -EINVAL;
+    for (i = 0; i < g->vtty_channels; i++) {
+        const struct colx_vtty_chan *c = &g->vtty_chan[i];
+
+        if (!c->cap)
+            continue;
+        if (!is_power_of_2(c->cap) || c->cap > COLX_VTTY_MAX_CAP ||
+            check_add_overflow(c->tx_off, (u64)sizeof(struct colx_vtty_ring) + c->cap, &end) ||
+            end > size ||
+            check_add_overflow(c->rx_off, (u64)sizeof(struct colx_vtty_ring) + c->cap, &end) ||
+            end > size)
+            return -EINVAL;
+    }
+    if (g->shfs_ring_cap) {
+        if (!is_power_of_2(g->shfs_ring_cap) || g->shfs_ring_cap > COLX_SHFS_MAX_RING_CAP ||
+            g->shfs_slot_stride < COLX_SHFS_MIN_SLOT_STRIDE ||
+            g->shfs_slot_stride > COLX_SHFS_MAX_SLOT_STRIDE || (g->shfs_slot_stride & 4095) ||
+            (g->shfs_data_off & 4095) ||
+            check_add_overflow(g->shfs_ring_off, (u64)layout.slots_off +
+                               g->shfs_ring_cap * sizeof(struct colx_shfs_slot), &end) ||
+            end > size ||
+            check_add_overflow(g->shfs_data_off, (u64)g->shfs_ring_cap * g->shfs_slot_stride, &end) ||
+            end > size)
+            return -EINVAL;
+    }
+    if (g->vnet_ring_cap) {
+        if (!is_power_of_2(g->vnet_ring_cap) || g->vnet_ring_cap > COLX_VNET_MAX_RING_CAP ||
+            !g->vnet_buf_count || g->vnet_buf_count > g->vnet_ring_cap ||
+            g->vnet_buf_size < COLX_VNET_MIN_BUF_SIZE || g->vnet_buf_size > COLX_VNET_MAX_BUF_SIZE ||
+            (g->vnet_buf_size & 4095) || (g->vnet_pool_off & 4095) ||
+            g->vnet_ring_stride < layout.slots_off + g->vnet_ring_cap * sizeof(struct colx_vnet_desc) ||
+            check_add_overflow(g->vnet_off, 4096 + (u64)COLX_VNET_RINGS * g->vnet_ring_stride, &end) ||
+            end > size ||
+            check_add_overflow(g->vnet_pool_off, (u64)g->vnet_buf_count * g->vnet_buf_size, &end) ||
+            end > size)
+            return -EINVAL;
+    }
+    if (g->trace_cap) {
+        if (!is_power_of_2(g->trace_cap) || g->trace_cap > COLX_TRACE_MAX_CAP ||
+            (g->trace_off & (COLX_CACHELINE - 1)) ||
+            check_add_overflow(g->trace_off, sizeof(struct colx_trace_hdr) +
+                               (u64)g->trace_cap * sizeof(struct colx_trace_rec), &end) ||
+            end > size)
+            return -EINVAL;
+    }
+    if (cl)
+        *cl = layout;
+    return 0;
+}
+
+#endif /* _COLX_GEOM_H */
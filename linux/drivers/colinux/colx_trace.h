@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _COLX_TRACE_H
+#define _COLX_TRACE_H
+
+#include <linux/atomic.h>
+#include <linux/io.h>
+#include <linux/timex.h>
+#include <uapi/linux/colinux_ring.h>
+
+/*
+ * Guest side of the request tracer (struct colx_trace_hdr). The host lays the
+ * ring out and the daemon owns the clock; front-ends only append, and only
+ * while the daemon has switched it on with the TSC, the clock we share.
+ */
+struct colx_trace {
+    struct colx_trace_hdr __iomem *hdr; /* NULL: the host laid out no tracer */
+    struct colx_trace_rec __iomem *recs;
+    u32 mask;
+};
+
+/* Locate the ring in a descriptor colx_read_geom() has checked */
+static inline void colx_trace_init(struct colx_trace *t, void __iomem *io, const struct colx_geom *g)
+{
+    t->hdr = NULL;
+    if (!IS_ENABLED(CONFIG_X86) || !g->trace_cap)
+        return;
+    t->hdr = (void __iomem *)((char __iomem *)io + g->trace_off);
+    t->recs = (void __iomem *)((char __iomem *)t->hdr + sizeof(struct colx_trace_hdr));
+    t->mask = g->trace_cap - 1;
+}
+
+/* Append one record; a load and a branch while tracing is off */
+static inline void colx_trace(struct colx_trace *t, u16 event, u8 queue, u64 id, u32 arg, u32 arg2)
+{
+    struct colx_trace_rec __iomem *r;
+    u32 seq;
+
+    if (!t->hdr || readl_relaxed(&t->hdr->clock) != COLX_TRACE_CLOCK_TSC)
+        return;
+    /* The host claims records with a locked add on the same word */
+    seq = atomic_fetch_inc((atomic_t __force *)&t->hdr->head);
+    r = &t->recs[seq & t->mask];
+    writel(0, &r->seq);
+    writew_relaxed(event, &r->event);
+    writeb_relaxed(queue, &r->queue);
+    writeq_relaxed(get_cycles(), &r->ts);
+    writeq_relaxed(id, &r->id);
+    writel_relaxed(arg, &r->arg);
+    writel_relaxed(arg2, &r->arg2);
+    /* writel orders the fields before seq */
+    writel(seq + 1, &r->seq);
+}
+
+#endif /* _COLX_TRACE_H */
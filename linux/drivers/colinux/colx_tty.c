@@ -1,91 +1,290 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <linux/module.h>
+#include <linux/interrupt.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
 #include <linux/io.h>
 #include <linux/workqueue.h>
 #include <uapi/linux/colinux_ring.h>
+#include "colx_geom.h"
+#include "colx_trace.h"
 
 static unsigned long colx_base;
 static unsigned long colx_size;
+static int colx_irq;
+static unsigned int rx_poll_max_ms = 50;
 module_param(colx_base, ulong, 0644);
 module_param(colx_size, ulong, 0644);
+module_param(colx_irq, int, 0444);
+module_param(rx_poll_max_ms, uint, 0644);
 MODULE_PARM_DESC(colx_base, "Shared mapping base");
 MODULE_PARM_DESC(colx_size, "Shared mapping size");
+MODULE_PARM_DESC(colx_irq, "Interrupt the host raises on console traffic (0: poll only)");
+MODULE_PARM_DESC(rx_poll_max_ms, "Longest idle poll interval without the host interrupt");
+
+/* Poll intervals: one jiffy while bytes move; a slow safety net with the interrupt */
+#define COLX_TTY_POLL_MIN 1
+#define COLX_TTY_IRQ_POLL_MS 1000
 
 static void __iomem *io;
+static struct colx_geom geom; /* ring placement and size, from the host */
+static struct colx_trace trace;
 static struct tty_driver *drv;
 static struct workqueue_struct *wq;
 
+/* colx_tty_port.flags */
+#define COLX_TTY_TX_WAIT 0 /* a writer waits for ring space or for the ring to drain */
+
+/*
+ * One per VTTY channel (/dev/ttyCOLX<channel>). Each has its own rings, work
+ * item and flow control, so a bulk copy saturating its channel never delays
+ * console bytes.
+ */
 struct colx_tty_port {
     struct tty_port port;
-    struct delayed_work rx_work;
+    struct delayed_work work;   /* RX drain and TX wakeup */
+    struct colx_vtty_ring __iomem *rx; /* host->guest (the host's TX ring) */
+    struct colx_vtty_ring __iomem *tx; /* guest->host */
+    u32 cap;                    /* bytes per ring */
+    unsigned long delay;        /* next idle poll interval, jiffies */
+    unsigned long flags;
+    u32 seen;                   /* guest_doorbell at the start of the last pass */
+    bool present;
 };
 
-static struct colx_tty_port gport;
+static struct colx_tty_port ports[COLX_VTTY_MAX_CHANNELS];
+static bool use_irq;            /* the host interrupts us; polling is a fallback */
+
+static inline struct colx_ring_hdr __iomem *colx_hdr(void)
+{
+    return io;
+}
+
+static inline struct colx_vtty_ring __iomem *colx_vtty(u64 off)
+{
+    return (void __iomem *)((char __iomem *)io + off);
+}
+
+static u32 colx_tx_used(struct colx_tty_port *cp)
+{
+    return (readl(&cp->tx->head) - readl(&cp->tx->tail)) & (cp->cap - 1);
+}
+
+/*
+ * Wake a host sleeping in its doorbell wait. Unlike the block and folder
+ * rings, VTTY traffic is not in the host's pending-slot check, so the bump
+ * is unconditional: a busy host finds it at its next wait.
+ */
+static inline void colx_ring_doorbell(void)
+{
+    struct colx_ring_hdr __iomem *hdr = colx_hdr();
+    writel(readl(&hdr->doorbell) + 1, &hdr->doorbell);
+}
 
-static void vtty_rx_work(struct work_struct *ws)
+/*
+ * Move host->guest bytes into the flip buffer. Returns true if any moved.
+ * Bytes stay in the ring while nobody has the tty open or the flip buffer is
+ * full, so the host sees back-pressure instead of losing input.
+ */
+static bool colx_tty_rx(struct colx_tty_port *cp)
 {
-    struct colx_tty_port *cp = container_of(to_delayed_work(ws), struct colx_tty_port, rx_work);
     struct tty_port *port = &cp->port;
-    if (!io) return;
-    struct colx_vtty_ring __iomem *rx = (void __iomem *)((char __iomem *)io + COLX_VTTY_RX_OFF);
-    u32 head = readl(&rx->head), tail = readl(&rx->tail), cap = readl(&rx->cap); if (!cap) cap = COLX_VTTY_CAP;
+    struct colx_vtty_ring __iomem *rx = cp->rx;
+    u32 head = readl(&rx->head), tail = readl(&rx->tail), cap = cp->cap;
     u32 used = (head - tail) & (cap - 1);
-    if (used) {
-        u32 first = min(used, cap - (tail & (cap - 1)));
-        int room = tty_buffer_request_room(port->tty, used);
-        if (room > 0) {
-            u32 n = min_t(u32, room, used);
-            u32 f2 = min(n, first);
-            tty_insert_flip_string(port, (const unsigned char __force __iomem *)&rx->buf[tail & (cap - 1)], f2);
-            if (n > f2)
-                tty_insert_flip_string(port, (const unsigned char __force __iomem *)&rx->buf[0], n - f2);
-            writel((tail + n) & (cap - 1), &rx->tail);
-            tty_flip_buffer_push(port);
+    struct tty_struct *tty;
+    u32 n, first;
+    int room;
+
+    if (!used)
+        return false;
+    tty = tty_port_tty_get(port);
+    if (!tty)
+        return false;
+    /* The host stores the bytes before head */
+    dma_rmb();
+    room = tty_buffer_request_room(port, used);
+    n = room > 0 ? min_t(u32, room, used) : 0;
+    if (n) {
+        first = min(n, cap - (tail & (cap - 1)));
+        tty_insert_flip_string(port, (const unsigned char __force *)&rx->buf[tail & (cap - 1)], first);
+        if (n > first)
+            tty_insert_flip_string(port, (const unsigned char __force *)&rx->buf[0], n - first);
+        /* Finish reading before the host may reuse the space */
+        mb();
+        writel((tail + n) & (cap - 1), &rx->tail);
+        /* A host that filled the ring past half may be waiting for room */
+        if (used > cap / 2)
+            colx_ring_doorbell();
+        tty_flip_buffer_push(port);
+        colx_trace(&trace, COLX_TRACE_EV_VTTY_GUEST_RX, cp - ports, 0, n, 0);
+    }
+    tty_kref_put(tty);
+    return n != 0;
+}
+
+/*
+ * Queue the next pass. With the host interrupt, advertise guest_waiting and
+ * re-check the doorbell (the host may have bumped it before seeing the flag),
+ * then sleep on the safety-net poll. Without it, poll every jiffy while bytes
+ * move or a writer waits, doubling per idle pass up to rx_poll_max_ms.
+ */
+static void colx_tty_rearm(struct colx_tty_port *cp, bool active)
+{
+    struct colx_ring_hdr __iomem *hdr = colx_hdr();
+    unsigned long max;
+
+    if (use_irq) {
+        if (!active) {
+            writel(1, &hdr->guest_waiting);
+            mb();
+            active = readl(&hdr->guest_doorbell) != cp->seen;
+        }
+        queue_delayed_work(wq, &cp->work, active ? 0 : msecs_to_jiffies(COLX_TTY_IRQ_POLL_MS));
+        return;
+    }
+    max = max_t(unsigned long, msecs_to_jiffies(READ_ONCE(rx_poll_max_ms)), COLX_TTY_POLL_MIN);
+    if (active || test_bit(COLX_TTY_TX_WAIT, &cp->flags))
+        cp->delay = COLX_TTY_POLL_MIN;
+    else
+        cp->delay = min(cp->delay * 2, max);
+    queue_delayed_work(wq, &cp->work, cp->delay);
+}
+
+static void colx_tty_work(struct work_struct *ws)
+{
+    struct colx_tty_port *cp = container_of(to_delayed_work(ws), struct colx_tty_port, work);
+    struct colx_ring_hdr __iomem *hdr = colx_hdr();
+    bool active;
+
+    if (!io)
+        return;
+    cp->seen = readl(&hdr->guest_doorbell);
+    /* Ring updates the doorbell announced are visible past this point */
+    dma_rmb();
+
+    active = colx_tty_rx(cp);
+
+    /* The host drained our TX ring: let blocked writers and drain waiters run */
+    if (test_bit(COLX_TTY_TX_WAIT, &cp->flags)) {
+        u32 used = colx_tx_used(cp);
+        if (!used || cp->cap - 1 - used >= WAKEUP_CHARS) {
+            clear_bit(COLX_TTY_TX_WAIT, &cp->flags);
+            tty_port_tty_wakeup(&cp->port);
         }
     }
-    queue_delayed_work(wq, &cp->rx_work, msecs_to_jiffies(10));
+    colx_tty_rearm(cp, active);
+}
+
+/* The doorbell does not say which channel moved: give every channel a pass */
+static irqreturn_t colx_tty_interrupt(int irq, void *dev_id)
+{
+    struct colx_ring_hdr __iomem *hdr = colx_hdr();
+    u32 bell;
+    bool ours = false;
+    int i;
+
+    if (!io)
+        return IRQ_NONE;
+    bell = readl(&hdr->guest_doorbell);
+    /* The line may be shared: claim it only if the host signalled since a channel's last pass */
+    for (i = 0; i < COLX_VTTY_MAX_CHANNELS; i++)
+        ours |= ports[i].present && bell != READ_ONCE(ports[i].seen);
+    if (!ours)
+        return IRQ_NONE;
+    writel(0, &hdr->guest_waiting);
+    for (i = 0; i < COLX_VTTY_MAX_CHANNELS; i++)
+        if (ports[i].present)
+            mod_delayed_work(wq, &ports[i].work, 0);
+    return IRQ_HANDLED;
+}
+
+/* Ask for a wakeup once the host drains the TX ring */
+static void colx_tty_tx_wait(struct colx_tty_port *cp)
+{
+    if (!test_and_set_bit(COLX_TTY_TX_WAIT, &cp->flags) && !use_irq)
+        mod_delayed_work(wq, &cp->work, COLX_TTY_POLL_MIN);
 }
 
 static int colx_tty_open(struct tty_struct *tty, struct file *filp)
 {
-    tty->driver_data = &gport;
-    tty_port_tty_set(&gport.port, tty);
+    struct colx_tty_port *cp = &ports[tty->index];
+
+    if (!cp->present)
+        return -ENODEV;
+    tty->driver_data = cp;
+    tty_port_tty_set(&cp->port, tty);
+    /* Input may have queued while closed */
+    mod_delayed_work(wq, &cp->work, 0);
     return 0;
 }
 
 static void colx_tty_close(struct tty_struct *tty, struct file *filp)
 {
-    tty_port_tty_set(&gport.port, NULL);
+    struct colx_tty_port *cp = tty->driver_data;
+
+    if (cp)
+        tty_port_tty_set(&cp->port, NULL);
 }
 
+/* Writes what fits; the tty core retries the rest after our write wakeup */
 static int colx_tty_write(struct tty_struct *tty, const unsigned char *buf, int count)
 {
+    struct colx_tty_port *cp = tty->driver_data;
+    struct colx_vtty_ring __iomem *tx;
+    u32 head, tail, cap = cp->cap, n, first;
+
     if (!io) return -ENODEV;
-    struct colx_vtty_ring __iomem *tx = (void __iomem *)((char __iomem *)io + COLX_VTTY_TX_OFF);
-    u32 head = readl(&tx->head), tail = readl(&tx->tail), cap = readl(&tx->cap); if (!cap) cap = COLX_VTTY_CAP;
-    u32 used = (head - tail) & (cap - 1);
-    u32 free = cap - used - 1;
-    u32 n = min_t(u32, free, count);
-    u32 first = min(n, cap - (head & (cap - 1)));
-    memcpy_toio(&tx->buf[head & (cap - 1)], buf, first);
-    if (n > first)
-        memcpy_toio(&tx->buf[0], buf + first, n - first);
-    wmb();
-    writel((head + n) & (cap - 1), &tx->head);
+    tx = cp->tx;
+    head = readl(&tx->head);
+    tail = readl(&tx->tail);
+    n = min_t(u32, cap - 1 - ((head - tail) & (cap - 1)), count);
+    if (n) {
+        first = min(n, cap - (head & (cap - 1)));
+        memcpy_toio(&tx->buf[head & (cap - 1)], buf, first);
+        if (n > first)
+            memcpy_toio(&tx->buf[0], buf + first, n - first);
+        /* writel orders the bytes before the new head */
+        writel((head + n) & (cap - 1), &tx->head);
+        colx_ring_doorbell();
+        colx_trace(&trace, COLX_TRACE_EV_VTTY_GUEST_TX, cp - ports, 0, n, 0);
+    }
+    if (n < count)
+        colx_tty_tx_wait(cp);
     return n;
 }
 
 static unsigned int colx_tty_write_room(struct tty_struct *tty)
 {
+    struct colx_tty_port *cp = tty->driver_data;
+    u32 room;
+
     if (!io) return 0;
-    struct colx_vtty_ring __iomem *tx = (void __iomem *)((char __iomem *)io + COLX_VTTY_TX_OFF);
-    u32 head = readl(&tx->head), tail = readl(&tx->tail), cap = readl(&tx->cap); if (!cap) cap = COLX_VTTY_CAP;
-    u32 used = (head - tail) & (cap - 1);
-    u32 free = cap - used - 1;
-    return free;
+    room = cp->cap - 1 - colx_tx_used(cp);
+    if (!room)
+        colx_tty_tx_wait(cp);
+    return room;
+}
+
+/* Bytes the host has not pulled yet; lets close and tcdrain wait for them */
+static unsigned int colx_tty_chars_in_buffer(struct tty_struct *tty)
+{
+    u32 used;
+
+    if (!io) return 0;
+    used = colx_tx_used(tty->driver_data);
+    if (used)
+        colx_tty_tx_wait(tty->driver_data);
+    return used;
+}
+
+/* The line discipline has room again: pick up input left in the ring */
+static void colx_tty_unthrottle(struct tty_struct *tty)
+{
+    struct colx_tty_port *cp = tty->driver_data;
+
+    mod_delayed_work(wq, &cp->work, 0);
 }
 
 static const struct tty_operations ops = {
@@ -93,39 +292,112 @@ static const struct tty_operations ops = {
     .close = colx_tty_close,
     .write = colx_tty_write,
     .write_room = colx_tty_write_room,
+    .chars_in_buffer = colx_tty_chars_in_buffer,
+    .unthrottle = colx_tty_unthrottle,
 };
 
+static void colx_tty_remove_ports(void)
+{
+    int i;
+
+    for (i = 0; i < COLX_VTTY_MAX_CHANNELS; i++) {
+        struct colx_tty_port *cp = &ports[i];
+
+        if (!cp->present)
+            continue;
+        cancel_delayed_work_sync(&cp->work);
+        tty_unregister_device(drv, i);
+        tty_port_destroy(&cp->port);
+        cp->present = false;
+    }
+}
+
 static int __init colx_tty_init(void)
 {
+    struct device *dev;
+    int i, ret, n = 0;
+
     if (!colx_base || !colx_size)
         return -EINVAL;
     io = ioremap(colx_base, colx_size);
     if (!io) return -ENOMEM;
-    drv = tty_alloc_driver(1, TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV);
-    if (IS_ERR(drv)) { iounmap(io); io = NULL; return PTR_ERR(drv); }
+    if (colx_read_geom(io, colx_size, &geom, NULL) || !geom.vtty_channels) {
+        pr_err("colx_tty: no VTTY rings in the shared mapping\n");
+        iounmap(io); io = NULL;
+        return -ENODEV;
+    }
+    colx_trace_init(&trace, io, &geom);
+    /* Unbound and not ordered: each channel's work runs independently */
+    wq = alloc_workqueue("colx_tty", WQ_UNBOUND|WQ_MEM_RECLAIM, 0);
+    if (!wq) { iounmap(io); io = NULL; return -ENOMEM; }
+    drv = tty_alloc_driver(COLX_VTTY_MAX_CHANNELS, TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV);
+    if (IS_ERR(drv)) { ret = PTR_ERR(drv); goto err_wq; }
     drv->driver_name = "colx_tty";
     drv->name = "ttyCOLX";
     drv->major = 0; drv->minor_start = 0;
     drv->type = TTY_DRIVER_TYPE_CONSOLE;
     drv->init_termios = tty_std_termios;
     tty_set_operations(drv, &ops);
-    tty_port_init(&gport.port);
-    if (tty_register_driver(drv)) { put_tty_driver(drv); tty_port_destroy(&gport.port); iounmap(io); io = NULL; return -EINVAL; }
-    tty_port_register_device(&gport.port, drv, 0, NULL);
-    wq = alloc_workqueue("colx_tty", WQ_UNBOUND|WQ_MEM_RECLAIM, 1);
-    INIT_DELAYED_WORK(&gport.rx_work, vtty_rx_work);
-    queue_delayed_work(wq, &gport.rx_work, msecs_to_jiffies(10));
-    pr_info("colx_tty: /dev/ttyCOLX0 registered\n");
+    ret = tty_register_driver(drv);
+    if (ret) { put_tty_driver(drv); goto err_wq; }
+
+    for (i = 0; i < geom.vtty_channels; i++) {
+        const struct colx_vtty_chan *c = &geom.vtty_chan[i];
+        struct colx_tty_port *cp = &ports[i];
+
+        if (!c->cap)
+            continue;
+        tty_port_init(&cp->port);
+        INIT_DELAYED_WORK(&cp->work, colx_tty_work);
+        cp->rx = colx_vtty(c->tx_off);
+        cp->tx = colx_vtty(c->rx_off);
+        cp->cap = c->cap;
+        cp->delay = COLX_TTY_POLL_MIN;
+        dev = tty_port_register_device(&cp->port, drv, i, NULL);
+        if (IS_ERR(dev)) {
+            pr_warn("colx_tty: ttyCOLX%d: %ld\n", i, PTR_ERR(dev));
+            tty_port_destroy(&cp->port);
+            continue;
+        }
+        cp->present = true;
+        n++;
+    }
+    if (!n) { ret = -ENODEV; goto err_driver; }
+
+    /* Interrupt-driven only if the host both supports and was given a line */
+    if (colx_irq > 0 && (geom.features & COLX_HDR_F_GUEST_IRQ)) {
+        if (request_irq(colx_irq, colx_tty_interrupt, IRQF_SHARED, "colx_tty", ports))
+            pr_warn("colx_tty: irq %d unavailable, polling\n", colx_irq);
+        else
+            use_irq = true;
+    }
+    for (i = 0; i < COLX_VTTY_MAX_CHANNELS; i++)
+        if (ports[i].present) {
+            pr_info("colx_tty: /dev/ttyCOLX%d registered (%u KiB rings)\n", i, ports[i].cap / 1024);
+            queue_delayed_work(wq, &ports[i].work, 0);
+        }
+    pr_info("colx_tty: %d channel(s), %s\n", n, use_irq ? "interrupt driven" : "polled");
     return 0;
+
+err_driver:
+    tty_unregister_driver(drv);
+    put_tty_driver(drv);
+err_wq:
+    destroy_workqueue(wq); wq = NULL;
+    iounmap(io); io = NULL;
+    return ret;
 }
 
 static void __exit colx_tty_exit(void)
 {
-    cancel_delayed_work_sync(&gport.rx_work);
+    if (use_irq) {
+        writel(0, &colx_hdr()->guest_waiting);
+        free_irq(colx_irq, ports);
+        use_irq = false;
+    }
+    colx_tty_remove_ports();
     if (wq) { destroy_workqueue(wq); wq = NULL; }
-    tty_unregister_device(drv, 0);
     tty_unregister_driver(drv);
-    tty_port_destroy(&gport.port);
     put_tty_driver(drv);
     if (io) { iounmap(io); io = NULL; }
 }
@@ -135,4 +407,3 @@ module_exit(colx_tty_exit);
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("coLinux vtty front-end (prototype)");
 MODULE_AUTHOR("coLinux 2.0");
-
@@ -5,7 +5,12 @@
 #include <linux/hdreg.h>
 #include <linux/vmalloc.h>
 #include <linux/io.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <uapi/linux/colinux_ring.h>
+#include "colx_geom.h"
+#include "colx_trace.h"
 
 static unsigned long colx_base;
 static unsigned long colx_size;
@@ -17,96 +22,454 @@ MODULE_PARM_DESC(colx_size, "Shared mapping size");
 static void __iomem *io;
 static struct gendisk *gd;
 static struct request_queue *q;
+static struct blk_mq_tag_set tag_set;
+static struct workqueue_struct *wq;
 
-static blk_qc_t colx_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+/*
+ * Ring state private to the guest, one per blk-mq hardware queue. Slot i is
+ * reserved when prod passes it, filled once its inflight[] entry is set,
+ * published when the shared prod (mirrored in published) passes it and
+ * retired when the host's cons passes it. Submitters fill their reserved
+ * slots concurrently and outside the lock, so only the contiguous filled
+ * prefix [.., filled) may be published. Slots complete in ring order, so
+ * [done, published) is exactly the set of requests owned by the host. A
+ * request larger than one window occupies a chain of consecutive slots,
+ * each holding it in inflight[].
+ */
+struct colx_vblk_queue {
+    spinlock_t lock;
+    u32 qid;
+    u32 cap;
+    u32 prod;                                   /* next slot to reserve */
+    u32 filled;                                 /* end of the filled prefix */
+    u32 published;                              /* last prod stored to the ring */
+    u32 done;                                   /* next slot to retire */
+    struct request **inflight;                  /* cap entries */
+    struct delayed_work poll_work;
+};
+
+/* Requests the poller retires per pass before rescheduling itself */
+#define COLX_VBLK_POLL_BATCH 64
+
+static struct colx_geom geom;                   /* layout the host published at map time */
+static struct colx_ctrl_layout ctrl_layout;
+static struct colx_vblk_queue vqs[COLX_VBLK_MAX_QUEUES];
+static unsigned int nr_queues;
+static bool vblk_trim;                          /* host set COLX_HDR_F_VBLK_TRIM */
+static u32 max_xfer;                            /* largest READ / WRITE: a full chain of windows */
+static struct colx_trace trace;                 /* request tracer, if the host laid one out */
+
+static inline struct colx_ring_ctrl __iomem *colx_ctrl(u32 qid)
+{
+    return (void __iomem *)((char __iomem *)io + geom.vblk_ring_off + qid * geom.vblk_ring_stride);
+}
+
+/* Consumer index: host-written, on its own cache line */
+static inline __u32 __iomem *colx_cons(u32 qid)
+{
+    return (void __iomem *)((char __iomem *)colx_ctrl(qid) + ctrl_layout.cons_off);
+}
+
+static inline struct colx_vblk_slot __iomem *colx_slot(u32 qid, u32 idx)
+{
+    struct colx_vblk_slot __iomem *slots = (void __iomem *)((char __iomem *)colx_ctrl(qid) +
+        ctrl_layout.slots_off);
+    return slots + idx;
+}
+
+/*
+ * Wake a host sleeping in its doorbell wait. Only a host that advertised
+ * host_waiting needs the signal: a busy one checks prod != cons on its next
+ * pass, as it does for an increment lost to a racing front-end. The full
+ * barrier orders the prod store before the host_waiting load; it pairs with
+ * the host setting host_waiting before its last ring check, so either the
+ * host sees the work or the guest sees it waiting.
+ */
+static inline void colx_ring_doorbell(void)
+{
+    struct colx_ring_hdr __iomem *hdr = io;
+
+    mb();
+    if (readl(&hdr->host_waiting))
+        writel(readl(&hdr->doorbell) + 1, &hdr->doorbell);
+}
+
+/*
+ * Hand the filled prefix to the host with one index store and one doorbell.
+ * The release barrier orders slot contents (and write payloads) before prod;
+ * it pairs with the host's acquire load of prod; slots filled on another CPU
+ * reach it through vq->lock, taken after their fill. Called with vq->lock
+ * held; returns true if anything was published.
+ */
+static bool colx_publish(struct colx_vblk_queue *vq)
+{
+    if (vq->published == vq->filled)
+        return false;
+    dma_wmb();
+    writel_relaxed(vq->filled, &colx_ctrl(vq->qid)->prod);
+    vq->published = vq->filled;
+    colx_ring_doorbell();
+    return true;
+}
+
+/* Slot data_off as the host expects it: relative to the geometry's vblk_data_off */
+static inline u32 colx_slot_data_off(u32 qid, u32 idx)
+{
+    return qid * geom.vblk_queue_stride + idx * geom.vblk_slot_stride;
+}
+
+static inline void __iomem *colx_slot_data(u32 qid, u32 idx)
+{
+    return (char __iomem *)io + geom.vblk_data_off + colx_slot_data_off(qid, idx);
+}
+
+/* Ring slots a request occupies: one per window of data, one for the other ops */
+static inline u32 colx_rq_slots(struct request *rq)
 {
+    if (req_op(rq) != REQ_OP_READ && req_op(rq) != REQ_OP_WRITE)
+        return 1;
+    return DIV_ROUND_UP(blk_rq_bytes(rq), geom.vblk_slot_stride);
+}
+
+/*
+ * Copy a request's payload to or from the windows of the chain starting at
+ * ring position first. Byte off lives in slot first + off / stride, and a
+ * chain that runs past the last slot continues at window 0.
+ */
+static void colx_copy_slots(struct request *rq, u32 qid, u32 first, u32 cap, bool to_slots)
+{
+    struct bio_vec bvec; struct bvec_iter iter;
+    u32 stride = geom.vblk_slot_stride;
+    size_t off = 0; void *kmap;
+    rq_for_each_segment(bvec, rq, iter) {
+        u32 done = 0;
+        kmap = kmap_local_page(bvec.bv_page);
+        while (done < bvec.bv_len) {
+            u32 in = off % stride;
+            u32 n = min_t(u32, bvec.bv_len - done, stride - in);
+            char __iomem *win = (char __iomem *)colx_slot_data(qid, (first + off / stride) % cap) + in;
+
+            if (to_slots)
+                memcpy_toio(win, kmap + bvec.bv_offset + done, n);
+            else
+                memcpy_fromio(kmap + bvec.bv_offset + done, win, n);
+            done += n;
+            off += n;
+        }
+        kunmap_local(kmap);
+    }
+}
+
+/*
+ * Map a request to its ring opcode and check its length: data ops must fit
+ * one chain of slot windows, FLUSH carries nothing, DISCARD / WRITE_ZEROES
+ * only a range.
+ */
+static blk_status_t colx_rq_op(struct request *rq, u32 len, u8 *op)
+{
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        *op = req_op(rq) == REQ_OP_READ ? COLX_VBLK_OP_READ : COLX_VBLK_OP_WRITE;
+        if (len == 0 || len > max_xfer || (len & 511))
+            return BLK_STS_IOERR;
+        return BLK_STS_OK;
+    case REQ_OP_FLUSH:
+        *op = COLX_VBLK_OP_FLUSH;
+        break;
+    case REQ_OP_DISCARD:
+        *op = COLX_VBLK_OP_DISCARD;
+        break;
+    case REQ_OP_WRITE_ZEROES:
+        *op = COLX_VBLK_OP_WRITE_ZEROES;
+        break;
+    default:
+        return BLK_STS_NOTSUPP;
+    }
+    if (!vblk_trim)
+        return BLK_STS_NOTSUPP;
+    if (*op == COLX_VBLK_OP_FLUSH)
+        return len ? BLK_STS_IOERR : BLK_STS_OK;
+    if (len == 0 || len > COLX_VBLK_MAX_TRIM || (len & 511))
+        return BLK_STS_IOERR;
+    return BLK_STS_OK;
+}
+
+static blk_status_t colx_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+    struct colx_vblk_queue *vq = hctx->driver_data;
     struct request *rq = bd->rq;
+    struct colx_vblk_slot __iomem *slot;
+    unsigned long flags;
+    u32 len = blk_rq_bytes(rq);
+    u32 stride = geom.vblk_slot_stride;
+    u32 nslots, first, k;
+    blk_status_t sts;
+    bool published;
+    u8 op;
+
+    if (!io)
+        return BLK_STS_IOERR;
+    sts = colx_rq_op(rq, len, &op);
+    if (sts != BLK_STS_OK)
+        return sts;
+
+    nslots = colx_rq_slots(rq);
+    spin_lock_irqsave(&vq->lock, flags);
+    if (vq->cap - (vq->prod - vq->done) < nslots) {
+        /*
+         * Ring full: blk-mq calls commit_rqs for anything filled but not
+         * yet published, and reruns the queue once an in-flight request ends
+         */
+        spin_unlock_irqrestore(&vq->lock, flags);
+        return BLK_STS_DEV_RESOURCE;
+    }
+    /* Reserve the chain; the payload copy (up to max_xfer) runs with IRQs on */
+    first = vq->prod;
+    vq->prod += nslots;
+    spin_unlock_irqrestore(&vq->lock, flags);
+
     blk_mq_start_request(rq);
 
-    if (rq_data_dir(rq) == READ) {
-        /* Copy into shared DATA buffer and mark request */
-    } else {
-        /* Copy from BIO into shared DATA buffer */
+    if (op == COLX_VBLK_OP_WRITE)
+        colx_copy_slots(rq, vq->qid, first, vq->cap, true);
+
+    /*
+     * One slot per window: each is a whole request for its piece, so the host
+     * needs no chain state (and merges the pieces back into one backing I/O).
+     * Ordered against the host by the barrier in colx_publish().
+     */
+    for (k = 0; k < nslots; k++) {
+        u32 idx = (first + k) % vq->cap;
+
+        slot = colx_slot(vq->qid, idx);
+        writeq_relaxed((u64)(uintptr_t)rq, &slot->id);
+        writeb_relaxed(op, &slot->op);
+        writeb_relaxed(COLX_ST_OK, &slot->status);
+        writew_relaxed(k + 1 < nslots ? COLX_VBLK_SLOT_F_CHAIN : 0, &slot->flags);
+        writeq_relaxed(blk_rq_pos(rq) + (u64)k * (stride / 512), &slot->lba); /* sectors */
+        writel_relaxed(nslots == 1 ? len : min(len - k * stride, stride), &slot->len);
+        writel_relaxed(colx_slot_data_off(vq->qid, idx), &slot->data_off);
     }
+    colx_trace(&trace, COLX_TRACE_EV_VBLK_SUBMIT, vq->qid, (u64)(uintptr_t)rq, len, op);
 
-    /* Prototype: single-slot request at fixed offsets */
-    if (!io) { blk_mq_end_request(rq, BLK_STS_IOERR); return BLK_QC_T_NONE; }
+    spin_lock_irqsave(&vq->lock, flags);
+    for (k = 0; k < nslots; k++)
+        vq->inflight[(first + k) % vq->cap] = rq;
+    /*
+     * Extend the filled prefix over this chain and any later ones that were
+     * waiting on it. A chain filled behind an unfilled one is published by
+     * whichever publish runs after the gap closes.
+     */
+    while (vq->filled != vq->prod && vq->inflight[vq->filled % vq->cap])
+        vq->filled++;
 
-    struct colx_ring_idx __iomem *idx = (void __iomem *)((char __iomem *)io + COLX_VBLK_RING_OFF);
-    struct colx_vblk_req __iomem *req = (void __iomem *)((char __iomem *)io + COLX_VBLK_RING_OFF + sizeof(*idx));
-    void __iomem *data = (void __iomem *)((char __iomem *)io + COLX_VBLK_DATA_OFF);
+    /* Publish once per dispatch batch: bd->last marks its final request */
+    published = bd->last && colx_publish(vq);
+    spin_unlock_irqrestore(&vq->lock, flags);
 
-    /* Aggregate request into contiguous buffer for prototype */
-    u32 len = blk_rq_bytes(rq);
-    if (len > COLX_VBLK_DATA_MAX || (len & 511)) { blk_mq_end_request(rq, BLK_STS_IOERR); return BLK_QC_T_NONE; }
-
-    if (rq_data_dir(rq) == WRITE) {
-        struct bio_vec bvec; struct bvec_iter iter;
-        size_t off = 0; void *kmap;
-        rq_for_each_segment(bvec, rq, iter) {
-            kmap = kmap_local_page(bvec.bv_page);
-            memcpy_toio((char __iomem *)data + off, kmap + bvec.bv_offset, bvec.bv_len);
-            kunmap_local(kmap);
-            off += bvec.bv_len;
+    if (published)
+        mod_delayed_work(wq, &vq->poll_work, 0);
+    return BLK_STS_OK;
+}
+
+/* blk-mq ended a dispatch batch early (without bd->last): publish what was filled */
+static void colx_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+    struct colx_vblk_queue *vq = hctx->driver_data;
+    unsigned long flags;
+    bool published;
+
+    if (!io)
+        return;
+    spin_lock_irqsave(&vq->lock, flags);
+    published = colx_publish(vq);
+    spin_unlock_irqrestore(&vq->lock, flags);
+    if (published)
+        mod_delayed_work(wq, &vq->poll_work, 0);
+}
+
+/*
+ * Completion path: retire every slot the host has consumed since the last
+ * pass. A chained request ends once the host consumed all of its slots, and
+ * fails if any of them did. Re-runs immediately while the host is making
+ * progress and backs off to one jiffy while requests are outstanding but not
+ * yet serviced.
+ */
+static void colx_vblk_poll(struct work_struct *ws)
+{
+    struct colx_vblk_queue *vq = container_of(to_delayed_work(ws), struct colx_vblk_queue, poll_work);
+    struct request *rqs[COLX_VBLK_POLL_BATCH];
+    blk_status_t sts[COLX_VBLK_POLL_BATCH];
+    unsigned long flags;
+    u32 cons, done, n = 0, i;
+    bool pending;
+
+    if (!io)
+        return;
+
+    /* Acquire: pairs with the host's release store of cons after the statuses */
+    cons = readl_relaxed(colx_cons(vq->qid));
+    dma_rmb();
+
+    /* The poller is the sole consumer of [done, cons); queue_rq only reads done */
+    done = READ_ONCE(vq->done);
+    while (done != cons && n < COLX_VBLK_POLL_BATCH) {
+        u32 first = done, nslots, k;
+        struct request *rq = vq->inflight[done % vq->cap];
+        u8 status = COLX_ST_OK;
+
+        if (!rq) {
+            done++;
+            continue;
         }
-    }
+        nslots = colx_rq_slots(rq);
+        if (cons - done < nslots)
+            break;              /* rest of the chain still with the host */
+        for (k = 0; k < nslots; k++) {
+            u32 idx = (first + k) % vq->cap;
+            u8 st = readb_relaxed(&colx_slot(vq->qid, idx)->status);
 
-    /* Fill request */
-    writeq((u64)(uintptr_t)rq, &req->id);
-    writeb(rq_data_dir(rq) == READ ? COLX_VBLK_OP_READ : COLX_VBLK_OP_WRITE, &req->op);
-    writeq(blk_rq_pos(rq), &req->lba); /* sectors */
-    writel(len, &req->len);
-    writel(0, &req->status);
-
-    /* Submit by bumping prod */
-    writel(readl(&idx->prod) + 1, &idx->prod);
-
-    /* Busy-wait for completion (prototype); real impl should block + be tick-driven */
-    int spins = 0;
-    while (readl(&req->status) == 0 && spins++ < 1000000) cpu_relax();
-
-    if (readl(&req->status) == 1) {
-        if (rq_data_dir(rq) == READ) {
-            struct bio_vec bvec; struct bvec_iter iter; size_t off = 0; void *kmap;
-            rq_for_each_segment(bvec, rq, iter) {
-                kmap = kmap_local_page(bvec.bv_page);
-                memcpy_fromio(kmap + bvec.bv_offset, (char __iomem *)data + off, bvec.bv_len);
-                kunmap_local(kmap);
-                off += bvec.bv_len;
-            }
+            if (st != COLX_ST_OK)
+                status = st;
+            vq->inflight[idx] = NULL;
         }
-        blk_mq_end_request(rq, BLK_STS_OK);
-    } else {
-        blk_mq_end_request(rq, BLK_STS_IOERR);
+        done += nslots;
+        /* Not rq_data_dir(): FLUSH counts as a read direction */
+        if (status == COLX_ST_OK && req_op(rq) == REQ_OP_READ)
+            colx_copy_slots(rq, vq->qid, first, vq->cap, false);
+        rqs[n] = rq;
+        sts[n] = status == COLX_ST_OK ? BLK_STS_OK : BLK_STS_IOERR;
+        n++;
+        colx_trace(&trace, COLX_TRACE_EV_VBLK_END, vq->qid, (u64)(uintptr_t)rq,
+                   blk_rq_bytes(rq), status);
     }
 
-    return BLK_QC_T_NONE;
+    spin_lock_irqsave(&vq->lock, flags);
+    vq->done = done;
+    pending = vq->published != vq->done;
+    spin_unlock_irqrestore(&vq->lock, flags);
+
+    /* End requests outside the lock: completion may rerun the queue */
+    for (i = 0; i < n; i++)
+        blk_mq_end_request(rqs[i], sts[i]);
+
+    if (pending)
+        queue_delayed_work(wq, &vq->poll_work, n ? 0 : 1);
+}
+
+static int colx_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+    hctx->driver_data = &vqs[hctx_idx];
+    return 0;
 }
 
 static const struct blk_mq_ops mq_ops = {
     .queue_rq = colx_queue_rq,
+    .commit_rqs = colx_commit_rqs,
+    .init_hctx = colx_init_hctx,
 };
 
+/*
+ * Prime guest state for each ring the geometry describes (legacy hosts end
+ * the set with a cap of 0). Every ring has the geometry's depth, which
+ * becomes the per-queue tag depth.
+ */
+static int colx_vblk_probe_rings(void)
+{
+    /* More queues than CPUs only splits the same submitters across rings */
+    unsigned int max = min_t(unsigned int, geom.vblk_queues, num_possible_cpus());
+    unsigned int i;
+
+    nr_queues = 0;
+    for (i = 0; i < max; i++) {
+        struct colx_vblk_queue *vq = &vqs[i];
+
+        if (i > 0 && !readl(&colx_ctrl(i)->cap))
+            break;
+        vq->inflight = kcalloc(geom.vblk_ring_cap, sizeof(*vq->inflight), GFP_KERNEL);
+        if (!vq->inflight)
+            return -ENOMEM;
+        spin_lock_init(&vq->lock);
+        vq->qid = i;
+        vq->cap = geom.vblk_ring_cap;
+        vq->prod = readl(&colx_ctrl(i)->prod);
+        vq->filled = vq->prod;
+        vq->published = vq->prod;
+        vq->done = vq->prod;
+        INIT_DELAYED_WORK(&vq->poll_work, colx_vblk_poll);
+        nr_queues++;
+    }
+    return 0;
+}
+
+static void colx_vblk_free_rings(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < COLX_VBLK_MAX_QUEUES; i++) {
+        kfree(vqs[i].inflight);
+        vqs[i].inflight = NULL;
+    }
+}
+
 static int __init colx_vblk_init(void)
 {
     int ret;
+    u32 depth;
     if (!colx_base || !colx_size)
         return -EINVAL;
     io = ioremap(colx_base, colx_size);
     if (!io) return -ENOMEM;
 
-    q = blk_mq_init_sq_queue(&(struct blk_mq_tag_set){
-        .ops = &mq_ops,
-        .nr_hw_queues = 1,
-        .queue_depth = 64,
-        .cmd_size = 0,
-        .numa_node = NUMA_NO_NODE,
-        .flags = BLK_MQ_F_SHOULD_MERGE,
-        .nr_maps = 1,
-    }, &mq_ops, 64, BLK_MQ_F_SHOULD_MERGE);
-    if (IS_ERR(q)) { ret = PTR_ERR(q); q = NULL; goto err_unmap; }
+    ret = colx_read_geom(io, colx_size, &geom, &ctrl_layout);
+    if (ret) { pr_err("colx_vblk: malformed ring geometry\n"); goto err_unmap; }
+    if (!geom.vblk_queues) { ret = -ENODEV; goto err_unmap; }
+    colx_trace_init(&trace, io, &geom);
+    ret = colx_vblk_probe_rings();
+    if (ret) goto err_rings;
+    depth = geom.vblk_ring_cap;
+
+    /* Each queue's poll work may run concurrently with the others */
+    wq = alloc_workqueue("colx_vblk", WQ_HIGHPRI | WQ_MEM_RECLAIM, COLX_VBLK_MAX_QUEUES);
+    if (!wq) { ret = -ENOMEM; goto err_rings; }
+
+    /* One hw queue per ring, one tag per ring slot: depth is the requests in flight per ring */
+    memset(&tag_set, 0, sizeof(tag_set));
+    tag_set.ops = &mq_ops;
+    tag_set.nr_hw_queues = nr_queues;
+    tag_set.queue_depth = depth;
+    tag_set.numa_node = NUMA_NO_NODE;
+    tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    ret = blk_mq_alloc_tag_set(&tag_set);
+    if (ret) goto err_wq;
+    q = blk_mq_init_queue(&tag_set);
+    if (IS_ERR(q)) { ret = PTR_ERR(q); q = NULL; goto err_tags; }
     blk_queue_logical_block_size(q, 512);
     blk_queue_physical_block_size(q, 512);
+    /*
+     * A request may chain up to COLX_VBLK_MAX_CHAIN windows (and no more
+     * than the ring holds). The payload is copied, so its segment layout
+     * costs nothing: allow a segment per sector, and let filesystem I/O use
+     * the whole chain rather than stop at BLK_DEF_MAX_SECTORS.
+     */
+    max_xfer = geom.vblk_slot_stride * min_t(u32, COLX_VBLK_MAX_CHAIN, geom.vblk_ring_cap);
+    blk_queue_max_hw_sectors(q, max_xfer / 512);
+    q->limits.max_sectors = max_xfer / 512;
+    blk_queue_max_segments(q, min_t(u32, max_xfer / 512, USHRT_MAX));
+    blk_queue_max_segment_size(q, max_xfer);
+    blk_queue_io_opt(q, max_xfer);
+
+    /* Host backing is sparse: trimmed ranges become holes in the image */
+    vblk_trim = geom.features & COLX_HDR_F_VBLK_TRIM;
+    if (vblk_trim) {
+        /* Host writes land in its page cache; fsync must reach it as FLUSH */
+        blk_queue_write_cache(q, true, false);
+        blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+        q->limits.discard_granularity = COLX_VBLK_TRIM_GRANULARITY;
+        blk_queue_max_discard_sectors(q, COLX_VBLK_MAX_TRIM / 512);
+        blk_queue_max_write_zeroes_sectors(q, COLX_VBLK_MAX_TRIM / 512);
+    }
 
     gd = alloc_disk(1);
     if (!gd) { ret = -ENOMEM; goto err_q; }
@@ -118,10 +481,18 @@ static int __init colx_vblk_init(void)
     snprintf(gd->disk_name, sizeof(gd->disk_name), "colxblk0");
     set_capacity(gd, (sector_t)(COLX_VBLK_DATA_MAX / 512)); /* prototype capacity; real via host */
     add_disk(gd);
-    pr_info("colx_vblk: registered /dev/%s\n", gd->disk_name);
+    pr_info("colx_vblk: registered /dev/%s (%u queues, depth %u, max transfer %u KiB in %u KiB slots%s)\n",
+            gd->disk_name, nr_queues, depth, max_xfer / 1024, geom.vblk_slot_stride / 1024,
+            vblk_trim ? ", discard" : "");
     return 0;
 err_q:
     blk_cleanup_queue(q); q = NULL;
+err_tags:
+    blk_mq_free_tag_set(&tag_set);
+err_wq:
+    destroy_workqueue(wq); wq = NULL;
+err_rings:
+    colx_vblk_free_rings();
 err_unmap:
     iounmap(io); io = NULL;
     return ret;
@@ -129,8 +500,14 @@ err_unmap:
 
 static void __exit colx_vblk_exit(void)
 {
+    unsigned int i;
+
     if (gd) { del_gendisk(gd); put_disk(gd); gd = NULL; }
-    if (q) { blk_cleanup_queue(q); q = NULL; }
+    if (q) { blk_cleanup_queue(q); q = NULL; blk_mq_free_tag_set(&tag_set); }
+    for (i = 0; i < nr_queues; i++)
+        cancel_delayed_work_sync(&vqs[i].poll_work);
+    if (wq) { destroy_workqueue(wq); wq = NULL; }
+    colx_vblk_free_rings();
     if (io) { iounmap(io); io = NULL; }
 }
 
@@ -139,4 +516,3 @@ module_exit(colx_vblk_exit);
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("coLinux vblk front-end (prototype)");
 MODULE_AUTHOR("coLinux 2.0");
-
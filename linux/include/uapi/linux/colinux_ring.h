@@ -11,10 +11,21 @@ struct colx_ring_hdr {
     __u64 tick_count;
     __u32 ping_req;
     __u32 ping_resp;
+    __u32 doorbell;     /* guest increments after publishing ring work */
+    __u32 host_waiting; /* nonzero while the host sleeps waiting for the doorbell */
+    /* Host -> guest notification (COLX_HDR_F_VTTY_NOTIFY); zero on older hosts */
+    __u32 guest_doorbell; /* host increments after filling or draining a VTTY ring */
+    __u32 guest_waiting;  /* nonzero while the guest sleeps waiting for the interrupt */
 };
 
 #define COLX_VER_1 1
 
+/* colx_ring_hdr.flags */
+#define COLX_HDR_F_DOORBELL 0x1 /* host sleeps on the doorbell instead of polling */
+#define COLX_HDR_F_VBLK_TRIM 0x2 /* host services FLUSH, DISCARD and WRITE_ZEROES */
+#define COLX_HDR_F_VTTY_NOTIFY 0x4 /* host bumps guest_doorbell on VTTY traffic */
+#define COLX_HDR_F_GUEST_IRQ 0x8 /* ... and raises the guest interrupt if guest_waiting */
+
 /* Status codes (align loosely with errno on Linux) */
 #define COLX_ST_OK      0
 #define COLX_ST_EINVAL  1
@@ -22,39 +33,181 @@ struct colx_ring_hdr {
 #define COLX_ST_ENOSPC  28
 #define COLX_ST_ETIME   62
 
-/* Offsets within the shared mapping for VBLK rings */
+/*
+ * Geometry descriptor at COLX_GEOM_OFF in the header page. The host sizes the
+ * mapping at map time (ring count and depth, per-slot transfer size) and
+ * publishes every ring's placement here; consumers read it instead of
+ * assuming a layout. Ring q's colx_ring_ctrl is at vblk_ring_off +
+ * q * vblk_ring_stride and its slot windows start at vblk_data_off +
+ * q * vblk_queue_stride, followed by one page of host-private scratch.
+ * Fields past `size` were not written by the host and read as absent.
+ * Hosts without the descriptor use struct colx_ring_ctrl_legacy.
+ *
+ * VTTY traffic is split into channels, each a pair of byte rings sized
+ * independently, so a bulk transfer fills its own ring and never queues
+ * behind (or ahead of) console bytes. Channel 0 is the console and repeats
+ * vtty_tx_off / vtty_rx_off / vtty_cap; hosts that write a descriptor
+ * shorter than COLX_GEOM_SIZE_CHAN have only that channel.
+ *
+ * The shared folder (SHFS) is one request ring whose slots each own a
+ * page-aligned data window; see struct colx_shfs_slot. Descriptors shorter
+ * than COLX_GEOM_SIZE_SHFS, or with shfs_ring_cap 0, have no shared folder.
+ *
+ * The virtual NIC (VNET) is a config page at vnet_off, its four rings (see
+ * struct colx_vnet_desc) vnet_ring_stride apart after it, and a buffer pool
+ * at vnet_pool_off. Descriptors shorter than COLX_GEOM_SIZE_VNET, or with
+ * vnet_ring_cap 0, have no NIC.
+ *
+ * The request tracer is a struct colx_trace_hdr at trace_off followed by
+ * trace_cap records; see struct colx_trace_rec. Descriptors shorter than
+ * COLX_GEOM_SIZE_TRACE, or with trace_cap 0, have no tracer.
+ */
+#define COLX_GEOM_OFF   0x100
+#define COLX_GEOM_MAGIC 0x4d4f4547 /* "GEOM" */
+#define COLX_GEOM_VER_1 1
+
+#define COLX_VTTY_MAX_CHANNELS 4
+#define COLX_VTTY_CH_CONSOLE   0
+#define COLX_VTTY_CH_BULK      1 /* by convention: large copies, raw mode */
+#define COLX_VTTY_MIN_CAP      4096
+#define COLX_VTTY_MAX_CAP      (16 * 1024 * 1024)
+
+struct colx_vtty_chan {
+    __u64 tx_off; /* host->guest colx_vtty_ring */
+    __u64 rx_off; /* guest->host colx_vtty_ring */
+    __u32 cap;    /* bytes in each ring's buf, a power of two; 0 if absent */
+    __u32 _rsvd;
+};
+
+struct colx_geom {
+    __u32 magic;             /* COLX_GEOM_MAGIC */
+    __u16 ver;               /* COLX_GEOM_VER_* */
+    __u16 size;              /* sizeof(struct colx_geom) as written by the host */
+    __u32 features;          /* COLX_HDR_F_* the host services */
+    __u32 vblk_queues;       /* rings initialised (0 if none fit the mapping) */
+    __u32 vblk_ring_cap;     /* slots per ring, a power of two */
+    __u32 vblk_slot_size;    /* sizeof(struct colx_vblk_slot) */
+    __u32 vblk_slot_stride;  /* data window per slot; larger READ / WRITE chain slots */
+    __u32 vblk_ring_stride;  /* bytes between consecutive rings' colx_ring_ctrl */
+    __u64 vblk_ring_off;     /* ring 0's colx_ring_ctrl */
+    __u64 vblk_data_off;     /* base that slot data_off is relative to */
+    __u64 vblk_queue_stride; /* bytes between queues' windows (windows + scratch page) */
+    __u64 vtty_tx_off;       /* host->guest colx_vtty_ring */
+    __u64 vtty_rx_off;       /* guest->host colx_vtty_ring */
+    __u32 vtty_cap;          /* bytes in each VTTY ring's buf, a power of two */
+    __u32 _rsvd;
+    __u32 vtty_channels;     /* entries of vtty_chan[] in use, channel 0 first */
+    __u32 _rsvd1;
+    struct colx_vtty_chan vtty_chan[COLX_VTTY_MAX_CHANNELS];
+    __u64 shfs_ring_off;     /* SHFS colx_ring_ctrl, then shfs_ring_cap slots */
+    __u64 shfs_data_off;     /* slot i's window: shfs_data_off + i * shfs_slot_stride */
+    __u32 shfs_ring_cap;     /* slots, a power of two; 0 if no shared folder */
+    __u32 shfs_slot_stride;  /* window bytes per slot, a multiple of 4096 */
+    __u64 vnet_off;          /* struct colx_vnet_cfg page, then the rings */
+    __u64 vnet_pool_off;     /* buffer i at vnet_pool_off + i * vnet_buf_size */
+    __u32 vnet_ring_cap;     /* slots per ring, a power of two >= vnet_buf_count; 0 if no NIC */
+    __u32 vnet_ring_stride;  /* bytes between consecutive rings' colx_ring_ctrl */
+    __u32 vnet_buf_count;
+    __u32 vnet_buf_size;     /* a multiple of 4096 */
+    __u64 trace_off;         /* struct colx_trace_hdr, then trace_cap records */
+    __u32 trace_cap;         /* records, a power of two; 0 if no tracer */
+    __u32 _rsvd2;
+};
+
+/* Descriptor sizes: the original fields, the channel table, the shared folder, the NIC, the tracer */
+#define COLX_GEOM_SIZE_V1    80
+#define COLX_GEOM_SIZE_CHAN  184
+#define COLX_GEOM_SIZE_SHFS  208
+#define COLX_GEOM_SIZE_VNET  240
+#define COLX_GEOM_SIZE_TRACE sizeof(struct colx_geom)
+
+/* Bounds the host accepts when sizing the rings */
+#define COLX_VBLK_MAX_QUEUES   8
+#define COLX_VBLK_MIN_RING_CAP 8
+#define COLX_VBLK_MAX_RING_CAP 1024
+#define COLX_VBLK_MAX_SLOT_STRIDE (1024 * 1024)
+
+/*
+ * Legacy fixed layout, used only when the header carries no geometry
+ * descriptor (hosts that predate it), with struct colx_ring_ctrl_legacy.
+ */
 #define COLX_VBLK_RING_OFF   0x1000
-#define COLX_VBLK_DATA_OFF   0x4000
+#define COLX_VBLK_RING_STRIDE 0x1000
+#define COLX_VBLK_DATA_OFF   0x100000
 #define COLX_VBLK_SLOT_DATA_STRIDE (128 * 1024)
-/* Prototype ring capacity used by initial host mapping (see mem.c ctrl->cap = 8) */
-#define COLX_VBLK_RING_CAP   8
-/* Maximum contiguous data area usable by the prototype */
+#define COLX_VBLK_RING_CAP   64
 #define COLX_VBLK_DATA_MAX   (COLX_VBLK_SLOT_DATA_STRIDE * COLX_VBLK_RING_CAP)
+#define COLX_VBLK_QUEUE_STRIDE (COLX_VBLK_DATA_MAX + 0x1000)
 
 /* VBLK opcodes */
 #define COLX_VBLK_OP_READ   0
 #define COLX_VBLK_OP_WRITE  1
+/*
+ * Data-less ops (only with COLX_HDR_F_VBLK_TRIM): data_off is ignored.
+ * FLUSH has len 0; DISCARD and WRITE_ZEROES cover len bytes, up to
+ * COLX_VBLK_MAX_TRIM. Both leave the range reading as zeros on sparse
+ * backings, but only WRITE_ZEROES guarantees it.
+ */
+#define COLX_VBLK_OP_FLUSH        2
+#define COLX_VBLK_OP_DISCARD      3
+#define COLX_VBLK_OP_WRITE_ZEROES 4
+#define COLX_VBLK_MAX_TRIM   (1U << 30)
+/* Host-side hole granularity (one NTFS / ext4 cluster) */
+#define COLX_VBLK_TRIM_GRANULARITY 4096
+
+/*
+ * Generic ring control (single producer/consumer). Each index is written by
+ * one side only and sits on its own cache line, so publishing work never
+ * invalidates the line the other side is polling. Slots follow at
+ * sizeof(struct colx_ring_ctrl).
+ *
+ * Ordering: the producer fills slots, then stores prod with release
+ * semantics; the consumer loads prod with acquire semantics before reading
+ * them. Completion mirrors it: status stores, then a release store of cons,
+ * which the producer loads with acquire. Either side may retire or publish
+ * several slots with a single index store.
+ */
+#define COLX_CACHELINE 64
 
-/* Generic ring control (single producer/consumer) */
 struct colx_ring_ctrl {
-    __u32 prod;      /* producer increments on submit */
-    __u32 cons;      /* consumer increments on complete */
+    __u32 prod;      /* producer only: slots published */
+    __u32 _rsvd0;
     __u32 cap;       /* number of slots */
     __u32 slot_size; /* sizeof(struct colx_vblk_slot) */
+    __u32 _pad0[(COLX_CACHELINE - 16) / 4];
+    __u32 cons;      /* consumer only: slots completed (after writing status) */
+    __u32 _pad1[(COLX_CACHELINE - 4) / 4];
 };
 
-/* VBLK ring slot (metadata) */
+/* Control block of hosts without a geometry descriptor: both indices share a line */
+struct colx_ring_ctrl_legacy {
+    __u32 prod;
+    __u32 cons;
+    __u32 cap;
+    __u32 slot_size;
+};
+
+/*
+ * VBLK ring slot (metadata). A READ / WRITE larger than one window is chained
+ * across consecutive slots: each is a complete request for its own piece
+ * (lba, len, window), and all but the last carry COLX_VBLK_SLOT_F_CHAIN. The
+ * host may service the pieces independently or merge them; the guest
+ * completes the request once every slot of the chain has a status.
+ */
+#define COLX_VBLK_SLOT_F_CHAIN 0x1
+#define COLX_VBLK_MAX_CHAIN    16 /* slots one request may span */
+
 struct colx_vblk_slot {
-    __u64 id;      /* opaque */
+    __u64 id;      /* opaque; the same for every slot of a chain */
     __u8  op;      /* COLX_VBLK_OP_* */
     __u8  status;  /* COLX_ST_* */
-    __u16 _rsvd;
+    __u16 flags;   /* COLX_VBLK_SLOT_F_*; was reserved (0) */
     __u64 lba;     /* sector units (512B) */
-    __u32 len;     /* bytes, multiple of 512, <= stride */
-    __u32 data_off;/* offset from COLX_VBLK_DATA_OFF to data */
+    __u32 len;     /* bytes, multiple of 512, <= vblk_slot_stride (data ops) */
+    __u32 data_off;/* offset from vblk_data_off to data (inside this ring's queue) */
 };
 
-/* VTTY byte rings (prototype) */
+/* VTTY byte rings; legacy placement (see struct colx_geom for the real one) */
 #define COLX_VTTY_TX_OFF   0x40000 /* host->guest */
 #define COLX_VTTY_RX_OFF   0x50000 /* guest->host */
 #define COLX_VTTY_CAP      (64 * 1024)
@@ -64,7 +217,225 @@ struct colx_vtty_ring {
     __u32 tail;   /* read position */
     __u32 cap;    /* capacity in bytes */
     __u32 _rsvd;
-    __u8  buf[COLX_VTTY_CAP];
+    __u8  buf[];  /* cap bytes */
+};
+
+/*
+ * Shared folder (SHFS): the host serves one directory tree through a
+ * request ring (colx_ring_ctrl ordering, slots of struct colx_shfs_slot).
+ * Every slot owns a fixed data window, page aligned, that carries the
+ * request payload in and the reply out: names for the namespace ops, file
+ * bytes for READ / WRITE, a colx_shfs_attr for the ops that return one.
+ * READ lands file data in the window straight from the host file, so the
+ * guest copies it once, into the page cache or the caller's buffer.
+ *
+ * Objects are named by node ids the host hands out from LOOKUP, CREATE and
+ * MKDIR (COLX_SHFS_ROOT is the shared directory); each counts one lookup
+ * that the guest returns with FORGET. Open files and directories are named
+ * by the fh OPEN / CREATE return, until RELEASE.
+ */
+#define COLX_SHFS_MAX_RING_CAP    256
+#define COLX_SHFS_MIN_SLOT_STRIDE 4096
+#define COLX_SHFS_MAX_SLOT_STRIDE (1024 * 1024)
+#define COLX_SHFS_ROOT 1
+#define COLX_SHFS_NAME_MAX 255
+
+/* Opcodes. In: node (the directory for name ops), fh, offset, arg, flags;
+ * payload in the window. Out: error, len bytes in the window, fh. */
+#define COLX_SHFS_OP_LOOKUP  1  /* node dir, name -> attr */
+#define COLX_SHFS_OP_FORGET  2  /* node, arg = lookups to drop */
+#define COLX_SHFS_OP_GETATTR 3  /* node -> attr */
+#define COLX_SHFS_OP_SETATTR 4  /* node, flags COLX_SHFS_SET_*, attr in -> attr */
+#define COLX_SHFS_OP_OPEN    5  /* node, flags O_ACCMODE | O_TRUNC | O_APPEND -> fh */
+#define COLX_SHFS_OP_RELEASE 6  /* fh */
+#define COLX_SHFS_OP_READ    7  /* fh, offset, len wanted -> bytes (short at EOF) */
+#define COLX_SHFS_OP_WRITE   8  /* fh, offset, bytes -> len written */
+#define COLX_SHFS_OP_READDIR 9  /* fh of an open directory, offset cookie -> dirents */
+#define COLX_SHFS_OP_CREATE  10 /* node dir, name, arg mode, flags as OPEN -> attr, fh */
+#define COLX_SHFS_OP_MKDIR   11 /* node dir, name, arg mode -> attr */
+#define COLX_SHFS_OP_UNLINK  12 /* node dir, name */
+#define COLX_SHFS_OP_RMDIR   13 /* node dir, name */
+#define COLX_SHFS_OP_RENAME  14 /* node old dir, arg new dir, "old\0new" */
+#define COLX_SHFS_OP_FSYNC   15 /* fh */
+#define COLX_SHFS_OP_STATFS  16 /* -> colx_shfs_statfs */
+
+/* colx_shfs_slot.flags for SETATTR */
+#define COLX_SHFS_SET_MODE  0x1
+#define COLX_SHFS_SET_SIZE  0x2
+#define COLX_SHFS_SET_MTIME 0x4
+
+struct colx_shfs_slot {
+    __u64 id;      /* opaque */
+    __u32 op;      /* COLX_SHFS_OP_* */
+    __s32 error;   /* host: 0 or a positive errno */
+    __u64 node;
+    __u64 fh;
+    __u64 offset;
+    __u64 arg;
+    __u32 len;     /* in: payload bytes, or bytes wanted (READ); out: reply bytes */
+    __u32 flags;
+    __u64 _rsvd;
+};
+
+struct colx_shfs_attr {
+    __u64 node;
+    __u64 ino;     /* stable for the path; what readdir reports */
+    __u64 size;
+    __u64 blocks;  /* 512-byte units */
+    __s64 atime_ns;
+    __s64 mtime_ns;
+    __s64 ctime_ns;
+    __u32 mode;    /* S_IFMT | permission bits */
+    __u32 nlink;
+};
+
+/* READDIR records, each padded to 8 bytes; next is the cookie to resume after it */
+struct colx_shfs_dirent {
+    __u64 ino;
+    __u64 next;
+    __u32 type;    /* DT_* */
+    __u32 namelen;
+    char  name[];
+};
+
+struct colx_shfs_statfs {
+    __u64 blocks;
+    __u64 bfree;
+    __u64 bavail;
+    __u64 files;
+    __u64 ffree;
+    __u32 bsize;
+    __u32 namelen;
+};
+
+/*
+ * Virtual NIC (VNET). Frames move through four colx_ring_ctrl rings of
+ * struct colx_vnet_desc that share one pool of vnet_buf_count buffers:
+ *
+ *   TX    guest -> host  buffers of frames to transmit
+ *   TXC   host -> guest  TX buffers the host is done with
+ *   FILL  guest -> host  empty buffers for the host to receive into
+ *   RX    host -> guest  FILL buffers holding received frames
+ *
+ * A buffer holds `count` frames packed back to back, each a struct
+ * colx_vnet_pkt followed by the frame and padded to 8 bytes, so one
+ * descriptor, one index store and one doorbell carry a whole burst. Every
+ * buffer is in exactly one place (owned by the guest or in one ring), and
+ * rings hold at least vnet_buf_count slots, so returning a buffer never
+ * finds its ring full.
+ *
+ * Offloads follow virtio-net, and bytes 4..13 of colx_vnet_pkt are a
+ * struct virtio_net_hdr. A frame with COLX_VNET_PKT_NEEDS_CSUM carries a
+ * partial checksum: the receiver of the frame (or the wire side) completes
+ * it over csum_start..end and stores it at csum_start + csum_offset. A
+ * frame with a gso_type is up to vnet_buf_size bytes of TCP or UDP payload
+ * behind one set of headers (hdr_len bytes) and is cut into gso_size-byte
+ * segments on its way to a wire. Each side sends only the offloads the
+ * other advertised in struct colx_vnet_cfg.
+ */
+#define COLX_VNET_RING_TX   0
+#define COLX_VNET_RING_TXC  1
+#define COLX_VNET_RING_FILL 2
+#define COLX_VNET_RING_RX   3
+#define COLX_VNET_RINGS     4
+#define COLX_VNET_MAX_RING_CAP 4096
+#define COLX_VNET_MIN_BUF_SIZE 4096
+#define COLX_VNET_MAX_BUF_SIZE (256 * 1024)
+
+/* colx_vnet_cfg.host_features / guest_features */
+#define COLX_VNET_F_CSUM       0x1 /* accepts partial checksums (NEEDS_CSUM) */
+#define COLX_VNET_F_GSO_TCPV4  0x2 /* accepts GSO_TCPV4 frames */
+#define COLX_VNET_F_GSO_TCPV6  0x4
+#define COLX_VNET_F_GSO_UDP_L4 0x8
+
+/* colx_vnet_pkt.flags and gso_type: the VIRTIO_NET_HDR_* values */
+#define COLX_VNET_PKT_NEEDS_CSUM 0x1
+#define COLX_VNET_PKT_DATA_VALID 0x2 /* received: checksums already verified */
+#define COLX_VNET_GSO_NONE   0
+#define COLX_VNET_GSO_TCPV4  1
+#define COLX_VNET_GSO_TCPV6  4
+#define COLX_VNET_GSO_UDP_L4 5
+
+/* At vnet_off; zeroed at map time. The host stores mtu last (release): 0
+ * means no host has attached to the NIC yet. */
+struct colx_vnet_cfg {
+    __u32 host_features;  /* COLX_VNET_F_* the host accepts on TX */
+    __u32 guest_features; /* COLX_VNET_F_* the guest accepts on RX */
+    __u8  mac[6];         /* the guest's address */
+    __u16 mtu;            /* largest non-GSO frame payload */
+};
+
+struct colx_vnet_desc {
+    __u32 buf;     /* pool index */
+    __u32 len;     /* bytes of packed frames (0 on FILL) */
+    __u16 count;   /* frames in the buffer (0 on FILL) */
+    __u16 _rsvd0;
+    __u32 _rsvd1;
+};
+
+struct colx_vnet_pkt {
+    __u32 len;         /* frame bytes after this header */
+    __u8  flags;       /* COLX_VNET_PKT_* */
+    __u8  gso_type;    /* COLX_VNET_GSO_* */
+    __u16 hdr_len;     /* GSO: bytes of headers repeated on every segment */
+    __u16 gso_size;    /* GSO: payload bytes per segment */
+    __u16 csum_start;
+    __u16 csum_offset;
+    __u16 _rsvd;
+};
+
+/*
+ * Request tracer: a flight recorder both sides append to, so one VBLK
+ * request can be followed from the guest's queue_rq through the host's
+ * pickup and backing I/O to the guest's end_request, on one clock. The
+ * host lays it out zeroed (clock COLX_TRACE_CLOCK_NONE: off); the daemon
+ * stores tsc_khz and then clock (release) to switch it on, and writers
+ * skip it while clock is not one they share.
+ *
+ * Any writer claims a record with an atomic fetch-add on head and
+ * overwrites the oldest: it stores seq 0, the fields, then seq = claimed
+ * index + 1 (release). Readers keep a record only if seq is nonzero,
+ * matches its position, and reads the same after the copy.
+ */
+#define COLX_TRACE_MAX_CAP (1U << 20)
+
+#define COLX_TRACE_CLOCK_NONE 0
+#define COLX_TRACE_CLOCK_TSC  1 /* x86 TSC: the guest runs on the host's CPUs */
+#define COLX_TRACE_CLOCK_HOST 2 /* host-only nanoseconds; guests skip the ring */
+
+/* VBLK (queue: ring, id: colx_vblk_slot.id, arg: len, arg2: op or status) */
+#define COLX_TRACE_EV_VBLK_SUBMIT   1 /* guest: slot filled */
+#define COLX_TRACE_EV_VBLK_PICKUP   2 /* host: slot read off the ring */
+#define COLX_TRACE_EV_VBLK_IO_START 3 /* host: backing I/O issued */
+#define COLX_TRACE_EV_VBLK_IO_END   4 /* host: backing I/O done; arg2 status */
+#define COLX_TRACE_EV_VBLK_COMPLETE 5 /* host: cons published; arg2 status */
+#define COLX_TRACE_EV_VBLK_END      6 /* guest: request ended; arg2 status */
+/* VTTY (queue: channel, arg: bytes) */
+#define COLX_TRACE_EV_VTTY_GUEST_TX 16 /* guest wrote to its guest->host ring */
+#define COLX_TRACE_EV_VTTY_GUEST_RX 17 /* guest drained its host->guest ring */
+#define COLX_TRACE_EV_VTTY_HOST_TX  18 /* host filled the host->guest ring */
+#define COLX_TRACE_EV_VTTY_HOST_RX  19 /* host drained the guest->host ring */
+/* Host driver IOCTL: ts at issue, arg duration in clock ticks, arg2 code */
+#define COLX_TRACE_EV_IOCTL 32
+
+struct colx_trace_hdr {
+    __u32 clock;     /* COLX_TRACE_CLOCK_*; stored last */
+    __u32 _rsvd;
+    __u64 tsc_khz;   /* clock ticks per millisecond */
+    __u32 _pad0[(COLX_CACHELINE - 16) / 4];
+    __u32 head;      /* records claimed, free-running; any writer */
+    __u32 _pad1[(COLX_CACHELINE - 4) / 4];
+};
+
+struct colx_trace_rec {
+    __u32 seq;     /* claimed index + 1, stored last; 0 while being written */
+    __u16 event;   /* COLX_TRACE_EV_* */
+    __u8  _rsvd;
+    __u8  queue;
+    __u64 ts;      /* clock ticks */
+    __u64 id;
+    __u32 arg;
+    __u32 arg2;
 };
 
 #endif /* _UAPI_LINUX_COLINUX_RING_H */